@@ -0,0 +1,376 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+/*
+ * Microbenchmarks for the load's hot paths on synthetic data.
+ * Each benchmark is timed over enough operations to run MIN_NANOS, REPEATS times, and the
+ * median ns/op is printed along with the spread so that noisy numbers are visible.
+ *
+ * mlightning_bench [name filter]
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "bson_tools.h"
+#include "concurrent_container.h"
+#include "hashed_index.h"
+#include "index.h"
+#include "key_encoding.h"
+#include "mongo_operations.h"
+#include "parserapidjsonevents.h"
+#include "threading.h"
+#include "util/hasher.h"
+
+namespace bench {
+
+    //Runs an operation iterations times
+    using Body = std::function<void(size_t iterations)>;
+    //Builds what a body works on for a run of iterations, none of it is timed
+    using Setup = std::function<Body(size_t iterations)>;
+
+    struct Benchmark {
+        std::string name;
+        Setup setup;
+    };
+
+    constexpr unsigned long long MIN_NANOS = 200 * 1000 * 1000;
+    constexpr size_t REPEATS = 5;
+    //Synthetic data is generated from a fixed seed so runs are comparable
+    constexpr unsigned SEED = 42;
+
+    /**
+     * Keeps the compiler from optimizing away work whose result is otherwise unused
+     */
+    inline void escape(const void* value) {
+        asm volatile("" : : "g"(value) : "memory");
+    }
+
+    /**
+     * Times the body only, its setup is run first and it is destroyed after
+     */
+    unsigned long long timeNanos(const Setup& setup, size_t iterations) {
+        Body body = setup(iterations);
+        auto start = std::chrono::steady_clock::now();
+        body(iterations);
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+    }
+
+    void run(const Benchmark& benchmark) {
+        //Grow the iterations until a run is long enough to time steadily
+        size_t iterations = 1;
+        unsigned long long nanos;
+        while ((nanos = timeNanos(benchmark.setup, iterations)) < MIN_NANOS / 10)
+            iterations *= 10;
+        iterations = std::max<size_t>(1, iterations * MIN_NANOS / std::max(nanos, 1ULL));
+        std::vector<double> perOp;
+        for (size_t i = 0; i < REPEATS; ++i)
+            perOp.push_back(double(timeNanos(benchmark.setup, iterations)) / iterations);
+        std::sort(perOp.begin(), perOp.end());
+        std::cout << std::left << std::setw(36) << benchmark.name << std::right << std::fixed
+                  << std::setprecision(1) << std::setw(12) << perOp[REPEATS / 2] << " ns/op"
+                  << "  (min " << perOp.front() << ", max " << perOp.back() << ", "
+                  << iterations << " ops)" << std::endl;
+    }
+
+    /**
+     * @return count documents shaped like a typical load, as JSON lines
+     */
+    std::vector<std::string> jsonDocs(size_t count) {
+        std::mt19937_64 random(SEED);
+        std::vector<std::string> docs;
+        for (size_t i = 0; i < count; ++i) {
+            docs.push_back("{\"_id\": " + std::to_string(random() >> 1)
+                           + ", \"name\": \"user" + std::to_string(random() % 100000)
+                           + "\", \"score\": " + std::to_string(double(random() % 10000) / 100)
+                           + ", \"active\": true, \"tags\": [\"alpha\", \"beta\", \"gamma\"]"
+                           + ", \"address\": {\"city\": \"Springfield\", \"zip\": "
+                           + std::to_string(random() % 100000) + "}}");
+        }
+        return docs;
+    }
+
+    /**
+     * @return count single field keys with random integer values
+     */
+    std::vector<mongo::BSONObj> intKeys(size_t count) {
+        std::mt19937_64 random(SEED);
+        std::vector<mongo::BSONObj> keys;
+        for (size_t i = 0; i < count; ++i)
+            keys.push_back(BSON("_id" << static_cast<long long>(random())));
+        return keys;
+    }
+
+    /**
+     * @return chunks upper bounds evenly spread over the long long range, the last is MaxKey
+     */
+    std::vector<mongo::BSONObj> chunkBounds(size_t chunks) {
+        std::vector<mongo::BSONObj> bounds;
+        const unsigned long long step = ~0ULL / chunks;
+        for (size_t i = 1; i < chunks; ++i)
+            bounds.push_back(BSON("_id" << static_cast<long long>(
+                    std::numeric_limits<long long>::min() + i * step)));
+        mongo::BSONObjBuilder max;
+        max.appendMaxKey("_id");
+        bounds.push_back(max.obj());
+        return bounds;
+    }
+
+    //The operation handed across the op queues, it doesn't run
+    struct NoOp : public tools::mtools::DbOp {
+        tools::mtools::OpReturnCode run(tools::mtools::Connection*) {
+            return true;
+        }
+    };
+
+    const size_t CHUNKS = 1024;
+    const size_t DOCS = 4096;
+
+    std::vector<Benchmark> benchmarks() {
+        std::vector<Benchmark> all;
+
+        all.push_back({"ParseRapidJsonEvents/doc", [](size_t) -> Body {
+            static const std::vector<std::string> docs = jsonDocs(DOCS);
+            std::shared_ptr<loader::ParseRapidJsonEvents> events(
+                    new loader::ParseRapidJsonEvents);
+            return [events](size_t iterations) {
+                rapidjson::Reader reader;
+                std::vector<char> line;
+                //In situ parsing writes over the line, the copy is part of each operation
+                for (size_t i = 0; i < iterations; ++i) {
+                    const std::string& doc = docs[i % docs.size()];
+                    line.assign(doc.c_str(), doc.c_str() + doc.size() + 1);
+                    rapidjson::InsituStringStream ss(line.data());
+                    events->reset();
+                    if (!reader.Parse<rapidjson::kParseInsituFlag>(ss, *events)) {
+                        std::cerr << "Parse failed: " << doc << std::endl;
+                        exit(EXIT_FAILURE);
+                    }
+                    mongo::BSONObj obj = events->obj();
+                    escape(obj.objdata());
+                }
+            };
+        }});
+
+        all.push_back({"BSONElementHasher::hash64", [](size_t) -> Body {
+            static const std::vector<mongo::BSONObj> keys = intKeys(DOCS);
+            return [](size_t iterations) {
+                long long sum = 0;
+                for (size_t i = 0; i < iterations; ++i)
+                    sum += mongo::BSONElementHasher::hash64(keys[i % keys.size()].firstElement(),
+                            mongo::BSONElementHasher::DEFAULT_HASH_SEED);
+                escape(&sum);
+            };
+        }});
+
+        all.push_back({"BSONElementBatchHasher::hash64", [](size_t) -> Body {
+            static const std::vector<mongo::BSONObj> keys = intKeys(DOCS);
+            std::vector<mongo::BSONElement> elements;
+            for (auto&& key : keys)
+                elements.push_back(key.firstElement());
+            return [elements](size_t iterations) {
+                static const size_t batch = mongo::BSONElementBatchHasher::BATCH_MAX;
+                mongo::BSONElementBatchHasher hasher;
+                long long hashes[mongo::BSONElementBatchHasher::BATCH_MAX];
+                //One operation is one element hashed, as for the single hasher
+                for (size_t i = 0; i < iterations; i += batch) {
+                    size_t count = std::min(batch, iterations - i);
+                    hasher.hash64(&elements[(i / batch * batch) % (elements.size() - batch)],
+                                  count, hashes);
+                    escape(hashes);
+                }
+            };
+        }});
+
+        /*
+         * targetStage picks a chunk with one of three searches, depending on the bounds.
+         * Building an InputNameSpaceContainer needs a cluster, so the searches are timed on
+         * their own over the same structures.
+         */
+        all.push_back({"targetStage BSON upperBound", [](size_t) -> Body {
+            static const std::vector<mongo::BSONObj> keys = intKeys(DOCS);
+            using Plan = tools::Index<mongo::BSONObj, size_t, tools::BSONObjCmp>;
+            std::shared_ptr<Plan> plan(new Plan(tools::BSONObjCmp(BSON("_id" << 1))));
+            size_t chunk = 0;
+            for (auto&& bound : chunkBounds(CHUNKS))
+                plan->insertUnordered(bound, chunk++);
+            plan->finalize();
+            return [plan](size_t iterations) {
+                size_t sum = 0;
+                for (size_t i = 0; i < iterations; ++i)
+                    sum += plan->upperBound(keys[i % keys.size()]);
+                escape(&sum);
+            };
+        }});
+
+        all.push_back({"targetStage encoded upperBound", [](size_t) -> Body {
+            static const std::vector<mongo::BSONObj> keys = intKeys(DOCS);
+            std::shared_ptr<tools::KeyEncoder> encoder(
+                    new tools::KeyEncoder(BSON("_id" << 1), tools::KeyEncoder::Source::KEY));
+            std::vector<std::string> bounds;
+            for (auto&& bound : chunkBounds(CHUNKS)) {
+                bounds.emplace_back();
+                if (!encoder->encode(bound, &bounds.back())) {
+                    std::cerr << "Unable to encode bound " << bound << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+            }
+            return [encoder, bounds](size_t iterations) {
+                std::string encoded;
+                size_t sum = 0;
+                for (size_t i = 0; i < iterations; ++i) {
+                    encoded.clear();
+                    encoder->encode(keys[i % keys.size()], &encoded);
+                    sum += std::upper_bound(bounds.begin(), bounds.end(), encoded)
+                           - bounds.begin();
+                }
+                escape(&sum);
+            };
+        }});
+
+        all.push_back({"targetStage hashed upperBound", [](size_t) -> Body {
+            static const std::vector<mongo::BSONObj> keys = intKeys(DOCS);
+            std::vector<mongo::BSONObj> chunkKeys = chunkBounds(CHUNKS);
+            std::vector<int64_t> bounds;
+            std::vector<size_t> values;
+            for (size_t i = 0; i + 1 < chunkKeys.size(); ++i) {
+                bounds.push_back(chunkKeys[i].firstElement().numberLong());
+                values.push_back(i);
+            }
+            values.push_back(chunkKeys.size() - 1);
+            std::shared_ptr<tools::HashedIndex<size_t>> plan(
+                    new tools::HashedIndex<size_t>(bounds, values));
+            return [plan](size_t iterations) {
+                size_t sum = 0;
+                for (size_t i = 0; i < iterations; ++i)
+                    sum += plan->upperBound(keys[i % keys.size()].firstElement().numberLong());
+                escape(&sum);
+            };
+        }});
+
+        all.push_back({"BSONObjCmp sort/key", [](size_t) -> Body {
+            static const std::vector<mongo::BSONObj> keys = intKeys(DOCS);
+            return [](size_t iterations) {
+                tools::BSONObjCmp compare(BSON("_id" << 1));
+                std::vector<mongo::BSONObj> sorted;
+                //One operation is one key of a DOCS key sort, unsorted keys are copied in for each
+                for (size_t i = 0; i < iterations; i += keys.size()) {
+                    sorted.assign(keys.begin(),
+                                  keys.begin() + std::min(keys.size(), iterations - i));
+                    std::sort(sorted.begin(), sorted.end(), compare);
+                    escape(sorted.data());
+                }
+            };
+        }});
+
+        /*
+         * The handoffs start their consumer in the setup.  The timing ends once the consumer has
+         * taken everything pushed, so the join is part of it.
+         */
+        all.push_back({"WaitQueue handoff", [](size_t) -> Body {
+            std::shared_ptr<tools::WaitQueue<size_t>> queue(new tools::WaitQueue<size_t>(1024));
+            std::shared_ptr<std::thread> consumer(new std::thread([queue] {
+                size_t value;
+                size_t sum = 0;
+                while (queue->pop(value))
+                    sum += value;
+                escape(&sum);
+            }));
+            return [queue, consumer](size_t iterations) {
+                for (size_t i = 0; i < iterations; ++i) {
+                    size_t value = i;
+                    queue->push(std::move(value));
+                }
+                queue->endWait();
+                consumer->join();
+            };
+        }});
+
+        all.push_back({"RingQueue handoff", [](size_t) -> Body {
+            std::shared_ptr<tools::RingQueue<size_t>> queue(new tools::RingQueue<size_t>(1024));
+            std::shared_ptr<std::thread> consumer(new std::thread([queue] {
+                size_t value;
+                size_t sum = 0;
+                while (queue->popWait(value))
+                    sum += value;
+                escape(&sum);
+            }));
+            return [queue, consumer](size_t iterations) {
+                for (size_t i = 0; i < iterations; ++i)
+                    queue->push(i);
+                queue->endWait();
+                consumer->join();
+            };
+        }});
+
+        all.push_back({"OpQueueNoLock handoff", [](size_t iterations) -> Body {
+            std::shared_ptr<tools::mtools::OpQueueNoLock> queue(
+                    new tools::mtools::OpQueueNoLock(1024));
+            std::shared_ptr<std::atomic<bool>> done(new std::atomic<bool>(false));
+            //The operations are made up front, the consumer frees them as it takes them
+            std::shared_ptr<tools::mtools::DbOpPointers> ops(new tools::mtools::DbOpPointers);
+            for (size_t i = 0; i < iterations; ++i)
+                ops->emplace_back(new NoOp());
+            std::shared_ptr<std::thread> consumer(new std::thread([queue, done] {
+                tools::mtools::DbOpPointer op;
+                for (;;) {
+                    if (queue->pop(op)) continue;
+                    //Check the queue once more after done so nothing pushed is left behind
+                    if (*done && !queue->pop(op)) break;
+                }
+            }));
+            return [queue, done, ops, consumer](size_t) {
+                //The lock free queue grows as needed, pushes don't fail
+                for (auto&& op : *ops)
+                    queue->push(op);
+                *done = true;
+                consumer->join();
+            };
+        }});
+
+        all.push_back({"ThreadPool dispatch", [](size_t) -> Body {
+            std::shared_ptr<std::atomic<size_t>> ran(new std::atomic<size_t>(0));
+            std::shared_ptr<tools::ThreadPool> pool(
+                    new tools::ThreadPool(std::max(1U, std::thread::hardware_concurrency())));
+            return [ran, pool](size_t iterations) {
+                for (size_t i = 0; i < iterations; ++i)
+                    pool->queue([ran] {ran->fetch_add(1, std::memory_order_relaxed);});
+                pool->endWaitInitiate();
+                pool->joinAll();
+            };
+        }});
+
+        return all;
+    }
+
+}  //namespace bench
+
+int main(int argc, char* argv[]) {
+    std::string filter = argc > 1 ? argv[1] : "";
+    for (auto&& benchmark : bench::benchmarks())
+        if (benchmark.name.find(filter) != std::string::npos) bench::run(benchmark);
+    return 0;
+}
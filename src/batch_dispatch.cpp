@@ -14,6 +14,23 @@
  */
 
 #include "batch_dispatch.h"
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iterator>
+#include <numeric>
+#include <queue>
+#include <set>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include "bson_arena.h"
+#include "chunk_ranges.h"
+#include "mongo_operations.h"
+#include "placement.h"
+#include "util/hasher.h"
 
 namespace loader {
     namespace dispatch {
@@ -24,14 +41,212 @@ namespace loader {
         const bool RAMQueueDispatch::factoryRegisterCreator = ChunkDispatcherFactory::registerCreator(
                 "ram",
                 &RAMQueueDispatch::create);
+        const bool DiskQueueDispatch::factoryRegisterCreator = ChunkDispatcherFactory::registerCreator(
+                "disk",
+                &DiskQueueDispatch::create);
+
+        constexpr size_t DiskQueueDispatch::RUN_BYTES;
+        constexpr size_t DiskQueueDispatch::MERGE_BYTES;
+        constexpr size_t DiskQueueDispatch::MERGE_BUFFER_MIN;
+        constexpr size_t RAMQueueDispatch::PARTITION_RECORDS;
+        constexpr size_t RAMQueueDispatch::PARTITIONS_MAX;
+        constexpr size_t ChunkDispatcher::CHUNKS_POLL_SECONDS;
+
+        namespace {
+            //Samples taken per partition to choose the splitters from
+            constexpr size_t PARTITION_OVERSAMPLE = 32;
+
+            /**
+             * Reorders the records into partitions of ascending key ranges, equal keys share a
+             * partition.  The splitters come from an evenly spaced sample of the records.
+             * @return the partition bounds, partitions + 1 of them
+             */
+            template<typename Record>
+            std::vector<size_t> partition(std::vector<Record>* records, size_t partitions) {
+                const size_t count = records->size();
+                if (partitions < 2) return {0, count};
+                std::vector<Record> sample;
+                size_t samples = partitions * PARTITION_OVERSAMPLE;
+                for (size_t i = 0; i < samples; ++i)
+                    sample.push_back((*records)[i * count / samples]);
+                std::sort(sample.begin(), sample.end());
+                std::vector<Record> splitters;
+                for (size_t range = 1; range < partitions; ++range)
+                    splitters.push_back(sample[range * PARTITION_OVERSAMPLE]);
+                std::vector<uint32_t> ranges(count);
+                std::vector<size_t> bounds(partitions + 1);
+                for (size_t i = 0; i < count; ++i) {
+                    ranges[i] = std::upper_bound(splitters.begin(), splitters.end(),
+                                                 (*records)[i]) - splitters.begin();
+                    ++bounds[ranges[i] + 1];
+                }
+                for (size_t range = 1; range <= partitions; ++range)
+                    bounds[range] += bounds[range - 1];
+                std::vector<size_t> next(bounds.begin(), bounds.end() - 1);
+                std::vector<Record> partitioned(count);
+                for (size_t i = 0; i < count; ++i)
+                    partitioned[next[ranges[i]]++] = (*records)[i];
+                records->swap(partitioned);
+                return bounds;
+            }
+
+            size_t pairBytes(const BsonPairDeque::value_type& value) {
+                return value.first.objsize() + value.second.objsize();
+            }
+
+            using Dedupe = ChunkDispatcher::Dedupe;
+
+            /**
+             * Walks count values in key order a run of equal keys at a time.  Without a dedupe
+             * every value is kept, otherwise one per key is: the first or last in push order.
+             * @param less compares the keys at sorted indexes
+             * @param position maps a sorted index to the value's push order position
+             * @param keep, lose are given the positions of the values kept and dropped
+             */
+            template<typename Less, typename Position, typename Keep, typename Lose>
+            void uniqueRuns(size_t count, Dedupe dedupe, Less less, Position position, Keep keep,
+                            Lose lose) {
+                for (size_t begin = 0; begin < count;) {
+                    size_t end = begin + 1;
+                    if (dedupe != Dedupe::NONE)
+                        while (end < count && !less(begin, end)) ++end;
+                    size_t winner = begin;
+                    for (size_t i = begin + 1; i < end; ++i)
+                        if ((position(i) < position(winner)) != (dedupe == Dedupe::LAST))
+                            winner = i;
+                    for (size_t i = begin; i < end; ++i) {
+                        if (i == winner) keep(position(i));
+                        else lose(position(i));
+                    }
+                    begin = end;
+                }
+            }
+
+            /**
+             * uniqueRuns over sorted records
+             */
+            template<typename Record, typename Keep, typename Lose>
+            void uniqueRecords(const Record* records, size_t count, Dedupe dedupe, Keep keep,
+                               Lose lose) {
+                uniqueRuns(count, dedupe,
+                           [records](size_t l, size_t r) {return records[l] < records[r];},
+                           [records](size_t i) {return records[i].position;}, keep, lose);
+            }
+
+            /**
+             * Sorts values by BSON key, for keys that can't be encoded, then runs uniqueRuns
+             */
+            template<typename Container, typename Keep, typename Lose>
+            void sortUniqueBson(const Bson& sortIndex, Dedupe dedupe, const Container& values,
+                                Keep keep, Lose lose) {
+                tools::BSONObjCmp compare(sortIndex);
+                std::vector<size_t> order(values.size());
+                std::iota(order.begin(), order.end(), 0);
+                auto less = [&](size_t l, size_t r) {
+                    return compare(values[l].first, values[r].first);
+                };
+                std::sort(order.begin(), order.end(), less);
+                uniqueRuns(order.size(), dedupe,
+                           [&](size_t l, size_t r) {return less(order[l], order[r]);},
+                           [&order](size_t i) {return order[i];}, keep, lose);
+            }
+
+            /**
+             * Reads the records of one run through a buffer, the current record stays valid
+             * until the next call to next()
+             */
+            class RunCursor {
+            public:
+                RunCursor(int fd, off_t offset, size_t size, size_t bufferSize,
+                          const tools::KeyEncoder& encoder) :
+                        _fd(fd), _offset(offset), _end(offset + size), _buffer(bufferSize),
+                        _encoder(encoder)
+                { }
+
+                /**
+                 * @return false when the run is exhausted
+                 */
+                bool next() {
+                    _pos += _recordSize;
+                    _recordSize = 0;
+                    if (!fill(sizeof(int32_t))) return false;
+                    size_t keySize = objSize(_pos);
+                    if (!fill(keySize + sizeof(int32_t)))
+                        corrupt();
+                    size_t docSize = objSize(_pos + keySize);
+                    if (!fill(keySize + docSize)) corrupt();
+                    _recordSize = keySize + docSize;
+                    key = Bson(&_buffer[_pos]);
+                    doc = Bson(&_buffer[_pos + keySize]);
+                    encoded.clear();
+                    isEncoded = _encoder.encode(key, &encoded);
+                    return true;
+                }
+
+                Bson key;
+                Bson doc;
+                std::string encoded;
+                bool isEncoded{};
+                //Index of the run, runs are in the order they were pushed
+                size_t run{};
+
+            private:
+                const int _fd;
+                off_t _offset;
+                const off_t _end;
+                std::vector<char> _buffer;
+                size_t _pos{};
+                size_t _used{};
+                size_t _recordSize{};
+                const tools::KeyEncoder& _encoder;
+
+                size_t objSize(size_t pos) const {
+                    int32_t size;
+                    std::memcpy(&size, &_buffer[pos], sizeof(size));
+                    return size;
+                }
+
+                /**
+                 * Makes sure size bytes from _pos are in the buffer
+                 * @return false if the run ends first
+                 */
+                bool fill(size_t size) {
+                    if (_used - _pos >= size) return true;
+                    std::memmove(_buffer.data(), &_buffer[_pos], _used - _pos);
+                    _used -= _pos;
+                    _pos = 0;
+                    //Records larger than the buffer get a buffer of their own size
+                    if (_buffer.size() < size) _buffer.resize(size);
+                    while (_used < size && _offset < _end) {
+                        size_t want = std::min<off_t>(_buffer.size() - _used, _end - _offset);
+                        ssize_t got = pread(_fd, &_buffer[_used], want, _offset);
+                        if (got <= 0) {
+                            std::cerr << "Unable to read disk queue run: " << std::strerror(errno)
+                                      << std::endl;
+                            exit(EXIT_FAILURE);
+                        }
+                        _used += got;
+                        _offset += got;
+                    }
+                    return _used >= size;
+                }
+
+                void corrupt() {
+                    std::cerr << "Disk queue run ends inside a record" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+            };
+        }  //namespace
 
         AbstractChunkDispatch::AbstractChunkDispatch(Settings settings) :
-                _settings(std::move(settings)),
-                _bulkWriteVersion(_settings.owner->bulkWriteVersion())
+                _settings(std::move(settings))
         {
             if (_settings.owner->directLoad()) _ep = _settings.owner->getEndPointForChunk(_settings
                     .chunkUB);
             else _ep = _settings.owner->getMongoSCycle();
+            if (tools::Trace::enabled())
+                _traceTag = tools::Trace::tag(_settings.owner->getShardForChunk(_settings.chunkUB),
+                                              _settings.chunkUB.toString());
         }
 
         ChunkDispatcher::ChunkDispatcher(Settings settings,
@@ -39,7 +254,7 @@ namespace loader {
                                                EndPointHolder* eph,
                                                tools::mtools::MongoCluster::NameSpace ns) :
                 _settings(std::move(settings)),
-                _tp(_settings.workThreads),
+                _tp(_settings.workThreads, tools::Placement::pin),
                 _mCluster(mCluster),
                 _eph(eph),
                 _ns(std::move(ns)),
@@ -49,6 +264,27 @@ namespace loader {
             init();
         }
 
+        void ChunkDispatcher::duplicate(const Bson& doc) {
+            ++_duplicates;
+            if (_settings.dedupe != Dedupe::REJECT) return;
+            tools::MutexLockGuard lock(_duplicatesMutex);
+            if (!_duplicatesFile.is_open()) {
+                _duplicatesFile.open(_settings.dedupeFile, std::ios_base::out | std::ios_base::app
+                                     | std::ios_base::binary);
+                if (!_duplicatesFile.is_open()) {
+                    std::cerr << "Unable to open duplicates file: " << _settings.dedupeFile
+                              << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+            }
+            _duplicatesFile.write(doc.objdata(), doc.objsize());
+            if (!_duplicatesFile) {
+                std::cerr << "Unable to write duplicates file: " << _settings.dedupeFile
+                          << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+
         void ChunkDispatcher::init() {
             //shardChunkCounters keeps track of the number of chunk depth per shard
             //Assumes the chunks are in sorted order so that the queues are correct per shard
@@ -56,10 +292,259 @@ namespace loader {
             for (auto& iCm : _mCluster.nsChunks(ns())) {
                 _loadPlan.insertUnordered(std::get<0>(iCm), ChunkDispatchPointer {});
                 size_t depth = ++(shardChunkCounters[std::get<1>(iCm)->first]);
+                //Shards holding more chunks than there are queues (i.e. zones) reuse the last
+                depth = std::min(depth, _settings.loadQueues->size());
                 _loadPlan.back() = ChunkDispatcherFactory::createObject(_settings.loadQueues->at(depth - 1), this, _eph, std::get<0>(iCm));
             }
         }
 
+        std::shared_ptr<tools::mtools::MongoCluster> ChunkDispatcher::routing(size_t* generation) {
+            tools::MutexLockGuard lock(_routingMutex);
+            //Writes rejected together only need one read
+            if (!_routing || _routingGeneration == *generation) {
+                _routing = std::make_shared<tools::mtools::MongoCluster>(
+                        _mCluster.connStr().toString(), std::string(),
+                        tools::mtools::MongoCluster::LoadSettings {_ns, std::string(), false});
+                ++_routingGeneration;
+                std::cout << _ns << ": chunks read again for stale routing, "
+                          << _routing->chunksCount(_ns) << " chunks" << std::endl;
+            }
+            *generation = _routingGeneration;
+            return _routing;
+        }
+
+        Bson ChunkDispatcher::routingKey(const Bson& doc) const {
+            //Missing fields are null to the shard key
+            mongo::BSONObjBuilder nullBuilder;
+            const Bson null = nullBuilder.appendNull("").obj();
+            mongo::BSONObjBuilder key;
+            for (mongo::BSONObjIterator i(_settings.sortIndex); i.more();) {
+                mongo::BSONElement field = i.next();
+                mongo::BSONElement value = doc.getFieldDotted(field.fieldName());
+                if (value.eoo()) value = null.firstElement();
+                if (field.type() == mongo::String
+                    && field.valueStringData() == mongo::StringData("hashed"))
+                    key.append(field.fieldName(), mongo::BSONElementHasher::hash64(value,
+                            mongo::BSONElementHasher::DEFAULT_HASH_SEED));
+                else key.appendAs(value, field.fieldName());
+            }
+            return key.obj();
+        }
+
+        bool ChunkDispatcher::reroute(const std::string& ns, tools::mtools::DataQueue* docs) {
+            size_t generation = _routingGeneration;
+            for (size_t attempt = 0; attempt < REROUTE_ATTEMPTS && !docs->empty(); ++attempt) {
+                //A migration that is committing rejects writes until it's done
+                if (attempt) std::this_thread::sleep_for(std::chrono::seconds(1));
+                std::shared_ptr<tools::mtools::MongoCluster> cluster = routing(&generation);
+                auto& chunks = cluster->nsChunks(ns);
+                std::unordered_map<tools::mtools::MongoCluster::ShardName,
+                                   tools::mtools::DataQueue> shards;
+                for (auto&& doc : *docs)
+                    shards[chunks.upperBoundSafe(routingKey(doc))->first].push_back(std::move(doc));
+                docs->clear();
+                for (auto&& shard : shards) {
+                    std::string error;
+                    mongo::ConnectionString cs = mongo::ConnectionString::parse(
+                            cluster->getConn(shard.first), error);
+                    std::unique_ptr<mongo::DBClientBase> conn;
+                    if (error.empty()) conn.reset(cs.connect(error));
+                    tools::mtools::DataQueue rejected;
+                    if (conn) {
+                        tools::mtools::DbOpPointer op = makeWrite(&shard.second);
+                        if (op->run(conn.get())) continue;
+                        //Rejected again, the chunk moved again or the move hasn't committed
+                        std::string rejectedNs;
+                        if (!op->rejected(&rejectedNs, &rejected)) {
+                            tools::BsonArena::release(docs);
+                            return false;
+                        }
+                    }
+                    else {
+                        std::cerr << "Unable to connect to " << shard.first << " to reroute: "
+                                  << error << std::endl;
+                        rejected.swap(shard.second);
+                    }
+                    docs->insert(docs->end(), std::make_move_iterator(rejected.begin()),
+                                 std::make_move_iterator(rejected.end()));
+                }
+            }
+            if (docs->empty()) return true;
+            std::cerr << ns << ": " << docs->size() << " documents couldn't be rerouted"
+                      << std::endl;
+            tools::BsonArena::release(docs);
+            return false;
+        }
+
+        void ChunkDispatcher::chunksWatchStart(mongo::BSONObj version) {
+            if (_watch.joinable()) return;
+            _watch = std::thread([this, version]() {
+                mongo::BSONObj seen = version;
+                std::unique_ptr<tools::mtools::MongoCluster> cluster;
+                for (;;) {
+                    {
+                        tools::MutexUniqueLock lock(_watchMutex);
+                        if (_watchNotify.wait_for(lock, std::chrono::seconds(CHUNKS_POLL_SECONDS),
+                                                  [this] {return _watchStop;}))
+                            return;
+                    }
+                    //The watch only keeps the routing current, a failed poll mustn't end the load
+                    try {
+                        if (!cluster)
+                            cluster.reset(new tools::mtools::MongoCluster(
+                                    _mCluster.connStr().toString(), std::string(),
+                                    tools::mtools::MongoCluster::LoadSettings {_ns, std::string(),
+                                                                               false}));
+                        mongo::BSONObj now = cluster->chunksVersion();
+                        if (now.isEmpty() || !now.woCompare(seen)) continue;
+                        seen = now.getOwned();
+                        chunksMoved();
+                    }
+                    catch (std::exception& e) {
+                        std::cerr << _ns << ": chunk version poll failed: " << e.what()
+                                  << std::endl;
+                        cluster.reset();
+                    }
+                }
+            });
+        }
+
+        bool ChunkDispatcher::chunksWatchStop() {
+            if (!_watch.joinable()) return true;
+            {
+                tools::MutexLockGuard lock(_watchMutex);
+                _watchStop = true;
+            }
+            _watchNotify.notify_all();
+            _watch.join();
+            //A move the polls missed
+            chunksMoved();
+            size_t generation = _routingGeneration;
+            std::shared_ptr<tools::mtools::MongoCluster> cluster = routing(&generation);
+            bool repaired = true;
+            tools::MutexLockGuard lock(_watchMutex);
+            for (auto&& moved : _moved)
+                repaired &= movedRepair(*cluster, moved);
+            return repaired;
+        }
+
+        void ChunkDispatcher::chunksMoved() {
+            size_t generation = _routingGeneration;
+            std::shared_ptr<tools::mtools::MongoCluster> cluster = routing(&generation);
+            auto& chunks = cluster->nsChunks(_ns);
+            tools::BSONObjCmp compare(_settings.sortIndex);
+            tools::MutexLockGuard lock(_watchMutex);
+            if (_owners.empty())
+                for (auto&& chunk : _loadPlan)
+                    _owners.push_back(_mCluster.getShardForChunk(_ns, chunk.first));
+            size_t moves = 0;
+            mongo::BSONObj min;
+            auto owner = chunks.begin();
+            size_t index = 0;
+            for (auto chunk = _loadPlan.begin(); chunk != _loadPlan.end(); ++chunk, ++index) {
+                const mongo::BSONObj& max = chunk->first;
+                const bool last = index + 1 == _loadPlan.size();
+                //The first chunk now ending past min on to the one ending at or past max
+                while (!min.isEmpty() && owner != chunks.end() && !compare(min, owner->first))
+                    ++owner;
+                std::set<tools::mtools::MongoCluster::ShardName> shards;
+                for (auto next = owner; next != chunks.end(); ++next) {
+                    shards.insert(next->second->first);
+                    if (!compare(next->first, max)) break;
+                }
+                min = max;
+                if (shards.size() != 1) {
+                    std::cerr << _ns << ": the range of chunk " << max << " is split over "
+                              << shards.size() << " shards mid direct load, its documents can't "
+                              "be sent as a chunk.  Keep the balancer stopped for direct loads"
+                              << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                const std::string& shard = *shards.begin();
+                if (shard == _owners[index]) continue;
+                _moved.push_back(MovedRange {_owners[index], index ? _loadPlan.container()
+                        [index - 1].first : mongo::BSONObj(), last ? mongo::BSONObj() : max});
+                _owners[index] = shard;
+                chunk->second->endPointSet(_eph->at(shard));
+                ++moves;
+            }
+            if (moves)
+                std::cout << _ns << ": " << moves << " chunks moved mid direct load, they are sent "
+                          "to their new shards" << std::endl;
+        }
+
+        bool ChunkDispatcher::movedRepair(tools::mtools::MongoCluster& cluster,
+                                          const MovedRange& moved) {
+            tools::mtools::ChunkRanges::Range range {moved.from, cluster.getConn(moved.from),
+                                                     moved.min, moved.max, 0};
+            std::unique_ptr<mongo::DBClientBase> from(tools::mtools::ChunkRanges::connect(range));
+            mongo::Cursor cur = tools::mtools::ChunkRanges::query(from.get(), _ns,
+                                                                  _settings.sortIndex, range);
+            auto& chunks = cluster.nsChunks(_ns);
+            std::unordered_map<tools::mtools::MongoCluster::ShardName,
+                               std::unique_ptr<mongo::DBClientBase>> conns;
+            size_t repaired = 0;
+            bool ok = true;
+            tools::mtools::DataQueue docs;
+            size_t bytes = 0;
+            auto flush = [&]() {
+                std::unordered_map<tools::mtools::MongoCluster::ShardName,
+                                   tools::mtools::DataQueue> shards;
+                for (auto&& doc : docs)
+                    shards[chunks.upperBoundSafe(routingKey(doc))->first].push_back(doc);
+                mongo::BSONArrayBuilder ids;
+                for (auto&& shard : shards) {
+                    //Back on the shard that took them, they aren't orphans
+                    if (shard.first == moved.from) continue;
+                    std::unique_ptr<mongo::DBClientBase>& conn = conns[shard.first];
+                    if (!conn) conn.reset(tools::mtools::ChunkRanges::connect(
+                            tools::mtools::ChunkRanges::Range {shard.first,
+                                    cluster.getConn(shard.first), mongo::BSONObj(),
+                                    mongo::BSONObj(), 0}));
+                    tools::mtools::DataQueue written = shard.second;
+                    tools::mtools::DbOpPointer op = makeWrite(&shard.second);
+                    //Documents the migration copied are already there, their duplicates count
+                    op->attempts = 1;
+                    if (!op->run(conn.get())) {
+                        ok = false;
+                        continue;
+                    }
+                    for (auto&& doc : written)
+                        ids.append(doc["_id"]);
+                    repaired += written.size();
+                }
+                mongo::BSONArray remove = ids.arr();
+                if (!remove.isEmpty()) {
+                    mongo::BSONObjBuilder in;
+                    in.appendArray("$in", remove);
+                    from->remove(_ns, mongo::Query(BSON("_id" << in.obj())));
+                }
+                docs.clear();
+                bytes = 0;
+            };
+            while (cur->more()) {
+                docs.push_back(cur->nextSafe().getOwned());
+                bytes += docs.back().objsize();
+                if (docs.size() >= queueSize() || bytes >= batchBytes()) flush();
+            }
+            if (!docs.empty()) flush();
+            if (repaired)
+                std::cout << _ns << ": " << repaired << " documents shard " << moved.from
+                          << " took after a chunk moved were moved to its new shard" << std::endl;
+            if (!ok)
+                std::cerr << _ns << ": documents shard " << moved.from << " took after a chunk "
+                          "moved couldn't all be moved, they are orphans" << std::endl;
+            return ok;
+        }
+
+        std::vector<size_t> ChunkDispatcher::docsRouted() const {
+            std::vector<size_t> routed;
+            routed.reserve(_loadPlan.size());
+            for (auto i = _loadPlan.cbegin(); i != _loadPlan.cend(); ++i)
+                routed.push_back(i->second->docsRouted());
+            return routed;
+        }
+
         ChunkDispatcher::OrderedWaterFall ChunkDispatcher::getWaterFall() {
             std::unordered_map<tools::mtools::MongoCluster::ShardName, std::deque<AbstractChunkDispatch*>> chunksort;
             for (auto& i : _mCluster.nsChunks(_ns))
@@ -80,19 +565,407 @@ namespace loader {
             return wf;
         }
 
+        void RAMQueueDispatch::pushSort(BsonPairDeque* q) {
+            if (_inOrder && stream(q)) return;
+            if (!_diverted && tools::MemoryBudget::full()) divert();
+            if (_diverted) {
+                _overflow->pushSort(q);
+                return;
+            }
+            size_t bytes = 0;
+            for (auto&& value : *q)
+                bytes += pairBytes(value);
+            tools::MemoryBudget::add(tools::MemoryBudget::Use::QUEUED, bytes);
+            _bytes += bytes;
+            size_t retries = _store.append(q);
+            if (retries) owner()->handoffRetried(retries);
+        }
+
+        bool RAMQueueDispatch::stream(BsonPairDeque* q) {
+            if (q->empty()) return true;
+            tools::BSONObjCmp compare(owner()->sortIndex());
+            tools::MutexLockGuard lock(_orderMutex);
+            if (!_inOrder) return false;
+            //Pushes of a chunk are serialized here, so the orders of the batches can't cross
+            bool ordered = _lastKey.isEmpty() || !compare(q->front().first, _lastKey);
+            for (size_t i = 1; ordered && i < q->size(); ++i)
+                ordered = !compare((*q)[i].first, (*q)[i - 1].first);
+            if (!ordered) {
+                _inOrder = false;
+                return false;
+            }
+            tools::MemoryBudget::waitForRoom();
+            _lastKey = q->back().first.getOwned();
+            tools::mtools::DataQueue docs;
+            docs.reserve(q->size());
+            for (auto&& value : *q)
+                docs.emplace_back(value.second);
+            q->clear();
+            //The chunk is journaled at prep, so the writes streamed before it hold it back
+            send(&docs, sentAhead());
+            return true;
+        }
+
+        void RAMQueueDispatch::divert() {
+            tools::MutexLockGuard lock(_overflowMutex);
+            if (_diverted) return;
+            _overflow.reset(new DiskQueueDispatch(settings()));
+            _diverted = true;
+            std::cout << "Memory budget is full, chunk " << settings().chunkUB
+                      << " continues on disk" << std::endl;
+        }
+
+        void RAMQueueDispatch::prep() {
+            _store.gather();
+            //Sorting waits for doLoad so that it can be sent a key range at a time
+            if (!_diverted) return;
+            //What is already in RAM joins the runs on disk
+            BsonPairDeque slice;
+            size_t queueSize = owner()->queueSize();
+            for (size_t begin = 0; begin < _store.size(); begin += queueSize) {
+                size_t end = std::min(begin + queueSize, _store.size());
+                size_t bytes = 0;
+                for (size_t i = begin; i < end; ++i) {
+                    bytes += _store.bytes(i);
+                    slice.emplace_back(_store.key(i), _store.doc(i));
+                }
+                _overflow->pushSort(&slice);
+                tools::MemoryBudget::remove(tools::MemoryBudget::Use::QUEUED, bytes);
+            }
+            _bytes = 0;
+            //The slices point into the store until they are on disk
+            _overflow->prep();
+            _store.clear();
+        }
+
         void RAMQueueDispatch::doLoad() {
+            if (_diverted) {
+                _overflow->doLoad();
+                return;
+            }
+            //The keys are normalized for the sort, anything that can't be is sorted as BSON
+            tools::KeyEncoder encoder(owner()->sortIndex(), tools::KeyEncoder::Source::KEY);
+            auto keyOf = [](const char* pair) {return Bson(pair);};
+            size_t threads = owner()->sortThreads();
+            std::vector<tools::FixedKeyRecord> fixed;
+            std::vector<tools::BytesKeyRecord> bytes;
+            std::vector<std::string> buffers;
+            _sendQueue.reserve(owner()->queueSize());
+            if (tools::encodeRecords(encoder, _store, keyOf, threads, &fixed))
+                sendPartitioned(&fixed);
+            else if (tools::encodeRecords(encoder, _store, keyOf, threads, &bytes, &buffers))
+                sendPartitioned(&bytes);
+            else {
+                //Keys that can't be encoded are sorted as BSON, the positions match the store's
+                std::vector<BsonPairDeque::value_type> pairs;
+                pairs.reserve(_store.size());
+                for (size_t i = 0; i < _store.size(); ++i)
+                    pairs.emplace_back(_store.key(i), Bson());
+                sortUniqueBson(owner()->sortIndex(), owner()->dedupe(), pairs,
+                               [this](size_t position) {queueSend(position);},
+                               [this](size_t position) {drop(position);});
+            }
+            flushSend();
+            _store.clear();
+            _bytes = 0;
+        }
+
+        template<typename Record>
+        void RAMQueueDispatch::sendPartitioned(std::vector<Record>* records) {
+            //Input in a few key ordered runs is merged, there is nothing to partition
+            if (tools::mergeRuns(records->data(), records->size())) {
+                uniqueRecords(records->data(), records->size(), owner()->dedupe(),
+                              [this](size_t position) {queueSend(position);},
+                              [this](size_t position) {drop(position);});
+                return;
+            }
+            size_t threads = owner()->sortThreads();
+            size_t partitions = std::min((records->size() + PARTITION_RECORDS - 1)
+                                         / PARTITION_RECORDS, PARTITIONS_MAX);
+            std::vector<size_t> bounds = partition(records, partitions);
+            for (size_t range = 0; range + 1 < bounds.size(); ++range) {
+                Record* begin = records->data() + bounds[range];
+                size_t count = bounds[range + 1] - bounds[range];
+                tools::sortRecords(begin, count, threads);
+                uniqueRecords(begin, count, owner()->dedupe(),
+                              [this](size_t position) {queueSend(position);},
+                              [this](size_t position) {drop(position);});
+            }
+        }
+
+        void RAMQueueDispatch::drop(size_t position) {
+            //Earlier sends may still hold the buffer the pair is in
+            _store.retire(_store.bytes(position));
+            owner()->duplicate(_store.doc(position));
+        }
+
+        void RAMQueueDispatch::queueSend(size_t position) {
+            Bson doc = _store.doc(position);
+            if (!_sendQueue.empty() && _sendBatch + doc.objsize() > owner()->batchBytes())
+                flushSend();
+            _sendQueue.emplace_back(doc);
+            _sendHeld += _store.bytes(position);
+            _sendBatch += doc.objsize();
+            if (_sendQueue.size() >= owner()->queueSize()) flushSend();
+        }
+
+        void RAMQueueDispatch::flushSend() {
+            //The operation counts the documents as in flight from here, the keys stay budgeted
+            //until the store's buffers go
+            _store.retire(_sendHeld - _sendBatch);
+            tools::MemoryBudget::remove(tools::MemoryBudget::Use::QUEUED, _sendBatch);
+            //The operation keeps all of the store's buffers until it is done, so its documents
+            //are budgeted again from then until the last hold goes
+            if (!_sendQueue.empty()) send(&_sendQueue, _store.hold(_sendBatch));
+            _sendHeld = _sendBatch = 0;
+            _sendQueue.clear();
+            _sendQueue.reserve(owner()->queueSize());
+        }
+
+        int ChunkDispatcher::spillReserve(size_t size, off_t* offset) {
+            tools::MutexLockGuard lock(_spillMutex);
+            if (_spillFd < 0) {
+                std::string path = (workPath().empty() ? "." : workPath())
+                        + "/mlightning_disk_queue.XXXXXX";
+                _spillFd = mkstemp(&path[0]);
+                if (_spillFd < 0) {
+                    std::cerr << "Unable to create disk queue file " << path << ": "
+                              << std::strerror(errno) << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                //The file goes away with the descriptor, even if the load doesn't finish
+                unlink(path.c_str());
+            }
+            *offset = _spillSize;
+            _spillSize += size;
+            return _spillFd;
+        }
+
+        void ChunkDispatcher::spillRelease(off_t offset, size_t size) {
+            if (!size || _spillFd < 0) return;
+            //Best effort, the file is still freed whole at the end of the load
+            fallocate(_spillFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size);
+        }
+
+        DiskQueueDispatch::~DiskQueueDispatch() {
+            for (auto&& run : _runs)
+                owner()->spillRelease(run.offset, run.size);
+        }
+
+        void DiskQueueDispatch::pushSort(BsonPairDeque* q) {
+            //Runs being spilled free up the budget
+            tools::MemoryBudget::waitForRoom();
+            std::shared_ptr<BsonPairDeque> run;
+            {
+                tools::MutexUniqueLock lock(_pendingMutex, std::defer_lock);
+                unsigned long long waited = tools::lockTimed(&lock);
+                if (waited) owner()->handoffWaited(waited);
+                size_t bytes = 0;
+                for (auto&& value : *q) {
+                    bytes += pairBytes(value);
+                    _pending.push_back(std::move(value));
+                }
+                q->clear();
+                tools::MemoryBudget::add(tools::MemoryBudget::Use::QUEUED, bytes);
+                _pendingBytes += bytes;
+                if (_pendingBytes < RUN_BYTES) return;
+                run = std::make_shared<BsonPairDeque>();
+                run->swap(_pending);
+                tools::MemoryBudget::move(tools::MemoryBudget::Use::QUEUED,
+                                          tools::MemoryBudget::Use::IN_FLIGHT, _pendingBytes);
+                _pendingBytes = 0;
+            }
+            {
+                tools::MutexLockGuard lock(_spillMutex);
+                ++_spilling;
+            }
+            owner()->queueTask([this, run] {
+                this->spill(run.get());
+                tools::MutexLockGuard lock(_spillMutex);
+                if (!--_spilling) _spillNotify.notify_all();
+            });
+        }
+
+        void DiskQueueDispatch::prep() {
+            //Input is over, nothing else can be pushed
+            tools::MemoryBudget::move(tools::MemoryBudget::Use::QUEUED,
+                                      tools::MemoryBudget::Use::IN_FLIGHT, _pendingBytes);
+            _pendingBytes = 0;
+            if (!_pending.empty()) spill(&_pending);
+            tools::MutexUniqueLock lock(_spillMutex);
+            _spillNotify.wait(lock, [this] {return !_spilling;});
+        }
+
+        void DiskQueueDispatch::sortUnique(BsonPairDeque* run) {
+            tools::KeyEncoder encoder(owner()->sortIndex(), tools::KeyEncoder::Source::KEY);
+            auto keyOf = [](const BsonPairDeque::value_type& value) -> const Bson& {
+                return value.first;};
+            BsonPairDeque kept;
+            size_t dropped = 0;
+            auto keep = [&](size_t position) {kept.push_back(std::move((*run)[position]));};
+            auto lose = [&](size_t position) {
+                const BsonPairDeque::value_type& value = (*run)[position];
+                dropped += pairBytes(value);
+                owner()->duplicate(value.second);
+                tools::BsonArena::release(value.first);
+                tools::BsonArena::release(value.second);
+            };
+            std::vector<tools::FixedKeyRecord> fixed;
+            std::vector<tools::BytesKeyRecord> bytes;
+            std::vector<std::string> buffers;
+            if (tools::encodeRecords(encoder, *run, keyOf, 1, &fixed)) {
+                tools::sortRecords(fixed.data(), fixed.size(), 1);
+                uniqueRecords(fixed.data(), fixed.size(), owner()->dedupe(), keep, lose);
+            }
+            else if (tools::encodeRecords(encoder, *run, keyOf, 1, &bytes, &buffers)) {
+                tools::sortRecords(bytes.data(), bytes.size(), 1);
+                uniqueRecords(bytes.data(), bytes.size(), owner()->dedupe(), keep, lose);
+            }
+            else
+                sortUniqueBson(owner()->sortIndex(), owner()->dedupe(), *run, keep, lose);
+            run->swap(kept);
+            tools::MemoryBudget::remove(tools::MemoryBudget::Use::IN_FLIGHT, dropped);
+        }
+
+        void DiskQueueDispatch::spill(BsonPairDeque* run) {
+            tools::KeyEncoder encoder(owner()->sortIndex(), tools::KeyEncoder::Source::KEY);
+            if (owner()->dedupe() != Dedupe::NONE)
+                sortUnique(run);
+            else if (!tools::sortEncoded(encoder, run, [](const BsonPairDeque::value_type& value)
+                                         -> const Bson& {return value.first;}))
+                std::sort(run->begin(), run->end(), Compare(tools::BSONObjCmp(owner()->sortIndex())));
+            size_t size = 0;
+            for (auto&& value : *run)
+                size += pairBytes(value);
+            off_t offset;
+            //Space is reserved so the runs can be written in parallel
+            int fd = owner()->spillReserve(size, &offset);
+            {
+                tools::MutexLockGuard lock(_fileMutex);
+                _fd = fd;
+                _runs.push_back(Run {offset, size});
+            }
+            //The write buffer counts against the budget while it is held
+            const size_t bufferBytes = MERGE_BUFFER_MIN * 16;
+            tools::MemoryBudget::add(tools::MemoryBudget::Use::IN_FLIGHT, bufferBytes);
+            std::vector<char> buffer;
+            buffer.reserve(bufferBytes);
+            for (auto&& value : *run) {
+                for (auto&& obj : {value.first, value.second}) {
+                    if (buffer.size() + obj.objsize() > buffer.capacity() && !buffer.empty()) {
+                        write(buffer.data(), buffer.size(), offset);
+                        offset += buffer.size();
+                        buffer.clear();
+                    }
+                    buffer.insert(buffer.end(), obj.objdata(), obj.objdata() + obj.objsize());
+                }
+                tools::BsonArena::release(value.first);
+                tools::BsonArena::release(value.second);
+            }
+            if (!buffer.empty()) write(buffer.data(), buffer.size(), offset);
+            run->clear();
+            tools::MemoryBudget::remove(tools::MemoryBudget::Use::IN_FLIGHT, size + bufferBytes);
+        }
+
+        void DiskQueueDispatch::write(const char* data, size_t size, off_t offset) {
+            while (size) {
+                ssize_t written = pwrite(_fd, data, size, offset);
+                if (written < 0) {
+                    if (errno == EINTR) continue;
+                    std::cerr << "Unable to write disk queue run: " << std::strerror(errno)
+                              << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                data += written;
+                offset += written;
+                size -= written;
+            }
+        }
+
+        void DiskQueueDispatch::doLoad() {
+            if (_runs.empty()) return;
+            tools::KeyEncoder encoder(owner()->sortIndex(), tools::KeyEncoder::Source::KEY);
+            tools::BSONObjCmp compare(owner()->sortIndex());
+            size_t bufferSize = std::max(MERGE_BYTES / _runs.size(), MERGE_BUFFER_MIN);
+            //The read buffers count against the budget for the merge, finalize threads merging
+            //side by side wait for each other's to go
+            const size_t bufferBytes = bufferSize * _runs.size();
+            tools::MemoryBudget::waitForRoom();
+            tools::MemoryBudget::add(tools::MemoryBudget::Use::IN_FLIGHT, bufferBytes);
+            std::vector<std::unique_ptr<RunCursor>> cursors;
+            for (auto&& run : _runs) {
+                cursors.emplace_back(new RunCursor(_fd, run.offset, run.size, bufferSize, encoder));
+                cursors.back()->run = cursors.size() - 1;
+            }
+            //Encoded keys have the same order as BSON, so pairs only compare BSON if one wasn't
+            auto greater = [&compare](const RunCursor* l, const RunCursor* r) {
+                if (l->isEncoded && r->isEncoded) {
+                    if (l->encoded != r->encoded) return r->encoded < l->encoded;
+                }
+                else if (compare(r->key, l->key)) return true;
+                else if (compare(l->key, r->key)) return false;
+                //Equal keys come out in push order
+                return r->run < l->run;
+            };
+            std::priority_queue<RunCursor*, std::vector<RunCursor*>, decltype(greater)>
+                    merge(greater);
+            for (auto&& cursor : cursors)
+                if (cursor->next()) merge.push(cursor.get());
+
             tools::mtools::DataQueue sendQueue;
             size_t queueSize = owner()->queueSize();
-            for (auto& i : _queue.unSafeAccess()) {
-                sendQueue.emplace_back(i.second);
+            size_t batch = 0;
+            sendQueue.reserve(queueSize);
+            auto queue = [&](const Bson& doc) {
+                if (!sendQueue.empty() && batch + doc.objsize() > owner()->batchBytes()) {
+                    send(&sendQueue);
+                    sendQueue.clear();
+                    sendQueue.reserve(queueSize);
+                    batch = 0;
+                }
+                batch += doc.objsize();
+                sendQueue.emplace_back(doc);
                 if (sendQueue.size() >= queueSize) {
                     send(&sendQueue);
                     sendQueue.clear();
                     sendQueue.reserve(queueSize);
+                    batch = 0;
+                }
+            };
+            //With a dedupe each key's document is held until the next key shows which one is sent
+            const Dedupe dedupe = owner()->dedupe();
+            bool held = false;
+            Bson heldKey;
+            Bson heldDoc;
+            while (!merge.empty()) {
+                RunCursor* cursor = merge.top();
+                merge.pop();
+                if (dedupe == Dedupe::NONE)
+                    queue(cursor->doc.getOwned());
+                //The merge is in key order, so a key that isn't greater is the same key
+                else if (held && !compare(heldKey, cursor->key)) {
+                    if (dedupe == Dedupe::LAST) {
+                        owner()->duplicate(heldDoc);
+                        heldDoc = cursor->doc.getOwned();
+                    }
+                    else owner()->duplicate(cursor->doc);
+                }
+                else {
+                    if (held) queue(heldDoc);
+                    held = true;
+                    heldKey = cursor->key.getOwned();
+                    heldDoc = cursor->doc.getOwned();
                 }
+                if (cursor->next()) merge.push(cursor);
             }
+            if (held) queue(heldDoc);
             if (sendQueue.size())
                 send(&sendQueue);
+            cursors.clear();
+            tools::MemoryBudget::remove(tools::MemoryBudget::Use::IN_FLIGHT, bufferBytes);
+            for (auto&& run : _runs)
+                owner()->spillRelease(run.offset, run.size);
+            _runs.clear();
         }
     }
 }  //namespace loader
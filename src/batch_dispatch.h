@@ -15,14 +15,24 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <memory>
+#include <thread>
+#include <sys/types.h>
+#include <unistd.h>
+#include "chunk_store.h"
 #include "concurrent_container.h"
 #include "factory.h"
 #include "index.h"
+#include "journal.h"
+#include "key_encoding.h"
 #include "loader_defs.h"
 #include "mongo_cluster.h"
 #include "loader_end_point.h"
+#include "memory_budget.h"
+#include "trace.h"
 
 namespace loader {
     namespace dispatch {
@@ -55,11 +65,25 @@ namespace loader {
              */
             virtual void pushSort(BsonPairDeque* q) = 0;
 
+            /**
+             * Sends a batch that is already an insert message, only direct dispatch takes these
+             */
+            virtual void pushWire(tools::mtools::WireBatchPointer batch) {
+                assert(false);
+            }
+
             /**
              * Called after any new input is over
              */
             virtual void prep() = 0;
 
+            /**
+             * @return true if documents are held until doLoad, false if they are sent as pushed
+             */
+            virtual bool holdsInput() const {
+                return true;
+            }
+
             /**
              * Completely queues the queue into the end points
              */
@@ -72,6 +96,13 @@ namespace loader {
                 return _ep;
             }
 
+            /**
+             * Points the chunk at another end point, i.e. its new shard after a migration
+             */
+            void endPointSet(EndPoint* ep) {
+                _ep = ep;
+            }
+
             /**
              * @return the holder for the derived class to use
              */
@@ -86,16 +117,58 @@ namespace loader {
                 return _settings;
             }
 
+            /**
+             * Records documents batchers routed to this chunk, called once per batch handed off
+             */
+            void routed(size_t docs) {
+                _docsRouted.fetch_add(docs, std::memory_order_relaxed);
+            }
+
+            size_t docsRouted() const {
+                return _docsRouted.load(std::memory_order_relaxed);
+            }
+
+            /**
+             * @return the shard and chunk to trace this chunk's work as, empty if tracing is off
+             */
+            const tools::Trace::Tag* traceTag() const {
+                return _traceTag;
+            }
+
+            /**
+             * Gives the chunk's journal holds to the operations it sent ahead of prep, i.e.
+             * streamed while the input was read, so the chunk isn't journaled before they are
+             * written.  Called once, before prep.
+             */
+            void sentAheadJoin(const Journal::Holds& holds) {
+                _sentAhead->insert(_sentAhead->end(), holds.begin(), holds.end());
+                _sentAhead.reset();
+            }
+
         protected:
             /**
              * Derived classes call this to unload their queues in batches
+             * @param hold kept by the operation until it is done with, i.e. the memory of q
              */
-            void send(tools::mtools::DataQueue* q);
+            void send(tools::mtools::DataQueue* q, std::shared_ptr<void> hold = nullptr);
+
+            void send(tools::mtools::WireBatchPointer batch);
+
+            /**
+             * @return the hold for operations sent ahead of prep, they keep the chunk's journal
+             * holds once it has them
+             */
+            std::shared_ptr<void> sentAhead() const {
+                return _sentAhead;
+            }
 
         private:
             Settings _settings;
-            EndPoint *_ep;
-            const int _bulkWriteVersion;
+            std::atomic<EndPoint*> _ep;
+            std::atomic<size_t> _docsRouted {};
+            //Kept by the trace, spans of the chunk's operations can outlive it
+            const tools::Trace::Tag* _traceTag {};
+            std::shared_ptr<Journal::Holds> _sentAhead {std::make_shared<Journal::Holds>()};
         };
 
         /**
@@ -131,15 +204,50 @@ namespace loader {
             using Value = ChunkDispatchPointer;
             using LoadPlan = tools::Index<Key, Value, tools::BSONObjCmp>;
 
+            /**
+             * What sorting queues do with documents with the same shard key
+             * NONE: all are sent
+             * FIRST: the first pushed to the queue is sent
+             * LAST: the last pushed to the queue is sent
+             * REJECT: the first is sent, the others are written to the duplicates file
+             */
+            enum class Dedupe {
+                NONE, FIRST, LAST, REJECT
+            };
+
+            /**
+             * How documents are written
+             * INSERT: inserted
+             * REPLACE: upserted by shard key and _id, replacing the document they match
+             * MERGE: upserted by shard key and _id, setting their fields on the document they match
+             */
+            enum class WriteMode {
+                INSERT, REPLACE, MERGE
+            };
+
             struct Settings {
                 LoadQueues *loadQueues;
                 int writeConcern;
                 bool directLoad;
                 mongo::BSONObj sortIndex;
+                //A unique shard key matches upserts alone, otherwise they need an _id
+                bool shardKeyUnique;
                 size_t ramQueueBatchSize;
+                //Batches are also cut once their documents reach this many bytes
+                size_t batchBytes;
                 std::string workPath;
                 size_t workThreads;
+                //0 for the hardware threads split over the chunks
+                size_t sortThreads;
                 int bulkWriteVersion;
+                //Pick the mongoS for each batch by load instead of one per chunk
+                bool routerByLoad;
+                Dedupe dedupe;
+                //BSON file rejected duplicates are appended to
+                std::string dedupeFile;
+                WriteMode writeMode;
+                //Count the operations until they are done with, for end points shared by loads
+                bool trackWrites;
             };
 
 
@@ -149,8 +257,12 @@ namespace loader {
                                tools::mtools::MongoCluster::NameSpace ns);
 
             ~ChunkDispatcher() {
+                chunksWatchStop();
                 _tp.terminateInitiate();
                 _tp.joinAll();
+                //The chunks go after this, their runs mustn't be released into a reused descriptor
+                if (_spillFd >= 0) close(_spillFd);
+                _spillFd = -1;
             }
 
             Value& at(const Key& key) {
@@ -180,6 +292,90 @@ namespace loader {
                 return _eph->getMongoSCycle();
             }
 
+            /**
+             * @return EndPoint for a batch, the least loaded mongoS if routers are picked by load,
+             * otherwise fixed
+             */
+            EndPoint* endPointForBatch(EndPoint* fixed) {
+                if (_settings.directLoad || !_settings.routerByLoad) return fixed;
+                return _eph->getMongoSLeastLoaded();
+            }
+
+            /**
+             * Writes documents a shard rejected for stale routing to the shards that own them
+             * now.  The namespace's chunks are read again, once for all the writes that were
+             * rejected together.  Direct writes are unversioned so a committed migration isn't
+             * rejected, the chunk watch catches those.  Thread safe.
+             * @return false if they couldn't be written
+             */
+            bool reroute(const std::string& ns, tools::mtools::DataQueue* docs);
+
+            /**
+             * Direct loads only.  Polls the namespace's chunk version while the load writes, a
+             * change has chunksMoved() point the chunks that moved at their new shards.
+             * @param version the chunk version the chunks were read at
+             */
+            void chunksWatchStart(mongo::BSONObj version);
+
+            /**
+             * Ends the chunk watch once the writes are done.  A last poll catches a move that
+             * hasn't been seen, then the documents the old shards took for the ranges they lost
+             * are moved to the shards that own them.
+             * @return false if some of them couldn't be moved
+             */
+            bool chunksWatchStop();
+
+            /**
+             * Reads the chunks again, points each chunk whose range is on another shard now at
+             * that shard's end point and notes the range for chunksWatchStop() to repair.  Exits
+             * if a chunk's range is now split over shards, its documents can't be sent as one.
+             */
+            void chunksMoved();
+
+            /**
+             * @return a write of the documents in q, an insert with the bulk write version in use
+             * or an upsert keyed on the shard key
+             */
+            tools::mtools::DbOpPointer makeWrite(tools::mtools::DataQueue* q) {
+                tools::mtools::DbOpPointer op;
+                if (_settings.writeMode != WriteMode::INSERT)
+                    op = tools::mtools::OpQueueBulkUpsertUnorderedv26_0::make(ns(), q,
+                            _settings.sortIndex, _settings.shardKeyUnique,
+                            _settings.writeMode == WriteMode::MERGE, writeConcern());
+                else switch (_settings.bulkWriteVersion) {
+                case 0 :
+                    op = tools::mtools::OpQueueBulkInsertUnorderedv24_0::make(ns(), q, 0,
+                                                                             writeConcern());
+                    break;
+                case 1 :
+                    op = tools::mtools::OpQueueBulkInsertUnorderedv26_0::make(ns(), q, 0,
+                                                                             writeConcern());
+                    break;
+                default :
+                    throw std::logic_error("Unknown bulk write protocol version");
+                }
+                writeTrack(op.get());
+                return op;
+            }
+
+            /**
+             * Counts op as pending until it is done with, if writes are tracked
+             */
+            void writeTrack(tools::mtools::DbOp* op) {
+                if (!_settings.trackWrites) return;
+                ++_writesPending;
+                op->holds.emplace_back(static_cast<void*>(this), [](void* owner) {
+                    static_cast<ChunkDispatcher*>(owner)->writeDone();});
+            }
+
+            /**
+             * Waits for all the tracked operations to be done with
+             */
+            void writesWait() {
+                tools::MutexUniqueLock lock(_writesMutex);
+                _writesNotify.wait(lock, [this] {return !_writesPending;});
+            }
+
             /**
              * @return EndPoint for a specific chunk's max key
              */
@@ -198,10 +394,80 @@ namespace loader {
                 return _settings.ramQueueBatchSize;
             }
 
+            const size_t batchBytes() const {
+                return _settings.batchBytes;
+            }
+
+            /**
+             * Records a batch handed to an end point
+             */
+            void batchSent(size_t docs, size_t bytes) {
+                ++_batchesSent;
+                _docsSent += docs;
+                _bytesSent += bytes;
+            }
+
+            size_t batchesSent() const {
+                return _batchesSent;
+            }
+
+            size_t docsSent() const {
+                return _docsSent;
+            }
+
+            size_t bytesSent() const {
+                return _bytesSent;
+            }
+
+            /**
+             * @return documents routed to each chunk so far, in chunk order
+             */
+            std::vector<size_t> docsRouted() const;
+
+            /**
+             * Records time input threads spent waiting to hand a batch to a queue
+             */
+            void handoffWaited(unsigned long long nanos) {
+                _handoffWaitNanos += nanos;
+            }
+
+            /**
+             * Records lock free handoffs that had to retry
+             */
+            void handoffRetried(size_t retries) {
+                _handoffRetries += retries;
+            }
+
+            unsigned long long handoffWaitNanos() const {
+                return _handoffWaitNanos;
+            }
+
+            size_t handoffRetries() const {
+                return _handoffRetries;
+            }
+
             const Bson& sortIndex() const {
                 return _settings.sortIndex;
             }
 
+            Dedupe dedupe() const {
+                return _settings.dedupe;
+            }
+
+            WriteMode writeMode() const {
+                return _settings.writeMode;
+            }
+
+            /**
+             * Takes a document dropped for having the same shard key as one that is sent, it is
+             * written to the duplicates file if they are rejected.  Thread safe.
+             */
+            void duplicate(const Bson& doc);
+
+            size_t duplicates() const {
+                return _duplicates;
+            }
+
             /**
              * @return temporary work path for e.g. external sorts
              */
@@ -209,6 +475,20 @@ namespace loader {
                 return _settings.workPath;
             }
 
+            /**
+             * Reserves room for a run in the spill file the disk queues share, so there is one
+             * descriptor however many chunks spill.  The file is created in workPath on first use
+             * and goes away with the load.
+             * @param offset set to the start of the reserved range
+             * @return the file's descriptor
+             */
+            int spillReserve(size_t size, off_t* offset);
+
+            /**
+             * Gives the disk space of a merged run back
+             */
+            void spillRelease(off_t offset, size_t size);
+
             /**
              * Are direct load queues in use?
              */
@@ -223,6 +503,16 @@ namespace loader {
                 return &_wc;
             }
 
+            /**
+             * @return threads a queue can use to sort itself while finalizing
+             */
+            size_t sortThreads() const {
+                if (_settings.sortThreads) return _settings.sortThreads;
+                //The finalize waterfall sorts chunks side by side, so they share the hardware
+                return std::max<size_t>(1, std::thread::hardware_concurrency()
+                                           / std::max<size_t>(1, _loadPlan.size()));
+            }
+
             const int bulkWriteVersion() const {
                 return _settings.bulkWriteVersion;
             }
@@ -231,8 +521,9 @@ namespace loader {
              * Queues a task in the thread pool associated with this queue
              * Will be used for disk queues
              */
-            void queueTask(tools::ThreadFunction func) {
-                _tp.queue(func);
+            template<typename Func>
+            void queueTask(Func&& func) {
+                _tp.queue(std::forward<Func>(func));
             }
 
         private:
@@ -246,21 +537,95 @@ namespace loader {
             const tools::mtools::MongoCluster::NameSpace _ns;
             LoadPlan _loadPlan;
             mongo::WriteConcern _wc;
+            std::atomic<size_t> _batchesSent {};
+            std::atomic<size_t> _docsSent {};
+            std::atomic<size_t> _bytesSent {};
+            std::atomic<unsigned long long> _handoffWaitNanos {};
+            std::atomic<size_t> _handoffRetries {};
+            std::atomic<size_t> _duplicates {};
+            std::atomic<size_t> _writesPending {};
+            tools::Mutex _writesMutex;
+            tools::ConditionVariable _writesNotify;
+            //Runs of every disk queue, created by the first spill
+            tools::Mutex _spillMutex;
+            int _spillFd {-1};
+            off_t _spillSize {};
+            //Opened by the first rejected duplicate
+            tools::Mutex _duplicatesMutex;
+            std::ofstream _duplicatesFile;
+            //Chunks as last read for rerouting, replaced whole so readers keep their copy
+            tools::Mutex _routingMutex;
+            std::shared_ptr<tools::mtools::MongoCluster> _routing;
+            std::atomic<size_t> _routingGeneration {};
+
+            //A range a shard lost mid-load, it may hold documents written after the move
+            struct MovedRange {
+                tools::mtools::MongoCluster::ShardName from;
+                //Empty for the open ended first and last chunks
+                mongo::BSONObj min;
+                mongo::BSONObj max;
+            };
+            //Shard each chunk is sent to by _loadPlan order, filled by the first move
+            std::vector<tools::mtools::MongoCluster::ShardName> _owners;
+            std::vector<MovedRange> _moved;
+            tools::Mutex _watchMutex;
+            tools::ConditionVariable _watchNotify;
+            bool _watchStop {};
+            std::thread _watch;
+
+            //Times rejected documents are routed again before the load fails
+            static constexpr size_t REROUTE_ATTEMPTS = 5;
+            //Between polls of the chunk version during direct loads
+            static constexpr size_t CHUNKS_POLL_SECONDS = 5;
+
+            void writeDone() {
+                if (--_writesPending) return;
+                tools::MutexLockGuard lock(_writesMutex);
+                _writesNotify.notify_all();
+            }
+
+            /**
+             * @param generation the routing last used, it is read again if that's still current
+             * @return the routing, generation is set to it
+             */
+            std::shared_ptr<tools::mtools::MongoCluster> routing(size_t* generation);
+
+            /**
+             * @return the chunk index key of a document, hashed fields are hashed
+             */
+            Bson routingKey(const Bson& doc) const;
 
+            /**
+             * Writes the documents the shard took for a range it lost to their owners, then
+             * removes them from it
+             * @return false if some couldn't be written
+             */
+            bool movedRepair(tools::mtools::MongoCluster& cluster, const MovedRange& moved);
         };
 
         //TODO: create a protocol version map, but given I'm not sure about the args right now..
-        inline void AbstractChunkDispatch::send(tools::mtools::DataQueue* q) {
-            switch(_bulkWriteVersion) {
-            case 0 : endPoint()->push(tools::mtools::OpQueueBulkInsertUnorderedv24_0::make(
-                owner()->ns(), q, 0, owner()->writeConcern()));
-            break;
-            case 1: endPoint()->push(tools::mtools::OpQueueBulkInsertUnorderedv26_0::make(
-                owner()->ns(), q, 0, owner()->writeConcern()));
-            break;
-            default :
-                std::logic_error("Unknown bulk write protocol version");
-            }
+        inline void AbstractChunkDispatch::send(tools::mtools::DataQueue* q,
+                                                std::shared_ptr<void> hold) {
+            size_t bytes = 0;
+            for (auto&& doc : *q)
+                bytes += doc.objsize();
+            owner()->batchSent(q->size(), bytes);
+            tools::mtools::DbOpPointer op = owner()->makeWrite(q);
+            if (hold) op->holds.push_back(std::move(hold));
+            //Progress the batch carries is journaled once the operation is written
+            Journal::attach(&op->holds);
+            op->traceTag = traceTag();
+            owner()->endPointForBatch(endPoint())->push(std::move(op), owner());
+        }
+
+        inline void AbstractChunkDispatch::send(tools::mtools::WireBatchPointer batch) {
+            owner()->batchSent(batch->docs(), batch->bytes());
+            tools::mtools::DbOpPointer op = tools::mtools::OpQueueWireInsert::make(
+                std::move(batch), owner()->writeConcern());
+            owner()->writeTrack(op.get());
+            Journal::attach(&op->holds);
+            op->traceTag = traceTag();
+            owner()->endPointForBatch(endPoint())->push(std::move(op), owner());
         }
 
         /**
@@ -270,12 +635,20 @@ namespace loader {
         class DirectDispatch : public AbstractChunkDispatch {
         public:
             DirectDispatch(Settings settings) :
-                    AbstractChunkDispatch(std::move(settings))
+                    AbstractChunkDispatch(std::move(settings)),
+                    _encoder(owner()->sortIndex(), tools::KeyEncoder::Source::DOCUMENT)
             {
             }
 
             void push(BsonV* q) {
-                std::sort(q->begin(), q->end(), tools::BSONObjCmp(owner()->sortIndex()));
+                tools::MemoryBudget::waitForRoom();
+                //Sorted on the encoded key fields, BSON compares if a value can't be encoded
+                if (!tools::sortEncoded(_encoder, q, [](const Bson& doc) -> const Bson& {
+                        return doc;})) {
+                    tools::BSONObjCmp compare(owner()->sortIndex());
+                    if (!std::is_sorted(q->begin(), q->end(), compare))
+                        std::sort(q->begin(), q->end(), compare);
+                }
                 send(q);
                 //TODO: remove this check
                 assert(q->empty());
@@ -285,12 +658,24 @@ namespace loader {
                 assert(false);
             }
 
+            /**
+             * Wire batches go out in the order they were filled, there is nothing left to sort
+             */
+            void pushWire(tools::mtools::WireBatchPointer batch) {
+                tools::MemoryBudget::waitForRoom();
+                send(std::move(batch));
+            }
+
             /*
              * This OpAgg does nothing else
              */
             void prep() {
             }
 
+            bool holdsInput() const {
+                return false;
+            }
+
             void doLoad() {
             }
 
@@ -300,94 +685,164 @@ namespace loader {
             }
         private:
             static const bool factoryRegisterCreator;
+            const tools::KeyEncoder _encoder;
         };
 
         /**
-         * Stores the data in RAM until it is time to push.  At which point is sorts it and sends it.
+         * External merge sort for data that doesn't fit in RAM.  Pushed documents are cut into
+         * runs that are sorted and spilled to a workPath file on the dispatcher's thread pool.  At
+         * load time the runs are k-way merged so the end point is sent inserts in key order.
+         * A record is the key BSON followed by the document BSON, so runs frame themselves.
          */
-        class RAMQueueDispatch : public AbstractChunkDispatch {
+        class DiskQueueDispatch : public AbstractChunkDispatch {
         public:
-            RAMQueueDispatch(Settings settings) :
+            //Documents held in RAM before they are spilled as a run
+            static constexpr size_t RUN_BYTES = 16 * 1024 * 1024;
+            //Read buffers for all the runs split this between them in the merge
+            static constexpr size_t MERGE_BYTES = 64 * 1024 * 1024;
+            static constexpr size_t MERGE_BUFFER_MIN = 64 * 1024;
+
+            DiskQueueDispatch(Settings settings) :
                     AbstractChunkDispatch(std::move(settings))
             {
             }
 
+            ~DiskQueueDispatch();
+
             void push(BsonV* q) {
                 assert(false);
             }
 
-            void pushSort(BsonPairDeque* q) {
-                //TODO: see if pre sorting is faster
-                _queue.moveIn(q);
-                q->clear();
-            }
+            void pushSort(BsonPairDeque* q);
 
-            void prep() {
-                _queue.sort(Compare(tools::BSONObjCmp(owner()->sortIndex())));
-            }
+            /**
+             * Spills what is left and waits for all the runs to be on disk
+             */
+            void prep();
 
             void doLoad();
 
             static ChunkDispatchPointer create(ChunkDispatcher* owner, EndPointHolder* eph, Bson chunkUB)
             {
-                return ChunkDispatchPointer(new RAMQueueDispatch(Settings {owner, eph, chunkUB}));
+                return ChunkDispatchPointer(new DiskQueueDispatch(Settings {owner, eph, chunkUB}));
             }
 
         private:
             using Compare = tools::IndexPairCompare<tools::BSONObjCmp, Bson>;
+            struct Run {
+                off_t offset;
+                size_t size;
+            };
 
             static const bool factoryRegisterCreator;
-            tools::ConcurrentQueue<BsonPairDeque::value_type> _queue;
 
+            /**
+             * Sorts a run and drops the documents that repeat a key, for a dedupe
+             */
+            void sortUnique(BsonPairDeque* run);
+
+            /**
+             * Sorts and writes a run, the documents are released once they are on disk
+             */
+            void spill(BsonPairDeque* run);
+
+            void write(const char* data, size_t size, off_t offset);
+
+            tools::Mutex _pendingMutex;
+            BsonPairDeque _pending;
+            size_t _pendingBytes{};
+
+            tools::Mutex _spillMutex;
+            tools::ConditionVariable _spillNotify;
+            size_t _spilling{};
+
+            //Guards the runs, they are in the owner's spill file
+            tools::Mutex _fileMutex;
+            int _fd{-1};
+            std::vector<Run> _runs;
         };
 
-        //TODO: DiskQueue OpAgg, cycle sort?
-        class DiskQueueDispatch : public AbstractChunkDispatch {
+        /**
+         * Stores the data in RAM until it is time to push.  At which point is sorts it and sends it.
+         * The pairs are copied into a ChunkStore as they are pushed and the batches sent point
+         * into it.
+         * The queue is partitioned into key sub-ranges that are sorted and sent in order, so the
+         * end point has the first range while the rest are sorting.
+         * Once the MemoryBudget is full the chunk diverts to a DiskQueueDispatch, which takes
+         * what is already in RAM at finalize so the load stays in key order.
+         * Inserts without a dedupe are streamed like a direct queue for as long as the batches
+         * arrive in key order, so input that is already sorted doesn't wait for finalize.
+         */
+        class RAMQueueDispatch : public AbstractChunkDispatch {
         public:
-            DiskQueueDispatch(Settings settings) :
-                    AbstractChunkDispatch(std::move(settings))
+            //Records per key sub-range
+            static constexpr size_t PARTITION_RECORDS = 256 * 1024;
+            static constexpr size_t PARTITIONS_MAX = 256;
+
+            RAMQueueDispatch(Settings settings) :
+                    AbstractChunkDispatch(std::move(settings)),
+                    _inOrder(owner()->dedupe() == ChunkDispatcher::Dedupe::NONE
+                             && owner()->writeMode() == ChunkDispatcher::WriteMode::INSERT)
             {
-                assert(false);
-                diskQueue.open(owner()->workPath() + "chunk" + this->settings().chunkUB.toString()
-                    + ".bson");
             }
 
             void push(BsonV* q) {
-                _holder.push(std::move(*q));
-                owner()->queueTask([this] {this->spill();});
-            }
-
-            void pushSort(BsonPairDeque* q) {
                 assert(false);
             }
 
-            void prep() {
-                //needs to work
-                assert(false);
-            }
+            void pushSort(BsonPairDeque* q);
 
-            void doLoad() {
-                //needs to work
-                assert(false);
-            }
+            void prep();
+
+            void doLoad();
 
             static ChunkDispatchPointer create(ChunkDispatcher* owner, EndPointHolder* eph, Bson chunkUB)
             {
-                return ChunkDispatchPointer(new DiskQueueDispatch(Settings {owner, eph, chunkUB}));
+                return ChunkDispatchPointer(new RAMQueueDispatch(Settings {owner, eph, chunkUB}));
             }
 
-        protected:
-            void spill() {
-                BsonV save;
-                while (_holder.pop(save)) {
+        private:
+            static const bool factoryRegisterCreator;
+            //Pushes are linked in without a lock, prep() gathers them
+            ChunkStore _store;
+            //Bytes in _store counted as queued by the MemoryBudget
+            std::atomic<size_t> _bytes {};
+            tools::Mutex _overflowMutex;
+            std::atomic<bool> _diverted {};
+            std::unique_ptr<DiskQueueDispatch> _overflow;
+            //True while every batch pushed has been in key order after the last, they are sent
+            std::atomic<bool> _inOrder;
+            tools::Mutex _orderMutex;
+            //Owned copy of the greatest key streamed
+            Bson _lastKey;
+            //The batch being built by doLoad
+            tools::mtools::DataQueue _sendQueue;
+            //Budgeted bytes (keys included) and document bytes of _sendQueue
+            size_t _sendHeld{};
+            size_t _sendBatch{};
+
+            void divert();
 
-                }
+            /**
+             * Sends the batch if it continues the key order of those sent before it
+             * @return false if it doesn't, nothing is streamed from then on
+             */
+            bool stream(BsonPairDeque* q);
 
-            }
+            /**
+             * Partitions the records into key sub-ranges, then sorts and sends each in order
+             */
+            template<typename Record>
+            void sendPartitioned(std::vector<Record>* records);
 
-        private:
-            tools::ConcurrentQueue<BsonV> _holder;
-            std::fstream diskQueue;
+            void queueSend(size_t position);
+
+            /**
+             * Drops a stored pair for its duplicate key
+             */
+            void drop(size_t position);
+
+            void flushSend();
         };
 
     }
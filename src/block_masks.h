@@ -0,0 +1,93 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLOCK_MASKS_X86
+#endif
+
+namespace tools {
+
+    /**
+     * Helpers for scanning text a 64 byte block at a time as bit masks, bit i is byte i
+     */
+    namespace blockmasks {
+        constexpr size_t BLOCK = 64;
+
+        /**
+         * The bytes of a block that doesn't have all 64 bytes
+         */
+        inline uint64_t eqTail(const char* block, size_t size, char c) {
+            uint64_t mask {};
+            for (size_t i = 0; i < size; ++i)
+                if (block[i] == c) mask |= uint64_t(1) << i;
+            return mask;
+        }
+
+#ifdef BLOCK_MASKS_X86
+        /**
+         * A full block loaded for eq()
+         */
+        struct Block {
+            __m128i part[4];
+
+            __attribute__((target("sse2")))
+            explicit Block(const char* block) {
+                for (int i = 0; i < 4; ++i)
+                    part[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + 16 * i));
+            }
+
+            __attribute__((target("sse2")))
+            uint64_t eq(char c) const {
+                const __m128i match = _mm_set1_epi8(c);
+                uint64_t mask {};
+                for (int i = 0; i < 4; ++i)
+                    mask |= uint64_t(uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(part[i], match))))
+                            << (16 * i);
+                return mask;
+            }
+        };
+#else
+        struct Block {
+            const char* data;
+
+            explicit Block(const char* block) : data(block) { }
+
+            uint64_t eq(char c) const {
+                return eqTail(data, BLOCK, c);
+            }
+        };
+#endif
+
+        /**
+         * @return each bit set if an odd number of bits are set at or below it, i.e. the bytes
+         * between pairs of quotes
+         */
+        inline uint64_t prefixXor(uint64_t bits) {
+            bits ^= bits << 1;
+            bits ^= bits << 2;
+            bits ^= bits << 4;
+            bits ^= bits << 8;
+            bits ^= bits << 16;
+            bits ^= bits << 32;
+            return bits;
+        }
+    }  //namespace blockmasks
+
+}  //namespace tools
@@ -0,0 +1,121 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "bson_arena.h"
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+namespace tools {
+
+    tools::Mutex BsonArena::_poolMutex;
+    std::vector<BsonArena::Block*> BsonArena::_pool;
+    std::unordered_set<const BsonArena::Block*> BsonArena::_blocks;
+
+    BsonArena::~BsonArena() {
+        if (!_block) return;
+        tools::MutexLockGuard lock(_poolMutex);
+        unref(_block);
+    }
+
+    char* BsonArena::allocate(size_t size) {
+        if (size > BLOCK_SIZE - HEADER_SIZE) return nullptr;
+        if (!_block || _used + size > BLOCK_SIZE) {
+            Block* block = blockGet();
+            if (_block) {
+                tools::MutexLockGuard lock(_poolMutex);
+                unref(_block);
+            }
+            _block = block;
+            _used = HEADER_SIZE;
+        }
+        char* data = reinterpret_cast<char*>(_block) + _used;
+        _used += size;
+        _block->refs.fetch_add(1, std::memory_order_relaxed);
+        return data;
+    }
+
+    mongo::BSONObj BsonArena::copy(const mongo::BSONObj& obj) {
+        char* data = allocate(obj.objsize());
+        if (!data) return obj.getOwned();
+        std::memcpy(data, obj.objdata(), obj.objsize());
+        return mongo::BSONObj(data);
+    }
+
+    void BsonArena::release(const mongo::BSONObj& obj) {
+        tools::MutexLockGuard lock(_poolMutex);
+        if (Block* block = blockFind(obj.objdata())) unref(block);
+    }
+
+    void BsonArena::release(std::vector<mongo::BSONObj>* docs) {
+        {
+            tools::MutexLockGuard lock(_poolMutex);
+            //Documents from the same block tend to be together, save the lookups
+            const char* lastData{};
+            Block* last{};
+            for (auto& doc : *docs) {
+                if (doc.isOwned()) continue;
+                if (!lastData || blockAddress(doc.objdata()) != blockAddress(lastData)) {
+                    lastData = doc.objdata();
+                    last = blockFind(lastData);
+                }
+                if (last) unref(last);
+            }
+        }
+        docs->clear();
+    }
+
+    BsonArena::Block* BsonArena::blockGet() {
+        Block* block{};
+        {
+            tools::MutexLockGuard lock(_poolMutex);
+            if (!_pool.empty()) {
+                block = _pool.back();
+                _pool.pop_back();
+            }
+        }
+        if (!block) {
+            void* memory;
+            if (posix_memalign(&memory, BLOCK_SIZE, BLOCK_SIZE)) {
+                std::cerr << "Unable to allocate arena block" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            block = new (memory) Block();
+            tools::MutexLockGuard lock(_poolMutex);
+            _blocks.insert(block);
+        }
+        //The ref for the arena filling it
+        block->refs.store(1, std::memory_order_relaxed);
+        return block;
+    }
+
+    void BsonArena::unref(Block* block) {
+        if (block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            _pool.push_back(block);
+    }
+
+    uintptr_t BsonArena::blockAddress(const char* data) {
+        return reinterpret_cast<uintptr_t>(data) & ~(uintptr_t(BLOCK_SIZE) - 1);
+    }
+
+    BsonArena::Block* BsonArena::blockFind(const char* data) {
+        const Block* block = reinterpret_cast<const Block*>(blockAddress(data));
+        if (!_blocks.count(block)) return nullptr;
+        return const_cast<Block*>(block);
+    }
+
+}  //namespace tools
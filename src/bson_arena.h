@@ -0,0 +1,96 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <unordered_set>
+#include <vector>
+#include "mongo_cxxdriver.h"
+#include "threading.h"
+
+namespace tools {
+
+    /**
+     * Blocks that finished BSON documents are placed in so that documents don't each need a
+     * malloc.  Each input thread has its own arena, the blocks come from a shared pool.
+     * Arena documents don't own their memory (isOwned() is false).  Each block counts the
+     * documents in it and goes back to the pool once they have all been released.
+     * Every arena document must be passed to release() once, after which it can't be used.
+     * release() ignores documents that aren't from an arena.
+     */
+    class BsonArena {
+    public:
+        //Blocks are aligned to their size so that a document can find its block
+        static constexpr size_t BLOCK_SIZE = 4 * 1024 * 1024;
+
+        BsonArena() { }
+        ~BsonArena();
+
+        BsonArena(const BsonArena&) = delete;
+        BsonArena& operator=(const BsonArena&) = delete;
+
+        /**
+         * @return space for a document of size bytes, nullptr if it's too large for a block.
+         * The space must hold a document before it's released.
+         */
+        char* allocate(size_t size);
+
+        /**
+         * @return obj copied into the arena, or an owned copy if it is too large for a block
+         */
+        mongo::BSONObj copy(const mongo::BSONObj& obj);
+
+        static void release(const mongo::BSONObj& obj);
+
+        /**
+         * Releases all the documents and clears docs
+         */
+        static void release(std::vector<mongo::BSONObj>* docs);
+
+    private:
+        struct Block {
+            //The arena currently filling the block holds a ref too
+            std::atomic<size_t> refs;
+        };
+        //Keeps the documents off the cache line with the ref count
+        static constexpr size_t HEADER_SIZE = 64;
+
+        Block* _block{};
+        size_t _used{};
+
+        static tools::Mutex _poolMutex;
+        static std::vector<Block*> _pool;
+        //Every block ever allocated, so that non arena documents can be detected
+        static std::unordered_set<const Block*> _blocks;
+
+        static Block* blockGet();
+
+        static uintptr_t blockAddress(const char* data);
+
+        /**
+         * Drops a ref, caller must hold _poolMutex
+         */
+        static void unref(Block* block);
+
+        /**
+         * @return the block holding data, nullptr if it isn't in a block. Caller must hold
+         * _poolMutex
+         */
+        static Block* blockFind(const char* data);
+    };
+
+}  //namespace tools
@@ -0,0 +1,219 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "calibrate.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <boost/filesystem.hpp>
+#include "input_processor.h"
+
+namespace loader {
+
+    constexpr double Calibrator::IMPROVEMENT;
+    constexpr size_t Calibrator::MIN_VALUE;
+
+    std::string Calibrator::Config::options() const {
+        std::ostringstream options;
+        options << "--load.inputThreads " << inputThreads
+                << " --load.batchSize " << batchSize
+                << " --dispatch.ramQueueBatchSize " << ramQueueBatchSize
+                << " --mongo.threads " << endPointThreads
+                << " --queuing '" << queuing << "'";
+        return options.str();
+    }
+
+    Calibrator::Calibrator(Loader::Settings settings) :
+            _settings(std::move(settings))
+    {
+        if (StreamInputProcessor::isStream(_settings.loadDir)) {
+            std::cerr << "calibrate needs input files to sample, not a stream" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (!_settings.calibrateTrials || !_settings.calibrateSampleMB) {
+            std::cerr << "calibrate needs at least one trial and a sample" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        _sampleDir = (_settings.workPath.empty() ? std::string(".") : _settings.workPath)
+                + "/mlightning.calibrate." + _settings.ns();
+        sample();
+    }
+
+    Calibrator::~Calibrator() {
+        boost::system::error_code error;
+        boost::filesystem::remove_all(_sampleDir, error);
+    }
+
+    void Calibrator::sample() {
+        boost::filesystem::create_directories(_sampleDir);
+        _sampleBytes = FileInputProcessor::sampleInput(_settings.loadDir, _settings.fileRegex,
+                                                       _settings.inputType,
+                                                       _settings.calibrateSampleMB * 1024 * 1024,
+                                                       _sampleDir);
+        std::cout << "Calibration sample: " << _sampleBytes / 1024 / 1024 << "MB in "
+                  << _sampleDir << std::endl;
+    }
+
+    double Calibrator::trial(const Config& config) {
+        const std::string options = config.options();
+        auto result = _results.find(options);
+        if (result != _results.end()) return result->second;
+        if (!trialsLeft()) return 0;
+        Loader::Settings settings = _settings;
+        settings.loadDir = _sampleDir;
+        settings.fileRegex.clear();
+        settings.threads = int(config.inputThreads);
+        settings.batcherSettings.queueSize = config.batchSize;
+        settings.dispatchSettings.ramQueueBatchSize = config.ramQueueBatchSize;
+        settings.endPointSettings.threadCount = config.endPointThreads;
+        settings.loadQueueJson = config.queuing;
+        //Trials are reported by the calibration, not as loads
+        settings.statsFile.clear();
+        settings.statsJsonFile.clear();
+        settings.traceFile.clear();
+        settings.metricsFile.clear();
+        settings.metricsInterval = 0;
+        settings.chunkMapSave.clear();
+        settings.resume = false;
+        //Journals, spills and rejects are cleaned up with the sample
+        settings.workPath = _sampleDir;
+        if (!settings.dedupeFile.empty()) settings.dedupeFile = _sampleDir + "/dedupe.bson";
+        if (settings.dryRun.empty()) {
+            settings.collection = scratchCollection();
+            settings.metadataCache.clear();
+            settings.dropDb = settings.dropIndexes = settings.deferIndexes = false;
+            settings.dropColl = true;
+        }
+        settings.process();
+        ++_trials;
+        std::cout << "\nCalibration trial " << _trials << " of at most "
+                  << _settings.calibrateTrials << ": " << options << std::endl;
+        //Setup, i.e. the drop and presplit of the scratch collection, isn't timed
+        tools::SimpleTimer<> timer;
+        {
+            Loader loader(std::move(settings));
+            timer.start();
+            loader.run();
+            timer.stop();
+        }
+        double rate = double(_sampleBytes) / 1024 / 1024 / std::max(timer.nanos() / 1e9, 1e-9);
+        std::cout << "Calibration trial " << _trials << ": " << rate << "MB/s" << std::endl;
+        _results[options] = rate;
+        return rate;
+    }
+
+    void Calibrator::climb(size_t Config::*setting, Config* best, double* bestRate) {
+        for (bool up : {true, false}) {
+            bool improved = false;
+            while (trialsLeft()) {
+                Config next = *best;
+                next.*setting = up ? best->*setting * 2 : best->*setting / 2;
+                if (next.*setting < MIN_VALUE) break;
+                double rate = trial(next);
+                if (rate < *bestRate * IMPROVEMENT) break;
+                *best = next;
+                *bestRate = rate;
+                improved = true;
+            }
+            if (improved) return;
+        }
+    }
+
+    void Calibrator::queuing(Config* best, double* bestRate) {
+        static const char* const mixes[] = {"{\"direct\": 10}", "{\"ram\": 1}",
+                                            "{\"direct\": 8, \"ram\": 2}", "{\"disk\": 1}"};
+        //Only the sorting queues see the duplicates of a key together
+        const bool direct = _settings.dedupe == "none";
+        const Config given = *best;
+        const mongo::BSONObj givenMix = mongo::fromjson(given.queuing);
+        for (const char* mix : mixes) {
+            if (!trialsLeft()) return;
+            if (!direct && std::string(mix).find("direct") != std::string::npos) continue;
+            if (!mongo::fromjson(mix).woCompare(givenMix)) continue;
+            Config next = given;
+            next.queuing = mix;
+            double rate = trial(next);
+            if (rate >= *bestRate * IMPROVEMENT) {
+                *best = next;
+                *bestRate = rate;
+            }
+        }
+    }
+
+    void Calibrator::run() {
+        Loader::Settings given = _settings;
+        given.process();
+        Config best {size_t(given.threads), given.batcherSettings.queueSize,
+                     given.dispatchSettings.ramQueueBatchSize,
+                     given.endPointSettings.threadCount, _settings.loadQueueJson};
+        //The given settings are the baseline the others have to beat
+        double bestRate = trial(best);
+        const double givenRate = bestRate;
+        queuing(&best, &bestRate);
+        climb(&Config::inputThreads, &best, &bestRate);
+        climb(&Config::endPointThreads, &best, &bestRate);
+        climb(&Config::batchSize, &best, &bestRate);
+        //Only the ram and disk queues send in ramQueueBatchSize batches
+        mongo::BSONObj mix = mongo::fromjson(best.queuing);
+        if (mix.hasField("ram") || mix.hasField("disk"))
+            climb(&Config::ramQueueBatchSize, &best, &bestRate);
+        if (_settings.dryRun.empty()) dropScratch();
+
+        std::vector<std::pair<double, std::string>> ranked;
+        for (auto&& result : _results)
+            ranked.emplace_back(result.second, result.first);
+        std::sort(ranked.rbegin(), ranked.rend());
+        std::cout << "\nCalibration: " << _trials << " trials of " << _sampleBytes / 1024 / 1024
+                  << "MB" << (_settings.dryRun.empty() ? "" : " (dry run)") << std::endl;
+        for (auto&& result : ranked)
+            std::cout << "  " << result.first << "MB/s: " << result.second << std::endl;
+        std::cout << "Best: " << best.options() << "\n  " << bestRate << "MB/s, "
+                  << (givenRate > 0 ? (bestRate / givenRate - 1) * 100 : 0)
+                  << "% over the given settings" << std::endl;
+        if (!_settings.calibrateSave.empty()) save(best, bestRate);
+    }
+
+    void Calibrator::save(const Config& best, double rate) const {
+        mongo::BSONObjBuilder saved;
+        saved.append("load.inputThreads", static_cast<long long>(best.inputThreads));
+        saved.append("load.batchSize", static_cast<long long>(best.batchSize));
+        saved.append("dispatch.ramQueueBatchSize", static_cast<long long>(best.ramQueueBatchSize));
+        saved.append("mongo.threads", static_cast<long long>(best.endPointThreads));
+        saved.append("queuing", best.queuing);
+        saved.append("MBps", rate);
+        saved.append("sampleMB", double(_sampleBytes) / 1024 / 1024);
+        saved.append("dryRun", _settings.dryRun);
+        std::ofstream file(_settings.calibrateSave, std::ios_base::out | std::ios_base::trunc);
+        if (file.is_open()) file << saved.obj().jsonString() << std::endl;
+        else std::cerr << "Unable to open calibration file: " << _settings.calibrateSave
+                       << std::endl;
+    }
+
+    void Calibrator::dropScratch() const {
+        Loader::Settings settings = _settings;
+        settings.collection = scratchCollection();
+        settings.process();
+        std::string error;
+        std::unique_ptr<mongo::DBClientBase> conn(settings.cs.connect(error));
+        if (!error.empty()) {
+            std::cerr << "Unable to connect to drop " << settings.ns() << ": " << error
+                      << std::endl;
+            return;
+        }
+        conn->dropCollection(settings.ns());
+    }
+
+}  //namespace loader
@@ -0,0 +1,105 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <map>
+#include <string>
+#include "loader.h"
+
+namespace loader {
+
+    /**
+     * Searches for the fastest load settings for the hardware and data at hand.  A sample of the
+     * input is loaded over and over, each trial timed from the end of setup to the last write.
+     * Trials go to the dry run end point if dryRun is set, otherwise into a scratch collection
+     * next to ns that is dropped afterwards.  The queuing mix is tried first, then each numeric
+     * setting is doubled or halved from the best so far for as long as the trials get faster.
+     */
+    class Calibrator {
+    public:
+        /**
+         * @param settings as read from the command line, i.e. before Settings::process()
+         */
+        explicit Calibrator(Loader::Settings settings);
+
+        ~Calibrator();
+
+        void run();
+
+    private:
+        struct Config {
+            size_t inputThreads;
+            size_t batchSize;
+            size_t ramQueueBatchSize;
+            size_t endPointThreads;
+            std::string queuing;
+
+            /**
+             * @return the command line options for the config
+             */
+            std::string options() const;
+        };
+
+        //A trial must be this much faster to be taken over the best, trials are noisy
+        static constexpr double IMPROVEMENT = 1.02;
+        //Halving stops here, doubling stops at the trial limit
+        static constexpr size_t MIN_VALUE = 1;
+
+        const Loader::Settings _settings;
+        std::string _sampleDir;
+        unsigned long long _sampleBytes{};
+        size_t _trials{};
+        //MB/s by options, a config is only ever run once
+        std::map<std::string, double> _results;
+
+        /**
+         * Copies the sample of the input into the scratch directory
+         */
+        void sample();
+
+        /**
+         * Runs a trial load of the sample
+         * @return MB/s, 0 if out of trials
+         */
+        double trial(const Config& config);
+
+        /**
+         * Doubles, or failing that halves, a setting of best for as long as it gets faster
+         */
+        void climb(size_t Config::*setting, Config* best, double* bestRate);
+
+        /**
+         * Tries the queuing mixes that can take the load's settings
+         */
+        void queuing(Config* best, double* bestRate);
+
+        void save(const Config& best, double rate) const;
+
+        /**
+         * Drops the scratch collection the trials loaded into
+         */
+        void dropScratch() const;
+
+        bool trialsLeft() const {
+            return _trials < _settings.calibrateTrials;
+        }
+
+        std::string scratchCollection() const {
+            return _settings.collection + "_calibrate";
+        }
+    };
+
+}  //namespace loader
@@ -0,0 +1,97 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "chunk_ranges.h"
+#include <algorithm>
+#include <iostream>
+
+namespace tools {
+    namespace mtools {
+
+        ChunkRanges::ChunkRanges(MongoCluster& cluster, const MongoCluster::NameSpace& ns,
+                                 size_t shardThreads) :
+                _shardThreads(std::max<size_t>(shardThreads, 1))
+        {
+            mongo::BSONObj min;
+            auto& chunks = cluster.nsChunks(ns);
+            for (auto&& chunk : chunks) {
+                //The last chunk ends at MaxKey, which $max can't include
+                bool last = _size + 1 == chunks.size();
+                _shards[chunk.second->first].ranges.push_back(Range {chunk.second->first,
+                        chunk.second->second, min, last ? mongo::BSONObj() : chunk.first, _size});
+                min = chunk.first;
+                ++_size;
+            }
+            _queued = _size;
+        }
+
+        bool ChunkRanges::next(Range* range) {
+            MutexUniqueLock lock(_mutex);
+            ShardRanges* next = nullptr;
+            _rangeNotify.wait(lock, [this, &next]() {
+                bool remaining = false;
+                next = nullptr;
+                for (auto&& shard : _shards) {
+                    if (shard.second.ranges.empty()) continue;
+                    remaining = true;
+                    if (shard.second.active < _shardThreads
+                        && (!next || shard.second.ranges.size() > next->ranges.size()))
+                        next = &shard.second;
+                }
+                return next || !remaining;
+            });
+            if (!next) return false;
+            *range = std::move(next->ranges.front());
+            next->ranges.pop_front();
+            ++next->active;
+            --_queued;
+            return true;
+        }
+
+        void ChunkRanges::done(const Range& range) {
+            MutexLockGuard lock(_mutex);
+            --_shards.at(range.shard).active;
+            _rangeNotify.notify_all();
+        }
+
+        mongo::Cursor ChunkRanges::query(mongo::DBClientBase* conn, const MongoCluster::NameSpace& ns,
+                                  const mongo::BSONObj& key, const Range& range)
+        {
+            mongo::Query query = mongo::Query().hint(key);
+            if (!range.min.isEmpty()) query.minKey(range.min);
+            if (!range.max.isEmpty()) query.maxKey(range.max);
+            mongo::Cursor cur = conn->query(ns, query, 0, 0, nullptr, mongo::QueryOption_NoCursorTimeout);
+            if (!cur.get()) {
+                std::cerr << "Unable to query shard " << range.shard << " for " << ns << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            return cur;
+        }
+
+        mongo::DBClientBase* ChunkRanges::connect(const Range& range) {
+            std::string error;
+            mongo::ConnectionString cs = mongo::ConnectionString::parse(range.conn, error);
+            mongo::DBClientBase* conn = nullptr;
+            if (error.empty()) conn = cs.connect(error);
+            if (!error.empty() || !conn) {
+                std::cerr << "Unable to connect to shard " << range.shard << ": " << error
+                          << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            return conn;
+        }
+
+    }  //namespace mtools
+}  //namespace tools
@@ -0,0 +1,108 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include "mongo_cluster.h"
+#include "mongo_cxxdriver.h"
+#include "threading.h"
+
+namespace tools {
+    namespace mtools {
+
+        /**
+         * The chunk ranges of a sharded namespace handed out to threads reading them straight from
+         * the shards that own them.  No more than shardThreads ranges of a shard are out at a
+         * time so no shard is swamped, the shard with the most ranges left goes first so that the
+         * shards finish together.
+         */
+        class ChunkRanges {
+        public:
+            struct Range {
+                MongoCluster::ShardName shard;
+                MongoCluster::ShardConn conn;
+                //Empty for the first and last chunks, which are open ended
+                mongo::BSONObj min;
+                mongo::BSONObj max;
+                //Chunk order in the namespace
+                size_t index;
+            };
+
+            ChunkRanges(MongoCluster& cluster, const MongoCluster::NameSpace& ns,
+                        size_t shardThreads);
+
+            /**
+             * Waits for a range on a shard that has room for another reader
+             * @return false once every range has been handed out
+             */
+            bool next(Range* range);
+
+            /**
+             * Frees the range's place on its shard
+             */
+            void done(const Range& range);
+
+            /**
+             * @return ranges not handed out yet
+             */
+            size_t queued() const {
+                return _queued;
+            }
+
+            size_t size() const {
+                return _size;
+            }
+
+            size_t shards() const {
+                return _shards.size();
+            }
+
+            size_t shardThreads() const {
+                return _shardThreads;
+            }
+
+            /**
+             * Opens a cursor over the range's documents on its shard.  Bounds are shard key values,
+             * $min/$max with the shard key index also covers hashed keys.  Exits on failure.
+             */
+            static mongo::Cursor query(mongo::DBClientBase* conn, const MongoCluster::NameSpace& ns,
+                                const mongo::BSONObj& key, const Range& range);
+
+            /**
+             * Connects to a range's shard, threads keep a connection per shard.  Exits on failure.
+             */
+            static mongo::DBClientBase* connect(const Range& range);
+
+        private:
+            struct ShardRanges {
+                std::deque<Range> ranges;
+                size_t active{};
+            };
+
+            const size_t _shardThreads;
+            size_t _size{};
+            Mutex _mutex;
+            ConditionVariable _rangeNotify;
+            std::unordered_map<MongoCluster::ShardName, ShardRanges> _shards;
+            std::atomic<size_t> _queued{};
+        };
+
+    }  //namespace mtools
+}  //namespace tools
@@ -0,0 +1,101 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "chunk_store.h"
+#include <cstring>
+#include "bson_arena.h"
+#include "memory_budget.h"
+
+namespace loader {
+    namespace dispatch {
+
+        ChunkStore::~ChunkStore() {
+            for (Batch* batch = _batches.exchange(nullptr); batch;) {
+                Batch* next = batch->next;
+                delete batch;
+                batch = next;
+            }
+        }
+
+        ChunkStore::Buffers::~Buffers() {
+            tools::MemoryBudget::remove(tools::MemoryBudget::Use::IN_FLIGHT, budgeted);
+        }
+
+        std::shared_ptr<void> ChunkStore::hold(size_t bytes) const {
+            if (!bytes) return _buffers;
+            std::shared_ptr<Buffers> buffers = _buffers;
+            return std::shared_ptr<void>(buffers.get(), [buffers, bytes](void*) {
+                tools::MemoryBudget::add(tools::MemoryBudget::Use::IN_FLIGHT, bytes);
+                buffers->budgeted += bytes;
+            });
+        }
+
+        void ChunkStore::retire(size_t bytes) const {
+            tools::MemoryBudget::move(tools::MemoryBudget::Use::QUEUED,
+                                      tools::MemoryBudget::Use::IN_FLIGHT, bytes);
+            _buffers->budgeted += bytes;
+        }
+
+        size_t ChunkStore::append(BsonPairDeque* q) {
+            size_t size = 0;
+            for (auto&& value : *q)
+                size += value.first.objsize() + value.second.objsize();
+            Batch* batch = new Batch {std::unique_ptr<char[]>(new char[size]), {},
+                                      _batches.load(std::memory_order_relaxed)};
+            batch->pairs.reserve(q->size());
+            BsonV docs;
+            docs.reserve(q->size());
+            char* out = batch->buffer.get();
+            for (auto&& value : *q) {
+                batch->pairs.push_back(out);
+                std::memcpy(out, value.first.objdata(), value.first.objsize());
+                out += value.first.objsize();
+                std::memcpy(out, value.second.objdata(), value.second.objsize());
+                out += value.second.objsize();
+                docs.push_back(std::move(value.second));
+            }
+            q->clear();
+            //A single lock for the batch's documents
+            tools::BsonArena::release(&docs);
+            size_t retries = 0;
+            while (!_batches.compare_exchange_weak(batch->next, batch, std::memory_order_release,
+                                                   std::memory_order_relaxed))
+                ++retries;
+            return retries;
+        }
+
+        void ChunkStore::gather() {
+            Batch* head = _batches.exchange(nullptr, std::memory_order_acquire);
+            std::vector<Batch*> batches;
+            size_t count = _pairs.size();
+            for (Batch* batch = head; batch; batch = batch->next) {
+                count += batch->pairs.size();
+                batches.push_back(batch);
+            }
+            _pairs.reserve(count);
+            for (auto batch = batches.rbegin(); batch != batches.rend(); ++batch) {
+                _pairs.insert(_pairs.end(), (*batch)->pairs.begin(), (*batch)->pairs.end());
+                _buffers->data.push_back(std::move((*batch)->buffer));
+                delete *batch;
+            }
+        }
+
+        void ChunkStore::clear() {
+            std::vector<const char*>().swap(_pairs);
+            _buffers = std::make_shared<Buffers>();
+        }
+
+    }  //namespace dispatch
+}  //namespace loader
@@ -0,0 +1,136 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "loader_defs.h"
+
+namespace loader {
+    namespace dispatch {
+
+        /**
+         * Compact store for the key and document pairs a RAM queue holds until finalize.
+         * Each appended batch is copied into a single buffer, the key BSON then the document
+         * BSON, and the pairs are kept as a pointer each.  There are no per pair allocations or
+         * ref counts, so the same RAM holds more pairs than a BsonPairDeque does.
+         * The pairs are read by position in append order.  Documents handed out point into the
+         * buffers, hold() keeps them valid once the store is cleared.
+         * Bytes the store is done with stay budgeted (IN_FLIGHT) until the last hold on their
+         * buffers goes, that is when the memory is freed.
+         */
+        class ChunkStore {
+        public:
+            ChunkStore() :
+                    _buffers(std::make_shared<Buffers>())
+            {
+            }
+
+            ~ChunkStore();
+
+            ChunkStore(const ChunkStore&) = delete;
+            ChunkStore& operator=(const ChunkStore&) = delete;
+
+            /**
+             * Copies the pairs in, releases the documents and clears q.  Thread safe with other
+             * appends, the batch is linked in without a lock.
+             * @return times the link had to be retried
+             */
+            size_t append(BsonPairDeque* q);
+
+            /**
+             * Moves the appended batches into position order, append order within a batch and
+             * oldest batch first.  Must not run at the same time as append.
+             */
+            void gather();
+
+            /**
+             * @return the gathered pairs
+             */
+            size_t size() const {
+                return _pairs.size();
+            }
+
+            bool empty() const {
+                return _pairs.empty();
+            }
+
+            /**
+             * @return the start of the pair at position, the key BSON
+             */
+            const char* operator[](size_t position) const {
+                return _pairs[position];
+            }
+
+            Bson key(size_t position) const {
+                return Bson(_pairs[position]);
+            }
+
+            Bson doc(size_t position) const {
+                return Bson(_pairs[position] + Bson(_pairs[position]).objsize());
+            }
+
+            /**
+             * @return the bytes of the pair, as counted by the MemoryBudget
+             */
+            size_t bytes(size_t position) const {
+                Bson key(_pairs[position]);
+                return key.objsize() + Bson(_pairs[position] + key.objsize()).objsize();
+            }
+
+            /**
+             * @return a hold on the buffers, pairs read from the store stay valid while it is held
+             * @param bytes counted by the holder (i.e. an operation's documents), they are
+             * budgeted until the buffers go once the holder lets go
+             */
+            std::shared_ptr<void> hold(size_t bytes = 0) const;
+
+            /**
+             * Moves bytes the store is done with from QUEUED to IN_FLIGHT until the buffers go
+             */
+            void retire(size_t bytes) const;
+
+            /**
+             * Lets go of all the pairs, the memory goes once the last hold does
+             */
+            void clear();
+
+        private:
+            struct Buffers {
+                std::vector<std::unique_ptr<char[]>> data;
+                //IN_FLIGHT bytes freed with the buffers
+                std::atomic<size_t> budgeted {};
+
+                ~Buffers();
+            };
+
+            /*
+             * An appended batch, appenders link them onto _batches newest first
+             */
+            struct Batch {
+                std::unique_ptr<char[]> buffer;
+                std::vector<const char*> pairs;
+                Batch* next;
+            };
+
+            std::atomic<Batch*> _batches {};
+            std::shared_ptr<Buffers> _buffers;
+            std::vector<const char*> _pairs;
+        };
+
+    }  //namespace dispatch
+}  //namespace loader
@@ -6,134 +6,120 @@
  */
 
 #include "clone.h"
+#include <algorithm>
+#include <iostream>
 
 namespace cloner {
 
-    Clone::Clone(const std::string &target, const std::string &source) :
-        _target(target),
-        _source(source) {
-        std::string error;
-        _targetConn.reset(_target.connStr().connect(error));
-        assert(error.empty());
-        _sourceConn.reset(_source.connStr().connect(error));
-        assert(error.empty());
+    namespace {
+        std::string withUriStart(std::string conn) {
+            if (conn.substr(0, mongo::uriStart.size()) != mongo::uriStart)
+                conn = mongo::uriStart + conn;
+            return conn;
+        }
+    }  //namespace
 
-        if (!_target.isSharded() || !_source.isSharded()) {
-            std::cerr << "Both clusters must be sharded for the cloner" << std::endl;
+    Clone::Clone(loader::Loader::Settings settings) :
+        _settings(std::move(settings)),
+        _source(withUriStart(_settings.loadDir)),
+        _oplog(_source, withUriStart(_settings.connstr)) {
+        if (!_source.isSharded()) {
+            std::cerr << "The source cluster must be sharded for the cloner" << std::endl;
             exit(EXIT_FAILURE);
         }
     }
 
     /**
-     * Stop all balancers
-     * Make sure that none of the databases exist, if they do drop them
-     * Insert the new databases/collections/chunks
+     * Stop the source balancer so that chunk ranges stay on the shards they are read from
      * Mark the oplog position on each replica set
-     * Clone the chunks
-     * Clone the unsharded collections in sharded databases
-     * Clone the non-sharded databases
-     * Start updates from the oplog position
+     * Load each sharded collection, the target's balancer is stopped by the load
+     * Start updates from the oplog position, saving where each shard got to
+     * With cloneOplogResume only the updates from the saved positions are applied
      */
     //TODO: Persist state information in the new cluster
-    //TODO: Options: drop databases, balancer wait
+    //TODO: Clone the unsharded collections and databases
     void Clone::run() {
-/*
-        if (!_target.stopBalancerWait(std::chrono::seconds(60))) {
-            std::cerr << "Unable to stop target balancer" << std::endl;
+        if (!_source.stopBalancerWait(std::chrono::seconds(120))) {
+            std::cerr << "Unable to stop the source balancer" << std::endl;
             exit(EXIT_FAILURE);
         }
-        if (!_source.stopBalancerWait(std::chrono::seconds(60))) {
-            std::cerr << "Unable to stop target balancer" << std::endl;
-            exit(EXIT_FAILURE);
+        std::vector<tools::mtools::MongoCluster::NameSpace> namespaces;
+        for (auto&& chunks : _source.nsChunks()) {
+            const std::string& ns = chunks.first;
+            size_t dot = ns.find('.');
+            std::string database = ns.substr(0, dot);
+            //Server internal databases are not cloned
+            if (database == "config" || database == "local") continue;
+            if (!_settings.database.empty() && database != _settings.database) continue;
+            if (!_settings.collection.empty() && ns.substr(dot + 1) != _settings.collection)
+                continue;
+            namespaces.push_back(ns);
         }
-
-
-        //Move tag ranges if they exist
-        //TODO: do we want to add sanity checks/shard range removals?
-        mongo::Cursor cur = _sourceConn->query("config.tags", mongo::Query());
-        while (cur->more()) {
-            _sourceConn->insert("config.tags", cur->next());
-            std::string error = _sourceConn->getLastError();
-            if (!error.empty()) {
-                std::cerr << "Unable to insert source tag ranges into target config.tags" << std::endl;
-                exit(EXIT_FAILURE);
-            }
+        if (namespaces.empty()) {
+            std::cerr << "No sharded collections to clone from: " << _settings.loadDir
+                      << std::endl;
+            exit(EXIT_SUCCESS);
         }
-
-        cur = _sourceConn->query("config.chunks", mongo::Query().sort(BSON("ns" << 1 << "max" << 1)));
-        _currShard = _target.shards().cbegin();
-
-        std::string prevNs;
-        tools::mtools::MongoCluster::TagBsonIndex* nsTags;
-        TagShardPointer currentTag;
-        while (cur->more()) {
-            mongo::BSONObj obj = cur->next();
-            std::string ns = obj.getStringField("ns");
-            //If it's a new namespace, shard it, clear the chunks, check for tag ranges
-            if (ns != prevNs) {
-                prevNs = ns;
-                //Unconditional call, it may fail because sharding is already enabled
-                mongo::BSONObj shardingError;
-                _target.enableSharding(mongo::nsGetDB(ns), &shardingError);
-                mongo::BSONObj oldColl = _sourceConn->findOne("config.collections", BSON("_id" << ns));
-                //This should always be found as we found chunks
-                assert(oldColl.isValid());
-                mongo::BSONObj key = oldColl.getObjectField("key");
-                assert(key.isValid());
-                //If the shard key is hashed, the first element should has a string value
-                mongo::BSONObj info;
-                if (key.firstElement().type() == mongo::BSONType::String) {
-                    //Make sure there is only a single chunk to prevent having to wait for balancing
-                    _target.shardCollection(ns, key, oldColl.getBoolField("unique"), 1, &info);
-                }
-                else
-                    _target.shardCollection(ns, key, oldColl.getBoolField("unique"), &info);
-                if (!info.isEmpty()) {
-                    std::cerr << "Unable to shard(" << ns << "):" << info << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                //remove all chunks from our freshy hashed collection
-                _targetConn->remove("config.chunks", MONGO_QUERY("ns" << ns), false, nullptr);
-                auto itr = _target.nsTagRanges().find(ns);
-                if (itr != _target.nsTagRanges().end()) {
-                    nsTags = &itr->second;
-                    currentTag.clear();
-                }
-                else
-                    nsTags = nullptr;
-            }
-            mongo::BSONObjBuilder bob;
-            mongo::BSONObjIterator itr(obj);
-            while(itr.more()) {
-                mongo::BSONElement elem = itr.next();
-                if (strcmp("shard", elem.fieldName()) == 0)
-                    continue;
-                bob.append(elem);
+        std::sort(namespaces.begin(), namespaces.end());
+        std::string oplogFile = _settings.cloneOplogFile;
+        if (oplogFile.empty())
+            oplogFile = (_settings.workPath.empty() ? std::string(".") : _settings.workPath)
+                    + "/mlightning.oplog.json";
+        if (_settings.cloneOplogResume) {
+            //Only the oplogs are applied, the collections were cloned by an earlier run
+            _oplog.load(oplogFile);
+            for (auto&& ns : namespaces) {
+                const tools::mtools::MongoCluster::MetaNameSpace* coll = _source.collection(ns);
+                if (coll && !coll->dropped) _oplogSettings.shardKeys[ns] = coll->key;
             }
-            //Check to see if this is a defined tag set, if not, use the next available chunk
-            //TODO: Use chunk count rather than RR to balance non-tagged chunks after tagging has taken place
-            if (nsTags) {
-                mongo::BSONObj maxKey = obj.getField("max").Obj();
-                mongo::BSONObj minKey = obj.getField("min").Obj();
-                //auto upper = std::upper_bound(nsTags->begin(), nsTags->end(), maxKey, nsTags->compare());
-                //auto lower = std::lower_bound(nsTags->begin(), nsTags->end(), minKey, nsTags->compare());
-            }
-            bob.append("shard", _currShard->first);
-            if (++_currShard == _target.shards().cend())
-                _currShard = _target.shards().cbegin();
-
-            //TODO: write or die, cleanup on fail first?
-            _targetConn->insert("config.chunks", bob.obj());
         }
+        else {
+            if (_settings.cloneOplog) _oplog.mark();
+            for (auto&& ns : namespaces)
+                cloneCollection(ns);
+            if (!_settings.cloneOplog) return;
+        }
+        _oplogSettings.lagSeconds = _settings.cloneOplogLag;
+        _oplogSettings.batchSize = std::max<size_t>(_settings.cloneOplogBatch, 1);
+        _oplog.catchUp(_oplogSettings);
+        //Whatever is within the lag still has to be applied, a resume starts from here
+        _oplog.save(oplogFile);
+    }
 
-        //Ensure that all routers see the new sharding info
-        _target.flushRouterConfigs();
-
-
-        //TODO: replace this with stopping mongoS to ensure it won't try to balance any collections
-        //i.e. db.shutdownServer()
-        std::this_thread::sleep_for(std::chrono::seconds(3));
-*/
+    void Clone::cloneCollection(const tools::mtools::MongoCluster::NameSpace& ns) {
+        const tools::mtools::MongoCluster::MetaNameSpace* coll = _source.collection(ns);
+        if (!coll || coll->dropped) return;
+        _oplogSettings.shardKeys[ns] = coll->key;
+        loader::Loader::Settings settings = _settings;
+        size_t dot = ns.find('.');
+        settings.database = ns.substr(0, dot);
+        settings.collection = ns.substr(dot + 1);
+        settings.loadDir = withUriStart(_settings.loadDir);
+        settings.inputType = "bson";
+        settings.shardKeyJson = coll->key.jsonString();
+        settings.shardKeyUnique = coll->unique;
+        //Every chunk bound but MaxKey, the target is split the same way
+        auto& chunks = _source.nsChunks(ns);
+        settings.presplitKeys.clear();
+        for (auto&& chunk : chunks)
+            settings.presplitKeys.push_back(chunk.first);
+        if (!settings.presplitKeys.empty()) settings.presplitKeys.pop_back();
+        //Only the first collection of a database drops it, otherwise earlier clones are lost
+        if (settings.dropDb && !_droppedDatabases.insert(settings.database).second) {
+            settings.dropDb = false;
+            settings.dropColl = true;
+        }
+        try {
+            settings.process();
+        } catch (std::exception &e) {
+            std::cerr << "Unable to process settings for " << ns << ": " << e.what()
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::cout << "\nCloning: " << ns << " shard key: " << settings.shardKeyJson
+                  << std::endl;
+        loader::Loader loader(std::move(settings));
+        loader.run();
     }
 
 } /* namespace Clone */
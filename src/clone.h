@@ -7,35 +7,43 @@
 
 #pragma once
 
+#include <set>
+#include "loader.h"
 #include "mongo_cxxdriver.h"
 #include "mongo_cluster.h"
+#include "oplog_tail.h"
 
 namespace cloner {
 
     /*
      * M sized sharded cluster to N sized sharded cluster
-     * Clones the sharding config data from one cluster another
-     * Assumes that the config.shards collection w/ any tagging information is created
-     * Copies tag ranges
-     * Copies config.chunks (so everything will in theory be balanced), but will round robin them
-     * This makes going from M to N easy, will honor tag ranges
+     * Every sharded collection of the source is loaded into the target with the same shard key.
+     * New target collections are split where the source is split and the chunks are spread over
+     * the target's shards, which makes going from M to N easy and honors tag ranges.
+     * The data is read a chunk range at a time straight from the source shard that owns it and
+     * goes through the usual batching and end points, see ClusterInputProcessor.
+     * Writes made during the copy are caught up from the source shards' oplogs afterwards.
+     * Unsharded collections are not cloned.
      */
     class Clone {
     public:
-        Clone(const std::string &target, const std::string &source);
+        /**
+         * @param settings as read from the command line, loadDir is the source cluster
+         */
+        explicit Clone(loader::Loader::Settings settings);
         void run();
 
     private:
-        tools::mtools::MongoCluster _target;
+        const loader::Loader::Settings _settings;
         tools::mtools::MongoCluster _source;
-        std::unique_ptr<mongo::DBClientBase> _targetConn;
-        std::unique_ptr<mongo::DBClientBase> _sourceConn;
-        tools::mtools::MongoCluster::ShardMap::const_iterator _currShard;
-
-        //iterators for different tag ranges
-        using TagShardPointer = std::unordered_map<tools::mtools::MongoCluster::ShardTag,
-                tools::mtools::MongoCluster::ShardMap::const_iterator>;
+        std::set<std::string> _droppedDatabases;
+        OplogTail _oplog;
+        OplogTail::Settings _oplogSettings;
+
+        /**
+         * Runs a Loader for a single sharded collection of the source
+         */
+        void cloneCollection(const tools::mtools::MongoCluster::NameSpace& ns);
     };
 
 } /* namespace Clone */
-
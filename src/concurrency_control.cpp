@@ -0,0 +1,115 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "concurrency_control.h"
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+
+namespace tools {
+    namespace mtools {
+
+        constexpr long long ConcurrencyControl::WINDOW_MS;
+        constexpr double ConcurrencyControl::LATENCY_BACKOFF;
+        constexpr double ConcurrencyControl::THROUGHPUT_DROP;
+
+        ConcurrencyControl::ConcurrencyControl(std::string name, bool adaptive, size_t ceiling,
+                                               std::atomic<size_t>* clusterActive,
+                                               size_t clusterCeiling) :
+                _name(std::move(name)), _adaptive(adaptive), _ceiling(std::max<size_t>(ceiling, 1)),
+                _clusterActive(clusterActive), _clusterCeiling(clusterCeiling),
+                _active(_adaptive ? 0 : _ceiling), _start(Clock::now()), _windowStart(_start)
+        {
+            if (!_adaptive) return;
+            //Start at half the ceiling, there has to always be one thread to make progress
+            size_t start = std::max<size_t>(_ceiling / 2, 1);
+            size_t active = 1;
+            clusterAcquire(1);
+            _active = active;
+            while (active < start && clusterAcquire(1))
+                ++active;
+            _active = active;
+        }
+
+        void ConcurrencyControl::record(size_t bytes, unsigned long long nanos) {
+            if (!_adaptive) return;
+            tools::MutexLockGuard lock(_mutex);
+            if (_released) return;
+            _windowBytes += bytes;
+            ++_windowBatches;
+            _windowNanos += nanos;
+            auto now = Clock::now();
+            if (std::chrono::duration_cast<std::chrono::milliseconds>(now - _windowStart).count()
+                >= WINDOW_MS)
+                adjust(now);
+        }
+
+        void ConcurrencyControl::adjust(Clock::time_point now) {
+            double seconds = std::chrono::duration<double>(now - _windowStart).count();
+            double latency = double(_windowNanos) / _windowBatches / 1000000;
+            double throughput = _windowBytes / seconds / (1024 * 1024);
+            _windowStart = now;
+            _windowBytes = 0;
+            _windowBatches = 0;
+            _windowNanos = 0;
+            if (!_bestLatency || latency < _bestLatency) _bestLatency = latency;
+
+            size_t active = _active;
+            if (latency > _bestLatency * LATENCY_BACKOFF && active > 1) {
+                size_t next = std::max<size_t>(active / 2, 1);
+                clusterRelease(active - next);
+                active = next;
+                //Latency at the new level is what is to be compared against from here
+                _bestLatency = 0;
+            }
+            else if (throughput >= _lastThroughput * THROUGHPUT_DROP && active < _ceiling
+                     && clusterAcquire(1)) {
+                ++active;
+            }
+            _lastThroughput = throughput;
+            if (active == _active) return;
+            _active = active;
+            _admitNotify.notify_all();
+            std::cout << std::fixed << std::setprecision(1)
+                    << std::chrono::duration<double>(now - _start).count() << "s " << _name
+                    << ": concurrency " << active << " (latency " << latency << "ms, "
+                    << throughput << "MB/s)" << std::endl;
+        }
+
+        void ConcurrencyControl::release() {
+            tools::MutexLockGuard lock(_mutex);
+            if (_released) return;
+            _released = true;
+            if (_adaptive) clusterRelease(_active);
+            _active = _ceiling;
+            _admitNotify.notify_all();
+        }
+
+        bool ConcurrencyControl::clusterAcquire(size_t threads) {
+            if (!_clusterActive) return true;
+            size_t active = *_clusterActive;
+            do {
+                //The first thread of an end point is always allowed
+                if (active >= _clusterCeiling && _active) return false;
+            } while (!_clusterActive->compare_exchange_weak(active, active + threads));
+            return true;
+        }
+
+        void ConcurrencyControl::clusterRelease(size_t threads) {
+            if (_clusterActive) *_clusterActive -= threads;
+        }
+
+    }  //namespace mtools
+}  //namespace tools
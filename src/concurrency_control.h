@@ -0,0 +1,108 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include "threading.h"
+
+namespace tools {
+    namespace mtools {
+
+        /**
+         * Additive increase, multiplicative decrease control of the writer threads an end point
+         * runs.  Threads at or past the active count park in admit().  Each window the
+         * controller adds a thread while batch latency holds and throughput doesn't fall, and
+         * halves the threads once latency climbs well past the best seen.
+         * A cluster wide count of active threads caps the growth of all end points together.
+         */
+        class ConcurrencyControl {
+        public:
+            /**
+             * @param adaptive false to always run ceiling threads
+             * @param ceiling the most threads this end point can run
+             * @param clusterActive active threads across the cluster, nullptr for no cluster cap
+             * @param clusterCeiling the most active threads across the cluster
+             */
+            ConcurrencyControl(std::string name, bool adaptive, size_t ceiling,
+                               std::atomic<size_t>* clusterActive, size_t clusterCeiling);
+
+            /**
+             * Blocks thread index while it is beyond the active count
+             */
+            void admit(size_t index) {
+                if (index < _active.load(std::memory_order_relaxed)) return;
+                tools::MutexUniqueLock lock(_mutex);
+                _admitNotify.wait(lock, [this, index] () {return index < _active;});
+            }
+
+            /**
+             * Records a finished batch, adjusting the active count at the end of each window
+             */
+            void record(size_t bytes, unsigned long long nanos);
+
+            /**
+             * Lets every thread run, i.e. so that parked threads see the end of the work
+             */
+            void release();
+
+            size_t active() const {
+                return _active;
+            }
+
+        private:
+            using Clock = std::chrono::steady_clock;
+            //Length of a measurement window
+            static constexpr long long WINDOW_MS = 1000;
+            //Latency over the best window latency by this much halves the threads
+            static constexpr double LATENCY_BACKOFF = 2.0;
+            //Throughput under the last window by this much stops growth
+            static constexpr double THROUGHPUT_DROP = 0.9;
+
+            const std::string _name;
+            const bool _adaptive;
+            const size_t _ceiling;
+            std::atomic<size_t>* const _clusterActive;
+            const size_t _clusterCeiling;
+            std::atomic<size_t> _active;
+            tools::Mutex _mutex;
+            tools::ConditionVariable _admitNotify;
+            const Clock::time_point _start;
+            Clock::time_point _windowStart;
+            size_t _windowBytes {};
+            size_t _windowBatches {};
+            unsigned long long _windowNanos {};
+            double _bestLatency {};
+            double _lastThroughput {};
+            bool _released {};
+
+            /**
+             * Ends the window, caller holds _mutex
+             */
+            void adjust(Clock::time_point now);
+
+            /**
+             * Takes a thread from the cluster count
+             * @return false if the cluster is at its ceiling
+             */
+            bool clusterAcquire(size_t threads);
+
+            void clusterRelease(size_t threads);
+        };
+
+    }  //namespace mtools
+}  //namespace tools
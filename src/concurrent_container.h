@@ -16,8 +16,12 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <deque>
 #include <functional>
+#include <memory>
+#include <thread>
 #include <type_traits>
 #include "threading.h"
 
@@ -28,9 +32,6 @@ namespace tools {
      * There is a method to unsafely access it so that different sorting can be used.
      *
      * This also supports the concept of max size and waiting for and notifying on it
-     * Max size is lazily set to converge (that means it's safe with Intel basically) on RISC
-     * you may get differing sizes, it shouldn't matter as long as that isn't going to break
-     * things, in the code here it shoudln't.
      *
      * Max size is* not* enforced, the users need to call the checking functions if that is desired.
      */
@@ -85,8 +86,7 @@ namespace tools {
         void pushCheckMax(value_type value) {
             MutexUniqueLock lock(*_mutex);
             _sizeMaxNotify->wait(lock, [this]()
-            {   return this->_sizeMax && (this->_container.size() >
-                        this->_sizeMax);});
+            {   return !this->_sizeMax || this->_container.size() < this->_sizeMax;});
             _container.push_back(std::move(value));
         }
 
@@ -124,9 +124,12 @@ namespace tools {
          * Changes the max size for waiting.
          */
         void sizeMaxSet(size_t sizeMax) {
-            bool doNotify = _sizeMax && (sizeMax > _sizeMax);
-            _sizeMax = sizeMax;
-            if (doNotify) _sizeMaxNotify->notify_all();
+            size_t last = _sizeMax.exchange(sizeMax);
+            //Waiters are released by a higher max or by no max at all
+            if (last && (!sizeMax || sizeMax > last)) {
+                MutexLockGuard lock(*_mutex);
+                _sizeMaxNotify->notify_all();
+            }
         }
 
         /**
@@ -183,9 +186,285 @@ namespace tools {
         ContainerType _container;
         mutable std::unique_ptr<Mutex> _mutex;
         mutable std::unique_ptr<ConditionVariable> _sizeMaxNotify;
-        volatile size_t _sizeMax {};
+        std::atomic<size_t> _sizeMax {};
     };
 
     template<typename Value, template<typename, typename > class Container = std::deque> using ConcurrentQueue = BasicConcurrentQueue<Value, Container>;
 
+    /**
+     * Bounded multi producer, multi consumer queue on a ring (D. Vyukov's bounded MPMC queue).
+     * Every cell has a sequence that says whether it is free for the push of the current lap or
+     * holds a value for its pop, so producers and consumers only contend on their own index and
+     * never on a lock.
+     *
+     * The surface matches BasicConcurrentQueue where it can so the two can be swapped: pop()
+     * doesn't wait and push() waits for room, as pushCheckMax() does.  tryPush() doesn't wait and
+     * popWait() waits for a value.  Waits spin briefly then park, the mutex is only taken when
+     * someone is parked.
+     */
+    template<typename T>
+    class RingQueue {
+    public:
+        typedef T value_type;
+        typedef value_type ValueType;
+        typedef std::deque<T> ContainerType;
+
+        //Attempts on an empty or full ring before parking
+        static constexpr size_t SPIN_TRIES = 256;
+
+        /**
+         * @param capacity rounded up to a power of 2
+         */
+        explicit RingQueue(size_t capacity = 1024) {
+            init(capacity);
+        }
+
+        ~RingQueue() {
+            clear();
+        }
+
+        RingQueue(const RingQueue&) = delete;
+        RingQueue& operator=(const RingQueue&) = delete;
+
+        /**
+         * Exchanges the values with from's.  The ring grows to hold them if needed.
+         * NOT THREAD SAFE
+         */
+        void swap(ContainerType& from) {
+            ContainerType values;
+            T value;
+            while (pop(value))
+                values.push_back(std::move(value));
+            if (from.size() > capacity()) {
+                clear();
+                init(from.size());
+            }
+            for (auto&& fromValue : from)
+                tryPush(std::move(fromValue));
+            from.swap(values);
+        }
+
+        /**
+         * @return false if the ring is full, value is then unchanged
+         */
+        template<typename U>
+        bool tryPush(U&& value) {
+            return pushRing(std::forward<U>(value), false);
+        }
+
+        /**
+         * @return false if the ring is empty
+         */
+        bool pop(value_type& ret) {
+            return popRing(ret, false);
+        }
+
+        /**
+         * Pushes, waiting for room if the ring is full
+         */
+        void push(value_type value) {
+            for (size_t tries = 0; tries < SPIN_TRIES; ++tries) {
+                if (tryPush(std::move(value))) return;
+                std::this_thread::yield();
+            }
+            ++_pushWaiters;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            {
+                MutexUniqueLock lock(_mutex);
+                _spaceNotify.wait(lock, [&] {return this->pushRing(std::move(value), true);});
+            }
+            --_pushWaiters;
+        }
+
+        void pushCheckMax(value_type value) {
+            push(std::move(value));
+        }
+
+        /**
+         * Waits for a value
+         * @return false only once endWait() is called and the ring is empty
+         */
+        bool popWait(value_type& ret) {
+            for (size_t tries = 0; tries < SPIN_TRIES; ++tries) {
+                if (pop(ret)) return true;
+                std::this_thread::yield();
+            }
+            ++_popWaiters;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            bool popped;
+            {
+                MutexUniqueLock lock(_mutex);
+                _workNotify.wait(lock, [&] {return (popped = this->popRing(ret, true)) || _endWait;});
+            }
+            --_popWaiters;
+            return popped || pop(ret);
+        }
+
+        /**
+         * Pops up to count values onto the back of ret
+         * @return true if there are any entries added to the container.
+         */
+        template<typename U>
+        bool popToPushBack(U* ret, size_t count = 10) {
+            T value;
+            size_t popped = 0;
+            while (popped < count && pop(value)) {
+                ret->push_back(std::move(value));
+                ++popped;
+            }
+            return popped;
+        }
+
+        /**
+         * Uses std::move to place each item from the iterators into the ring, waiting for room
+         */
+        template<typename InputIterator>
+        void moveIn(InputIterator first, InputIterator last) {
+            for (; first != last; ++first)
+                push(std::move(*first));
+        }
+
+        template<typename U>
+        void moveIn(U* u) {
+            moveIn(u->begin(), u->end());
+        }
+
+        /**
+         * popWait() returns false once the ring is empty
+         */
+        void endWait() {
+            _endWait = true;
+            MutexLockGuard lock(_mutex);
+            _workNotify.notify_all();
+        }
+
+        /**
+         * @return the values in the ring, a snapshot that may be stale under concurrent use
+         */
+        size_t size() const {
+            size_t popPos = _popPos.load(std::memory_order_acquire);
+            size_t pushPos = _pushPos.load(std::memory_order_acquire);
+            return pushPos > popPos ? pushPos - popPos : 0;
+        }
+
+        bool empty() const {
+            return size() == 0;
+        }
+
+        size_t capacity() const {
+            return _mask + 1;
+        }
+
+    private:
+        struct Cell {
+            std::atomic<size_t> sequence;
+            typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+        };
+        //Keeps the push and pop indexes off each other's cache line
+        static constexpr size_t CACHE_LINE = 64;
+
+        std::unique_ptr<Cell[]> _cells;
+        size_t _mask {};
+        char _padPush[CACHE_LINE];
+        std::atomic<size_t> _pushPos {};
+        char _padPop[CACHE_LINE];
+        std::atomic<size_t> _popPos {};
+        char _padWaiters[CACHE_LINE];
+        std::atomic<size_t> _popWaiters {};
+        std::atomic<size_t> _pushWaiters {};
+        std::atomic<bool> _endWait {};
+        Mutex _mutex;
+        ConditionVariable _workNotify;
+        ConditionVariable _spaceNotify;
+
+        /**
+         * @param locked the caller holds _mutex
+         */
+        template<typename U>
+        bool pushRing(U&& value, bool locked) {
+            Cell* cell;
+            size_t pos = _pushPos.load(std::memory_order_relaxed);
+            for (;;) {
+                cell = &_cells[pos & _mask];
+                size_t sequence = cell->sequence.load(std::memory_order_acquire);
+                intptr_t diff = intptr_t(sequence) - intptr_t(pos);
+                if (!diff) {
+                    if (_pushPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                }
+                else if (diff < 0) return false;
+                else pos = _pushPos.load(std::memory_order_relaxed);
+            }
+            new (&cell->storage) T(std::forward<U>(value));
+            cell->sequence.store(pos + 1, std::memory_order_release);
+            //A parked consumer registers before it checks, so it sees this value or the count
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (_popWaiters.load(std::memory_order_relaxed)) {
+                if (locked) _workNotify.notify_one();
+                else {
+                    MutexLockGuard lock(_mutex);
+                    _workNotify.notify_one();
+                }
+            }
+            return true;
+        }
+
+        bool popRing(value_type& ret, bool locked) {
+            Cell* cell;
+            size_t pos = _popPos.load(std::memory_order_relaxed);
+            for (;;) {
+                cell = &_cells[pos & _mask];
+                size_t sequence = cell->sequence.load(std::memory_order_acquire);
+                intptr_t diff = intptr_t(sequence) - intptr_t(pos + 1);
+                if (!diff) {
+                    if (_popPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                }
+                else if (diff < 0) return false;
+                else pos = _popPos.load(std::memory_order_relaxed);
+            }
+            T* value = reinterpret_cast<T*>(&cell->storage);
+            ret = std::move(*value);
+            value->~T();
+            cell->sequence.store(pos + _mask + 1, std::memory_order_release);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (_pushWaiters.load(std::memory_order_relaxed)) {
+                if (locked) _spaceNotify.notify_one();
+                else {
+                    MutexLockGuard lock(_mutex);
+                    _spaceNotify.notify_one();
+                }
+            }
+            return true;
+        }
+
+        void init(size_t capacity) {
+            size_t size = 2;
+            while (size < capacity)
+                size <<= 1;
+            _cells.reset(new Cell[size]);
+            for (size_t i = 0; i < size; ++i)
+                _cells[i].sequence.store(i, std::memory_order_relaxed);
+            _mask = size - 1;
+            _pushPos = 0;
+            _popPos = 0;
+        }
+
+        void clear() {
+            if (!_cells) return;
+            T value;
+            while (pop(value))
+                ;
+        }
+    };
+
+    template<typename T>
+    constexpr size_t RingQueue<T>::SPIN_TRIES;
+
+    /**
+     * A ConcurrentQueue bounded to a lock free ring, for queues shared by many producers and
+     * consumers that don't need sorting
+     */
+    template<typename Value> using BoundedConcurrentQueue = RingQueue<Value>;
+
 }  //namespace tools
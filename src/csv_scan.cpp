@@ -0,0 +1,70 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "csv_scan.h"
+#include <algorithm>
+#include <cstdint>
+#include "block_masks.h"
+
+namespace tools {
+
+    const char* CsvScan::record(const char* begin, const char* end,
+                                std::vector<Field>* fields) const
+    {
+        using blockmasks::BLOCK;
+        fields->clear();
+        const char* fieldBegin = begin;
+        auto fieldAdd = [&](const char* fieldEnd) {
+            fields->push_back(Field {fieldBegin, fieldEnd, _quoting && fieldEnd > fieldBegin
+                                                           && *fieldBegin == '"'});
+            fieldBegin = fieldEnd + 1;
+        };
+        uint64_t inQuote {};
+        for (const char* block = begin; block < end; block += BLOCK) {
+            size_t size = std::min(size_t(end - block), BLOCK);
+            uint64_t delimiters, quotes, newlines;
+            if (size == BLOCK) {
+                blockmasks::Block masks(block);
+                delimiters = masks.eq(_delimiter);
+                quotes = _quoting ? masks.eq('"') : 0;
+                newlines = masks.eq('\n');
+            }
+            else {
+                delimiters = blockmasks::eqTail(block, size, _delimiter);
+                quotes = _quoting ? blockmasks::eqTail(block, size, '"') : 0;
+                newlines = blockmasks::eqTail(block, size, '\n');
+            }
+            uint64_t quoted = blockmasks::prefixXor(quotes) ^ inQuote;
+            inQuote = uint64_t(int64_t(quoted) >> 63);
+            for (uint64_t separators = (delimiters | newlines) & ~quoted; separators;
+                    separators &= separators - 1) {
+                const char* separator = block + __builtin_ctzll(separators);
+                if (*separator != '\n') {
+                    fieldAdd(separator);
+                    continue;
+                }
+                const char* fieldEnd = separator;
+                if (fieldEnd > fieldBegin && fieldEnd[-1] == '\r') --fieldEnd;
+                fieldAdd(fieldEnd);
+                return separator + 1;
+            }
+        }
+        const char* fieldEnd = end;
+        if (fieldEnd > fieldBegin && fieldEnd[-1] == '\r') --fieldEnd;
+        fieldAdd(fieldEnd);
+        return end;
+    }
+
+}  //namespace tools
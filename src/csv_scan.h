@@ -0,0 +1,55 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace tools {
+
+    /**
+     * Splits delimited records (CSV, TSV) into fields a 64 byte block at a time.  Delimiters,
+     * quotes and newlines become bit masks, what's quoted is a prefix xor of the quotes, so a
+     * doubled quote inside a quoted field needs no special case.  Only the delimiters and
+     * newlines outside quotes are visited.
+     */
+    class CsvScan {
+    public:
+        struct Field {
+            const char* begin;
+            const char* end;
+            //The field is in quotes, which are included in [begin, end)
+            bool quoted;
+        };
+
+        /**
+         * @param quoting false if quotes are just characters, i.e. TSV
+         */
+        CsvScan(char delimiter, bool quoting) : _delimiter(delimiter), _quoting(quoting) { }
+
+        /**
+         * Splits the record at begin, it ends at the first newline outside quotes or at end.
+         * A carriage return before the newline isn't part of the last field.
+         * @return where the next record starts
+         */
+        const char* record(const char* begin, const char* end, std::vector<Field>* fields) const;
+
+    private:
+        const char _delimiter;
+        const bool _quoting;
+    };
+
+}  //namespace tools
@@ -0,0 +1,194 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "csv_schema.h"
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+namespace loader {
+
+    namespace {
+        bool columnType(const std::string& type, CsvSchema::Type* to) {
+            using Type = CsvSchema::Type;
+            if (type == "auto") *to = Type::AUTO;
+            else if (type == "string") *to = Type::STRING;
+            else if (type == "int") *to = Type::INT;
+            else if (type == "long") *to = Type::LONG;
+            else if (type == "double") *to = Type::DOUBLE;
+            else if (type == "bool") *to = Type::BOOL;
+            else if (type == "date") *to = Type::DATE;
+            else if (type == "oid") *to = Type::OID;
+            else if (type == "skip") *to = Type::SKIP;
+            else return false;
+            return true;
+        }
+
+        bool integer(const char* text, size_t size, long long* number) {
+            bool negative = size && text[0] == '-';
+            size_t i = size && (text[0] == '-' || text[0] == '+');
+            if (i == size) return false;
+            unsigned long long value {};
+            for (; i < size; ++i) {
+                unsigned digit = static_cast<unsigned char>(text[i]) - '0';
+                if (digit > 9 || value > (ULLONG_MAX - digit) / 10) return false;
+                value = value * 10 + digit;
+            }
+            if (value > (negative ? 1ULL << 63 : (unsigned long long)(LLONG_MAX))) return false;
+            *number = negative ? static_cast<long long>(0 - value) : static_cast<long long>(value);
+            return true;
+        }
+
+        bool real(const char* text, size_t size, double* number) {
+            //strtod needs a terminator
+            char buffer[64];
+            std::string large;
+            const char* str = buffer;
+            if (size < sizeof(buffer)) {
+                std::memcpy(buffer, text, size);
+                buffer[size] = '\0';
+            }
+            else {
+                large.assign(text, size);
+                str = large.c_str();
+            }
+            char* end;
+            errno = 0;
+            *number = std::strtod(str, &end);
+            return size && end == str + size && !errno;
+        }
+
+        //YYYY-MM-DD[(T| )HH:MM:SS[.mmm]][Z]
+        bool isoDate(const char* text, size_t size, long long* millis) {
+            std::string str(text, size);
+            std::tm tm {};
+            int consumed {};
+            if (std::sscanf(str.c_str(), "%4d-%2d-%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+                            &consumed) != 3)
+                return false;
+            const char* rest = str.c_str() + consumed;
+            int ms {};
+            if (*rest == 'T' || *rest == ' ') {
+                int time {};
+                if (std::sscanf(rest + 1, "%2d:%2d:%2d%n", &tm.tm_hour, &tm.tm_min, &tm.tm_sec,
+                                &time) != 3)
+                    return false;
+                rest += 1 + time;
+                if (*rest == '.') {
+                    int digits {};
+                    for (++rest; *rest >= '0' && *rest <= '9'; ++rest, ++digits)
+                        if (digits < 3) ms = ms * 10 + (*rest - '0');
+                    for (; digits < 3; ++digits)
+                        ms *= 10;
+                }
+            }
+            if (*rest == 'Z') ++rest;
+            if (*rest) return false;
+            tm.tm_year -= 1900;
+            tm.tm_mon -= 1;
+            *millis = static_cast<long long>(timegm(&tm)) * 1000 + ms;
+            return true;
+        }
+
+        //Keeps AUTO from reading words strtod knows, i.e. inf and nan, as numbers
+        bool decimal(const char* text, size_t size) {
+            for (size_t i = 0; i < size; ++i)
+                if (!std::strchr("+-.0123456789eE", text[i])) return false;
+            return true;
+        }
+
+        bool hex(const char* text, size_t size) {
+            for (size_t i = 0; i < size; ++i)
+                if (!std::isxdigit(static_cast<unsigned char>(text[i]))) return false;
+            return true;
+        }
+    }  //namespace
+
+    bool CsvSchema::specSet(const mongo::BSONObj& spec, std::string* error) {
+        _columns.clear();
+        for (mongo::BSONObjIterator i(spec); i.more();) {
+            mongo::BSONElement column = i.next();
+            Type type;
+            if (column.type() != mongo::String || !columnType(column.String(), &type)) {
+                *error = std::string("Invalid type for column ") + column.fieldName()
+                         + ", types are " + typesPretty();
+                return false;
+            }
+            _columns.push_back(Column {column.fieldName(), type});
+        }
+        if (_columns.empty()) {
+            *error = "The schema has no columns";
+            return false;
+        }
+        return true;
+    }
+
+    bool CsvSchema::append(const char* text, size_t size, Type type,
+                           const mongo::StringData& name, mongo::BSONObjBuilder* out)
+    {
+        long long whole;
+        double number;
+        switch (type) {
+        case Type::SKIP:
+            return true;
+        case Type::STRING:
+            out->append(name, mongo::StringData(text, size));
+            return true;
+        case Type::INT:
+            if (!integer(text, size, &whole) || whole < INT_MIN || whole > INT_MAX) return false;
+            out->append(name, static_cast<int>(whole));
+            return true;
+        case Type::LONG:
+            if (!integer(text, size, &whole)) return false;
+            out->append(name, whole);
+            return true;
+        case Type::DOUBLE:
+            if (!real(text, size, &number)) return false;
+            out->append(name, number);
+            return true;
+        case Type::BOOL:
+            if ((size == 4 && !std::memcmp(text, "true", 4)) || (size == 1 && *text == '1'))
+                out->append(name, true);
+            else if ((size == 5 && !std::memcmp(text, "false", 5)) || (size == 1 && *text == '0'))
+                out->append(name, false);
+            else return false;
+            return true;
+        case Type::DATE:
+            if (!integer(text, size, &whole) && !isoDate(text, size, &whole)) return false;
+            out->appendDate(name, mongo::Date_t(static_cast<unsigned long long>(whole)));
+            return true;
+        case Type::OID:
+            if (size != 24 || !hex(text, size)) return false;
+            out->append(name, mongo::OID(std::string(text, size)));
+            return true;
+        case Type::AUTO:
+            if (integer(text, size, &whole)) {
+                if (whole >= INT_MIN && whole <= INT_MAX) out->append(name, static_cast<int>(whole));
+                else out->append(name, whole);
+            }
+            else if (decimal(text, size) && real(text, size, &number)) out->append(name, number);
+            else if (size == 4 && !std::memcmp(text, "true", 4)) out->append(name, true);
+            else if (size == 5 && !std::memcmp(text, "false", 5)) out->append(name, false);
+            else out->append(name, mongo::StringData(text, size));
+            return true;
+        }
+        return false;
+    }
+
+}  //namespace loader
@@ -0,0 +1,84 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include "mongo_cxxdriver.h"
+
+namespace loader {
+
+    /**
+     * The columns of delimited (CSV, TSV) input: their field names and the BSON type each is
+     * stored as.  Without a spec the names come from each file's header and every column is
+     * AUTO.
+     */
+    class CsvSchema {
+    public:
+        enum class Type {
+            AUTO, STRING, INT, LONG, DOUBLE, BOOL, DATE, OID, SKIP
+        };
+
+        struct Column {
+            std::string name;
+            Type type;
+        };
+
+        /**
+         * Reads a spec of the form {column: type, ...} with the columns in file order
+         * @return false if the spec isn't valid, error says why
+         */
+        bool specSet(const mongo::BSONObj& spec, std::string* error);
+
+        bool empty() const {
+            return _columns.empty();
+        }
+
+        /**
+         * @param header the first line of each file names the columns.  It is skipped if there
+         * is a spec.
+         */
+        void headerSet(bool header) {
+            _header = header;
+        }
+
+        bool header() const {
+            return _header;
+        }
+
+        const std::vector<Column>& columns() const {
+            return _columns;
+        }
+
+        /**
+         * Appends the text of a field as name.  AUTO is a whole number (int if it fits), a
+         * double, true or false, or else a string.  Dates are milliseconds since the epoch or
+         * ISO 8601 in UTC.
+         * @return false if the text isn't of type, nothing is appended
+         */
+        static bool append(const char* text, size_t size, Type type, const mongo::StringData& name,
+                           mongo::BSONObjBuilder* out);
+
+        static std::string typesPretty() {
+            return "auto, string, int, long, double, bool, date, oid, skip";
+        }
+
+    private:
+        std::vector<Column> _columns;
+        bool _header {true};
+    };
+
+}  //namespace loader
@@ -0,0 +1,200 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "dump_loader.h"
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <boost/filesystem.hpp>
+#include "threading.h"
+
+namespace loader {
+
+    namespace {
+        const std::string DUMP_DATA = ".bson";
+        const std::string DUMP_METADATA = ".metadata.json";
+
+        bool endsWith(const std::string& str, const std::string& suffix) {
+            return str.size() >= suffix.size()
+                    && !str.compare(str.size() - suffix.size(), suffix.size(), suffix);
+        }
+    }  //namespace
+
+    DumpLoader::DumpLoader(Loader::Settings settings) :
+            _settings(std::move(settings))
+    {
+        if (!_settings.dumpShardKeysJson.empty())
+            _shardKeys = mongo::fromjson(_settings.dumpShardKeysJson);
+        findCollections();
+    }
+
+    void DumpLoader::findCollections() {
+        using namespace boost::filesystem;
+        path dumpDir(_settings.loadDir);
+        if (!is_directory(dumpDir)) {
+            std::cerr << "loadPath is required to be a mongodump directory. loadPath: "
+                      << _settings.loadDir << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::vector<path> databases;
+        for (directory_iterator ditr {dumpDir}; ditr != directory_iterator {}; ditr++) {
+            if (!is_directory(ditr->path())) continue;
+            std::string database = ditr->path().filename().string();
+            //Server internal databases are not restored
+            if (database == "local" || database == "config") continue;
+            if (!_settings.database.empty() && database != _settings.database) continue;
+            databases.push_back(ditr->path());
+        }
+        std::sort(databases.begin(), databases.end());
+        for (auto&& database : databases)
+            addDatabase(database.string(), database.filename().string());
+        //A single database dump, i.e. mongodump -d db, loaded with --db
+        if (databases.empty() && !_settings.database.empty())
+            addDatabase(dumpDir.string(), _settings.database);
+        if (_collections.empty()) {
+            std::cerr << "No collections to load at: " << _settings.loadDir << std::endl;
+            exit(EXIT_SUCCESS);
+        }
+    }
+
+    void DumpLoader::addDatabase(const std::string& dir, const std::string& database) {
+        using namespace boost::filesystem;
+        std::vector<std::string> files;
+        for (directory_iterator ditr {path(dir)}; ditr != directory_iterator {}; ditr++) {
+            std::string filename = ditr->path().filename().string();
+            if (is_regular_file(ditr->path()) && endsWith(filename, DUMP_DATA))
+                files.push_back(filename);
+        }
+        std::sort(files.begin(), files.end());
+        for (auto&& filename : files) {
+            DumpCollection coll;
+            coll.database = database;
+            coll.collection = filename.substr(0, filename.size() - DUMP_DATA.size());
+            //system.indexes, system.users etc. are server managed
+            if (coll.collection.compare(0, 7, "system.") == 0) continue;
+            if (!_settings.collection.empty() && coll.collection != _settings.collection)
+                continue;
+            coll.dir = dir;
+            path metadata = path(dir) / (coll.collection + DUMP_METADATA);
+            if (exists(metadata)) coll.indexes = readIndexes(metadata.string());
+            _collections.push_back(std::move(coll));
+        }
+    }
+
+    std::vector<mongo::BSONObj> DumpLoader::readIndexes(const std::string& metadataFile) {
+        std::ifstream infile(metadataFile);
+        std::stringstream json;
+        json << infile.rdbuf();
+        if (!infile) {
+            std::cerr << "Unable to read: " << metadataFile << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::vector<mongo::BSONObj> indexes;
+        mongo::BSONObj metadata = mongo::fromjson(json.str());
+        for (mongo::BSONObj::iterator i(metadata.getObjectField("indexes")); i.more();) {
+            mongo::BSONObj index = i.next().Obj();
+            if (index.getStringField("name") == std::string("_id_")) continue;
+            //The namespace is implicit in createIndexes and may not match the load target
+            indexes.push_back(index.removeField("ns").getOwned());
+        }
+        return indexes;
+    }
+
+    void DumpLoader::loadCollection(const DumpCollection& coll) {
+        Loader::Settings settings = _settings;
+        settings.database = coll.database;
+        settings.collection = coll.collection;
+        settings.loadDir = coll.dir;
+        settings.fileRegex = ".*/" + tools::regexEscape(coll.collection + DUMP_DATA);
+        //Any of the bson formats can read a dump, default to plain bson for anything else
+        if (settings.inputType.compare(0, 4, "bson") != 0) settings.inputType = "bson";
+        //Only the first collection of a database drops it, otherwise earlier loads are lost
+        if (settings.dropDb && !_droppedDatabases.insert(coll.database).second) {
+            settings.dropDb = false;
+            settings.dropColl = true;
+        }
+        mongo::BSONElement shardKey = _shardKeys.getField(coll.ns());
+        if (!shardKey.eoo()) settings.shardKeyJson = shardKey.Obj().jsonString();
+        try {
+            settings.process();
+        } catch (std::exception &e) {
+            std::cerr << "Unable to process settings for " << coll.ns() << ": " << e.what()
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        _connstr = settings.connstr;
+        std::cout << "\nLoading: " << coll.ns() << " shard key: " << settings.shardKeyJson
+                  << std::endl;
+        Loader loader(std::move(settings));
+        loader.run();
+    }
+
+    void DumpLoader::rebuildIndexes() {
+        tools::mtools::MongoCluster cluster(_connstr);
+        cluster.loadCluster();
+        std::cout << "\nBuilding indexes on " << cluster.shards().size() << " shards"
+                  << std::endl;
+        tools::SimpleTimer<> timerIndex;
+        std::atomic<bool> failed{};
+        //One shard builds the indexes of a collection at a time, all shards at once
+        tools::ThreadPool tpIndex(cluster.shards().size());
+        for (auto&& shard : cluster.shards()) {
+            const std::string shardConn = shard.second;
+            tpIndex.queue([this, shardConn, &failed]() {
+                std::string error;
+                mongo::ConnectionString cs = mongo::ConnectionString::parse(shardConn, error);
+                std::unique_ptr<mongo::DBClientBase> conn;
+                if (error.empty()) conn.reset(cs.connect(error));
+                if (!error.empty()) {
+                    std::cerr << "Unable to connect to shard " << shardConn << ": " << error
+                              << std::endl;
+                    failed = true;
+                    return;
+                }
+                for (auto&& coll : _collections) {
+                    if (coll.indexes.empty()) continue;
+                    mongo::BSONArrayBuilder indexes;
+                    for (auto&& index : coll.indexes)
+                        indexes.append(index);
+                    mongo::BSONObj info;
+                    if (!conn->runCommand(coll.database, BSON("createIndexes" << coll.collection
+                                          << "indexes" << indexes.arr()), info)) {
+                        std::cerr << "Index build failed on " << shardConn << " for "
+                                  << coll.ns() << ": " << info << std::endl;
+                        failed = true;
+                    }
+                }
+            });
+        }
+        tpIndex.endWaitInitiate();
+        tpIndex.joinAll();
+        timerIndex.stop();
+        long indexSeconds = timerIndex.seconds();
+        std::cout << "Index time: " << indexSeconds / 60 << "m" << indexSeconds % 60 << "s"
+                  << std::endl;
+        if (failed) {
+            std::cerr << "Not all indexes were built" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    void DumpLoader::run() {
+        std::cout << "Dump collections: " << _collections.size() << std::endl;
+        for (auto&& coll : _collections)
+            loadCollection(coll);
+        rebuildIndexes();
+    }
+
+}  //namespace loader
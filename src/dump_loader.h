@@ -0,0 +1,86 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <set>
+#include <string>
+#include <vector>
+#include "loader.h"
+#include "mongo_cxxdriver.h"
+
+namespace loader {
+
+    /**
+     * Loads a mongodump output directory: <dir>/<db>/<coll>.bson with <coll>.metadata.json.
+     * Every collection gets its own Loader run with a bson input format.  Once all the data is
+     * in the indexes recorded in the metadata are built on every shard at the same time.
+     */
+    class DumpLoader {
+    public:
+        /**
+         * @param settings as read from the command line, i.e. before Settings::process()
+         */
+        explicit DumpLoader(Loader::Settings settings);
+
+        void run();
+
+    private:
+        struct DumpCollection {
+            std::string database;
+            std::string collection;
+            std::string dir;
+            //Indexes from the metadata, _id is left out
+            std::vector<mongo::BSONObj> indexes;
+
+            std::string ns() const {
+                return database + "." + collection;
+            }
+        };
+
+        const Loader::Settings _settings;
+        mongo::BSONObj _shardKeys;
+        std::vector<DumpCollection> _collections;
+        std::set<std::string> _droppedDatabases;
+        //Connection string once it's been through Settings::process
+        std::string _connstr;
+
+        /**
+         * Finds the collections in the dump directory
+         */
+        void findCollections();
+
+        /**
+         * Adds the collections in a database directory of the dump
+         */
+        void addDatabase(const std::string& dir, const std::string& database);
+
+        /**
+         * Runs a Loader for a single collection
+         */
+        void loadCollection(const DumpCollection& coll);
+
+        /**
+         * Builds the dump indexes on all shards concurrently
+         */
+        void rebuildIndexes();
+
+        /**
+         * @return the indexes in a metadata.json file besides _id
+         */
+        static std::vector<mongo::BSONObj> readIndexes(const std::string& metadataFile);
+    };
+
+}  //namespace loader
@@ -0,0 +1,172 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "exporter.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <boost/filesystem.hpp>
+
+namespace loader {
+
+    Exporter::Exporter(Loader::Settings settings) :
+            _settings(std::move(settings)),
+            _ns(_settings.ns()),
+            _json(_settings.exportFormat == "json"),
+            _fileBytes(std::max<size_t>(_settings.exportFileMB, 1) * 1024 * 1024),
+            _cluster(_settings.connstr.substr(0, mongo::uriStart.size()) == mongo::uriStart
+                     ? _settings.connstr : mongo::uriStart + _settings.connstr)
+    {
+        if (_settings.database.empty() || _settings.collection.empty()) {
+            std::cerr << "db and coll are required for an export" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (!_json && _settings.exportFormat != "bson") {
+            std::cerr << "Unknown export format: " << _settings.exportFormat
+                      << "\nValues are bson, json" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        const tools::mtools::MongoCluster::MetaNameSpace* coll = _cluster.collection(_ns);
+        if (!_cluster.isSharded() || !coll || !_cluster.chunksCount(_ns)) {
+            std::cerr << _ns << " is not a sharded collection, export reads by chunk range"
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        _key = coll->key;
+    }
+
+    void Exporter::run() {
+        boost::filesystem::create_directories(_settings.exportDir);
+        tools::SimpleTimer<> timerExport;
+        _ranges.reset(new tools::mtools::ChunkRanges(_cluster, _ns, _settings.exportShardThreads));
+        size_t threads = _settings.threads > 0 ? size_t(_settings.threads)
+                                               : std::thread::hardware_concurrency() * 2;
+        threads = std::max<size_t>(std::min(threads, _ranges->shards()
+                                                     * _ranges->shardThreads()), 1);
+        std::cout << "Exporting " << _ns << ": " << _ranges->size() << " chunks on "
+                  << _ranges->shards() << " shards with " << threads << " threads" << std::endl;
+        tools::ThreadPool tpExport(threads);
+        for (size_t i = 0; i < threads; ++i)
+            tpExport.queue([this]() {this->threadExportRanges();});
+        tpExport.endWaitInitiate();
+        tpExport.joinAll();
+        timerExport.stop();
+        if (_settings.exportManifest) writeManifest();
+        double mb = double(_bytes) / 1024 / 1024;
+        std::cout << "Exported: " << _docs << " docs, " << mb << "MB in " << _files.size()
+                  << " files; " << mb / std::max(timerExport.nanos() / 1e9, 1e-9) << "MB/s"
+                  << "\nReload with: --loadPath " << _settings.exportDir << " --fileRegex '.*/"
+                  << tools::regexEscape(_settings.collection) << "\\.[0-9]+-[0-9]+\\."
+                  << _settings.exportFormat << "' --inputType " << _settings.exportFormat
+                  << std::endl;
+    }
+
+    void Exporter::threadExportRanges() {
+        std::unordered_map<tools::mtools::MongoCluster::ShardName,
+                           std::unique_ptr<mongo::DBClientBase>> conns;
+        tools::mtools::ChunkRanges::Range range;
+        while (_ranges->next(&range)) {
+            std::unique_ptr<mongo::DBClientBase>& conn = conns[range.shard];
+            if (!conn) conn.reset(tools::mtools::ChunkRanges::connect(range));
+            exportRange(range, conn.get());
+            _ranges->done(range);
+        }
+    }
+
+    void Exporter::exportRange(const tools::mtools::ChunkRanges::Range& range,
+                               mongo::DBClientBase* conn)
+    {
+        mongo::Cursor cur = tools::mtools::ChunkRanges::query(conn, _ns, _key, range);
+        std::ofstream out;
+        ExportFile file {};
+        size_t part = 0;
+        auto close = [&]() {
+            if (!out.is_open()) return;
+            out.close();
+            if (!out) {
+                std::cerr << "Unable to write export file: " << file.file << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            tools::MutexLockGuard lock(_filesMutex);
+            _files.push_back(file);
+        };
+        //A range with no documents still gets a file so the manifest covers the key space
+        while (cur->more() || !part) {
+            if (!out.is_open()) {
+                char name[64];
+                std::snprintf(name, sizeof(name), ".%06zu-%03zu.", range.index, part++);
+                file = ExportFile {_settings.collection + name + _settings.exportFormat,
+                                   range.shard, range.index, bound(range.min, false),
+                                   bound(range.max, true), 0, 0};
+                out.open((boost::filesystem::path(_settings.exportDir) / file.file).string(),
+                         std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+                if (!out.is_open()) {
+                    std::cerr << "Unable to open export file: " << file.file << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+            }
+            if (!cur->more()) break;
+            mongo::BSONObj doc = cur->nextSafe();
+            size_t size = doc.objsize();
+            if (_json) {
+                std::string json = doc.jsonString(mongo::Strict);
+                out.write(json.data(), json.size()).put('\n');
+            }
+            else out.write(doc.objdata(), size);
+            ++file.docs;
+            file.bytes += size;
+            ++_docs;
+            _bytes += size;
+            if (file.bytes >= _fileBytes) close();
+        }
+        close();
+    }
+
+    mongo::BSONObj Exporter::bound(const mongo::BSONObj& value, bool max) const {
+        if (!value.isEmpty()) return value;
+        mongo::BSONObjBuilder bound;
+        for (mongo::BSONObjIterator i(_key); i.more();) {
+            const char* field = i.next().fieldName();
+            if (max) bound.appendMaxKey(field);
+            else bound.appendMinKey(field);
+        }
+        return bound.obj();
+    }
+
+    void Exporter::writeManifest() {
+        std::sort(_files.begin(), _files.end(), [](const ExportFile& l, const ExportFile& r) {
+            return l.file < r.file;});
+        mongo::BSONArrayBuilder files;
+        for (auto&& file : _files)
+            files.append(BSON("file" << file.file << "shard" << file.shard << "chunk"
+                              << static_cast<long long>(file.chunk) << "min" << file.min
+                              << "max" << file.max << "docs" << static_cast<long long>(file.docs)
+                              << "bytes" << static_cast<long long>(file.bytes)));
+        mongo::BSONObj manifest = BSON("ns" << _ns << "key" << _key << "format"
+                                       << _settings.exportFormat << "files" << files.arr());
+        std::string path = (boost::filesystem::path(_settings.exportDir)
+                            / (_settings.collection + ".manifest.json")).string();
+        std::ofstream out(path, std::ios_base::out | std::ios_base::trunc);
+        out << manifest.jsonString(mongo::Strict, 1) << std::endl;
+        if (!out) {
+            std::cerr << "Unable to write export manifest: " << path << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::cout << "Manifest: " << path << std::endl;
+    }
+
+}  //namespace loader
@@ -0,0 +1,88 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include "chunk_ranges.h"
+#include "loader.h"
+#include "mongo_cluster.h"
+
+namespace loader {
+
+    /**
+     * Exports a sharded collection, the reverse of a load.  The collection is split by its chunk
+     * ranges and each range is read straight from the shard that owns it, ranges on different
+     * shards at once.  Ranges are written to files of BSON or JSON lines, cut at a size so that
+     * a reload can spread them over its input threads.  A manifest records the shard key bounds
+     * of every file.
+     */
+    class Exporter {
+    public:
+        /**
+         * @param settings as read from the command line, i.e. before Settings::process()
+         */
+        explicit Exporter(Loader::Settings settings);
+
+        void run();
+
+    private:
+        struct ExportFile {
+            std::string file;
+            tools::mtools::MongoCluster::ShardName shard;
+            size_t chunk;
+            mongo::BSONObj min;
+            mongo::BSONObj max;
+            size_t docs;
+            unsigned long long bytes;
+        };
+
+        const Loader::Settings _settings;
+        const std::string _ns;
+        const bool _json;
+        const unsigned long long _fileBytes;
+        tools::mtools::MongoCluster _cluster;
+        mongo::BSONObj _key;
+        std::unique_ptr<tools::mtools::ChunkRanges> _ranges;
+        tools::Mutex _filesMutex;
+        std::vector<ExportFile> _files;
+        std::atomic<size_t> _docs{};
+        std::atomic<unsigned long long> _bytes{};
+
+        /**
+         * Exports ranges until there are none left
+         */
+        void threadExportRanges();
+
+        /**
+         * Writes a range's documents to as many files as it takes
+         */
+        void exportRange(const tools::mtools::ChunkRanges::Range& range,
+                         mongo::DBClientBase* conn);
+
+        /**
+         * @return the range bound, the key pattern's fields at filler if the range is open ended
+         */
+        mongo::BSONObj bound(const mongo::BSONObj& value, bool max) const;
+
+        /**
+         * Writes the manifest of the files written
+         */
+        void writeManifest();
+    };
+
+}  //namespace loader
@@ -0,0 +1,280 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "field_transform.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
+namespace loader {
+
+    namespace {
+        //Orders by size first, so most compares are of the sizes
+        bool fieldLess(const std::string& field, const char* name, size_t size) {
+            if (field.size() != size) return field.size() < size;
+            return std::memcmp(field.data(), name, size) < 0;
+        }
+
+        bool coerceType(const std::string& type, FieldTransform::Coerce* coerce) {
+            using Coerce = FieldTransform::Coerce;
+            if (type == "int") *coerce = Coerce::INT;
+            else if (type == "long") *coerce = Coerce::LONG;
+            else if (type == "double") *coerce = Coerce::DOUBLE;
+            else if (type == "string") *coerce = Coerce::STRING;
+            else if (type == "bool") *coerce = Coerce::BOOL;
+            else if (type == "date") *coerce = Coerce::DATE;
+            else return false;
+            return true;
+        }
+
+        /**
+         * @return true if value is a whole number, which is set to it
+         */
+        bool integer(const mongo::BSONElement& value, long long* number) {
+            switch (value.type()) {
+            case mongo::NumberInt:
+            case mongo::NumberLong:
+                *number = value.numberLong();
+                return true;
+            case mongo::NumberDouble: {
+                double d = value.Double();
+                if (std::trunc(d) != d || d < double(LLONG_MIN) || d >= double(LLONG_MAX))
+                    return false;
+                *number = static_cast<long long>(d);
+                return true;
+            }
+            case mongo::Bool:
+                *number = value.Bool();
+                return true;
+            case mongo::String: {
+                const char* str = value.valuestr();
+                char* end;
+                errno = 0;
+                *number = std::strtoll(str, &end, 10);
+                return *str && !*end && !errno;
+            }
+            default:
+                return false;
+            }
+        }
+
+        bool real(const mongo::BSONElement& value, double* number) {
+            switch (value.type()) {
+            case mongo::NumberInt:
+            case mongo::NumberLong:
+            case mongo::NumberDouble:
+                *number = value.Number();
+                return true;
+            case mongo::Bool:
+                *number = value.Bool();
+                return true;
+            case mongo::String: {
+                const char* str = value.valuestr();
+                char* end;
+                *number = std::strtod(str, &end);
+                return *str && !*end;
+            }
+            default:
+                return false;
+            }
+        }
+    }  //namespace
+
+    FieldTransform::Field* FieldTransform::fieldAdd(const std::string& from) {
+        auto i = std::lower_bound(_fields.begin(), _fields.end(), from,
+                                  [](const Field& field, const std::string& name) {
+                                      return fieldLess(field.from, name.data(), name.size());
+                                  });
+        //Fields only named by a rename or coerce aren't kept if the fields are listed
+        if (i == _fields.end() || i->from != from)
+            i = _fields.insert(i, Field {from, _include, from, Coerce::NONE});
+        return &*i;
+    }
+
+    bool FieldTransform::specSet(const mongo::BSONObj& spec, std::string* error) {
+        _include = false;
+        _fields.clear();
+        auto names = [&](const char* part, bool drop) {
+            mongo::BSONElement list = spec.getField(part);
+            if (list.eoo()) return true;
+            if (list.type() != mongo::Array) {
+                *error = std::string(part) + " must be an array of field names";
+                return false;
+            }
+            for (mongo::BSONObjIterator i(list.Obj()); i.more();) {
+                mongo::BSONElement name = i.next();
+                if (name.type() != mongo::String) {
+                    *error = std::string(part) + " must be an array of field names";
+                    return false;
+                }
+                fieldAdd(name.String())->drop = drop;
+            }
+            return true;
+        };
+        for (mongo::BSONObjIterator i(spec); i.more();) {
+            std::string part = i.next().fieldName();
+            if (part != "include" && part != "exclude" && part != "rename" && part != "coerce") {
+                *error = "Unknown transform part: " + part;
+                return false;
+            }
+        }
+        if (spec.hasField("include") && spec.hasField("exclude")) {
+            *error = "include and exclude can't be used together";
+            return false;
+        }
+        if (!names("include", false) || !names("exclude", true)) return false;
+        _include = spec.hasField("include");
+        for (mongo::BSONObjIterator i(spec.getObjectField("rename")); i.more();) {
+            mongo::BSONElement to = i.next();
+            if (to.type() != mongo::String || !to.valuestrsize() || to.valuestr()[0] == '$') {
+                *error = std::string("Invalid rename of ") + to.fieldName();
+                return false;
+            }
+            fieldAdd(to.fieldName())->name = to.String();
+        }
+        for (mongo::BSONObjIterator i(spec.getObjectField("coerce")); i.more();) {
+            mongo::BSONElement type = i.next();
+            Coerce coerce;
+            if (type.type() != mongo::String || !coerceType(type.String(), &coerce)) {
+                *error = std::string("Invalid coerce type for ") + type.fieldName()
+                         + ", types are " + typesPretty();
+                return false;
+            }
+            fieldAdd(type.fieldName())->coerce = coerce;
+        }
+        //A document can't have two fields of the same name, so renames can't land on a field
+        //that is kept or on each other
+        for (auto&& renamed : _fields) {
+            if (renamed.drop || renamed.name == renamed.from) continue;
+            bool collides = !field(renamed.name.data(), renamed.name.size());
+            for (auto&& other : _fields)
+                collides |= &other != &renamed && !other.drop && other.name == renamed.name;
+            if (collides) {
+                *error = "Rename of " + renamed.from + " to " + renamed.name
+                         + " collides with another field called " + renamed.name;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const FieldTransform::Field* FieldTransform::field(const char* name, size_t size) const {
+        auto i = std::lower_bound(_fields.begin(), _fields.end(), name,
+                                  [size](const Field& field, const char* name) {
+                                      return fieldLess(field.from, name, size);
+                                  });
+        if (i != _fields.end() && i->from.size() == size
+            && !std::memcmp(i->from.data(), name, size))
+            return &*i;
+        return _include ? &_dropped : nullptr;
+    }
+
+    bool FieldTransform::produces(const std::string& name) const {
+        for (auto&& field : _fields)
+            if (!field.drop && field.name == name) return true;
+        const Field* kept = field(name.data(), name.size());
+        return !kept;
+    }
+
+    bool FieldTransform::apply(const mongo::BSONObj& doc, mongo::BSONObjBuilder* out) const {
+        for (mongo::BSONObjIterator i(doc); i.more();) {
+            mongo::BSONElement element = i.next();
+            const Field* transform = field(element.fieldName(), element.fieldNameSize() - 1);
+            if (!transform) out->append(element);
+            else if (transform->drop) continue;
+            else if (transform->coerce != Coerce::NONE) {
+                if (!coerce(element, transform->coerce, transform->name, out)) return false;
+            }
+            else out->appendAs(element, transform->name);
+        }
+        return true;
+    }
+
+    bool FieldTransform::coerce(const mongo::BSONElement& value, Coerce to,
+                                const mongo::StringData& name, mongo::BSONObjBuilder* out) {
+        if (value.type() == mongo::jstNULL) {
+            out->appendNull(name);
+            return true;
+        }
+        long long whole;
+        double number;
+        switch (to) {
+        case Coerce::NONE:
+            out->appendAs(value, name);
+            return true;
+        case Coerce::INT:
+            if (!integer(value, &whole) || whole < INT_MIN || whole > INT_MAX) return false;
+            out->append(name, static_cast<int>(whole));
+            return true;
+        case Coerce::LONG:
+            if (!integer(value, &whole)) return false;
+            out->append(name, whole);
+            return true;
+        case Coerce::DOUBLE:
+            if (!real(value, &number)) return false;
+            out->append(name, number);
+            return true;
+        case Coerce::STRING:
+            switch (value.type()) {
+            case mongo::String:
+                out->appendAs(value, name);
+                return true;
+            case mongo::NumberInt:
+            case mongo::NumberLong:
+                out->append(name, std::to_string(value.numberLong()));
+                return true;
+            case mongo::NumberDouble: {
+                std::ostringstream str;
+                str << std::setprecision(17) << value.Double();
+                out->append(name, str.str());
+                return true;
+            }
+            case mongo::Bool:
+                out->append(name, value.Bool() ? "true" : "false");
+                return true;
+            case mongo::jstOID:
+                out->append(name, value.__oid().toString());
+                return true;
+            default:
+                return false;
+            }
+        case Coerce::BOOL:
+            if (value.type() == mongo::String) {
+                std::string str = value.String();
+                if (str != "true" && str != "false") return false;
+                out->append(name, str == "true");
+                return true;
+            }
+            if (!real(value, &number)) return false;
+            out->append(name, number != 0);
+            return true;
+        case Coerce::DATE:
+            if (value.type() == mongo::Date) {
+                out->appendAs(value, name);
+                return true;
+            }
+            //Milliseconds since the epoch
+            if (value.type() == mongo::String || !integer(value, &whole)) return false;
+            out->appendDate(name, mongo::Date_t(static_cast<unsigned long long>(whole)));
+            return true;
+        }
+        return false;
+    }
+}  //namespace loader
@@ -0,0 +1,97 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include "mongo_cxxdriver.h"
+
+namespace loader {
+
+    /**
+     * Declarative changes to the top level fields of each document as it is read: which fields
+     * are kept, what they are called and what type they are stored as.  Formats apply it while
+     * they build a document, so dropped fields are never built.
+     * Fields are named by their input names.
+     */
+    class FieldTransform {
+    public:
+        enum class Coerce {
+            NONE, INT, LONG, DOUBLE, STRING, BOOL, DATE
+        };
+
+        /**
+         * What happens to a field
+         */
+        struct Field {
+            std::string from;
+            bool drop;
+            //The output name, from if it isn't renamed
+            std::string name;
+            Coerce coerce;
+        };
+
+        /**
+         * Reads a spec of the form:
+         * {include: [fields], exclude: [fields], rename: {from: to}, coerce: {field: type}}
+         * Any part can be left out, include and exclude can't both be used.
+         * @return false if the spec isn't valid, error says why
+         */
+        bool specSet(const mongo::BSONObj& spec, std::string* error);
+
+        bool empty() const {
+            return !_include && _fields.empty();
+        }
+
+        /**
+         * @return how to handle a top level field, nullptr if it is kept as is
+         */
+        const Field* field(const char* name, size_t size) const;
+
+        /**
+         * @return true if documents still have a field called name once transformed, i.e. a
+         * shard key field
+         */
+        bool produces(const std::string& name) const;
+
+        /**
+         * Appends the transformed fields of doc to out
+         * @return false if a field couldn't be coerced
+         */
+        bool apply(const mongo::BSONObj& doc, mongo::BSONObjBuilder* out) const;
+
+        /**
+         * Appends value as name converted to a type.  Nulls stay null.
+         * @return false if value doesn't convert, nothing is appended
+         */
+        static bool coerce(const mongo::BSONElement& value, Coerce to,
+                           const mongo::StringData& name, mongo::BSONObjBuilder* out);
+
+        static std::string typesPretty() {
+            return "int, long, double, string, bool, date";
+        }
+
+    private:
+        //Only the fields in _fields that aren't dropped are kept
+        bool _include {};
+        //Sorted by name size and then name, so a lookup needs no allocation
+        std::vector<Field> _fields;
+        Field _dropped {std::string(), true, std::string(), Coerce::NONE};
+
+        Field* fieldAdd(const std::string& from);
+    };
+
+}  //namespace loader
@@ -0,0 +1,176 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "gzip_stream.h"
+#include <cstring>
+
+namespace tools {
+
+    namespace {
+        constexpr unsigned char GZIP_ID1 = 0x1f;
+        constexpr unsigned char GZIP_ID2 = 0x8b;
+        constexpr unsigned char GZIP_FEXTRA = 0x04;
+        //Fixed gzip header size, XLEN follows
+        constexpr size_t GZIP_HEADER_SIZE = 10;
+
+        /**
+         * Reads the bgzip header at offset.
+         * @return the total size of the block, 0 if this isn't a bgzip block
+         */
+        long long bgzipBlockSize(std::ifstream& infile, long long offset) {
+            unsigned char header[GZIP_HEADER_SIZE + 2];
+            infile.clear();
+            infile.seekg(offset);
+            infile.read(reinterpret_cast<char*>(header), sizeof(header));
+            if (!infile || header[0] != GZIP_ID1 || header[1] != GZIP_ID2
+                || !(header[3] & GZIP_FEXTRA))
+                return 0;
+            size_t extraLength = header[10] | (header[11] << 8);
+            std::vector<unsigned char> extra(extraLength);
+            infile.read(reinterpret_cast<char*>(extra.data()), extraLength);
+            if (!infile) return 0;
+            //Subfields are SI1, SI2, SLEN (2 bytes), data.  bgzip is 'B' 'C' with BSIZE
+            for (size_t pos = 0; pos + 4 <= extraLength;) {
+                size_t subLength = extra[pos + 2] | (extra[pos + 3] << 8);
+                if (extra[pos] == 'B' && extra[pos + 1] == 'C' && subLength == 2
+                    && pos + 6 <= extraLength)
+                    return (extra[pos + 4] | (extra[pos + 5] << 8)) + 1;
+                pos += 4 + subLength;
+            }
+            return 0;
+        }
+    }  //namespace
+
+    GzipStreamBuf::GzipStreamBuf() :
+            _in(BUFFER_SIZE), _out(BUFFER_SIZE)
+    {
+        std::memset(&_zstream, 0, sizeof(_zstream));
+    }
+
+    GzipStreamBuf::~GzipStreamBuf() {
+        close();
+    }
+
+    bool GzipStreamBuf::open(const std::string& fileName, long long begin, long long end) {
+        close();
+        _file.open(fileName, std::ios_base::in | std::ios_base::binary);
+        if (!_file.is_open()) return false;
+        if (begin) _file.seekg(begin);
+        _compressedRead = begin;
+        _end = end;
+        _produced = 0;
+        _endPosition = 0;
+        _endReached = false;
+        _memberEnded = false;
+        _finished = false;
+        _failed = false;
+        std::memset(&_zstream, 0, sizeof(_zstream));
+        //15 window bits + 16 for a gzip wrapper
+        if (inflateInit2(&_zstream, 15 + 16) != Z_OK) {
+            _file.close();
+            return false;
+        }
+        _zstreamInit = true;
+        setg(_out.data(), _out.data(), _out.data());
+        return true;
+    }
+
+    void GzipStreamBuf::close() {
+        if (_zstreamInit) inflateEnd(&_zstream);
+        _zstreamInit = false;
+        if (_file.is_open()) _file.close();
+        setg(_out.data(), _out.data(), _out.data());
+    }
+
+    GzipStreamBuf::int_type GzipStreamBuf::underflow() {
+        if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+        if (!_zstreamInit || _finished) return traits_type::eof();
+        _zstream.next_out = reinterpret_cast<Bytef*>(_out.data());
+        _zstream.avail_out = _out.size();
+        while (_zstream.avail_out == _out.size()) {
+            if (_zstream.avail_in == 0) {
+                _file.read(_in.data(), _in.size());
+                std::streamsize count = _file.gcount();
+                if (count <= 0) {
+                    //A member that never finished means the file is truncated
+                    if (!_memberEnded && _produced) _failed = true;
+                    _finished = true;
+                    break;
+                }
+                _compressedRead += count;
+                _zstream.next_in = reinterpret_cast<Bytef*>(_in.data());
+                _zstream.avail_in = count;
+            }
+            if (_memberEnded) {
+                //Anything other than another member is trailing padding, stop there
+                if (_zstream.next_in[0] != GZIP_ID1) {
+                    _finished = true;
+                    break;
+                }
+                inflateReset(&_zstream);
+                _memberEnded = false;
+            }
+            int ret = inflate(&_zstream, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END) {
+                _memberEnded = true;
+                long long memberEnd = _compressedRead - _zstream.avail_in;
+                if (_end && !_endReached && memberEnd >= _end) {
+                    _endReached = true;
+                    _endPosition = _produced + (_out.size() - _zstream.avail_out);
+                }
+            }
+            else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                _failed = true;
+                _finished = true;
+                break;
+            }
+        }
+        size_t produced = _out.size() - _zstream.avail_out;
+        _produced += produced;
+        //Running out of file before the end offset means everything read belongs to the reader
+        if (_finished && !_endReached) {
+            _endReached = true;
+            _endPosition = _produced;
+        }
+        setg(_out.data(), _out.data(), _out.data() + produced);
+        if (!produced) return traits_type::eof();
+        return traits_type::to_int_type(*gptr());
+    }
+
+    bool GzipStreamBuf::bgzipSegment(const fileinfo& file, unsigned long long segmentSize,
+                                     LocSegMapping* mapping)
+    {
+        std::ifstream infile(file.name, std::ios_base::in | std::ios_base::binary);
+        if (!infile.is_open()) return false;
+        LocSegMapping segments;
+        long long segmentStart{};
+        long long blockStart{};
+        const long long fileSize = file.size;
+        while (blockStart < fileSize) {
+            long long blockSize = bgzipBlockSize(infile, blockStart);
+            if (!blockSize) return false;
+            if (blockStart - segmentStart >= (long long)segmentSize) {
+                segments.emplace_back(file.name, segmentStart, blockStart);
+                segmentStart = blockStart;
+            }
+            blockStart += blockSize;
+        }
+        //always have a "to end" for every file for consistancy
+        segments.emplace_back(file.name, segmentStart, 0);
+        mapping->insert(mapping->end(), segments.begin(), segments.end());
+        return true;
+    }
+
+}  //namespace tools
@@ -0,0 +1,138 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <fstream>
+#include <istream>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include "tools.h"
+
+namespace tools {
+
+    /**
+     * Decompressing stream buffer for gzip files.
+     * Concatenated gzip members (i.e. bgzip or cat a.gz b.gz) are read as one stream.
+     * Reading can start at any member boundary, which is what allows bgzip files to be split.
+     */
+    class GzipStreamBuf : public std::streambuf {
+    public:
+        GzipStreamBuf();
+        ~GzipStreamBuf();
+
+        /**
+         * Opens the file for reading.
+         * @param begin compressed offset to start at, must be the start of a gzip member
+         * @param end compressed offset of a member start to record the uncompressed position
+         * of, 0 for none.  Reading continues past end so that records can be completed.
+         */
+        bool open(const std::string& fileName, long long begin = 0, long long end = 0);
+
+        void close();
+
+        bool is_open() const {
+            return _file.is_open();
+        }
+
+        /**
+         * @return true if the compressed data was corrupt
+         */
+        bool failed() const {
+            return _failed;
+        }
+
+        /**
+         * @return uncompressed bytes handed to the reader since open
+         */
+        unsigned long long position() const {
+            return _produced - (egptr() - gptr());
+        }
+
+        /**
+         * @return true once the uncompressed position of the end member is known
+         */
+        bool endReached() const {
+            return _endReached;
+        }
+
+        /**
+         * @return uncompressed position that the end offset starts at.  Valid if endReached()
+         */
+        unsigned long long endPosition() const {
+            return _endPosition;
+        }
+
+        /**
+         * Walks a bgzip file by its block headers, no decompression is done.
+         * @return false if the file isn't bgzip, in which case it can't be split
+         */
+        static bool bgzipSegment(const fileinfo& file, unsigned long long segmentSize,
+                                 LocSegMapping* mapping);
+
+    protected:
+        int_type underflow();
+
+    private:
+        static constexpr size_t BUFFER_SIZE = 1024 * 1024;
+
+        std::ifstream _file;
+        z_stream _zstream;
+        bool _zstreamInit{};
+        std::vector<char> _in;
+        std::vector<char> _out;
+        //Compressed bytes read from the file, including begin
+        long long _compressedRead{};
+        long long _end{};
+        unsigned long long _produced{};
+        unsigned long long _endPosition{};
+        bool _endReached{};
+        bool _memberEnded{};
+        bool _finished{};
+        bool _failed{};
+    };
+
+    /**
+     * istream over a GzipStreamBuf so that getline/read work as they do on an ifstream.
+     */
+    class GzipInputStream : public std::istream {
+    public:
+        GzipInputStream() : std::istream(&_buf) { }
+
+        void open(const std::string& fileName, long long begin = 0, long long end = 0) {
+            clear();
+            if (!_buf.open(fileName, begin, end))
+                setstate(std::ios_base::failbit);
+        }
+
+        void close() {
+            _buf.close();
+        }
+
+        bool is_open() const {
+            return _buf.is_open();
+        }
+
+        const GzipStreamBuf& buf() const {
+            return _buf;
+        }
+
+    private:
+        GzipStreamBuf _buf;
+    };
+
+}  //namespace tools
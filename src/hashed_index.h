@@ -0,0 +1,103 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <assert.h>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+namespace tools {
+
+    /**
+     * Routes a 64 bit hash to the value of the chunk it belongs in, i.e. the upper bound
+     * search of a tools::Index, for hashed shard keys.
+     * The upper bounds are a flat int64_t array in Eytzinger (breadth first) order on cache line
+     * aligned memory, so the search is branchless and touches one line per level.
+     * The last bound is MaxKey and isn't stored, hashes above the other bounds route to it.
+     */
+    template<typename Value>
+    class HashedIndex {
+    public:
+        HashedIndex() = default;
+
+        /**
+         * @param bounds are the sorted upper bounds, less MaxKey
+         * @param values has a value for each bound and one more for the MaxKey bound
+         */
+        HashedIndex(const std::vector<int64_t>& bounds, const std::vector<Value>& values) :
+                _size(bounds.size()), _last(values.back())
+        {
+            assert(values.size() == bounds.size() + 1);
+            void* memory;
+            //Position 0 isn't used, the root is 1
+            if (posix_memalign(&memory, CACHE_LINE, (_size + 1) * sizeof(int64_t))) {
+                std::cerr << "Unable to allocate hashed index" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            _bounds.reset(static_cast<int64_t*>(memory));
+            _values.resize(_size + 1);
+            size_t sorted = 0;
+            build(bounds, values, &sorted, 1);
+        }
+
+        bool empty() const {
+            return !_bounds;
+        }
+
+        /**
+         * @return the value of the first bound greater than hash
+         */
+        Value upperBound(int64_t hash) const {
+            size_t k = 1;
+            while (k <= _size)
+                k = 2 * k + (_bounds[k] <= hash);
+            //Walk back up past the right turns, 0 means no bound is greater
+            k >>= __builtin_ffsll(~k);
+            return k ? _values[k] : _last;
+        }
+
+    private:
+        static constexpr size_t CACHE_LINE = 64;
+
+        struct Free {
+            void operator()(int64_t* memory) const {
+                free(memory);
+            }
+        };
+
+        size_t _size{};
+        std::unique_ptr<int64_t[], Free> _bounds;
+        std::vector<Value> _values;
+        Value _last{};
+
+        /**
+         * In order walk of the implicit tree, filling it from the sorted bounds
+         */
+        void build(const std::vector<int64_t>& bounds, const std::vector<Value>& values,
+                   size_t* sorted, size_t k) {
+            if (k > _size) return;
+            build(bounds, values, sorted, 2 * k);
+            _bounds[k] = bounds[*sorted];
+            _values[k] = values[*sorted];
+            ++*sorted;
+            build(bounds, values, sorted, 2 * k + 1);
+        }
+    };
+
+}  //namespace tools
@@ -0,0 +1,68 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "hyper_log_log.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace tools {
+
+    namespace {
+        //The splitmix64 finalizer
+        inline uint64_t mix(uint64_t value) {
+            value ^= value >> 30;
+            value *= 0xbf58476d1ce4e5b9ULL;
+            value ^= value >> 27;
+            value *= 0x94d049bb133111ebULL;
+            return value ^ (value >> 31);
+        }
+    }  //namespace
+
+    void HyperLogLog::merge(const HyperLogLog& other) {
+        for (size_t i = 0; i < _registers.size(); ++i)
+            _registers[i] = std::max(_registers[i], other._registers[i]);
+    }
+
+    double HyperLogLog::estimate() const {
+        const double registers = double(_registers.size());
+        double sum {};
+        size_t zeros {};
+        for (uint8_t value : _registers) {
+            sum += std::ldexp(1.0, -int(value));
+            zeros += !value;
+        }
+        double alpha = 0.7213 / (1 + 1.079 / registers);
+        double estimate = alpha * registers * registers / sum;
+        //Linear counting is better while many registers are empty
+        if (estimate <= 2.5 * registers && zeros)
+            return registers * std::log(registers / double(zeros));
+        return estimate;
+    }
+
+    uint64_t HyperLogLog::hash(const void* data, size_t size, uint64_t seed) {
+        const char* bytes = static_cast<const char*>(data);
+        uint64_t hash = mix(seed ^ size);
+        for (; size >= 8; size -= 8, bytes += 8) {
+            uint64_t word;
+            std::memcpy(&word, bytes, 8);
+            hash = mix(hash ^ word);
+        }
+        uint64_t tail {};
+        std::memcpy(&tail, bytes, size);
+        return mix(hash ^ tail ^ (uint64_t(size) << 56));
+    }
+
+}  //namespace tools
@@ -169,10 +169,10 @@ namespace tools {
         }
 
         /**
-         * Sorts the data
+         * Sorts the data, data inserted in order (i.e. streamed from a sorted query) isn't resorted
          */
         void finalize() {
-            sort();
+            if (!std::is_sorted(_container.begin(), _container.end(), _compare)) sort();
         }
 
         /**
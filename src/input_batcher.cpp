@@ -22,10 +22,34 @@ namespace loader {
                 "direct", &DirectQueue::create);
         const bool RAMQueue::factoryRegisterCreator = ChunkBatchFactory::registerCreator(
                 "ram", &RAMQueue::create);
+        const bool DiskQueue::factoryRegisterCreator = ChunkBatchFactory::registerCreator(
+                "disk", &DiskQueue::create);
+
+        const size_t AbstractChunkBatcher::SHARED_STAGE_DOCS;
+
+        SharedBatchPool* AbstractChunkBatcher::sharedBatches() {
+            return _owner->settings().sharedBatches;
+        }
+
+        void SharedBatchPool::flush() {
+            tools::MutexLockGuard lock(_mutex);
+            for (auto&& batch : _docs) {
+                if (batch.second->values.empty()) continue;
+                Journal::Attach attach(&batch.second->holds);
+                batch.first->routed(batch.second->values.size());
+                batch.first->push(&batch.second->values);
+            }
+            for (auto&& batch : _pairs) {
+                if (batch.second->values.empty()) continue;
+                batch.first->routed(batch.second->values.size());
+                batch.first->pushSort(&batch.second->values);
+            }
+        }
 
         AbstractChunkBatcher::AbstractChunkBatcher(InputNameSpaceContainer* owner, Bson UBIndex) :
                 _owner(owner),
                 _queueSize(_owner->settings().queueSize),
+                _batchBytes(_owner->settings().batchBytes),
                 _dispatcher(_owner->getDispatchForChunk(UBIndex)),
                 _UBIndex(std::move(UBIndex))
         {
@@ -38,9 +62,49 @@ namespace loader {
             for (auto&& iCm : _mCluster.nsChunks(ns)) {
                 _inputPlan.insertUnordered(std::get<0>(iCm), ChunkBatcherPointer {});
                 size_t depth = ++(shardChunkCounters[std::get<1>(iCm)->first]);
-                _inputPlan.back() = ChunkBatchFactory::createObject(_settings.loadQueues
-                                    ->at(depth - 1), this, std::get<0>(iCm));
+                //Shards holding more chunks than there are queues (i.e. zones) reuse the last
+                depth = std::min(depth, _settings.loadQueues->size());
+                if (_settings.journal
+                    && _settings.journal->done(Journal::chunkRecord(std::get<0>(iCm))))
+                    _inputPlan.back().reset(new SkipQueue(this, std::get<0>(iCm)));
+                else
+                    _inputPlan.back() = ChunkBatchFactory::createObject(_settings.loadQueues
+                                        ->at(depth - 1), this, std::get<0>(iCm));
+            }
+            initHashed();
+            initEncoded();
+        }
+
+        void InputNameSpaceContainer::initEncoded() {
+            std::vector<std::string> bounds;
+            std::vector<AbstractChunkBatcher*> stages;
+            for (auto& i : _inputPlan) {
+                bounds.emplace_back();
+                if (!_encoder.encode(i.first, &bounds.back())) return;
+                stages.push_back(i.second.get());
+            }
+            _encodedBounds.swap(bounds);
+            _encodedStages.swap(stages);
+        }
+
+        void InputNameSpaceContainer::initHashed() {
+            mongo::BSONElement key = _settings.sortIndex.firstElement();
+            if (key.type() != mongo::String || key.valueStringData() != mongo::StringData("hashed")
+                || _inputPlan.empty())
+                return;
+            std::vector<int64_t> bounds;
+            std::vector<AbstractChunkBatcher*> batchers;
+            auto last = --_inputPlan.end();
+            for (auto i = _inputPlan.begin(); i != last; ++i) {
+                mongo::BSONElement bound = i->first.firstElement();
+                //Anything other than hashed values stays on the BSON upper bound search
+                if (bound.type() != mongo::NumberLong) return;
+                bounds.push_back(bound.numberLong());
+                batchers.push_back(i->second.get());
             }
+            if (last->first.firstElement().type() != mongo::MaxKey) return;
+            batchers.push_back(last->second.get());
+            _hashedPlan = tools::HashedIndex<AbstractChunkBatcher*>(bounds, batchers);
         }
 
         void InputNameSpaceContainer::clean() {
@@ -15,11 +15,18 @@
 
 #pragma once
 
+#include <algorithm>
+#include <iterator>
 #include <memory>
+#include <mutex>
 #include <unordered_map>
 #include "batch_dispatch.h"
+#include "bson_arena.h"
 #include "factory.h"
+#include "hashed_index.h"
 #include "index.h"
+#include "journal.h"
+#include "key_encoding.h"
 #include "loader_defs.h"
 #include "mongo_cxxdriver.h"
 #include "mongo_cluster.h"
@@ -29,6 +36,7 @@ namespace loader {
 
         class InputNameSpaceContainer;
         class AbstractChunkBatcher;
+        class SharedBatchPool;
 
         using ChunkBatcherPointer = std::unique_ptr<AbstractChunkBatcher>;
 
@@ -66,10 +74,6 @@ namespace loader {
              * We currently only support a single index which is the sort/shard key
              */
             virtual Bson getIndex() = 0;
-            /**
-             * Returns any fields that the builder added to the document
-             */
-            virtual Bson getAdd() = 0;
             /**
              * Returns the document location on in the original data set
              */
@@ -118,6 +122,10 @@ namespace loader {
                 return _queueSize;
             }
 
+            const size_t batchBytes() const {
+                return _batchBytes;
+            }
+
             /**
              * @return the index upper bound being used
              */
@@ -125,16 +133,129 @@ namespace loader {
                 return _UBIndex;
             }
 
+            /**
+             * @return the shared batches to stage into, nullptr if batches aren't shared
+             */
+            SharedBatchPool* sharedBatches();
+
+            /**
+             * @return documents staged per thread before they are appended to a shared batch
+             */
+            size_t stageSize() const {
+                return std::min(queueSize(), SHARED_STAGE_DOCS);
+            }
+
         protected:
+            static const size_t SHARED_STAGE_DOCS = 64;
+
             AbstractChunkBatcher(InputNameSpaceContainer* owner, Bson UBIndex);
 
         private:
             InputNameSpaceContainer *_owner;
             size_t _queueSize;
+            size_t _batchBytes;
             dispatch::AbstractChunkDispatch *_dispatcher;
             const Bson _UBIndex;
         };
 
+        /**
+         * Per chunk batches that every input thread appends to, so that partial batches are
+         * bounded by chunks x batchSize instead of threads x chunks x batchSize and batches fill
+         * faster.  Threads stage a few documents and append them under a spin lock, whoever fills
+         * a batch pushes it to the chunk's dispatch.
+         */
+        class SharedBatchPool {
+        public:
+            template<typename Container>
+            struct Batch {
+                tools::SpinLock lock;
+                Container values;
+                size_t bytes{};
+                //Journal tokens of the documents in values
+                Journal::Holds holds;
+            };
+            using DocBatch = Batch<BsonV>;
+            using PairBatch = Batch<BsonPairDeque>;
+
+            DocBatch* docs(dispatch::AbstractChunkDispatch* dispatch) {
+                return get(&_docs, dispatch);
+            }
+
+            PairBatch* pairs(dispatch::AbstractChunkDispatch* dispatch) {
+                return get(&_pairs, dispatch);
+            }
+
+            /**
+             * Moves staged values into a shared batch, a value that would take it over batchBytes
+             * starts the next batch instead, as a single batcher's values do
+             * @param holds the staged journal tokens, on return those of the full batches
+             * @return the batches that filled, to be pushed by the caller
+             */
+            template<typename Container>
+            static std::vector<Container> share(Batch<Container>* batch, Container* staged,
+                                                size_t* stagedBytes, Journal::Holds* holds,
+                                                size_t queueSize, size_t batchBytes) {
+                std::vector<Container> full;
+                {
+                    std::lock_guard<tools::SpinLock> lock(batch->lock);
+                    //Values after a cut in the batch are all staged ones, so only their tokens
+                    Journal::Holds stagedHolds = *holds;
+                    Journal::merge(&batch->holds, holds);
+                    auto cut = [&]() {
+                        full.emplace_back();
+                        full.back().swap(batch->values);
+                        Journal::Holds cutHolds = batch->holds;
+                        Journal::merge(holds, &cutHolds);
+                        batch->holds = stagedHolds;
+                        batch->bytes = 0;
+                    };
+                    for (auto&& value : *staged) {
+                        size_t bytes = valueBytes(value);
+                        if (!batch->values.empty() && batch->bytes + bytes > batchBytes) cut();
+                        batch->values.push_back(std::move(value));
+                        batch->bytes += bytes;
+                        if (batch->values.size() >= queueSize) cut();
+                    }
+                    if (batch->bytes >= batchBytes) cut();
+                    if (batch->values.empty()) batch->holds.clear();
+                }
+                staged->clear();
+                *stagedBytes = 0;
+                return full;
+            }
+
+            /**
+             * Pushes what is left in the batches, input must be over
+             */
+            void flush();
+
+        private:
+            static size_t valueBytes(const mongo::BSONObj& doc) {
+                return doc.objsize();
+            }
+
+            static size_t valueBytes(const std::pair<mongo::BSONObj, mongo::BSONObj>& value) {
+                return value.second.objsize();
+            }
+
+            template<typename Container>
+            using BatchMap = std::unordered_map<dispatch::AbstractChunkDispatch*,
+                    std::unique_ptr<Batch<Container>>>;
+
+            tools::Mutex _mutex;
+            BatchMap<BsonV> _docs;
+            BatchMap<BsonPairDeque> _pairs;
+
+            template<typename Container>
+            Batch<Container>* get(BatchMap<Container>* map, dispatch::AbstractChunkDispatch* dispatch)
+            {
+                tools::MutexLockGuard lock(_mutex);
+                auto& batch = (*map)[dispatch];
+                if (!batch) batch.reset(new Batch<Container>());
+                return batch.get();
+            }
+        };
+
         /**
          * InputNameSpaceContainer is not thread safe.  It aggregates documents into batches for passing onto
          * an operation dispatcher.  This is only valid for a single namespace.
@@ -145,6 +266,14 @@ namespace loader {
                 LoadQueues *loadQueues;
                 mongo::BSONObj sortIndex;
                 size_t queueSize;
+                //Batches are also cut once their documents reach this many bytes
+                size_t batchBytes;
+                //Batches shared across input threads, nullptr for a batch per thread per chunk
+                SharedBatchPool* sharedBatches;
+                //Chunks the journal has as finished are skipped, nullptr for no journal
+                const Journal* journal;
+                //Direct queues append documents straight into insert messages
+                bool wireBatches;
             };
 
             InputNameSpaceContainer(Settings settings,
@@ -155,7 +284,8 @@ namespace loader {
                     _mCluster(mCluster),
                     _out(out),
                     _inputPlan(tools::mtools::MongoCluster::CHUNK_SORT),
-                    _ns(ns)
+                    _ns(ns),
+                    _encoder(_settings.sortIndex, tools::KeyEncoder::Source::KEY)
             {
                 init(_ns);
             }
@@ -168,9 +298,24 @@ namespace loader {
              * @return the stage for a single bson value.
              */
             AbstractChunkBatcher* targetStage(const Bson& indexValue) {
+                if (!_encodedBounds.empty() && _encoder.encode(indexValue, &_encodedKey)) {
+                    size_t stage = std::upper_bound(_encodedBounds.begin(), _encodedBounds.end(),
+                                                    _encodedKey) - _encodedBounds.begin();
+                    //MaxKey itself, there is no greater bound
+                    return _encodedStages[std::min(stage, _encodedStages.size() - 1)];
+                }
                 return _inputPlan.upperBound(indexValue).get();
             }
 
+            /**
+             * @return the stage for a hashed shard key value, no key object is needed
+             */
+            AbstractChunkBatcher* targetStage(int64_t hash) {
+                if (_hashedPlan.empty())
+                    return targetStage(BSON("_id-hash" << static_cast<long long>(hash)));
+                return _hashedPlan.upperBound(hash);
+            }
+
             /**
              * returns the opAggregator for that upper bound chunk key
              */
@@ -193,6 +338,16 @@ namespace loader {
              */
             void init(const tools::mtools::MongoCluster::NameSpace& ns);
 
+            /**
+             * Builds _hashedPlan if the chunk bounds are hashed values
+             */
+            void initHashed();
+
+            /**
+             * Builds the encoded bounds if every chunk bound can be encoded
+             */
+            void initEncoded();
+
             /**
              * Clear the queues
              */
@@ -210,28 +365,48 @@ namespace loader {
             tools::mtools::MongoCluster &_mCluster;
             dispatch::ChunkDispatcher *_out;
             InputPlan _inputPlan;
+            tools::HashedIndex<AbstractChunkBatcher*> _hashedPlan;
             tools::mtools::MongoCluster::NameSpace _ns;
+            //The chunk bounds normalized, routing compares bytes instead of BSON
+            const tools::KeyEncoder _encoder;
+            std::vector<std::string> _encodedBounds;
+            std::vector<AbstractChunkBatcher*> _encodedStages;
+            std::string _encodedKey;
 
         };
 
         class DirectQueue : public AbstractChunkBatcher {
         public:
             DirectQueue(InputNameSpaceContainer* owner, Bson UBIndex) :
-                    AbstractChunkBatcher(owner, std::move(UBIndex))
+                    AbstractChunkBatcher(owner, std::move(UBIndex)),
+                    _shared(sharedBatches() ? sharedBatches()->docs(postTo()) : nullptr),
+                    _wireBatches(owner->settings().wireBatches && !_shared)
             {
-                _bsonHolder.reserve(queueSize());
+                if (!_wireBatches) _bsonHolder.reserve(_shared ? stageSize() : queueSize());
             }
 
             void push(DocumentBuilder* stage) {
-                _bsonHolder.push_back(stage->getFinalDoc());
-                if (_bsonHolder.size() >= queueSize()) {
-                    postTo()->push(&_bsonHolder);
-                    _bsonHolder.reserve(queueSize());
+                Bson doc = stage->getFinalDoc();
+                Journal::track(&_holds);
+                if (_wireBatches) {
+                    pushWire(doc);
+                    return;
+                }
+                if (_shared) {
+                    _bytes += doc.objsize();
+                    _bsonHolder.push_back(std::move(doc));
+                    if (_bsonHolder.size() >= stageSize()) flush();
+                    return;
                 }
+                //A large document starts the next batch instead of pushing this one over
+                if (!_bsonHolder.empty() && _bytes + doc.objsize() > batchBytes()) flush();
+                _bytes += doc.objsize();
+                _bsonHolder.push_back(std::move(doc));
+                if (_bsonHolder.size() >= queueSize() || _bytes >= batchBytes()) flush();
             }
 
             void clean() {
-                if (!_bsonHolder.empty()) postTo()->push(&_bsonHolder);
+                if (!empty()) flush();
             }
 
             static ChunkBatcherPointer create(InputNameSpaceContainer* owner, const Bson& UBIndex) {
@@ -240,30 +415,82 @@ namespace loader {
 
         private:
             BsonV _bsonHolder;
+            size_t _bytes{};
+            SharedBatchPool::DocBatch* const _shared;
+            const bool _wireBatches;
+            tools::mtools::WireBatchPointer _wire;
+            //Document bytes of the last wire batch, the next one reserves that much
+            size_t _wireReserve{};
+            Journal::Holds _holds;
 
             static const bool factoryRegisterCreator;
 
+            /**
+             * The document is copied into the message and given back to its arena right away
+             */
+            void pushWire(const Bson& doc) {
+                if (_wire && !_wire->empty() && _wire->bytes() + doc.objsize() > batchBytes())
+                    flush();
+                if (!_wire)
+                    _wire.reset(new tools::mtools::WireBatch(postTo()->owner()->ns(),
+                                                             _wireReserve));
+                _wire->append(doc);
+                tools::BsonArena::release(doc);
+                if (_wire->docs() >= queueSize() || _wire->bytes() >= batchBytes()) flush();
+            }
+
+            void flush() {
+                tools::Trace::Span span("flush", postTo()->traceTag());
+                if (_wireBatches) {
+                    _wireReserve = _wire->bytes();
+                    Journal::Attach attach(&_holds);
+                    postTo()->routed(_wire->docs());
+                    postTo()->pushWire(std::move(_wire));
+                    return;
+                }
+                if (_shared) {
+                    std::vector<BsonV> full = SharedBatchPool::share(_shared, &_bsonHolder,
+                                                                     &_bytes, &_holds, queueSize(),
+                                                                     batchBytes());
+                    //Each batch that filled is given the tokens of all of them
+                    for (auto&& batch : full) {
+                        Journal::Attach attach(&_holds, true);
+                        postTo()->routed(batch.size());
+                        postTo()->push(&batch);
+                    }
+                    _holds.clear();
+                    return;
+                }
+                Journal::Attach attach(&_holds);
+                postTo()->routed(_bsonHolder.size());
+                postTo()->push(&_bsonHolder);
+                _bsonHolder.reserve(queueSize());
+                _bytes = 0;
+            }
+
             bool empty() const {
-                return _bsonHolder.empty();
+                return _wireBatches ? !_wire || _wire->empty() : _bsonHolder.empty();
             }
         };
 
         class RAMQueue : public AbstractChunkBatcher {
         public:
             RAMQueue(InputNameSpaceContainer* owner, Bson UBIndex) :
-                AbstractChunkBatcher(owner, std::move(UBIndex))
+                AbstractChunkBatcher(owner, std::move(UBIndex)),
+                _shared(sharedBatches() ? sharedBatches()->pairs(postTo()) : nullptr)
             {
             }
 
             void push(DocumentBuilder* stage) {
                 _bsonHolder.push_back(std::make_pair(stage->getIndex(), stage->getFinalDoc()));
-                if (_bsonHolder.size() > queueSize()) {
-                    postTo()->pushSort(&_bsonHolder);
-                }
+                _bytes += _bsonHolder.back().second.objsize();
+                if (_shared ? _bsonHolder.size() >= stageSize()
+                            : _bsonHolder.size() > queueSize() || _bytes >= batchBytes())
+                    flush();
             }
 
             void clean() {
-                if (!_bsonHolder.empty()) postTo()->pushSort(&_bsonHolder);
+                if (!_bsonHolder.empty()) flush();
             }
 
             bool empty() const {
@@ -278,7 +505,70 @@ namespace loader {
         private:
             static const bool factoryRegisterCreator;
             BsonPairDeque _bsonHolder;
+            size_t _bytes{};
+            SharedBatchPool::PairBatch* const _shared;
+            //Held documents are journaled by chunk, these stay empty
+            Journal::Holds _holds;
+
+            void flush() {
+                tools::Trace::Span span("flush", postTo()->traceTag());
+                if (_shared) {
+                    std::vector<BsonPairDeque> full = SharedBatchPool::share(_shared, &_bsonHolder,
+                                                                             &_bytes, &_holds,
+                                                                             queueSize(),
+                                                                             batchBytes());
+                    for (auto&& batch : full) {
+                        postTo()->routed(batch.size());
+                        postTo()->pushSort(&batch);
+                    }
+                    return;
+                }
+                postTo()->routed(_bsonHolder.size());
+                postTo()->pushSort(&_bsonHolder);
+                _bytes = 0;
+            }
+
+        };
 
+        /**
+         * Batches keys and documents like the RAMQueue, the DiskQueueDispatch sorts them on disk
+         */
+        class DiskQueue : public RAMQueue {
+        public:
+            DiskQueue(InputNameSpaceContainer* owner, Bson UBIndex) :
+                RAMQueue(owner, std::move(UBIndex))
+            {
+            }
+
+            static ChunkBatcherPointer create(InputNameSpaceContainer* owner, Bson UBIndex)
+            {
+                return ChunkBatcherPointer(new DiskQueue(owner, std::move(UBIndex)));
+            }
+
+        private:
+            static const bool factoryRegisterCreator;
+        };
+
+        /**
+         * Drops the documents of a chunk that a resumed load finished before
+         */
+        class SkipQueue : public AbstractChunkBatcher {
+        public:
+            SkipQueue(InputNameSpaceContainer* owner, Bson UBIndex) :
+                AbstractChunkBatcher(owner, std::move(UBIndex))
+            {
+            }
+
+            void push(DocumentBuilder* stage) {
+                tools::BsonArena::release(stage->getFinalDoc());
+            }
+
+            void clean() {
+            }
+
+            bool empty() const {
+                return true;
+            }
         };
 
         /*
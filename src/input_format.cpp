@@ -7,14 +7,56 @@
 
 #include "input_format.h"
 #include <assert.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace loader {
 
     const bool InputFormatJson::_registerFactory = InputFormatFactory::registerCreator("json",
                                                                            &InputFormatJson::create);
+    const bool InputFormatJsonMmap::_registerFactory = InputFormatFactory::registerCreator("jsonmmap",
+                                                                       &InputFormatJsonMmap::create);
+    const bool InputFormatJsonArray::_registerFactory = InputFormatFactory::registerCreator(
+            "jsonarray", &InputFormatJsonArray::create);
+    const bool InputFormatCsv::_registerFactoryCsv = InputFormatFactory::registerCreator("csv",
+                                                                       &InputFormatCsv::createCsv);
+    const bool InputFormatCsv::_registerFactoryTsv = InputFormatFactory::registerCreator("tsv",
+                                                                       &InputFormatCsv::createTsv);
     const bool InputFormatBson::_registerFactory = InputFormatFactory::registerCreator("bson",
                                                                                &InputFormatBson::create);
+    const bool InputFormatBsonArena::_registerFactory = InputFormatFactory::registerCreator(
+            "bsonarena", &InputFormatBsonArena::create);
+    const bool InputFormatJsonGzip::_registerFactory = InputFormatFactory::registerCreator("jsongz",
+                                                                       &InputFormatJsonGzip::create);
+    const bool InputFormatBsonGzip::_registerFactory = InputFormatFactory::registerCreator("bsongz",
+                                                                       &InputFormatBsonGzip::create);
+
+    void AbstractFileInputFormat::segment(const tools::fileinfo& file,
+                                          unsigned long long segmentSize,
+                                          tools::LocSegMapping* mapping)
+    {
+        for (size_t pos = 0; pos < file.size; pos += segmentSize)
+            mapping->emplace_back(file.name, pos, pos + segmentSize);
+        //always have a "to end" for every file for consistancy
+        mapping->back().end = 0;
+    }
+
+    void AbstractFileInputFormat::keyFieldsSet(const mongo::BSONObj& keys) {
+        _keyFields.clear();
+        for (mongo::BSONObjIterator itr(keys); itr.more();)
+            _keyFields.emplace_back(itr.next().fieldName());
+        _keyFieldNames.clear();
+        for (auto& field : _keyFields)
+            _keyFieldNames.push_back(field.c_str());
+    }
 
     void InputFormatJson::reset(tools::LocSegment segment)
     {
@@ -23,67 +65,513 @@ namespace loader {
          * This ensures we don't read a partial object/an object another thread is
          */
         _locSegment = std::move(segment);
-        if (_infile.is_open())
-            _infile.close();
-        _infile.open(_locSegment.file, std::ios_base::in);
+        openInput();
+        _lines.reset(&input(), inputPosition());
         /*
          * If we are starting somewhere other than the very start of the file, scroll to the
          * end of that line and start there.  Prevents partial documents and races.
          */
         //TODO: test this on windows, what happens on a CR-LF if you're on LF: fails to read one?
         if (_locSegment.begin) {
-            _infile.seekg(_locSegment.begin);
-            std::string string;
-            getline(_infile,string);
+            char* line;
+            size_t lineSize;
+            _lines.next(&line, &lineSize);
         }
+    }
+
+    void InputFormatJson::resetBuffer(const char* data, size_t size) {
+        _locSegment = tools::LocSegment("stream", 0, 0);
+        _memoryInput.reset(data, size);
+        _lines.reset(&_memoryInput, 0);
+    }
+
+    size_t InputFormatJson::records(const char* data, size_t size, bool endOfStream) const {
+        if (endOfStream) return size;
+        const void* lastNewline = memrchr(data, '\n', size);
+        return lastNewline ? static_cast<const char*>(lastNewline) - data + 1 : 0;
+    }
+
+    void InputFormatJson::openInput() {
+        _infile.close();
+        _infile.open(_locSegment.file, _locSegment.begin, _locSegment.end, _readAheadBuffers);
         assert(_infile.is_open());
     }
 
     //TODO: Keep average object size and implement fromjson with a large/smaller buffer
     bool InputFormatJson::next(mongo::BSONObj* nextDoc) {
+        for (;;) {
+            ++_lineNumber;
+            if (segmentEnded()) return false;
+            long long lineStart = _lines.position();
+            char* line;
+            size_t lineSize;
+            if (!_lines.next(&line, &lineSize)) return false;
+            //Strings are decoded in the line buffer, so keys and values aren't copied by the parser
+            rapidjson::InsituStringStream ss(line);
+            _events.reset();
+            if(!_reader.Parse<rapidjson::kParseInsituFlag>(ss, _events)) {
+                rapidjson::ParseErrorCode error = _reader.GetParseErrorCode();
+                size_t offset = _reader.GetErrorOffset();
+                if (_errors) {
+                    _errors->add(_locSegment.file, lineStart + offset,
+                                 rapidjson::GetParseError_En(error));
+                    continue;
+                }
+                //In situ parsing has overwritten the line up to the error
+                std::string errorLine(line, lineSize);
+                std::cerr << "Error file: " << _locSegment.file << ":" << _locSegment.begin
+                        << " line #:" << _lineNumber << rapidjson::GetParseError_En(error)
+                        << "\nLine: " << errorLine << "\noffset: " << offset << " near "
+                        << errorLine.substr(offset, 10) << "..." << std::endl;
+                return false;
+            }
+            *nextDoc = _arena.copy(_events.obj());
+            return true;
+        }
+    }
+
+    void InputFormatJsonGzip::openInput() {
+        _gzfile.close();
+        _gzfile.open(_locSegment.file, _locSegment.begin, _locSegment.end);
+        assert(_gzfile.is_open());
+    }
+
+    bool InputFormatJsonGzip::next(mongo::BSONObj* nextDoc) {
+        if (InputFormatJson::next(nextDoc)) return true;
+        if (_gzfile.buf().failed()) {
+            std::cerr << "Failed decompressing file: " << _locSegment.file << ":"
+                    << _locSegment.begin << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return false;
+    }
+
+    void InputFormatJsonGzip::segment(const tools::fileinfo& file,
+                                      unsigned long long segmentSize,
+                                      tools::LocSegMapping* mapping)
+    {
+        if (!tools::GzipStreamBuf::bgzipSegment(file, segmentSize, mapping)) {
+            std::cout << "Not bgzip, unable to split: " << file.name << std::endl;
+            mapping->emplace_back(file.name, 0, 0);
+        }
+    }
+
+    InputFormatMmap::~InputFormatMmap() {
+        unmap();
+    }
+
+    void InputFormatMmap::unmap() {
+        if (_map)
+            munmap(const_cast<char*>(_map), _mapSize);
+        _map = nullptr;
+        _mapSize = 0;
+        _mapOffset = 0;
+        _pos = _segmentEnd = _fileEnd = nullptr;
+    }
+
+    void InputFormatMmap::reset(tools::LocSegment segment)
+    {
+        map(std::move(segment));
+        /*
+         * If we are starting somewhere other than the very start of the file, scroll to the
+         * end of that line and start there.  Same as the resync in InputFormatJson::reset.
+         */
+        if (_locSegment.begin) {
+            const char* lineEnd = tools::findNewline(_pos, _fileEnd);
+            _pos = lineEnd == _fileEnd ? _fileEnd : lineEnd + 1;
+        }
+    }
+
+    void InputFormatMmap::map(tools::LocSegment segment)
+    {
+        _locSegment = std::move(segment);
+        unmap();
+        int fd = open(_locSegment.file.c_str(), O_RDONLY);
+        struct stat fileStat;
+        if (fd == -1 || fstat(fd, &fileStat) == -1) {
+            std::cerr << "Unable to open file: " << _locSegment.file << ".  " << strerror(errno)
+                    << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        size_t fileSize = fileStat.st_size;
+        static const size_t pageSize = sysconf(_SC_PAGE_SIZE);
+        _mapOffset = std::min(size_t(_locSegment.begin), fileSize) / pageSize * pageSize;
+        _mapSize = fileSize - _mapOffset;
+        //mmap cannot map zero bytes, an empty or fully skipped file just has no documents
+        if (_mapSize) {
+            void* map = mmap(nullptr, _mapSize, PROT_READ, MAP_PRIVATE, fd, _mapOffset);
+            if (map == MAP_FAILED) {
+                std::cerr << "Unable to map file: " << _locSegment.file << ".  "
+                        << strerror(errno) << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            madvise(map, _mapSize, MADV_SEQUENTIAL);
+            _map = static_cast<const char*>(map);
+        }
+        close(fd);
+        _fileEnd = _map + _mapSize;
+        _pos = _map + (std::min(size_t(_locSegment.begin), fileSize) - _mapOffset);
+        if (_locSegment.end && size_t(_locSegment.end) < fileSize)
+            _segmentEnd = _map + (_locSegment.end - _mapOffset);
+        else
+            _segmentEnd = _fileEnd;
+    }
+
+    bool InputFormatJsonMmap::next(mongo::BSONObj* nextDoc) {
+        for (;;) {
+            ++_lineNumber;
+            if (_pos > _segmentEnd || _pos >= _fileEnd) return false;
+            const char* line = _pos;
+            const char* lineEnd = tools::findNewline(line, _fileEnd);
+            _pos = lineEnd == _fileEnd ? _fileEnd : lineEnd + 1;
+            BufferStream ss(line, lineEnd - line);
+            _events.reset();
+            if(!_reader.Parse(ss, _events)) {
+                rapidjson::ParseErrorCode error = _reader.GetParseErrorCode();
+                size_t offset = _reader.GetErrorOffset();
+                if (_errors) {
+                    _errors->add(_locSegment.file, _mapOffset + (line - _map) + offset,
+                                 rapidjson::GetParseError_En(error));
+                    continue;
+                }
+                std::string errorLine(line, lineEnd - line);
+                std::cerr << "Error file: " << _locSegment.file << ":" << _locSegment.begin
+                        << " line #:" << _lineNumber << rapidjson::GetParseError_En(error)
+                        << "\nLine: " << errorLine << "\noffset: " << offset << " near "
+                        << errorLine.substr(offset, 10) << "..." << std::endl;
+                return false;
+            }
+            *nextDoc = _arena.copy(_events.obj());
+            return true;
+        }
+    }
+
+    void InputFormatJsonArray::reset(tools::LocSegment segment)
+    {
+        map(std::move(segment));
+        //Later segments start on an element, only the first has the array's opening bracket
+        if (!_locSegment.begin) {
+            skipSpace();
+            if (_pos == _fileEnd) return;
+            if (*_pos != '[') {
+                std::cerr << "Error file: " << _locSegment.file << " does not start with a JSON "
+                        "array" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            ++_pos;
+        }
+    }
+
+    bool InputFormatJsonArray::next(mongo::BSONObj* nextDoc) {
         ++_lineNumber;
-        if (_locSegment.end && (_infile.tellg() > _locSegment.end)) return false;
-        if (!getline(_infile, _line)) return false;
-        //*nextDoc = mongo::fromjson(_line);/*
-        rapidjson::StringStream ss(_line.c_str());
+        if (_pos >= _segmentEnd) return false;
+        skipSpace();
+        if (_pos == _fileEnd) return false;
+        //The end of the array
+        if (*_pos == ']') {
+            _pos = _fileEnd;
+            return false;
+        }
+        const char* element = _pos;
+        BufferStream ss(element, _fileEnd - element);
         _events.reset();
-        _events.bufferSizeSet(_bufferSize);
-        if(!_reader.Parse(ss, _events)) {
+        if (!_reader.Parse<rapidjson::kParseStopWhenDoneFlag>(ss, _events)) {
             rapidjson::ParseErrorCode error = _reader.GetParseErrorCode();
             size_t offset = _reader.GetErrorOffset();
-            std::cerr << "Error file: " << _locSegment.file << ":" << _locSegment.begin << " line #:"
-                    << _lineNumber << rapidjson::GetParseError_En(error) << "\nLine: " << _line
-                    << "\noffset: " << offset << " near " << _line.substr(offset, 10) << "..."
-                    << std::endl;
-            return false;
+            std::cerr << "Error file: " << _locSegment.file << ":" << pos() << " element #:"
+                    << _lineNumber << rapidjson::GetParseError_En(error) << "\nNear: "
+                    << std::string(element + offset, std::min(size_t(_fileEnd - element - offset),
+                                                              size_t(10)))
+                    << "..." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        _pos = element + ss.Tell();
+        skipSpace();
+        //Segments begin just past a comma, so the comma is taken but not what follows it
+        if (_pos < _fileEnd && *_pos == ',') ++_pos;
+        else if (_pos < _fileEnd && *_pos == ']') _pos = _fileEnd;
+        else {
+            std::cerr << "Error file: " << _locSegment.file << ":" << pos() << " element #:"
+                    << _lineNumber << " is not followed by ',' or ']'" << std::endl;
+            exit(EXIT_FAILURE);
         }
-        *nextDoc = _events.obj();
-        _bufferSize = nextDoc->objsize();
-        //*/
+        *nextDoc = _arena.copy(_events.obj());
         return true;
     }
 
+    void InputFormatJsonArray::segment(const tools::fileinfo& file,
+                                       unsigned long long segmentSize,
+                                       tools::LocSegMapping* mapping)
+    {
+        if (!segmentSize || file.size <= segmentSize) {
+            mapping->emplace_back(file.name, 0, 0);
+            return;
+        }
+        map(tools::LocSegment(file.name, 0, 0));
+        skipSpace();
+        if (_pos == _fileEnd || *_pos != '[') {
+            std::cerr << "Error file: " << file.name << " does not start with a JSON array"
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        //The pieces are scanned at once guessing they don't start in a string
+        const char* first = _pos + 1;
+        size_t pieces = (_fileEnd - first + segmentSize - 1) / segmentSize;
+        std::vector<tools::JsonScan> scans(pieces);
+        auto pieceBegin = [&](size_t piece) { return first + piece * segmentSize; };
+        auto pieceEnd = [&](size_t piece) {
+            return piece + 1 == pieces ? _fileEnd : first + (piece + 1) * segmentSize;
+        };
+        {
+            tools::ThreadPool tp(std::max<size_t>(
+                    std::min(pieces, size_t(std::thread::hardware_concurrency())), 1));
+            for (size_t piece = 0; piece < pieces; ++piece)
+                tp.queue([&, piece]() {
+                    scans[piece].scan(pieceBegin(piece), pieceEnd(piece),
+                                      tools::JsonScan::State {});
+                });
+            tp.endWaitInitiate();
+            tp.joinAll();
+        }
+        //Each piece starts where the last ended, elements are at depth one within the array
+        tools::JsonScan::State state {};
+        long long depth = 1;
+        size_t rescans {};
+        mapping->emplace_back(file.name, 0, 0);
+        for (size_t piece = 0; piece < pieces; ++piece) {
+            tools::JsonScan& scan = scans[piece];
+            if (state != tools::JsonScan::State {}) {
+                scan.scan(pieceBegin(piece), pieceEnd(piece), state);
+                ++rescans;
+            }
+            long long comma = piece ? scan.commaAt(1 - depth) : -1;
+            if (comma != -1) {
+                long long begin = (pieceBegin(piece) - _map) + comma;
+                mapping->back().end = begin;
+                mapping->emplace_back(file.name, begin, 0);
+            }
+            state = scan.endState();
+            depth += scan.endDepth();
+        }
+        if (rescans)
+            std::cout << "Rescanned " << rescans << " of " << pieces << " pieces of " << file.name
+                      << std::endl;
+        unmap();
+    }
+
+    void InputFormatCsv::reset(tools::LocSegment segment)
+    {
+        InputFormatMmap::reset(std::move(segment));
+        if (_columnsFile != _locSegment.file) columnsRead();
+        bool header = !_schema || _schema->header();
+        if (!_locSegment.begin && header && _pos < _fileEnd) {
+            _pos = _scan.record(_pos, _fileEnd, &_fields);
+            ++_lineNumber;
+        }
+    }
+
+    void InputFormatCsv::columnsRead() {
+        _columns.clear();
+        if (_schema && !_schema->empty()) _columns = _schema->columns();
+        else {
+            std::ifstream input(_locSegment.file);
+            std::string line;
+            std::getline(input, line);
+            _scan.record(line.data(), line.data() + line.size(), &_fields);
+            for (auto&& field : _fields)
+                _columns.push_back(CsvSchema::Column {text(field).toString(),
+                                                      CsvSchema::Type::AUTO});
+        }
+        if (_transform) {
+            for (auto&& column : _columns) {
+                const FieldTransform::Field* field = _transform->field(column.name.data(),
+                                                                       column.name.size());
+                if (!field) continue;
+                if (field->drop) {
+                    column.type = CsvSchema::Type::SKIP;
+                    continue;
+                }
+                column.name = field->name;
+                switch (field->coerce) {
+                case FieldTransform::Coerce::NONE: break;
+                case FieldTransform::Coerce::INT: column.type = CsvSchema::Type::INT; break;
+                case FieldTransform::Coerce::LONG: column.type = CsvSchema::Type::LONG; break;
+                case FieldTransform::Coerce::DOUBLE: column.type = CsvSchema::Type::DOUBLE; break;
+                case FieldTransform::Coerce::STRING: column.type = CsvSchema::Type::STRING; break;
+                case FieldTransform::Coerce::BOOL: column.type = CsvSchema::Type::BOOL; break;
+                case FieldTransform::Coerce::DATE: column.type = CsvSchema::Type::DATE; break;
+                }
+            }
+        }
+        _columnsFile = _locSegment.file;
+    }
+
+    mongo::StringData InputFormatCsv::text(const tools::CsvScan::Field& field) {
+        if (!field.quoted) return mongo::StringData(field.begin, field.end - field.begin);
+        const char* begin = field.begin + 1;
+        const char* end = field.end;
+        if (end > begin && end[-1] == '"') --end;
+        //Quotes in a quoted field are doubled
+        _unquoted.clear();
+        for (const char* c = begin; c < end; ++c) {
+            _unquoted.push_back(*c);
+            if (*c == '"' && c + 1 < end && c[1] == '"') ++c;
+        }
+        return mongo::StringData(_unquoted.data(), _unquoted.size());
+    }
+
+    bool InputFormatCsv::next(mongo::BSONObj* nextDoc) {
+        for (;;) {
+            ++_lineNumber;
+            if (_pos > _segmentEnd || _pos >= _fileEnd) return false;
+            const char* record = _pos;
+            _pos = _scan.record(_pos, _fileEnd, &_fields);
+            //Blank lines have no document
+            if (_fields.size() == 1 && _fields.front().begin == _fields.front().end) continue;
+            std::string error;
+            if (_fields.size() > _columns.size())
+                error = std::to_string(_fields.size()) + " fields, there are "
+                        + std::to_string(_columns.size()) + " columns";
+            _buffer.reset();
+            mongo::BSONObjBuilder doc(_buffer);
+            for (size_t i = 0; i < _fields.size() && error.empty(); ++i) {
+                const CsvSchema::Column& column = _columns[i];
+                const tools::CsvScan::Field& field = _fields[i];
+                if (column.type == CsvSchema::Type::SKIP
+                        || (!field.quoted && field.begin == field.end))
+                    continue;
+                mongo::StringData value = text(field);
+                if (!CsvSchema::append(value.rawData(), value.size(), column.type, column.name,
+                                       &doc))
+                    error = "column " + column.name + ": \"" + value.toString()
+                            + "\" doesn't convert";
+            }
+            if (!error.empty()) {
+                if (_errors) {
+                    doc.done();
+                    _errors->add(_locSegment.file, _mapOffset + (record - _map), error);
+                    continue;
+                }
+                std::cerr << "Error file: " << _locSegment.file << ":" << _locSegment.begin
+                        << " line #:" << _lineNumber << " " << error << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            *nextDoc = _arena.copy(doc.done());
+            return true;
+        }
+    }
+
     void InputFormatBson::reset(tools::LocSegment segment)
     {
         _locSegment = std::move(segment);
-        if (_infile.is_open())
-            _infile.close();
-        _infile.open(_locSegment.file, std::ios_base::in);
-        //we currently don't handle partial bson
-        assert(_locSegment.begin == 0);
-        assert(_locSegment.end == 0);
+        //Segments from InputFormatBson::segment always start on a document boundary
+        _position = _locSegment.begin;
+        openInput();
+        _stream = &input();
+    }
+
+    void InputFormatBson::resetBuffer(const char* data, size_t size) {
+        _locSegment = tools::LocSegment("stream", 0, 0);
+        _position = 0;
+        _memoryInput.reset(data, size);
+        _stream = &_memoryInput;
+    }
+
+    size_t InputFormatBson::records(const char* data, size_t size, bool endOfStream) const {
+        size_t end = 0;
+        for (;;) {
+            int32_t bsonSize;
+            if (size - end < sizeof(bsonSize)) break;
+            std::memcpy(&bsonSize, data + end, sizeof(bsonSize));
+            if (bsonSize < 5 || bsonSize > mongo::BSONObjMaxUserSize) {
+                std::cerr << "Invalid document size in stream: " << bsonSize << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            if (size - end < size_t(bsonSize)) break;
+            end += bsonSize;
+        }
+        if (endOfStream && end != size) {
+            std::cerr << "Stream ended in the middle of a document" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return end;
+    }
+
+    void InputFormatBson::openInput() {
+        _infile.close();
+        _infile.open(_locSegment.file, _locSegment.begin, _locSegment.end, _readAheadBuffers);
         assert(_infile.is_open());
     }
 
+    void InputFormatBsonGzip::openInput() {
+        _gzfile.close();
+        _gzfile.open(_locSegment.file);
+        assert(_gzfile.is_open());
+    }
+
+    bool InputFormatBsonGzip::next(mongo::BSONObj* nextDoc) {
+        if (InputFormatBson::next(nextDoc)) return true;
+        if (_gzfile.buf().failed()) {
+            std::cerr << "Failed decompressing file: " << _locSegment.file << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return false;
+    }
+
+    void InputFormatBson::segment(const tools::fileinfo& file, unsigned long long segmentSize,
+                                  tools::LocSegMapping* mapping)
+    {
+        std::ifstream infile(file.name, std::ios_base::in | std::ios_base::binary);
+        if (!infile.is_open()) {
+            std::cerr << "Unable to open file for splitting: " << file.name << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        //The prefixes are read a window at a time, only a document larger than the window
+        //leaves it and seeks
+        const long long windowSize = 4 * 1024 * 1024;
+        std::vector<char> window(windowSize);
+        long long windowStart{};
+        long long windowEnd{};
+        long long segmentStart{};
+        long long docStart{};
+        const long long fileSize = file.size;
+        while (docStart < fileSize) {
+            if (docStart - segmentStart >= (long long)segmentSize) {
+                mapping->emplace_back(file.name, segmentStart, docStart);
+                segmentStart = docStart;
+            }
+            int32_t bsonSize = 0;
+            if (docStart < windowStart || docStart + (long long)sizeof(bsonSize) > windowEnd) {
+                infile.clear();
+                infile.seekg(docStart);
+                infile.read(window.data(), std::min(windowSize, fileSize - docStart));
+                windowStart = docStart;
+                windowEnd = docStart + infile.gcount();
+            }
+            bool read = docStart + (long long)sizeof(bsonSize) <= windowEnd;
+            if (read)
+                std::memcpy(&bsonSize, window.data() + (docStart - windowStart), sizeof(bsonSize));
+            if (!read || bsonSize < 5 || bsonSize > mongo::BSONObjMaxUserSize) {
+                std::cerr << "Invalid document size while splitting file: " << file.name
+                        << ".  Offset: " << docStart << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            docStart += bsonSize;
+        }
+        //always have a "to end" for every file for consistancy
+        mapping->emplace_back(file.name, segmentStart, 0);
+    }
+
     bool InputFormatBson::next(mongo::BSONObj* nextDoc) {
+        if (_locSegment.end && _position >= _locSegment.end) return false;
         //Read the size into the buffer
         ++_docCount;
         //bsonspec.org defines the size of a bson object as 32 bit integer
         int32_t bsonSize;
-        _infile.read(_buffer.data(), sizeof(bsonSize));
-        if (_infile.eof())
+        stream().read(_buffer.data(), sizeof(bsonSize));
+        if (stream().eof())
             return false;
-        if (!_infile) {
+        if (!stream()) {
             std::cerr << "Failed reading file: " << _locSegment.file
                     << ".  Reading size of object: " << _docCount
                     << std::endl;
@@ -103,17 +591,76 @@ namespace loader {
             exit(EXIT_FAILURE);
         }
         //Read the rest of the object in the buffer
-        _infile.read(_buffer.data() + (sizeof(bsonSize)), bsonSize - sizeof(bsonSize));
-        if (!_infile) {
+        stream().read(_buffer.data() + (sizeof(bsonSize)), bsonSize - sizeof(bsonSize));
+        if (!stream()) {
             std::cerr << "Failed reading file: " << _locSegment.file
                     << ".  Reading object: " << _docCount
                     << std::endl;
             exit(EXIT_FAILURE);
         }
+        _position += bsonSize;
         mongo::BSONObj tmpObj(_buffer.data());
-        *nextDoc = tmpObj.copy();
+        *nextDoc = _transform ? transformed(tmpObj).copy() : tmpObj.copy();
         return true;
     }
 
+    mongo::BSONObj InputFormatBson::transformed(const mongo::BSONObj& doc) {
+        _transformBuffer.reset();
+        mongo::BSONObjBuilder out(_transformBuffer);
+        if (!_transform->apply(doc, &out)) {
+            std::cerr << "Unable to coerce a field in file: " << _locSegment.file
+                    << ".  Reading object: " << _docCount << ".  Object: " << doc.toString()
+                    << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return out.done();
+    }
+
+    bool InputFormatBsonArena::next(mongo::BSONObj* nextDoc) {
+        if (_locSegment.end && _position >= _locSegment.end) return false;
+        ++_docCount;
+        //bsonspec.org defines the size of a bson object as 32 bit integer
+        int32_t bsonSize;
+        stream().read(reinterpret_cast<char*>(&bsonSize), sizeof(bsonSize));
+        if (stream().eof())
+            return false;
+        if (!stream()) {
+            std::cerr << "Failed reading file: " << _locSegment.file
+                    << ".  Reading size of object: " << _docCount
+                    << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        //TODO: Undefined, endian, see mongo/src/mongo/platform/endian.h
+        if (bsonSize > mongo::BSONObjMaxUserSize) {
+            std::cerr << "Size too large for object in file: " << _locSegment.file
+                    << ".  Reading object: " << _docCount << ".  Size: " << bsonSize
+                    << std::endl;
+            exit(EXIT_FAILURE);
+        } else if (bsonSize < 5) {
+            std::cerr << "Size too small for object in file: " << _locSegment.file
+                    << ".  Reading object: " << _docCount << ".  Size: " << bsonSize
+                    << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        //Transformed documents are copied into the arena once they are built
+        char* data = _transform ? nullptr : _arena.allocate(bsonSize);
+        if (!data) {
+            _largeDoc.resize(bsonSize);
+            data = _largeDoc.data();
+        }
+        std::memcpy(data, &bsonSize, sizeof(bsonSize));
+        stream().read(data + sizeof(bsonSize), bsonSize - sizeof(bsonSize));
+        if (!stream()) {
+            std::cerr << "Failed reading file: " << _locSegment.file
+                    << ".  Reading object: " << _docCount
+                    << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        _position += bsonSize;
+        *nextDoc = mongo::BSONObj(data);
+        if (_transform) *nextDoc = _arena.copy(transformed(*nextDoc));
+        else if (data == _largeDoc.data()) *nextDoc = nextDoc->getOwned();
+        return true;
+    }
 
 }  //namespace loader
@@ -6,12 +6,23 @@
  */
 #pragma once
 
+#include <assert.h>
+#include <cctype>
 #include <fstream>
 #include <functional>
 #include <memory>
+#include <string>
+#include <vector>
 #include "factory.h"
+#include "bson_arena.h"
+#include "csv_scan.h"
+#include "csv_schema.h"
+#include "gzip_stream.h"
+#include "json_scan.h"
+#include "line_scan.h"
 #include "mongo_cxxdriver.h"
 #include "parserapidjsonevents.h"
+#include "read_ahead.h"
 #include "tools.h"
 
 namespace loader {
@@ -35,6 +46,28 @@ namespace loader {
     using InputFormatFactory = tools::RegisterFactory<InputFormatPointer,
             CreateInputFormatFunction>;
 
+    /**
+     * Records that didn't parse, for the formats that can skip them and go on
+     */
+    struct ParseErrors {
+        //Only the first errors are kept, every error is counted
+        static constexpr size_t KEPT = 100;
+
+        struct Error {
+            std::string file;
+            size_t offset;
+            std::string message;
+        };
+
+        std::vector<Error> errors;
+        unsigned long long count{};
+
+        void add(const std::string& file, size_t offset, std::string message) {
+            if (errors.size() < KEPT) errors.push_back(Error {file, offset, std::move(message)});
+            ++count;
+        }
+    };
+
     /*
      * Public interface for the extraction of documents from sources.
      * bool next(mongo::BSONObj* nextDoc) is used to allow for the greatest variety of input sources
@@ -56,6 +89,109 @@ namespace loader {
          * this is called.
          */
         virtual size_t pos() = 0;
+
+        /**
+         * @return true if a single file can be broken into multiple segments
+         */
+        virtual bool splittable() const { return false; }
+
+        /**
+         * Appends segments of roughly segmentSize bytes covering the file to mapping.
+         * The last segment always has an end of 0 (run to the end).
+         * The default cuts at fixed offsets, the reader is expected to resync in reset.
+         */
+        virtual void segment(const tools::fileinfo& file, unsigned long long segmentSize,
+                             tools::LocSegMapping* mapping);
+
+        /**
+         * @return true if a segment in progress can be cut at any byte offset, i.e. the reader
+         * resyncs itself on reset
+         */
+        virtual bool splitAnywhere() const { return false; }
+
+        /**
+         * Moves the end of the segment being read so the rest can be handed to another reader.
+         * Only valid if splitAnywhere() and end is past pos()
+         */
+        virtual void segmentEndSet(long long end) { assert(false); }
+
+        /**
+         * Sets the top level fields whose elements keyFields() returns, i.e. the shard key
+         */
+        virtual void keyFieldsSet(const mongo::BSONObj& keys);
+
+        /**
+         * Gets the key field elements of the last document from next() in key order, eoo if
+         * missing.  The default finds them in one walk of the document without building an
+         * object; formats that see the fields as they are read record them instead.
+         * @param elements must hold a slot for each key field
+         */
+        virtual void keyFields(const mongo::BSONObj& doc, mongo::BSONElement* elements) const {
+            doc.getFields(_keyFieldNames.size(), const_cast<const char**>(_keyFieldNames.data()),
+                          elements);
+        }
+
+        /**
+         * @param buffers number of buffers to read ahead of the parser, 0 for synchronous reads.
+         * Only formats reading files directly use it.
+         */
+        void readAheadSet(size_t buffers) {
+            _readAheadBuffers = buffers;
+        }
+
+        /**
+         * @return true if the format can read from a stream, i.e. stdin, using records() and
+         * resetBuffer()
+         */
+        virtual bool streamable() const { return false; }
+
+        /**
+         * Used to cut a stream into buffers that only hold whole records.
+         * @param endOfStream true if nothing follows data, so a final record can end there
+         * @return the length of the prefix of data that holds whole records
+         */
+        virtual size_t records(const char* data, size_t size, bool endOfStream) const {
+            assert(false);
+            return 0;
+        }
+
+        /**
+         * Reads documents from a buffer from records() instead of a file segment.
+         * The buffer must stay valid until the next reset
+         */
+        virtual void resetBuffer(const char* data, size_t size) { assert(false); }
+
+        /**
+         * Sets the field transform documents are put through as they are read, nullptr for
+         * none.  The transform must outlive the format.  Key fields are by output name.
+         */
+        virtual void transformSet(const FieldTransform* transform) {
+            _transform = transform && !transform->empty() ? transform : nullptr;
+        }
+
+        /**
+         * Sets the columns of delimited input, other formats ignore it.  The schema must
+         * outlive the format.
+         */
+        virtual void schemaSet(const CsvSchema* schema) { }
+
+        /**
+         * Records that don't parse are added to errors and skipped instead of stopping the load,
+         * by the formats that can find the next record (json, jsonmmap, csv and tsv).  The
+         * others still stop.  nullptr to stop on errors.
+         */
+        void errorsSet(ParseErrors* errors) {
+            _errors = errors;
+        }
+
+    protected:
+        size_t _readAheadBuffers{};
+        const FieldTransform* _transform{};
+        ParseErrors* _errors{};
+
+    private:
+        std::vector<std::string> _keyFields;
+        std::vector<const char*> _keyFieldNames;
     };
 
     /**
@@ -67,27 +203,245 @@ namespace loader {
         virtual void reset(tools::LocSegment segment);
         virtual bool next(mongo::BSONObj* nextDoc);
         virtual size_t pos() {
-            return _infile.tellg();
+            return _lines.position();
+        }
+        virtual bool splittable() const { return true; }
+        virtual bool splitAnywhere() const { return true; }
+        virtual void segmentEndSet(long long end) {
+            _locSegment.end = end;
+        }
+        virtual void keyFieldsSet(const mongo::BSONObj& keys) {
+            _events.captureFieldsSet(keys);
+        }
+        virtual void keyFields(const mongo::BSONObj& doc, mongo::BSONElement* elements) const {
+            _events.capturedFields(doc, elements);
+        }
+        virtual void transformSet(const FieldTransform* transform) {
+            AbstractFileInputFormat::transformSet(transform);
+            _events.transformSet(_transform);
         }
+        virtual bool streamable() const { return true; }
+        virtual size_t records(const char* data, size_t size, bool endOfStream) const;
+        virtual void resetBuffer(const char* data, size_t size);
 
         static InputFormatPointer create() {
             return InputFormatPointer(new InputFormatJson());
         }
 
+    protected:
+        /**
+         * Opens the segment's file positioned at the segment begin
+         */
+        virtual void openInput();
+
+        /**
+         * @return the stream lines are read from
+         */
+        virtual std::istream& input() {
+            return _infile;
+        }
+
+        /**
+         * @return the stream offset the input starts at, positions are relative to this
+         */
+        virtual long long inputPosition() {
+            return _locSegment.begin;
+        }
+
+        /**
+         * @return true if the next line starts after the segment end
+         */
+        virtual bool segmentEnded() {
+            return _locSegment.end && (_lines.position() > _locSegment.end);
+        }
+
+        tools::LocSegment _locSegment;
+        tools::LineReader _lines;
+
     private:
-        std::ifstream _infile;
-        std::string _line;
+        tools::ReadAheadInputStream _infile;
+        tools::MemoryInputStream _memoryInput;
         rapidjson::Reader _reader;
         //line number is one indexed
         unsigned long long _lineNumber{};
-        tools::LocSegment _locSegment;
 
         const static bool _registerFactory;
 
         ParseRapidJsonEvents _events;
-        size_t _bufferSize{};
+        tools::BsonArena _arena;
+    };
+
+    /**
+     * rapidjson input stream over a buffer that isn't null terminated (i.e. a mapped file).
+     * Peek returns '\0' at the end of the buffer so the parser never reads past it.
+     */
+    struct BufferStream {
+        typedef char Ch;
+
+        BufferStream(const Ch* src, size_t size) : _src(src), _begin(src), _end(src + size) { }
+
+        Ch Peek() const { return _src == _end ? '\0' : *_src; }
+        Ch Take() { return _src == _end ? '\0' : *_src++; }
+        size_t Tell() const { return static_cast<size_t>(_src - _begin); }
+
+        Ch* PutBegin() { assert(false); return 0; }
+        void Put(Ch) { assert(false); }
+        void Flush() { assert(false); }
+        size_t PutEnd(Ch*) { assert(false); return 0; }
+
+    private:
+        const Ch* _src;
+        const Ch* _begin;
+        const Ch* _end;
+    };
+
+    /**
+     * Base of the formats that read a memory mapped file.  The segment begin/end semantics are
+     * the same as InputFormatJson, a segment that begins mid file resyncs at the next line.
+     */
+    class InputFormatMmap : public AbstractFileInputFormat {
+    public:
+        virtual ~InputFormatMmap();
+        virtual void reset(tools::LocSegment segment);
+        virtual size_t pos() {
+            return _mapOffset + (_pos - _map);
+        }
+        virtual bool splittable() const { return true; }
+        virtual bool splitAnywhere() const { return true; }
+        virtual void segmentEndSet(long long end) {
+            _segmentEnd = _map + (end - _mapOffset);
+        }
+
+    protected:
+        //line number is one indexed
+        unsigned long long _lineNumber{};
+        tools::LocSegment _locSegment;
+        //The mapping starts at the page holding the segment begin, not the start of the file
+        const char* _map{};
+        size_t _mapSize{};
+        size_t _mapOffset{};
+        const char* _pos{};
+        const char* _segmentEnd{};
+        const char* _fileEnd{};
+        tools::BsonArena _arena;
+
+        void unmap();
+
+        /**
+         * Maps the file of the segment, _pos is at its begin and _segmentEnd at its end
+         */
+        void map(tools::LocSegment segment);
+    };
+
+    /**
+     * Reads JSON from a memory mapped file.
+     * Lines are found in place and handed to the parser without being copied.
+     */
+    class InputFormatJsonMmap : public InputFormatMmap {
+    public:
+        InputFormatJsonMmap() { };
+        virtual bool next(mongo::BSONObj* nextDoc);
+        virtual void keyFieldsSet(const mongo::BSONObj& keys) {
+            _events.captureFieldsSet(keys);
+        }
+        virtual void keyFields(const mongo::BSONObj& doc, mongo::BSONElement* elements) const {
+            _events.capturedFields(doc, elements);
+        }
+        virtual void transformSet(const FieldTransform* transform) {
+            AbstractFileInputFormat::transformSet(transform);
+            _events.transformSet(_transform);
+        }
+
+        static InputFormatPointer create() {
+            return InputFormatPointer(new InputFormatJsonMmap());
+        }
+
+    protected:
+        rapidjson::Reader _reader;
+        ParseRapidJsonEvents _events;
+
+    private:
+        const static bool _registerFactory;
+    };
+
+    /**
+     * Reads a file holding one JSON array of documents, i.e. an export, from a memory map.
+     * Elements are parsed one at a time in place, so the file never has to fit in memory.
+     * Segments start on element boundaries found by a structural scan of the file, the pieces
+     * of a file are scanned at once (see tools::JsonScan).
+     */
+    class InputFormatJsonArray : public InputFormatJsonMmap {
+    public:
+        virtual void reset(tools::LocSegment segment);
+        virtual bool next(mongo::BSONObj* nextDoc);
+        virtual bool splitAnywhere() const { return false; }
+        virtual void segment(const tools::fileinfo& file, unsigned long long segmentSize,
+                             tools::LocSegMapping* mapping);
+
+        static InputFormatPointer create() {
+            return InputFormatPointer(new InputFormatJsonArray());
+        }
 
-        size_t buffersize() { return _bufferSize; }
+    private:
+        const static bool _registerFactory;
+
+        void skipSpace() {
+            while (_pos < _fileEnd && std::isspace(static_cast<unsigned char>(*_pos)))
+                ++_pos;
+        }
+    };
+
+    /**
+     * Reads delimited records, CSV or TSV, from a memory mapped file and builds each document
+     * straight from the fields.  Records are split with tools::CsvScan.  A segment beginning mid
+     * file resyncs at the next line, so a quoted field with a newline in it can't straddle a
+     * segment boundary.  Blank unquoted fields are left out of the document.
+     */
+    class InputFormatCsv : public InputFormatMmap {
+    public:
+        explicit InputFormatCsv(char delimiter) :
+            _scan(delimiter, delimiter != '\t'), _buffer(4096) { }
+        virtual void reset(tools::LocSegment segment);
+        virtual bool next(mongo::BSONObj* nextDoc);
+        virtual void transformSet(const FieldTransform* transform) {
+            AbstractFileInputFormat::transformSet(transform);
+            _columnsFile.clear();
+        }
+        virtual void schemaSet(const CsvSchema* schema) {
+            _schema = schema;
+            _columnsFile.clear();
+        }
+
+        static InputFormatPointer createCsv() {
+            return InputFormatPointer(new InputFormatCsv(','));
+        }
+
+        static InputFormatPointer createTsv() {
+            return InputFormatPointer(new InputFormatCsv('\t'));
+        }
+
+    private:
+        const static bool _registerFactoryCsv;
+        const static bool _registerFactoryTsv;
+
+        tools::CsvScan _scan;
+        const CsvSchema* _schema{};
+        //The columns with the transform applied, and the file they were read for
+        std::vector<CsvSchema::Column> _columns;
+        std::string _columnsFile;
+        std::vector<tools::CsvScan::Field> _fields;
+        std::string _unquoted;
+        mongo::BufBuilder _buffer;
+
+        /**
+         * Sets _columns from the schema or the file's header
+         */
+        void columnsRead();
+
+        /**
+         * @return the text of a field with its quotes taken off
+         */
+        mongo::StringData text(const tools::CsvScan::Field& field);
     };
 
     /**
@@ -95,30 +449,166 @@ namespace loader {
      */
     class InputFormatBson : public AbstractFileInputFormat {
     public:
-        InputFormatBson() : _buffer(mongo::BSONObjMaxUserSize) {};
+        InputFormatBson() : InputFormatBson(mongo::BSONObjMaxUserSize) {};
         virtual void reset(tools::LocSegment segment);
         virtual bool next(mongo::BSONObj* nextDoc);
         virtual size_t pos() {
-            return _infile.tellg();
+            return _position;
         }
+        virtual bool splittable() const { return true; }
+        virtual bool streamable() const { return true; }
+        virtual size_t records(const char* data, size_t size, bool endOfStream) const;
+        virtual void resetBuffer(const char* data, size_t size);
+
+        /**
+         * Walks the document length prefixes so that every segment starts on a document.
+         */
+        virtual void segment(const tools::fileinfo& file, unsigned long long segmentSize,
+                             tools::LocSegMapping* mapping);
 
         static InputFormatPointer create() {
             return InputFormatPointer(new InputFormatBson());
         }
 
+    protected:
+        /**
+         * @param bufferSize size of the per document read buffer
+         */
+        explicit InputFormatBson(size_t bufferSize) : _buffer(bufferSize) {};
+
+        /**
+         * Opens the segment's file positioned at the segment begin
+         */
+        virtual void openInput();
+
+        /**
+         * @return the stream documents are read from
+         */
+        virtual std::istream& input() {
+            return _infile;
+        }
+
+        /**
+         * @return the stream documents are currently read from, input() or a buffer
+         */
+        std::istream& stream() {
+            return *_stream;
+        }
+
+        /**
+         * @return doc put through the transform, valid until the next call.  Exits if a field
+         * can't be coerced.
+         */
+        mongo::BSONObj transformed(const mongo::BSONObj& doc);
+
+        tools::LocSegment _locSegment;
+        unsigned long long _docCount{};
+        //Byte offset of the next document, tracked so tellg isn't needed per document
+        long long _position{};
+
     private:
-        std::ifstream _infile;
+        mongo::BufBuilder _transformBuffer;
+        std::istream* _stream{};
+        tools::MemoryInputStream _memoryInput;
+        tools::ReadAheadInputStream _infile;
         std::string _line;
-        unsigned long long _docCount{};
-        tools::LocSegment _locSegment;
         std::vector<char> _buffer;
 
         const static bool _registerFactory;
+    };
 
-        ParseRapidJsonEvents _events;
-        size_t _bufferSize{};
+    /**
+     * Reads JSON from a gzip file.
+     * bgzip files are split on block boundaries so that a single file can feed multiple threads.
+     * Other gzip files are read by a single thread.
+     */
+    class InputFormatJsonGzip : public InputFormatJson {
+    public:
+        virtual bool next(mongo::BSONObj* nextDoc);
+        //Positions are uncompressed offsets, segments are compressed block offsets
+        virtual bool splitAnywhere() const { return false; }
+        virtual bool streamable() const { return false; }
+
+        virtual void segment(const tools::fileinfo& file, unsigned long long segmentSize,
+                             tools::LocSegMapping* mapping);
+
+        static InputFormatPointer create() {
+            return InputFormatPointer(new InputFormatJsonGzip());
+        }
+
+    protected:
+        virtual void openInput();
+
+        virtual std::istream& input() {
+            return _gzfile;
+        }
+
+        //Positions are uncompressed bytes from the segment begin
+        virtual long long inputPosition() {
+            return 0;
+        }
+
+        /**
+         * Segment ends are compressed offsets, so the uncompressed position is checked against
+         * where the end block starts once that is known
+         */
+        virtual bool segmentEnded() {
+            return _locSegment.end && _gzfile.buf().endReached()
+                    && (unsigned long long)(_lines.position()) > _gzfile.buf().endPosition();
+        }
+
+    private:
+        tools::GzipInputStream _gzfile;
+
+        const static bool _registerFactory;
+    };
+
+    /**
+     * Reads BSON from a file straight into arena blocks, there is no copy or allocation per
+     * document.  Blocks are recycled once the documents in them have been sent.
+     */
+    class InputFormatBsonArena : public InputFormatBson {
+    public:
+        InputFormatBsonArena() : InputFormatBson(0) { }
+        virtual bool next(mongo::BSONObj* nextDoc);
+
+        static InputFormatPointer create() {
+            return InputFormatPointer(new InputFormatBsonArena());
+        }
+
+    private:
+        tools::BsonArena _arena;
+        //Documents too large for an arena block, or to be transformed, are read here and copied
+        std::vector<char> _largeDoc;
+
+        const static bool _registerFactory;
+    };
 
-        size_t buffersize() { return _bufferSize; }
+    /**
+     * Reads BSON from a gzip file.
+     * Documents span gzip blocks so the files cannot be split.
+     */
+    class InputFormatBsonGzip : public InputFormatBson {
+    public:
+        virtual bool next(mongo::BSONObj* nextDoc);
+        virtual bool splittable() const { return false; }
+        virtual bool streamable() const { return false; }
+
+        static InputFormatPointer create() {
+            return InputFormatPointer(new InputFormatBsonGzip());
+        }
+
+    protected:
+        virtual void openInput();
+
+        virtual std::istream& input() {
+            return _gzfile;
+        }
+
+    private:
+        tools::GzipInputStream _gzfile;
+
+        const static bool _registerFactory;
     };
 
 }  //namespace loader
@@ -13,82 +13,208 @@
  *    limitations under the License.
  */
 
+#include <algorithm>
+#include <fstream>
 #include <regex>
+#include <typeinfo>
+#include <cerrno>
+#include <cstring>
 #include <boost/filesystem.hpp>
+#include <fcntl.h>
+#include <unistd.h>
 #include "input_processor.h"
 #include "loader.h"
+#include "placement.h"
+#include "trace.h"
 #include "util/hasher.h"
 
 namespace loader {
 
-    void FileInputProcessor::run() {
+    std::deque<tools::fileinfo> FileInputProcessor::listFiles(const std::string& loadDir,
+                                                              const std::string& fileRegex,
+                                                              unsigned long long* totalSize) {
         //Ensure the directory exists
-        if (!is_directory(boost::filesystem::path(_loadDir))) {
-            std::cerr << "loadPath is required to be a directory. loadPath: " << _loadDir
+        if (!is_directory(boost::filesystem::path(loadDir))) {
+            std::cerr << "loadPath is required to be a directory. loadPath: " << loadDir
                       << std::endl;
             exit(EXIT_FAILURE);
         }
 
-        /*
-         * Initial setup.  Getting all the files that are going to put into the mognoDs.
-         * If we files that are larger than bytes per thread, break them down and into smaller
-         * segments
-         */
         using namespace boost::filesystem;
         std::deque<tools::fileinfo> files;
-        path loadDir(_loadDir);
-        std::regex fileRegex(_fileRegex);
-        unsigned long long totalSize{};
-        for (directory_iterator ditr {loadDir}; ditr != directory_iterator {}; ditr++) {
+        std::regex regex(fileRegex);
+        *totalSize = 0;
+        for (directory_iterator ditr {path(loadDir)}; ditr != directory_iterator {}; ditr++) {
             std::string filename = ditr->path().string();
             if (!is_regular_file(ditr->path())
-                || (_fileRegex.length() && !std::regex_match(filename, fileRegex))) continue;
+                || (fileRegex.length() && !std::regex_match(filename, regex))) continue;
             size_t filesize = boost::filesystem::file_size(filename);
             files.emplace_back(filename, filesize);
-            totalSize += filesize;
+            *totalSize += filesize;
         }
         //Ensure that there are files for us to process
         if (!files.size()) {
             std::cerr << "No files to load at: " << loadDir;
-            if (_fileRegex.size())
-                std::cerr << "\nRegex: " << _fileRegex;
+            if (fileRegex.size())
+                std::cerr << "\nRegex: " << fileRegex;
             std::cerr << std::endl;
             exit(EXIT_SUCCESS);
         }
-        /*
-         * Crucial this is sorted and not changed past this point.  _locSetMapping is used as an
-         * index and it can also have std::sort called against it to find the index of a file name.
-         *
-         * The various queue stages that need to look up a file index by name or name by index use
-         * this and expect to use this as the source of truth for file->index mapping.
-         */
         std::sort(files.begin(), files.end());
-        _locSegMapping.reserve(files.size());
-        if (allowInputSplits()) {
-            unsigned long long sizePerThread = totalSize / _threads;
+        return files;
+    }
+
+    std::vector<mongo::BSONObj> FileInputProcessor::sampleKeys(const std::string& loadDir,
+                                                               const std::string& fileRegex,
+                                                               const std::string& inputType,
+                                                               const mongo::BSONObj& keys,
+                                                               size_t samples,
+                                                               const FieldTransform* transform,
+                                                               const CsvSchema* schema) {
+        //Documents read in a row, more segments spread the sample better but cost seeks
+        const size_t docsPerSegment = 64;
+        unsigned long long totalSize;
+        std::deque<tools::fileinfo> files = listFiles(loadDir, fileRegex, &totalSize);
+        tools::LocSegMapping segments;
+        InputFormatPointer format = InputFormatFactory::createObject(inputType);
+        format->transformSet(transform);
+        format->schemaSet(schema);
+        unsigned long long sampleSegments = samples / docsPerSegment + 1;
+        for (auto&& file : files) {
+            unsigned long long fileSegments = std::max(1ULL,
+                    sampleSegments * file.size / std::max(totalSize, 1ULL));
+            //Unsplittable files can only be sampled from the start
+            if (format->splittable() && fileSegments > 1)
+                format->segment(file, file.size / fileSegments, &segments);
+            else
+                segments.emplace_back(file.name, 0, 0);
+        }
+        std::vector<mongo::BSONObj> sample;
+        for (auto&& segment : segments) {
+            format->reset(segment);
+            mongo::BSONObj doc;
+            for (size_t docs = 0; docs < docsPerSegment && format->next(&doc); ++docs) {
+                mongo::BSONObj key = doc.extractFields(keys);
+                if (key.nFields() == keys.nFields()) sample.push_back(key.getOwned());
+                tools::BsonArena::release(doc);
+            }
+        }
+        return sample;
+    }
+
+    unsigned long long FileInputProcessor::sampleInput(const std::string& loadDir,
+                                                       const std::string& fileRegex,
+                                                       const std::string& inputType,
+                                                       unsigned long long bytes,
+                                                       const std::string& sampleDir) {
+        //Small shares of many files cost more in opens than they add in spread
+        const unsigned long long minShare = 1024 * 1024;
+        unsigned long long totalSize;
+        std::deque<tools::fileinfo> files = listFiles(loadDir, fileRegex, &totalSize);
+        InputFormatPointer format = InputFormatFactory::createObject(inputType);
+        unsigned long long share = std::max(minShare, bytes / files.size());
+        unsigned long long copied = 0;
+        std::vector<char> buffer;
+        for (size_t fileNumber = 0; fileNumber < files.size() && copied < bytes; ++fileNumber) {
+            const tools::fileinfo& file = files[fileNumber];
+            boost::filesystem::path source(file.name);
+            //The index keeps the sample files in the input order
+            std::string target = sampleDir + "/" + std::to_string(fileNumber) + "."
+                    + source.filename().string();
+            if (!format->streamable() || file.size <= share) {
+                boost::filesystem::copy_file(source, target,
+                                             boost::filesystem::copy_option::overwrite_if_exists);
+                copied += file.size;
+                continue;
+            }
+            std::ifstream input(file.name, std::ios_base::in | std::ios_base::binary);
+            size_t kept = 0;
+            //Grows until a whole record fits
+            for (size_t size = share; !kept; size = std::min<size_t>(size * 2, file.size)) {
+                buffer.resize(size);
+                input.seekg(0);
+                input.read(buffer.data(), size);
+                kept = format->records(buffer.data(), size_t(input.gcount()),
+                                       size == file.size);
+                if (size == file.size) break;
+            }
+            std::ofstream output(target, std::ios_base::out | std::ios_base::binary
+                                 | std::ios_base::trunc);
+            output.write(buffer.data(), kept);
+            if (!input || !output) {
+                std::cerr << "Unable to sample " << file.name << " into " << target << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            copied += kept;
+        }
+        return copied;
+    }
+
+    tools::LocSegMapping FileInputProcessor::segmentFiles(const std::deque<tools::fileinfo>& files,
+                                                           unsigned long long totalSize,
+                                                           const std::string& inputType,
+                                                           size_t threads) {
+        tools::LocSegMapping mapping;
+        mapping.reserve(files.size());
+        //The input format decides if and where a file can be split
+        InputFormatPointer inputFormat = InputFormatFactory::createObject(inputType);
+        if (inputFormat->splittable()) {
+            unsigned long long sizePerThread = totalSize / threads;
             for (auto&& filerec : files) {
                 /**
                  * If the size per thread is greater than an overage, split the file up into segments
                  */
                 if (filerec.size > sizePerThread + OVERAGE_SIZE) {
                     std::cout << "breaking: " << filerec.name << std::endl;
-                    size_t pos{};
-                    for (pos = 0; pos < filerec.size; pos += sizePerThread)
-                        _locSegMapping.emplace_back(filerec.name, pos, pos + sizePerThread);
-                    //always have a "to end" for every file for consistancy
-                    _locSegMapping.back().end = 0;
+                    inputFormat->segment(filerec, sizePerThread, &mapping);
                 }
                 else
-                    _locSegMapping.emplace_back(filerec.name, 0, 0);
+                    mapping.emplace_back(filerec.name, 0, 0);
             }
         } else {
             for (auto&& i : files)
-                _locSegMapping.emplace_back(i.name, 0, 0);
+                mapping.emplace_back(i.name, 0, 0);
         }
+        return mapping;
+    }
+
+    void FileInputProcessor::run() {
+        tools::SimpleTimer<> timerScan;
+        /*
+         * Initial setup.  Getting all the files that are going to put into the mognoDs.
+         * If we files that are larger than bytes per thread, break them down and into smaller
+         * segments
+         */
+        unsigned long long totalSize;
+        std::deque<tools::fileinfo> files = listFiles(_loadDir, _fileRegex, &totalSize);
+        _totalBytes = totalSize;
+        boost::filesystem::path loadDir(_loadDir);
+        /*
+         * Crucial this is sorted and not changed past this point.  _locSetMapping is used as an
+         * index and it can also have std::sort called against it to find the index of a file name.
+         *
+         * The various queue stages that need to look up a file index by name or name by index use
+         * this and expect to use this as the source of truth for file->index mapping.
+         */
+        _locSegMapping = segmentFiles(files, totalSize, _inputType, _threads);
 
         //Insert the segments into the queue for the threads to consume
-        LocSegmentQueue::ContainerType fileQ(_locSegMapping.begin(), _locSegMapping.end());
+        LocSegmentQueue::ContainerType fileQ;
+        const Journal* journal = _owner->journal();
+        for (size_t i = 0; i < _locSegMapping.size(); ++i) {
+            //A resumed load only reads what the journal doesn't have as finished
+            if (journal && journal->resuming()) {
+                const tools::LocSegment& segment = _locSegMapping[i];
+                for (auto&& piece : journal->remaining(segment,
+                        boost::filesystem::file_size(segment.file)))
+                    fileQ.emplace_back(i, std::move(piece));
+            }
+            else fileQ.emplace_back(i, _locSegMapping[i]);
+        }
+        _queuedSegments = fileQ.size();
         _locSegmentQueue.swap(fileQ);
+        timerScan.stop();
+        _scanSeconds = timerScan.nanos() / 1e9;
 
         std::cout << "Dir: " << loadDir << "\nSegments: " << _locSegmentQueue.size()
                   << "\nKicking off run" << std::endl;
@@ -96,10 +222,11 @@ namespace loader {
         /*
          * Start up the threads to read in the files
          */
-        size_t inputThreads = _threads > _locSegmentQueue.size() ? _locSegmentQueue.size()
-                : _threads;
+        size_t inputThreads = std::max<size_t>(1, _threads > _locSegmentQueue.size()
+                ? _locSegmentQueue.size() : _threads);
 
-        _tpInput.reset(new tools::ThreadPool(inputThreads));
+        _activeThreads = inputThreads;
+        _tpInput.reset(new tools::ThreadPool(inputThreads, tools::Placement::pin));
         for (size_t i = 0; i < inputThreads; i++)
             _tpInput->queue([this]() {this->threadProcessSegment();});
         _tpInput->endWaitInitiate();
@@ -107,35 +234,241 @@ namespace loader {
     }
 
     void FileInputProcessor::threadProcessSegment() {
-        SegmentProcessor lsp(_owner, _ns, _owner->settings().inputType);
-        tools::LocSegment segment;
-        for (;;) {
-            if (!_locSegmentQueue.pop(segment)) break;
-            auto itr = std::find(_locSegMapping.begin(), _locSegMapping.end(), segment);
-            assert(itr != _locSegMapping.end());
-            lsp.processSegmentToBatch(segment, std::distance(_locSegMapping.begin(), itr));
+        SegmentProcessor lsp(_owner, _ns, _owner->settings().inputType, this);
+        Journal* journal = _owner->segmentJournal();
+        QueuedSegment work;
+        while (nextSegment(&work)) {
+            //The segment is journaled once every batch holding its documents is written
+            Journal::Token token;
+            if (journal) {
+                token = journal->start(std::string());
+                Journal::currentSet(token);
+            }
+            lsp.processSegmentToBatch(std::move(work.second), work.first);
+            if (token) {
+                token->recordSet(Journal::segmentRecord(lsp.segment()));
+                Journal::currentSet(nullptr);
+            }
             ++_processedSegments;
         }
     }
 
+    bool FileInputProcessor::nextSegment(QueuedSegment* work) {
+        tools::MutexUniqueLock lock(_idleMutex);
+        if (_locSegmentQueue.pop(*work)) return true;
+        if (--_activeThreads == 0) _idleNotify.notify_all();
+        ++_idleThreads;
+        _idleNotify.wait(lock, [this]() {
+            return !this->_locSegmentQueue.empty() || !this->_activeThreads;});
+        --_idleThreads;
+        if (!_locSegmentQueue.pop(*work)) return false;
+        ++_activeThreads;
+        return true;
+    }
+
+    bool FileInputProcessor::pushSplit(tools::LocSegment tail, tools::LogicalLoc logicalLoc,
+                                       const std::function<void()>& cutSegment)
+    {
+        tools::MutexLockGuard lock(_idleMutex);
+        //Another thread may have already fed the idle threads, all pushes hold _idleMutex
+        if (_idleThreads <= _locSegmentQueue.size()
+            || _locSegmentQueue.size() >= _locSegmentQueue.capacity()) return false;
+        cutSegment();
+        _locSegmentQueue.push(QueuedSegment(logicalLoc, std::move(tail)));
+        ++_splitSegments;
+        _idleNotify.notify_one();
+        return true;
+    }
+
     void FileInputProcessor::wait() {
         _tpInput->joinAll();
         //Make sure that all segments have been processed, invariant
-        if (_processedSegments != _locSegMapping.size()) {
+        if (_processedSegments != _queuedSegments + _splitSegments) {
             std::cerr << "Error: not all segments processed. Total segments: "
-                    << _locSegMapping.size() << "; Processed: " << _processedSegments
-                    << "; Exiting" << std::endl;
+                    << _queuedSegments + _splitSegments << "; Processed: "
+                    << _processedSegments << "; Exiting" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    StreamInputProcessor::StreamInputProcessor(Loader* owner, size_t threads,
+                                               std::string inputType, std::string streamPath,
+                                               tools::mtools::MongoCluster::NameSpace ns) :
+            _owner(owner), _threads(threads), _inputType(std::move(inputType)),
+            _streamPath(std::move(streamPath)), _ns(std::move(ns)),
+            //Enough buffers that every parse thread can have one while the next are read
+            _free(threads * 2 + 1), _full(threads * 2 + 1)
+    { }
+
+    StreamInputProcessor::~StreamInputProcessor() {
+        if (_fd > 0) close(_fd);
+    }
+
+    bool StreamInputProcessor::isStream(const std::string& path) {
+        return path == STDIN_PATH
+                || boost::filesystem::status(path).type() == boost::filesystem::fifo_file;
+    }
+
+    void StreamInputProcessor::run() {
+        if (!InputFormatFactory::createObject(_inputType)->streamable()) {
+            std::cerr << "Input type " << _inputType << " cannot be read from a stream"
+                    << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        _fd = _streamPath == STDIN_PATH ? STDIN_FILENO : open(_streamPath.c_str(), O_RDONLY);
+        if (_fd == -1) {
+            std::cerr << "Unable to open stream: " << _streamPath << ".  " << strerror(errno)
+                    << std::endl;
             exit(EXIT_FAILURE);
         }
+        for (size_t i = 0; i < _threads * 2 + 1; ++i) {
+            _buffers.emplace_back(new Buffer());
+            _buffers.back()->data.resize(BUFFER_SIZE);
+            _free.push(_buffers.back().get());
+        }
+        std::cout << "Stream: " << _streamPath << "\nKicking off run" << std::endl;
+        //One thread reads, the rest parse
+        _tpInput.reset(new tools::ThreadPool(_threads + 1, tools::Placement::pin));
+        _tpInput->queue([this]() {this->threadRead();});
+        for (size_t i = 0; i < _threads; ++i)
+            _tpInput->queue([this]() {this->threadProcessBuffers();});
+        _tpInput->endWaitInitiate();
+    }
+
+    void StreamInputProcessor::threadRead() {
+        InputFormatPointer format = InputFormatFactory::createObject(_inputType);
+        //Partial record at the end of the last buffer
+        std::vector<char> carry;
+        bool endOfStream = false;
+        while (!endOfStream) {
+            Buffer* buffer;
+            _free.pop(buffer);
+            std::copy(carry.begin(), carry.end(), buffer->data.begin());
+            buffer->size = carry.size();
+            size_t records = 0;
+            for (;;) {
+                while (buffer->size < buffer->data.size()) {
+                    ssize_t count = read(_fd, buffer->data.data() + buffer->size,
+                                         buffer->data.size() - buffer->size);
+                    if (count < 0 && errno == EINTR) continue;
+                    if (count < 0) {
+                        std::cerr << "Failed reading stream: " << _streamPath << ".  "
+                                << strerror(errno) << std::endl;
+                        exit(EXIT_FAILURE);
+                    }
+                    if (!count) {
+                        endOfStream = true;
+                        break;
+                    }
+                    buffer->size += count;
+                    _bytesRead += count;
+                }
+                records = format->records(buffer->data.data(), buffer->size, endOfStream);
+                if (records || endOfStream) break;
+                //A record larger than the buffer
+                buffer->data.resize(buffer->data.size() * 2);
+            }
+            carry.assign(buffer->data.begin() + records, buffer->data.begin() + buffer->size);
+            buffer->size = records;
+            if (records) _full.push(std::move(buffer));
+            else _free.push(std::move(buffer));
+        }
+        _full.endWait();
+    }
+
+    void StreamInputProcessor::threadProcessBuffers() {
+        SegmentProcessor lsp(_owner, _ns, _inputType);
+        Buffer* buffer;
+        while (_full.pop(buffer)) {
+            lsp.processBufferToBatch(buffer->data.data(), buffer->size);
+            _free.push(std::move(buffer));
+        }
+    }
+
+    void StreamInputProcessor::wait() {
+        _tpInput->joinAll();
+        std::cout << "Stream read: " << _bytesRead / 1024 / 1024 << "MB" << std::endl;
+    }
+
+    ClusterInputProcessor::ClusterInputProcessor(Loader* owner, size_t threads,
+                                                 std::string sourceConn, size_t shardThreads,
+                                                 tools::mtools::MongoCluster::NameSpace ns) :
+            _owner(owner), _threads(threads), _sourceConn(std::move(sourceConn)),
+            _shardThreads(std::max<size_t>(shardThreads, 1)), _ns(std::move(ns))
+    { }
+
+    void ClusterInputProcessor::run() {
+        tools::mtools::MongoCluster source(_sourceConn);
+        const tools::mtools::MongoCluster::MetaNameSpace* coll = source.collection(_ns);
+        if (!source.isSharded() || !coll || !source.chunksCount(_ns)) {
+            std::cerr << _ns << " is not sharded in the source cluster: " << _sourceConn
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        _key = coll->key;
+        _ranges.reset(new tools::mtools::ChunkRanges(source, _ns, _shardThreads));
+        size_t threads = std::min(_threads, _ranges->shards() * _ranges->shardThreads());
+        std::cout << "Cloning " << _ns << " from " << _sourceConn << ": " << _ranges->size()
+                  << " chunks on " << _ranges->shards() << " shards\nKicking off run"
+                  << std::endl;
+        _tpInput.reset(new tools::ThreadPool(threads, tools::Placement::pin));
+        for (size_t i = 0; i < threads; ++i)
+            _tpInput->queue([this]() {this->threadProcessRanges();});
+        _tpInput->endWaitInitiate();
+    }
+
+    void ClusterInputProcessor::threadProcessRanges() {
+        SegmentProcessor lsp(_owner, _ns, "bson");
+        //A connection per source shard, made as ranges on it come up
+        std::unordered_map<tools::mtools::MongoCluster::ShardName,
+                           std::unique_ptr<mongo::DBClientBase>> conns;
+        std::vector<char> buffer;
+        buffer.reserve(BUFFER_SIZE);
+        Range range;
+        while (_ranges->next(&range)) {
+            std::unique_ptr<mongo::DBClientBase>& conn = conns[range.shard];
+            if (!conn) conn.reset(tools::mtools::ChunkRanges::connect(range));
+            readRange(range, conn.get(), &lsp, &buffer);
+            _ranges->done(range);
+        }
+    }
+
+    void ClusterInputProcessor::readRange(const Range& range, mongo::DBClientBase* conn,
+                                          SegmentProcessor* lsp, std::vector<char>* buffer)
+    {
+        mongo::Cursor cur = tools::mtools::ChunkRanges::query(conn, _ns, _key, range);
+        buffer->clear();
+        while (cur->more()) {
+            mongo::BSONObj doc = cur->nextSafe();
+            size_t size = doc.objsize();
+            if (!buffer->empty() && buffer->size() + size > BUFFER_SIZE) {
+                lsp->processBufferToBatch(buffer->data(), buffer->size());
+                buffer->clear();
+            }
+            buffer->insert(buffer->end(), doc.objdata(), doc.objdata() + size);
+            ++_docsRead;
+            _bytesRead += size;
+        }
+        if (!buffer->empty()) lsp->processBufferToBatch(buffer->data(), buffer->size());
+    }
+
+    void ClusterInputProcessor::wait() {
+        _tpInput->joinAll();
+        std::cout << "Cloned: " << _docsRead << " docs, " << _bytesRead / 1024 / 1024 << "MB"
+                  << std::endl;
     }
 
     //TODO::clean this up and not pass owner
-    SegmentProcessor::SegmentProcessor(Loader* owner, std::string ns, const std::string& fileType) :
+    SegmentProcessor::SegmentProcessor(Loader* owner, std::string ns, const std::string& fileType,
+                                       FileInputProcessor* splitter) :
             _owner(owner),
+            _splitter(splitter),
             _ns(std::move(ns)),
             _add_id(_owner->settings().indexHas_id && _owner->settings().add_id),
+            _idRequired(_owner->settings().resume && !_owner->settings().indexHas_id),
             _keys(_owner->settings().shardKeysBson),
             _keyFieldsCount(_keys.nFields()),
+            _hashed(_owner->settings().hashed),
             _inputAggregator(_owner->queueSettings(),
                              owner->cluster(),
                              &owner->chunkDispatcher(),
@@ -143,6 +476,47 @@ namespace loader {
             _docLogicalLoc{}
     {
         _input = InputFormatFactory::createObject(fileType);
+        _input->keyFieldsSet(_keys);
+        _input->transformSet(&_owner->settings().transform);
+        _input->schemaSet(&_owner->settings().csvSchema);
+        _input->readAheadSet(_owner->settings().readAheadBuffers);
+        _keyElements.resize(_keyFieldsCount);
+        _process = processSelect();
+        //Ids are generated inside the chunks so that each chunk is appended to
+        if (_add_id && _owner->settings().add_idPerChunk) {
+            const int oidType = BSON("_id" << mongo::OID()).firstElement().canonicalType();
+            std::vector<tools::OidGenerator::Range> ranges;
+            tools::OidGenerator::Value lower {};
+            for (auto& chunk : _owner->cluster().nsChunks(_ns)) {
+                mongo::BSONElement max = std::get<0>(chunk).firstElement();
+                tools::OidGenerator::Value upper {};
+                if (max.canonicalType() > oidType) upper = tools::OidGenerator::VALUE_END;
+                else if (max.canonicalType() == oidType)
+                    upper = tools::OidGenerator::value(max.value());
+                if (upper > lower) {
+                    ranges.push_back(tools::OidGenerator::Range {lower, upper});
+                    lower = upper;
+                }
+            }
+            _oids.rangesSet(ranges);
+        }
+    }
+
+    void SegmentProcessor::splitSegment() {
+        long long end = _segment.end;
+        if (!end) end = boost::filesystem::file_size(_segment.file);
+        long long pos = _input->pos();
+        //Not worth splitting, don't check again for this segment
+        if (end - pos < (long long)FileInputProcessor::OVERAGE_SIZE) {
+            _splitDeclined = true;
+            return;
+        }
+        long long cut = pos + (end - pos) / 2;
+        tools::LocSegment tail(_segment.file, cut, _segment.end);
+        _splitter->pushSplit(std::move(tail), _docLogicalLoc, [this, cut]() {
+            this->_input->segmentEndSet(cut);
+            this->_segment.end = cut;
+        });
     }
 
     Bson SegmentProcessor::getFinalDoc() {
@@ -150,74 +524,217 @@ namespace loader {
     }
 
     Bson SegmentProcessor::getIndex() {
+        if (_hashed) return BSON("_id-hash" << _docHash);
         return std::move(_docShardKey);
     }
 
-    Bson SegmentProcessor::getAdd() {
-        return std::move(_extra->obj());
-    }
-
     tools::DocLoc SegmentProcessor::getLoc() {
-        _docLoc.length = _input->pos() - _docLoc.start;
-        _docLoc.length--;
-        assert(_docLoc.length > 0);
-        return std::move(_docLoc);
+        return _docLoc;
     }
 
     void SegmentProcessor::processSegmentToBatch(tools::LocSegment segment,
                                                tools::LogicalLoc logicalLoc)
     {
-        //TODO: it probably faster to pull elements and check those, then buld from that
-        //May need to switch to void getFields(unsigned n, const char **fieldNames, BSONElement* fields) const;
         _docLogicalLoc = logicalLoc;
+        _segment = segment;
+        _splitDeclined = !_splitter || !_input->splitAnywhere();
         _input->reset(std::move(segment));
+        (this->*_process)();
+    }
+
+    void SegmentProcessor::processBufferToBatch(const char* data, size_t size) {
+        _docLogicalLoc = 0;
+        _splitDeclined = true;
+        _input->resetBuffer(data, size);
+        (this->*_process)();
+    }
+
+    namespace {
+        /**
+         * Calls the format's functions directly, without a virtual call, for processDocuments
+         */
+        template<typename Format>
+        struct FormatCalls {
+            static bool next(AbstractFileInputFormat* input, mongo::BSONObj* doc) {
+                return static_cast<Format*>(input)->Format::next(doc);
+            }
+
+            static size_t pos(AbstractFileInputFormat* input) {
+                return static_cast<Format*>(input)->Format::pos();
+            }
+
+            static void keyFields(AbstractFileInputFormat* input, const mongo::BSONObj& doc,
+                                  mongo::BSONElement* elements) {
+                static_cast<const Format*>(input)->Format::keyFields(doc, elements);
+            }
+        };
+
+        //Formats without an instantiation of their own
+        template<>
+        struct FormatCalls<AbstractFileInputFormat> {
+            static bool next(AbstractFileInputFormat* input, mongo::BSONObj* doc) {
+                return input->next(doc);
+            }
+
+            static size_t pos(AbstractFileInputFormat* input) {
+                return input->pos();
+            }
+
+            static void keyFields(AbstractFileInputFormat* input, const mongo::BSONObj& doc,
+                                  mongo::BSONElement* elements) {
+                input->keyFields(doc, elements);
+            }
+        };
+    }  //namespace
+
+    template<typename Format, SegmentProcessor::KeyKind kind, bool addId>
+    void SegmentProcessor::processDocuments() {
+        using Calls = FormatCalls<Format>;
+        AbstractFileInputFormat* const input = _input.get();
+        tools::Trace::Span span("parse");
         _docLoc.location = _docLogicalLoc;
-        _docLoc.start = _input->pos();
+        _docLoc.start = Calls::pos(input);
         //Reads in documents until the segment comes back with no more docs
-        while (_input->next(&_doc)) {
-            mongo::BSONObjBuilder extra;
+        while (Calls::next(input, &_doc)) {
+            if (!_splitDeclined && _splitter->splitWanted()) splitSegment();
+            _docLoc.length = Calls::pos(input) - _docLoc.start;
+            _docLoc.length--;
+            assert(_docLoc.length > 0);
+            _owner->stats().docsParsed->add();
+            _owner->stats().bytesParsed->add(_doc.objsize());
             //TODO: Make sure that this extra field keys works with multikey indexes, sparse, etc
-            //fillWithNull is set to false, not sure that works with mulitfield keys
-            _docShardKey = _doc.extractFields(_keys, false);
-            _added_id = false;
+            //The input format has already located the key fields, no need to walk _doc again
+            Calls::keyFields(input, _doc, _keyElements.data());
+            int keyFieldsFound = kind == KeyKind::COMPOUND
+                    ? std::count_if(_keyElements.begin(), _keyElements.end(),
+                                    [](const mongo::BSONElement& e) {return !e.eoo();})
+                    : !_keyElements.front().eoo();
             //Check to see if the document has a complete shard key
-            if (_docShardKey.nFields() != _keyFieldsCount) {
+            if (keyFieldsFound != _keyFieldsCount) {
                 //If we can add the _id and _id is the only missing field, add it, else error
-                if (_add_id && (_keyFieldsCount - _docShardKey.nFields()) == 1 &&
-                        !_docShardKey.hasField("_id")) {
+                if (addId && (_keyFieldsCount - keyFieldsFound) == 1 &&
+                        _keyElements[_owner->settings().indexPos_id].eoo()) {
                     //If the shard key is only short by _id and we are willing to add it, do so
                     //The shard key must be complete at this stage so all sorting is correct
-                    _added_id = true;
-                    auto oid = mongo::OID::gen();
-                    //Update the added fields
-                    extra.append("_id", oid);
-                    //Add the _id field
-                    if (_keyFieldsCount == 1)
-                        _docShardKey = BSON("_id" << oid);
-                    else {
-                        auto itr = _docShardKey.begin();
-                        size_t pos = 0;
-                        mongo::BSONObjBuilder index;
-                        do {
-                            if (pos != _owner->settings().indexPos_id) index.append(itr.next());
-                            else index.append("_id", oid);
-                            ++pos;
-                        }
-                        while (itr.more());
-                        _docShardKey = index.obj();
-                    }
+                    idAdd();
                 }
                 //TOOD: Consider continuing on errors or making it a setting
                 else throw std::logic_error("No shard key in doc");
             }
-            //If hashing is required, do it
-            if (_owner->settings().hashed) _docShardKey =
-                    BSON("_id-hash" << mongo::BSONElementHasher::hash64(_docShardKey.firstElement(),
-                                           mongo::BSONElementHasher::DEFAULT_HASH_SEED));
-            _extra = &extra;
-            auto* stage = _inputAggregator.targetStage(_docShardKey);
-            stage->push(this);
-            _docLoc.start = _input->pos();
+            //A shard key with _id is already known to have it, _id is usually the first field
+            if (_idRequired && std::strcmp(_doc.firstElement().fieldName(), "_id")
+                    && !_doc.hasField("_id"))
+                throw std::logic_error("No _id in doc, resuming needs documents to have one");
+            //Hashed keys are a single field, they are hashed a batch at a time
+            if (kind == KeyKind::HASHED) {
+                PendingDoc& pending = _pending[_pendingCount];
+                pending.doc = std::move(_doc);
+                pending.loc = _docLoc;
+                //The element points into the doc, which stays put in _pending
+                _pendingKeys[_pendingCount] = _keyElements.front();
+                if (++_pendingCount == HASH_BATCH_SIZE) flushPending();
+            }
+            else if (kind == KeyKind::SINGLE) {
+                const mongo::BSONElement& element = _keyElements.front();
+                mongo::BSONObjBuilder key(5 + element.size());
+                key.append(element);
+                _docShardKey = key.obj();
+                pushDoc();
+            }
+            else {
+                //Sized exactly so the key is a single allocation
+                int keySize = 5;
+                for (auto& element : _keyElements)
+                    keySize += element.size();
+                mongo::BSONObjBuilder key(keySize);
+                for (auto& element : _keyElements)
+                    key.append(element);
+                _docShardKey = key.obj();
+                pushDoc();
+            }
+            _docLoc.start = Calls::pos(input);
         }
+        flushPending();
+    }
+
+    template<typename Format>
+    SegmentProcessor::ProcessFunction SegmentProcessor::processFor(KeyKind kind, bool addId) {
+        switch (kind) {
+        case KeyKind::HASHED:
+            return addId ? &SegmentProcessor::processDocuments<Format, KeyKind::HASHED, true>
+                         : &SegmentProcessor::processDocuments<Format, KeyKind::HASHED, false>;
+        case KeyKind::SINGLE:
+            return addId ? &SegmentProcessor::processDocuments<Format, KeyKind::SINGLE, true>
+                         : &SegmentProcessor::processDocuments<Format, KeyKind::SINGLE, false>;
+        case KeyKind::COMPOUND:
+            break;
+        }
+        return addId ? &SegmentProcessor::processDocuments<Format, KeyKind::COMPOUND, true>
+                     : &SegmentProcessor::processDocuments<Format, KeyKind::COMPOUND, false>;
+    }
+
+    SegmentProcessor::ProcessFunction SegmentProcessor::processSelect() const {
+        KeyKind kind = _hashed ? KeyKind::HASHED
+                               : _keyFieldsCount == 1 ? KeyKind::SINGLE : KeyKind::COMPOUND;
+        //Only the exact type, a format derived from one of these may override its functions
+        const std::type_info& format = typeid(*_input);
+        if (format == typeid(InputFormatJsonMmap))
+            return processFor<InputFormatJsonMmap>(kind, _add_id);
+        if (format == typeid(InputFormatJsonArray))
+            return processFor<InputFormatJsonArray>(kind, _add_id);
+        if (format == typeid(InputFormatCsv)) return processFor<InputFormatCsv>(kind, _add_id);
+        if (format == typeid(InputFormatJson)) return processFor<InputFormatJson>(kind, _add_id);
+        if (format == typeid(InputFormatBson)) return processFor<InputFormatBson>(kind, _add_id);
+        if (format == typeid(InputFormatBsonArena))
+            return processFor<InputFormatBsonArena>(kind, _add_id);
+        return processFor<AbstractFileInputFormat>(kind, _add_id);
+    }
+
+    void SegmentProcessor::flushPending() {
+        if (!_pendingCount) return;
+        long long int hashes[HASH_BATCH_SIZE];
+        _hasher.hash64(_pendingKeys, _pendingCount, hashes);
+        for (size_t i = 0; i < _pendingCount; ++i) {
+            _doc = std::move(_pending[i].doc);
+            _docLoc = _pending[i].loc;
+            //The key is only materialized if a batcher asks for it
+            _docHash = hashes[i];
+            _docShardKey = mongo::BSONObj();
+            _inputAggregator.targetStage(static_cast<int64_t>(hashes[i]))->push(this);
+        }
+        _pendingCount = 0;
+    }
+
+    void SegmentProcessor::idAdd() {
+        const int size = _doc.objsize() + ID_ELEMENT_SIZE;
+        char* data = _idArena.allocate(size);
+        std::vector<char> large;
+        if (!data) {
+            large.resize(size);
+            data = large.data();
+        }
+        std::memcpy(data, &size, sizeof(size));
+        char* element = data + sizeof(size);
+        element[0] = mongo::jstOID;
+        std::memcpy(element + 1, "_id", 4);
+        _oids.next(element + 5);
+        std::memcpy(element + ID_ELEMENT_SIZE, _doc.objdata() + sizeof(size),
+                    _doc.objsize() - sizeof(size));
+        mongo::BSONObj doc = large.empty() ? mongo::BSONObj(data) : mongo::BSONObj(data).getOwned();
+        //The other key fields moved along with the rest of the document
+        const char* begin = _doc.objdata();
+        for (auto& key : _keyElements) {
+            if (key.eoo() || key.rawdata() < begin || key.rawdata() >= begin + _doc.objsize())
+                continue;
+            key = mongo::BSONElement(doc.objdata() + (key.rawdata() - begin) + ID_ELEMENT_SIZE);
+        }
+        tools::BsonArena::release(_doc);
+        _doc = std::move(doc);
+        _keyElements[_owner->settings().indexPos_id] = _doc.firstElement();
+    }
+
+    void SegmentProcessor::pushDoc() {
+        auto* stage = _inputAggregator.targetStage(_docShardKey);
+        stage->push(this);
     }
 }  //namespace loader
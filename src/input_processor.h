@@ -15,13 +15,21 @@
 
 #pragma once
 
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include "chunk_ranges.h"
 #include "input_batcher.h"
 #include "input_format.h"
 #include "mongo_cxxdriver.h"
+#include "oid_generator.h"
+#include "util/hasher.h"
 
 namespace loader {
 
     class Loader;
+    class SegmentProcessor;
     /*
      * Runs the loading
      */
@@ -32,12 +40,30 @@ namespace loader {
         virtual ~InputProcessor() {};
         virtual void run() = 0;
         virtual void wait() = 0;
+
+        /**
+         * @return bytes of input the load will read, 0 if that isn't known
+         */
+        virtual unsigned long long totalBytes() const {
+            return 0;
+        }
+
+        /**
+         * @return work read and waiting for a parse thread
+         */
+        virtual size_t queued() const = 0;
+
+        /**
+         * @return seconds spent finding and segmenting the input before reading started
+         */
+        virtual double scanSeconds() const {
+            return 0;
+        }
     };
 
     /*
      * Processes files
      */
-    //TODO: If splits are possible is tied into the format, not the processing, move
     class FileInputProcessor : public InputProcessor {
     public:
         FileInputProcessor(Loader* owner, size_t threads, std::string inputType,
@@ -58,13 +84,94 @@ namespace loader {
          */
         void wait();
 
-    private:
-        const bool allowInputSplits() const { return _inputType == "json"; }
+        unsigned long long totalBytes() const {
+            return _totalBytes;
+        }
+
+        size_t queued() const {
+            return _locSegmentQueue.size();
+        }
+
+        double scanSeconds() const {
+            return _scanSeconds;
+        }
 
-        using LocSegmentQueue = tools::ConcurrentQueue<tools::LocSegment>;
+        /**
+         * @return true if there are threads waiting for work that a split would feed.
+         * Cheap enough to be called per document.
+         */
+        bool splitWanted() const {
+            return _idleThreads.load(std::memory_order_relaxed);
+        }
+
+        /**
+         * Hands the tail of a segment in progress to an idle thread.
+         * cutSegment is only called if the split is still wanted and should move the end of the
+         * segment in progress to tail.begin.
+         * The tail keeps the logical location of the segment it came from.
+         * @return true if the split took place
+         */
+        bool pushSplit(tools::LocSegment tail, tools::LogicalLoc logicalLoc,
+                       const std::function<void()>& cutSegment);
+
+        /**
+         * Reads documents from segments spread evenly over the input files.
+         * @return the shard keys (fields in keys order) of about samples documents, documents
+         * missing a key field are skipped
+         * @param transform the documents are sampled as the load transforms them, nullptr for none
+         * @param schema the columns of delimited input, nullptr for none
+         */
+        static std::vector<mongo::BSONObj> sampleKeys(const std::string& loadDir,
+                                                      const std::string& fileRegex,
+                                                      const std::string& inputType,
+                                                      const mongo::BSONObj& keys,
+                                                      size_t samples,
+                                                      const FieldTransform* transform,
+                                                      const CsvSchema* schema);
+
+        /**
+         * @return the files in loadDir matching fileRegex sorted by name, exits if there are none
+         */
+        static std::deque<tools::fileinfo> listFiles(const std::string& loadDir,
+                                                     const std::string& fileRegex,
+                                                     unsigned long long* totalSize);
+
+        /**
+         * Cuts files large enough that threads would otherwise wait on them into segments.
+         * Segments are kept in file order, a segment's index is its logical location.
+         */
+        static tools::LocSegMapping segmentFiles(const std::deque<tools::fileinfo>& files,
+                                                 unsigned long long totalSize,
+                                                 const std::string& inputType, size_t threads);
+
+        /**
+         * Copies about bytes of the input into sampleDir, a share from the start of each file
+         * cut at a record boundary.  Formats that can't find record boundaries, i.e. compressed
+         * files, are copied a whole file at a time.
+         * @return the bytes copied
+         */
+        static unsigned long long sampleInput(const std::string& loadDir,
+                                              const std::string& fileRegex,
+                                              const std::string& inputType,
+                                              unsigned long long bytes,
+                                              const std::string& sampleDir);
+
+    private:
+        //The logical location travels with the segment so no lookup is required
+        using QueuedSegment = std::pair<tools::LogicalLoc, tools::LocSegment>;
+        using LocSegmentQueue = tools::BoundedConcurrentQueue<QueuedSegment>;
         LocSegmentQueue _locSegmentQueue;
         tools::LocSegMapping _locSegMapping;
+        std::size_t _queuedSegments{};
+        std::atomic<unsigned long long> _totalBytes{};
+        double _scanSeconds{};
         std::atomic<std::size_t> _processedSegments{};
+        std::atomic<std::size_t> _splitSegments{};
+        //Threads waiting on the queue are idle, when no threads are active the input is done
+        tools::Mutex _idleMutex;
+        tools::ConditionVariable _idleNotify;
+        std::atomic<std::size_t> _idleThreads{};
+        size_t _activeThreads{};
         std::unique_ptr<tools::ThreadPool> _tpInput;
 
         Loader* const _owner;
@@ -78,6 +185,122 @@ namespace loader {
          * This is where the threads do the actual work
          */
         void threadProcessSegment();
+
+        /**
+         * Gets the next segment to work on.  If there isn't one the thread waits for a split
+         * until all threads are out of work.
+         * @return false if all input is complete
+         */
+        bool nextSegment(QueuedSegment* work);
+    };
+
+    /*
+     * Processes a stream, i.e. stdin or a named pipe, that can't be split up front.
+     * A single thread reads the stream into a bounded ring of large buffers cut on record
+     * boundaries, the parse threads take the buffers from there.
+     */
+    class StreamInputProcessor : public InputProcessor {
+    public:
+        static constexpr size_t BUFFER_SIZE = 16 * 1024 * 1024;
+        //Path meaning stdin
+        static constexpr const char* STDIN_PATH = "-";
+
+        StreamInputProcessor(Loader* owner, size_t threads, std::string inputType,
+                             std::string streamPath, tools::mtools::MongoCluster::NameSpace ns);
+        ~StreamInputProcessor();
+
+        /**
+         * @return true if path should be loaded with a StreamInputProcessor, i.e. "-" or a fifo
+         */
+        static bool isStream(const std::string& path);
+
+        void run();
+
+        void wait();
+
+        size_t queued() const {
+            return _full.size();
+        }
+
+    private:
+        struct Buffer {
+            std::vector<char> data;
+            size_t size{};
+        };
+
+        Loader* const _owner;
+        const size_t _threads;
+        const std::string _inputType;
+        const std::string _streamPath;
+        const tools::mtools::MongoCluster::NameSpace _ns;
+        int _fd{-1};
+        //The ring, buffers cycle from free to full and back
+        std::vector<std::unique_ptr<Buffer>> _buffers;
+        tools::WaitQueue<Buffer*> _free;
+        tools::WaitQueue<Buffer*> _full;
+        std::unique_ptr<tools::ThreadPool> _tpInput;
+        std::atomic<size_t> _bytesRead{};
+
+        /**
+         * Reads the stream into buffers until it ends
+         */
+        void threadRead();
+
+        /**
+         * Parses buffers until the stream ends
+         */
+        void threadProcessBuffers();
+    };
+
+    /*
+     * Reads a sharded collection out of another cluster, a chunk range at a time straight from the
+     * shard that owns the range.  Ranges on different shards are read at once, no more than
+     * shardThreads of a shard's ranges are open at a time so no source shard is swamped.
+     */
+    class ClusterInputProcessor : public InputProcessor {
+    public:
+        //Documents read from a range are parsed a buffer at a time
+        static constexpr size_t BUFFER_SIZE = 4 * 1024 * 1024;
+
+        /**
+         * @param sourceConn connection string of the source cluster's mongoS
+         * @param shardThreads ranges of a source shard that are read at once
+         */
+        ClusterInputProcessor(Loader* owner, size_t threads, std::string sourceConn,
+                              size_t shardThreads, tools::mtools::MongoCluster::NameSpace ns);
+
+        void run();
+
+        void wait();
+
+        size_t queued() const {
+            return _ranges ? _ranges->queued() : 0;
+        }
+
+    private:
+        using Range = tools::mtools::ChunkRanges::Range;
+
+        Loader* const _owner;
+        const size_t _threads;
+        const std::string _sourceConn;
+        const size_t _shardThreads;
+        const tools::mtools::MongoCluster::NameSpace _ns;
+        mongo::BSONObj _key;
+        std::unique_ptr<tools::mtools::ChunkRanges> _ranges;
+        std::atomic<size_t> _docsRead{};
+        std::atomic<unsigned long long> _bytesRead{};
+        std::unique_ptr<tools::ThreadPool> _tpInput;
+
+        /**
+         * Reads ranges until there are none left
+         */
+        void threadProcessRanges();
+
+        /**
+         * Queries the range on its shard and queues the documents
+         */
+        void readRange(const Range& range, mongo::DBClientBase* conn, SegmentProcessor* lsp,
+                       std::vector<char>* buffer);
     };
 
     /*
@@ -87,7 +310,12 @@ namespace loader {
      */
     class SegmentProcessor : public docbuilder::DocumentBuilder {
     public:
-        SegmentProcessor(Loader* owner, std::string ns, const std::string& fileType);
+        /**
+         * @param splitter if set, the remainder of large segments is offered to it when it has
+         * idle threads
+         */
+        SegmentProcessor(Loader* owner, std::string ns, const std::string& fileType,
+                         FileInputProcessor* splitter = nullptr);
 
         /**
          * Takes a segment and it's logical location (i.e. the mapping to something real)
@@ -95,26 +323,111 @@ namespace loader {
          */
         void processSegmentToBatch(tools::LocSegment segment, tools::LogicalLoc logicalLoc);
 
+        /**
+         * Puts all the documents in a buffer of whole records into the right queues
+         */
+        void processBufferToBatch(const char* data, size_t size);
+
+        /**
+         * @return the segment last processed, its end is where it stopped if it was split
+         */
+        const tools::LocSegment& segment() const {
+            return _segment;
+        }
+
         virtual Bson getFinalDoc();
         virtual Bson getIndex();
-        virtual Bson getAdd();
         virtual tools::DocLoc getLoc();
 
     private:
+        /**
+         * Offers the back half of the current segment to the splitter
+         */
+        void splitSegment();
+
+        /**
+         * How the shard key is built, picked once rather than per document
+         */
+        enum class KeyKind {
+            HASHED, SINGLE, COMPOUND
+        };
+
+        using ProcessFunction = void (SegmentProcessor::*)();
+
+        /**
+         * Puts the documents from the reset input into the right queues.  There is an
+         * instantiation per format, key kind and add_id so the calls per document are direct.
+         * Format is AbstractFileInputFormat for formats that go through virtual calls.
+         */
+        template<typename Format, KeyKind kind, bool addId>
+        void processDocuments();
+
+        template<typename Format>
+        static ProcessFunction processFor(KeyKind kind, bool addId);
+
+        /**
+         * @return the processDocuments for the input format and the shard key
+         */
+        ProcessFunction processSelect() const;
+
+        /**
+         * Hashes the keys of the pending documents together and queues the documents
+         */
+        void flushPending();
+
+        /**
+         * Queues the document set in _doc, _docShardKey and _docLoc by its key object
+         */
+        void pushDoc();
+
+        /**
+         * Rewrites _doc with a generated _id as its first field and points the _id key element
+         * at it
+         */
+        void idAdd();
+
+        /**
+         * For hashed keys documents wait here until a batch of keys can be hashed together
+         */
+        struct PendingDoc {
+            Bson doc;
+            tools::DocLoc loc;
+        };
+
+        static constexpr size_t HASH_BATCH_SIZE = mongo::BSONElementBatchHasher::BATCH_MAX;
+        //The type byte, "_id" and the id
+        static constexpr int ID_ELEMENT_SIZE = 1 + 4 + mongo::OID::kOIDLen;
+
         Loader *_owner;
+        FileInputProcessor* const _splitter;
         const std::string _ns;
         const bool _add_id;
+        //A resumed load writes documents again, they only dedupe on an _id of their own
+        const bool _idRequired;
         const mongo::BSONObj _keys;
         int _keyFieldsCount;
+        const bool _hashed;
         docbuilder::InputNameSpaceContainer _inputAggregator;
         tools::LogicalLoc _docLogicalLoc;
         tools::DocLoc _docLoc;
         std::string _docJson;
         Bson _doc;
-        mongo::BSONObjBuilder *_extra = NULL;
         mongo::BSONObj _docShardKey;
-        bool _added_id{};
+        long long int _docHash{};
+        //Shard key elements of _doc in key order, found by the input format
+        std::vector<mongo::BSONElement> _keyElements;
         InputFormatPointer _input;
+        ProcessFunction _process;
+        //The segment being read, its end moves if it is split
+        tools::LocSegment _segment;
+        bool _splitDeclined{};
+        mongo::BSONElementBatchHasher _hasher;
+        PendingDoc _pending[HASH_BATCH_SIZE];
+        mongo::BSONElement _pendingKeys[HASH_BATCH_SIZE];
+        size_t _pendingCount{};
+        tools::OidGenerator _oids;
+        //Documents rewritten with an _id
+        tools::BsonArena _idArena;
 
     };
 
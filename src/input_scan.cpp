@@ -0,0 +1,330 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "input_scan.h"
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <thread>
+#include "bson_tools.h"
+#include "input_processor.h"
+
+namespace loader {
+
+    constexpr double InputScan::ORDERED;
+    constexpr size_t InputScan::CHUNKS_REPORTED;
+
+    namespace {
+        std::string percent(double part, double whole) {
+            std::ostringstream out;
+            out << std::fixed << std::setprecision(2) << (whole ? 100 * part / whole : 0) << "%";
+            return out.str();
+        }
+    }  //namespace
+
+    InputScan::InputScan(Loader::Settings settings) :
+            _settings(std::move(settings))
+    {
+        _settings.process();
+        if (!_settings.sharded) {
+            std::cerr << "A scan needs the shard key to report on" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (StreamInputProcessor::isStream(_settings.loadDir)) {
+            std::cerr << "A scan reads the input files, it can't scan a stream" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        _chunks = _settings.scanChunks ? _settings.scanChunks : _settings.chunksPerShard;
+        if (_settings.hashed) _total.hashedChunks.resize(_chunks);
+    }
+
+    void InputScan::run() {
+        tools::SimpleTimer<> timer;
+        unsigned long long totalSize;
+        std::deque<tools::fileinfo> files = FileInputProcessor::listFiles(_settings.loadDir,
+                _settings.fileRegex, &totalSize);
+        _segments = FileInputProcessor::segmentFiles(files, totalSize, _settings.inputType,
+                                                     _settings.threads);
+        std::cout << "Scanning " << files.size() << " files, " << totalSize / 1024 / 1024
+                  << "MB in " << _segments.size() << " segments" << std::endl;
+        std::vector<std::thread> threads;
+        size_t threadCount = std::min(size_t(_settings.threads), _segments.size());
+        for (size_t thread = 0; thread < threadCount; ++thread)
+            threads.emplace_back(&InputScan::threadScan, this);
+        for (auto&& thread : threads)
+            thread.join();
+        timer.stop();
+
+        std::vector<mongo::BSONObj> splits;
+        std::vector<double> chunkDocs;
+        std::vector<WeightedKey> hotKeys;
+        if (_settings.hashed)
+            chunkDocs.assign(_total.hashedChunks.begin(), _total.hashedChunks.end());
+        else
+            splits = rangeSplits(&chunkDocs, &hotKeys);
+        std::pair<std::string, std::string> plan = queuing();
+        report(splits, chunkDocs, hotKeys, plan, timer.millis());
+        if (!_settings.scanSave.empty()) save(splits, chunkDocs, plan.first);
+    }
+
+    void InputScan::threadScan() {
+        Stats stats;
+        stats.hashedChunks.resize(_total.hashedChunks.size());
+        const size_t fields = _settings.shardKeyFields.size();
+        //The threads' samples together are the size the presplit would take
+        const size_t sampleMax = _settings.hashed ? 0
+                : std::max(_chunks * std::max(_settings.presplitSamples, size_t(1))
+                           / _settings.threads, size_t(1));
+        //Hashed chunks are equal ranges of the hashes, as the load presplits them
+        const uint64_t step = std::numeric_limits<uint64_t>::max() / std::max(_chunks, size_t(1));
+        const uint64_t base = uint64_t(std::numeric_limits<int64_t>::min());
+        std::mt19937_64 random(std::random_device{}());
+        tools::BSONObjCmp compare(_settings.shardKeysBson);
+
+        InputFormatPointer format = InputFormatFactory::createObject(_settings.inputType);
+        format->keyFieldsSet(_settings.shardKeysBson);
+        format->transformSet(&_settings.transform);
+        format->schemaSet(&_settings.csvSchema);
+        format->errorsSet(&stats.errors);
+        std::vector<mongo::BSONElement> elements(fields);
+        std::string lastKey;
+
+        for (size_t segment; (segment = _nextSegment++) < _segments.size();) {
+            format->reset(_segments[segment]);
+            //Order only matters within a segment, segments are read side by side
+            lastKey.clear();
+            mongo::BSONObj doc;
+            while (format->next(&doc)) {
+                ++stats.docs;
+                stats.bytes += doc.objsize();
+                format->keyFields(doc, elements.data());
+                size_t found = std::count_if(elements.begin(), elements.end(),
+                        [](const mongo::BSONElement& element) {return !element.eoo();});
+                if (found != fields) {
+                    //The load gives these documents an _id, which is unique and so its own key
+                    if (_settings.add_id && found + 1 == fields
+                        && elements[_settings.indexPos_id].eoo())
+                        ++stats.idGenerated;
+                    else
+                        ++stats.keyMissing;
+                    tools::BsonArena::release(doc);
+                    continue;
+                }
+                if (_settings.hashed) {
+                    long long hash = mongo::BSONElementHasher::hash64(elements.front(),
+                            mongo::BSONElementHasher::DEFAULT_HASH_SEED);
+                    stats.keys.add(tools::HyperLogLog::hash(&hash, sizeof(hash)));
+                    ++stats.hashedChunks[std::min((uint64_t(hash) - base) / step,
+                                                  uint64_t(_chunks - 1))];
+                    tools::BsonArena::release(doc);
+                    continue;
+                }
+                mongo::BSONObjBuilder keyBuilder;
+                uint64_t hash = 0;
+                for (size_t field = 0; field < fields; ++field) {
+                    const mongo::BSONElement& element = elements[field];
+                    keyBuilder.appendAs(element, _settings.shardKeyFields[field]);
+                    hash = tools::HyperLogLog::hash(element.value(), element.valuesize(),
+                                                    hash + element.type());
+                }
+                stats.keys.add(hash);
+                mongo::BSONObj key = keyBuilder.done();
+                if (!lastKey.empty()) {
+                    if (compare(key, mongo::BSONObj(lastKey.data()))) ++stats.outOfOrder;
+                    else ++stats.inOrder;
+                }
+                lastKey.assign(key.objdata(), key.objsize());
+                ++stats.keysSeen;
+                if (stats.sample.size() < sampleMax)
+                    stats.sample.push_back(key.getOwned());
+                else {
+                    unsigned long long replace = random() % stats.keysSeen;
+                    if (replace < sampleMax) stats.sample[replace] = key.getOwned();
+                }
+                tools::BsonArena::release(doc);
+            }
+        }
+        merge(std::move(stats));
+    }
+
+    void InputScan::merge(Stats&& stats) {
+        tools::MutexLockGuard lock(_mutex);
+        _total.docs += stats.docs;
+        _total.bytes += stats.bytes;
+        _total.keyMissing += stats.keyMissing;
+        _total.idGenerated += stats.idGenerated;
+        _total.inOrder += stats.inOrder;
+        _total.outOfOrder += stats.outOfOrder;
+        for (auto&& error : stats.errors.errors) {
+            if (_total.errors.errors.size() == ParseErrors::KEPT) break;
+            _total.errors.errors.push_back(std::move(error));
+        }
+        _total.errors.count += stats.errors.count;
+        _total.keys.merge(stats.keys);
+        for (size_t chunk = 0; chunk < stats.hashedChunks.size(); ++chunk)
+            _total.hashedChunks[chunk] += stats.hashedChunks[chunk];
+        //Threads read different amounts, so their sampled keys stand for different amounts
+        double weight = stats.sample.empty() ? 0 : double(stats.keysSeen) / stats.sample.size();
+        for (auto&& key : stats.sample)
+            _sample.emplace_back(std::move(key), weight);
+    }
+
+    std::vector<mongo::BSONObj> InputScan::rangeSplits(std::vector<double>* chunkDocs,
+                                                       std::vector<WeightedKey>* hotKeys) {
+        tools::BSONObjCmp compare(_settings.shardKeysBson);
+        std::sort(_sample.begin(), _sample.end(), [&compare](const WeightedKey& l,
+                                                             const WeightedKey& r) {
+            return compare(l.first, r.first);});
+        double total = 0;
+        for (auto&& key : _sample)
+            total += key.second;
+        const double share = total / std::max(_chunks, size_t(1));
+        std::vector<mongo::BSONObj> splits;
+        chunkDocs->assign(1, 0.0);
+        double seen = 0;
+        size_t quantile = 1;
+        for (size_t run = 0; run < _sample.size();) {
+            //Equal keys can't be split, they go into one chunk however many there are
+            size_t end = run + 1;
+            double keyDocs = _sample[run].second;
+            for (; end < _sample.size() && !compare(_sample[run].first, _sample[end].first); ++end)
+                keyDocs += _sample[end].second;
+            if (keyDocs > share) hotKeys->emplace_back(_sample[run].first, keyDocs);
+            //A chunk starts at each key holding a quantile, the first key is in the first chunk
+            bool split = false;
+            for (; quantile < _chunks && quantile * share < seen + keyDocs; ++quantile)
+                split = true;
+            if (split && run > 0) {
+                splits.push_back(_sample[run].first);
+                chunkDocs->push_back(0);
+            }
+            chunkDocs->back() += keyDocs;
+            seen += keyDocs;
+            run = end;
+        }
+        return splits;
+    }
+
+    std::pair<std::string, std::string> InputScan::queuing() const {
+        const unsigned long long budget = _settings.ramBudget ? _settings.ramBudget * 1024 * 1024
+                                                              : tools::getTotalSystemMemory() / 4 * 3;
+        const unsigned long long compared = _total.inOrder + _total.outOfOrder;
+        const std::string queues = std::to_string(_settings.chunksPerShard);
+        if (!_settings.hashed && compared && _total.inOrder >= ORDERED * compared)
+            return {"\"direct\":" + queues,
+                    "the keys are already in order, direct queues send the input as it is read"};
+        if (_total.bytes <= budget)
+            return {"\"ram\":" + queues,
+                    "the documents fit in the RAM budget, ram queues sort each chunk in memory"};
+        return {"\"disk\":" + queues,
+                "the documents are larger than the RAM budget, disk queues sort through workPath"};
+    }
+
+    void InputScan::report(const std::vector<mongo::BSONObj>& splits,
+                           const std::vector<double>& chunkDocs,
+                           const std::vector<WeightedKey>& hotKeys,
+                           const std::pair<std::string, std::string>& queuing, long millis) const {
+        std::cout << "\nScanned " << _total.docs << " documents, " << _total.bytes / 1024 / 1024
+                  << "MB of BSON in " << double(millis) / 1000 << "s" << std::endl;
+
+        std::cout << "Parse errors: " << _total.errors.count << std::endl;
+        std::vector<ParseErrors::Error> errors = _total.errors.errors;
+        std::sort(errors.begin(), errors.end(), [](const ParseErrors::Error& l,
+                                                   const ParseErrors::Error& r) {
+            return l.file < r.file || (l.file == r.file && l.offset < r.offset);});
+        for (auto&& error : errors)
+            std::cout << "  " << error.file << ":" << error.offset << ": " << error.message
+                      << std::endl;
+        if (errors.size() < _total.errors.count)
+            std::cout << "  (first " << errors.size() << " shown)" << std::endl;
+
+        std::cout << "Missing shard key fields: " << _total.keyMissing << " documents"
+                  << std::endl;
+        if (_settings.add_id)
+            std::cout << "Given a generated _id: " << _total.idGenerated << " documents"
+                      << std::endl;
+        std::cout << "Distinct shard keys: ~" << static_cast<unsigned long long>(
+                _total.keys.estimate()) << (_total.idGenerated ? " plus the generated _ids" : "")
+                  << std::endl;
+        const unsigned long long compared = _total.inOrder + _total.outOfOrder;
+        if (compared)
+            std::cout << "Keys in order: " << percent(_total.inOrder, compared) << std::endl;
+
+        if (!chunkDocs.empty()) {
+            double total = 0;
+            for (auto&& docs : chunkDocs)
+                total += docs;
+            auto range = std::minmax_element(chunkDocs.begin(), chunkDocs.end());
+            std::cout << "Chunks: " << chunkDocs.size() << " of " << _chunks
+                      << (_settings.hashed ? "" : " estimated from a sample")
+                      << "\n  documents min: " << static_cast<long long>(*range.first)
+                      << " mean: " << static_cast<long long>(total / chunkDocs.size())
+                      << " max: " << static_cast<long long>(*range.second) << std::endl;
+            std::vector<size_t> largest(chunkDocs.size());
+            for (size_t chunk = 0; chunk < largest.size(); ++chunk)
+                largest[chunk] = chunk;
+            size_t shown = std::min(CHUNKS_REPORTED, largest.size());
+            std::partial_sort(largest.begin(), largest.begin() + shown, largest.end(),
+                              [&chunkDocs](size_t l, size_t r) {
+                return chunkDocs[l] > chunkDocs[r];});
+            for (size_t index = 0; index < shown; ++index) {
+                size_t chunk = largest[index];
+                std::cout << "  chunk " << chunk << ": " << static_cast<long long>(chunkDocs[chunk])
+                          << " documents (" << percent(chunkDocs[chunk], total) << ")";
+                if (!_settings.hashed)
+                    std::cout << " from " << (chunk ? splits[chunk - 1].toString() : "MinKey");
+                std::cout << std::endl;
+            }
+        }
+        for (auto&& key : hotKeys)
+            std::cout << "Hot key: " << key.first << " ~" << static_cast<long long>(key.second)
+                      << " documents, more than a chunk can be split into" << std::endl;
+
+        std::cout << "Suggested queuing: '" << queuing.first << "', " << queuing.second
+                  << std::endl;
+    }
+
+    void InputScan::save(const std::vector<mongo::BSONObj>& splits,
+                         const std::vector<double>& chunkDocs, const std::string& queuing) const {
+        mongo::BSONArrayBuilder chunks;
+        for (auto&& docs : chunkDocs)
+            chunks.append(static_cast<long long>(docs));
+        mongo::BSONArrayBuilder splitKeys;
+        for (auto&& split : splits)
+            splitKeys.append(split);
+        mongo::BSONObjBuilder saved;
+        saved.append("ns", _settings.ns());
+        saved.append("shardKey", _settings.shardKeysBson);
+        saved.append("docs", static_cast<long long>(_total.docs));
+        saved.append("bytes", static_cast<long long>(_total.bytes));
+        saved.append("parseErrors", static_cast<long long>(_total.errors.count));
+        saved.append("keyMissing", static_cast<long long>(_total.keyMissing));
+        saved.append("idGenerated", static_cast<long long>(_total.idGenerated));
+        saved.append("distinctKeys", static_cast<long long>(_total.keys.estimate()));
+        saved.append("inOrder", static_cast<long long>(_total.inOrder));
+        saved.append("outOfOrder", static_cast<long long>(_total.outOfOrder));
+        saved.append("chunkDocs", chunks.arr());
+        saved.append("splits", splitKeys.arr());
+        saved.append("queuing", queuing);
+        std::ofstream file(_settings.scanSave, std::ios_base::out | std::ios_base::trunc);
+        if (file.is_open()) file << saved.obj().jsonString(mongo::Strict, 1) << std::endl;
+        else std::cerr << "Unable to open scan file: " << _settings.scanSave << std::endl;
+    }
+
+}  //namespace loader
@@ -0,0 +1,109 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+#include "hyper_log_log.h"
+#include "input_format.h"
+#include "loader.h"
+#include "threading.h"
+#include "tools.h"
+
+namespace loader {
+
+    /**
+     * Reads all of the input with the load's segments and parsers, without a cluster, and reports
+     * what a load of it would run into: parse errors, documents missing shard key fields, the
+     * distinct keys, how ordered the keys already are and how the documents spread over the
+     * prospective chunks.  Split points and a queuing to load with are suggested from that.
+     */
+    class InputScan {
+    public:
+        /**
+         * @param settings as read from the command line, i.e. before Settings::process()
+         */
+        explicit InputScan(Loader::Settings settings);
+
+        void run();
+
+    private:
+        //Share of keys that must follow the one before them for direct queues to be suggested
+        static constexpr double ORDERED = 0.99;
+        //Largest chunks reported
+        static constexpr size_t CHUNKS_REPORTED = 10;
+
+        struct Stats {
+            unsigned long long docs{};
+            unsigned long long bytes{};
+            unsigned long long keyMissing{};
+            unsigned long long idGenerated{};
+            //Range keys compared to the one before them in the segment
+            unsigned long long inOrder{};
+            unsigned long long outOfOrder{};
+            ParseErrors errors;
+            tools::HyperLogLog keys;
+            //Documents in each equal range of the hashed key space
+            std::vector<unsigned long long> hashedChunks;
+            //Reservoir sample of range keys, each standing for keysSeen / size() documents
+            std::vector<mongo::BSONObj> sample;
+            unsigned long long keysSeen{};
+        };
+
+        //A sampled key and the documents it stands for
+        using WeightedKey = std::pair<mongo::BSONObj, double>;
+
+        Loader::Settings _settings;
+        size_t _chunks;
+        tools::LocSegMapping _segments;
+        std::atomic<size_t> _nextSegment{};
+        tools::Mutex _mutex;
+        Stats _total;
+        std::vector<WeightedKey> _sample;
+
+        /**
+         * Scans segments until there are none left, then merges its stats into the total
+         */
+        void threadScan();
+
+        void merge(Stats&& stats);
+
+        /**
+         * Cuts the weighted sample into chunks of equal documents
+         * @param chunkDocs is set to the estimated documents of each chunk
+         * @param hotKeys is set to the keys holding more than a chunk's share of the documents
+         */
+        std::vector<mongo::BSONObj> rangeSplits(std::vector<double>* chunkDocs,
+                                                std::vector<WeightedKey>* hotKeys);
+
+        /**
+         * @return the queuing option to load the input with and why
+         */
+        std::pair<std::string, std::string> queuing() const;
+
+        void report(const std::vector<mongo::BSONObj>& splits,
+                    const std::vector<double>& chunkDocs,
+                    const std::vector<WeightedKey>& hotKeys,
+                    const std::pair<std::string, std::string>& queuing, long millis) const;
+
+        void save(const std::vector<mongo::BSONObj>& splits,
+                  const std::vector<double>& chunkDocs, const std::string& queuing) const;
+    };
+
+}  //namespace loader
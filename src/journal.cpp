@@ -0,0 +1,156 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "journal.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+
+namespace loader {
+
+    const char Journal::FINISHED[] = "finished";
+
+    thread_local Journal::Token Journal::_current;
+    thread_local Journal::Holds* Journal::_attached {};
+    thread_local bool Journal::_share {};
+
+    namespace {
+        const char SEGMENT[] = "segment";
+        const char CHUNK[] = "chunk";
+    }  //namespace
+
+    Journal::Journal(std::string path, bool resume) :
+            _path(std::move(path)), _resume(resume)
+    {
+        if (_path.empty()) return;
+        if (_resume) {
+            std::ifstream journal(_path);
+            std::string line;
+            while (std::getline(journal, line)) {
+                //A record cut short by a crash has no newline, getline can't tell so check eof
+                if (journal.eof()) break;
+                _done.insert(line);
+                std::istringstream fields(line);
+                std::string type, file, begin, end;
+                if (!std::getline(fields, type, '\t') || type != SEGMENT) continue;
+                if (!std::getline(fields, file, '\t') || !std::getline(fields, begin, '\t')
+                    || !std::getline(fields, end, '\t'))
+                    continue;
+                _ranges[file].emplace_back(std::stoll(begin), std::stoll(end));
+            }
+            for (auto&& ranges : _ranges)
+                std::sort(ranges.second.begin(), ranges.second.end());
+            std::cout << "Resuming from " << _path << ": " << _done.size()
+                    << " finished segments and chunks" << std::endl;
+        }
+        else {
+            //Starting over the journal of a load that didn't finish loses what it has done
+            std::ifstream journal(_path);
+            std::string line, last;
+            while (std::getline(journal, line))
+                last = line;
+            if (!last.empty() && last != FINISHED) {
+                std::cerr << "The journal " << _path << " is of a load that didn't finish.  "
+                        "Resume it or remove the journal" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        _fd = open(_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | (_resume ? 0 : O_TRUNC), 0644);
+        if (_fd == -1) {
+            std::cerr << "Unable to open journal: " << _path << ".  " << strerror(errno)
+                    << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    Journal::~Journal() {
+        if (_fd != -1) close(_fd);
+    }
+
+    void Journal::append(const std::string& record) {
+        if (_fd == -1) return;
+        std::string line = record + '\n';
+        tools::MutexUniqueLock lock(_mutex);
+        if (write(_fd, line.data(), line.size()) != ssize_t(line.size())) {
+            std::cerr << "Unable to write journal: " << _path << ".  " << strerror(errno)
+                    << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        const size_t written = ++_written;
+        //A sync covers every record written before it starts, appends that arrive during it
+        //are synced together by the next one
+        while (_synced < written) {
+            if (_syncing) {
+                _syncNotify.wait(lock);
+                continue;
+            }
+            _syncing = true;
+            const size_t covered = _written;
+            lock.unlock();
+            if (fdatasync(_fd)) {
+                std::cerr << "Unable to sync journal: " << _path << ".  " << strerror(errno)
+                        << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            lock.lock();
+            _syncing = false;
+            _synced = covered;
+            _syncNotify.notify_all();
+        }
+    }
+
+    tools::LocSegMapping Journal::remaining(const tools::LocSegment& segment,
+                                            long long fileSize) const
+    {
+        tools::LocSegMapping pieces;
+        auto ranges = _ranges.find(segment.file);
+        if (ranges == _ranges.end()) {
+            pieces.push_back(segment);
+            return pieces;
+        }
+        long long pos = segment.begin;
+        const long long end = segment.end ? segment.end : fileSize;
+        for (auto&& range : ranges->second) {
+            long long rangeEnd = range.second ? range.second : fileSize;
+            if (rangeEnd <= pos || range.first >= end) continue;
+            if (range.first > pos) pieces.emplace_back(segment.file, pos, range.first);
+            pos = std::max(pos, rangeEnd);
+        }
+        //The end of file stays open ended
+        if (pos < end) pieces.emplace_back(segment.file, pos, segment.end);
+        return pieces;
+    }
+
+    std::string Journal::segmentRecord(const tools::LocSegment& segment) {
+        std::ostringstream record;
+        record << SEGMENT << '\t' << segment.file << '\t' << segment.begin << '\t' << segment.end;
+        return record.str();
+    }
+
+    std::string Journal::chunkRecord(const Bson& chunkUB) {
+        return std::string(CHUNK) + '\t' + chunkUB.toString();
+    }
+
+    void Journal::merge(Holds* holds, Holds* from) {
+        for (auto&& hold : *from)
+            if (holds->empty() || holds->back() != hold) holds->push_back(std::move(hold));
+        from->clear();
+    }
+
+}  //namespace loader
@@ -0,0 +1,187 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "loader_defs.h"
+#include "mongo_cxxdriver.h"
+#include "mongo_operations.h"
+#include "threading.h"
+#include "tools.h"
+
+namespace loader {
+
+    /**
+     * Progress journal for resuming a load.  Finished input segments (direct queuing) and
+     * finished chunks (ram/disk queuing) are appended to a file in workPath.  A resumed load skips
+     * whatever the journal holds.
+     *
+     * Work is journaled through tokens.  Every batch that carries documents of a piece of work
+     * holds its token, and so does every operation made from the batch.  When the last holder is
+     * gone, all of the work's documents have been written and the record is appended.
+     * Operations that fail exit the load without letting go of their tokens.
+     * Records are synced in groups, a record's append returns once a sync covers it.
+     * A load that completes ends the journal with finish(), a new load won't start over the
+     * journal of one that didn't.
+     */
+    class Journal {
+    public:
+        class Entry {
+        public:
+            Entry(Journal* journal, std::string record) :
+                    _journal(journal), _record(std::move(record)) { }
+
+            ~Entry() {
+                if (!_record.empty()) _journal->append(_record);
+            }
+
+            /**
+             * Sets the record to write, i.e. once the work's extent is known
+             */
+            void recordSet(std::string record) {
+                _record = std::move(record);
+            }
+
+        private:
+            Journal* const _journal;
+            std::string _record;
+        };
+        using Token = std::shared_ptr<Entry>;
+        using Holds = tools::mtools::DbOp::Holds;
+
+        /**
+         * Holds attached to the operations that send() makes on this thread while in scope
+         */
+        class Attach {
+        public:
+            /**
+             * @param share true to give every operation the holds, otherwise the first takes them
+             */
+            Attach(Holds* holds, bool share = false) : _last(_attached), _lastShare(_share) {
+                _attached = holds;
+                _share = share;
+            }
+
+            ~Attach() {
+                _attached = _last;
+                _share = _lastShare;
+            }
+
+        private:
+            Holds* const _last;
+            const bool _lastShare;
+        };
+
+        /**
+         * Opens the journal, a new load starts it over if the last one finished
+         * @param path empty for a journal that records nothing, i.e. for a dry run
+         */
+        Journal(std::string path, bool resume);
+
+        ~Journal();
+
+        /**
+         * @return a token that appends record once every holder lets go
+         */
+        Token start(std::string record) {
+            return std::make_shared<Entry>(this, std::move(record));
+        }
+
+        /**
+         * @return true if record was journaled by an earlier run
+         */
+        bool done(const std::string& record) const {
+            return _done.count(record);
+        }
+
+        bool resuming() const {
+            return _resume;
+        }
+
+        /**
+         * Records that the load completed, all of its writes are done
+         */
+        void finish() {
+            append(FINISHED);
+        }
+
+        /**
+         * @return pieces of segment that an earlier run didn't finish
+         */
+        tools::LocSegMapping remaining(const tools::LocSegment& segment, long long fileSize) const;
+
+        static std::string segmentRecord(const tools::LocSegment& segment);
+
+        static std::string chunkRecord(const Bson& chunkUB);
+
+        /**
+         * Sets the token documents read on this thread belong to, nullptr for none
+         */
+        static void currentSet(Token token) {
+            _current = std::move(token);
+        }
+
+        /**
+         * Adds the current token to a batch's holds unless it is already the last one
+         */
+        static void track(Holds* holds) {
+            if (_current && (holds->empty() || holds->back() != _current))
+                holds->push_back(_current);
+        }
+
+        /**
+         * Moves the attached holds into an operation
+         */
+        static void attach(Holds* holds) {
+            if (!_attached) return;
+            holds->insert(holds->end(), _attached->begin(), _attached->end());
+            if (!_share) _attached->clear();
+        }
+
+        /**
+         * Merges holds, keeping one copy of each token on the end
+         */
+        static void merge(Holds* holds, Holds* from);
+
+    private:
+        static const char FINISHED[];
+
+        static thread_local Token _current;
+        static thread_local Holds* _attached;
+        static thread_local bool _share;
+
+        const std::string _path;
+        const bool _resume;
+        std::unordered_set<std::string> _done;
+        //Finished byte ranges by file from the segment records, an end of 0 is the end of file
+        std::unordered_map<std::string, std::vector<std::pair<long long, long long>>> _ranges;
+        tools::Mutex _mutex;
+        tools::ConditionVariable _syncNotify;
+        //Records written and records covered by a sync, one thread syncs at a time
+        size_t _written{};
+        size_t _synced{};
+        bool _syncing{};
+        int _fd{-1};
+
+        void append(const std::string& record);
+    };
+
+}  //namespace loader
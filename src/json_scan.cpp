@@ -0,0 +1,115 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "json_scan.h"
+#include <algorithm>
+#include "block_masks.h"
+
+namespace tools {
+
+    namespace {
+        using blockmasks::BLOCK;
+
+        struct Masks {
+            uint64_t quote;
+            uint64_t backslash;
+            uint64_t structure;
+        };
+
+        inline void masksTail(const char* block, size_t size, Masks* masks) {
+            using blockmasks::eqTail;
+            masks->quote = eqTail(block, size, '"');
+            masks->backslash = eqTail(block, size, '\\');
+            masks->structure = eqTail(block, size, '{') | eqTail(block, size, '}')
+                               | eqTail(block, size, '[') | eqTail(block, size, ']')
+                               | eqTail(block, size, ',');
+        }
+
+        inline void masksFull(const char* data, Masks* masks) {
+            blockmasks::Block block(data);
+            masks->quote = block.eq('"');
+            masks->backslash = block.eq('\\');
+            masks->structure = block.eq('{') | block.eq('}') | block.eq('[') | block.eq(']')
+                               | block.eq(',');
+        }
+
+        /**
+         * @return the bytes following an odd length run of backslashes, i.e. escaped
+         * @param carry in: the block starts escaped, out: the block ends in an odd run
+         */
+        inline uint64_t escapedBytes(uint64_t backslash, uint64_t* carry) {
+            const uint64_t evenBits = 0x5555555555555555ULL;
+            const uint64_t oddBits = ~evenBits;
+            uint64_t startEdges = backslash & ~(backslash << 1);
+            //A run continuing from the last block has the opposite parity
+            uint64_t evenStartMask = evenBits ^ *carry;
+            uint64_t evenStarts = startEdges & evenStartMask;
+            uint64_t oddStarts = startEdges & ~evenStartMask;
+            uint64_t evenCarries = backslash + evenStarts;
+            uint64_t oddCarries = backslash + oddStarts;
+            bool endsOdd = oddCarries < backslash;
+            oddCarries |= *carry;
+            *carry = endsOdd ? 1 : 0;
+            uint64_t evenCarryEnds = evenCarries & ~backslash;
+            uint64_t oddCarryEnds = oddCarries & ~backslash;
+            return (evenCarryEnds & oddBits) | (oddCarryEnds & evenBits);
+        }
+
+    }  //namespace
+
+    void JsonScan::scan(const char* begin, const char* end, State start) {
+        _commas.clear();
+        uint64_t inString = start.inString ? ~uint64_t(0) : 0;
+        uint64_t carry = start.escaped ? 1 : 0;
+        long long depth {};
+        long long low {};
+        for (const char* block = begin; block < end; block += BLOCK) {
+            size_t size = std::min(size_t(end - block), BLOCK);
+            Masks masks;
+            if (size == BLOCK) masksFull(block, &masks);
+            else masksTail(block, size, &masks);
+            uint64_t escaped = escapedBytes(masks.backslash, &carry);
+            //A partial block's carry is the bit just past its end
+            if (size != BLOCK) carry = (escaped >> size) & 1;
+            uint64_t strings = blockmasks::prefixXor(masks.quote & ~escaped) ^ inString;
+            inString = uint64_t(int64_t(strings) >> 63);
+            for (uint64_t structure = masks.structure & ~strings; structure;
+                    structure &= structure - 1) {
+                int bit = __builtin_ctzll(structure);
+                switch (block[bit]) {
+                case '{': case '[':
+                    ++depth;
+                    break;
+                case '}': case ']':
+                    low = std::min(low, --depth);
+                    break;
+                default:
+                    if (depth == low && (_commas.empty() || depth < _commas.back().depth))
+                        _commas.push_back(Comma {depth, size_t(block - begin) + bit + 1});
+                    break;
+                }
+            }
+        }
+        _endState = State {inString != 0, carry != 0};
+        _endDepth = depth;
+    }
+
+    long long JsonScan::commaAt(long long depth) const {
+        for (auto&& comma : _commas)
+            if (comma.depth == depth) return comma.offset;
+        return -1;
+    }
+
+}  //namespace tools
@@ -0,0 +1,81 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace tools {
+
+    /**
+     * Structural scan of JSON text in the style of simdjson.  Each 64 byte block is turned into
+     * bit masks of its quotes, backslashes and structural characters.  Escaped quotes and what
+     * is inside strings are then found with bit arithmetic, not a branch per byte.  Only the
+     * brackets and commas outside of strings are visited one at a time, to track the depth.
+     *
+     * A scan may start anywhere with a guessed state, so the pieces of a file can be scanned at
+     * once.  A piece whose guess turns out wrong, once the piece before it is done, is scanned
+     * again from the real state.
+     */
+    class JsonScan {
+    public:
+        struct State {
+            bool inString;
+            //The first byte is escaped by a backslash run that ends the previous piece
+            bool escaped;
+
+            bool operator==(const State& other) const {
+                return inString == other.inString && escaped == other.escaped;
+            }
+
+            bool operator!=(const State& other) const {
+                return !(*this == other);
+            }
+        };
+
+        /**
+         * Scans [begin, end), depths are relative to the depth at begin
+         */
+        void scan(const char* begin, const char* end, State start);
+
+        const State& endState() const {
+            return _endState;
+        }
+
+        long long endDepth() const {
+            return _endDepth;
+        }
+
+        /**
+         * Only the first comma at each new low of the depth is kept, so depth must be the lowest
+         * the scan can reach, i.e. the depth of a top level array's elements.
+         * @return the offset from begin just past the first comma at depth, -1 if there isn't one
+         */
+        long long commaAt(long long depth) const;
+
+    private:
+        struct Comma {
+            long long depth;
+            size_t offset;
+        };
+
+        State _endState {};
+        long long _endDepth{};
+        std::vector<Comma> _commas;
+    };
+
+}  //namespace tools
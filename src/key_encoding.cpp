@@ -0,0 +1,291 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "key_encoding.h"
+#include <array>
+#include <cmath>
+#include <cstring>
+
+namespace tools {
+
+    namespace {
+        //Fewer records than this per thread aren't worth a thread
+        constexpr size_t RANGE_MIN = 64 * 1024;
+
+        size_t rangeCount(size_t count, size_t threads) {
+            return std::max<size_t>(1, std::min(threads, count / RANGE_MIN));
+        }
+
+        /**
+         * Runs each task on its own thread, the first on the caller's
+         */
+        void runAll(const std::vector<std::function<void()>>& tasks) {
+            std::vector<std::thread> running;
+            for (size_t task = 1; task < tasks.size(); ++task)
+                running.emplace_back(tasks[task]);
+            if (!tasks.empty()) tasks[0]();
+            for (auto&& thread : running)
+                thread.join();
+        }
+
+        //Sign flipped so that signed order is unsigned order
+        inline uint64_t flipSign(int64_t value) {
+            return uint64_t(value) ^ (uint64_t(1) << 63);
+        }
+
+        inline void appendBigEndian(uint64_t value, std::string* out) {
+            char bytes[8];
+            for (int i = 7; i >= 0; --i, value >>= 8)
+                bytes[i] = char(value & 0xff);
+            out->append(bytes, sizeof(bytes));
+        }
+
+        /**
+         * Doubles as unsigned integers in numeric order, used outside the int64 range
+         */
+        inline uint64_t doubleBits(double value) {
+            uint64_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            return bits & (uint64_t(1) << 63) ? ~bits : bits | (uint64_t(1) << 63);
+        }
+
+        //Numbers below, in and above the int64 range, NaN sorts before all numbers
+        enum NumberRange : char {
+            NUMBER_NAN = 0, NUMBER_BELOW = 1, NUMBER_INT64 = 2, NUMBER_ABOVE = 3
+        };
+
+        /**
+         * Integer part then fraction, so int, long and double compare exactly
+         */
+        void appendNumber(const mongo::BSONElement& e, std::string* out) {
+            if (e.type() != mongo::NumberDouble) {
+                out->push_back(NUMBER_INT64);
+                appendBigEndian(flipSign(e.numberLong()), out);
+                appendBigEndian(doubleBits(0), out);
+                return;
+            }
+            double value = e.numberDouble();
+            //2^63, the first double past the int64 range
+            const double int64End = 9223372036854775808.0;
+            if (std::isnan(value)) out->push_back(NUMBER_NAN);
+            else if (value < -int64End || value >= int64End) {
+                out->push_back(value < 0 ? NUMBER_BELOW : NUMBER_ABOVE);
+                appendBigEndian(doubleBits(value), out);
+            }
+            else {
+                double integer = std::floor(value);
+                out->push_back(NUMBER_INT64);
+                appendBigEndian(flipSign(int64_t(integer)), out);
+                //Positive doubles order as their bits
+                appendBigEndian(doubleBits(value - integer), out);
+            }
+        }
+
+        /**
+         * Zero bytes are escaped to 00 01 and the string ends with 00 00, keeping the encoding
+         * prefix free so that the following fields can't change the order
+         */
+        void appendString(const char* str, size_t size, std::string* out) {
+            const char* end = str + size;
+            for (const char* zero; (zero = static_cast<const char*>(memchr(str, 0, end - str)));
+                    str = zero + 1) {
+                out->append(str, zero - str);
+                out->append("\0\x01", 2);
+            }
+            out->append(str, end - str);
+            out->append("\0\0", 2);
+        }
+
+        bool appendElement(const mongo::BSONElement& e, std::string* out) {
+            //Canonical types run from -1 (MinKey) to 127 (MaxKey)
+            out->push_back(char(e.canonicalType() + 1));
+            switch (e.type()) {
+            case mongo::MinKey:
+            case mongo::MaxKey:
+            case mongo::jstNULL:
+            case mongo::Undefined:
+                return true;
+            case mongo::NumberDouble:
+            case mongo::NumberInt:
+            case mongo::NumberLong:
+                appendNumber(e, out);
+                return true;
+            case mongo::String:
+            case mongo::Symbol:
+                appendString(e.valuestr(), e.valuestrsize() - 1, out);
+                return true;
+            case mongo::jstOID:
+                out->append(e.value(), 12);
+                return true;
+            case mongo::Bool:
+                out->push_back(e.boolean() ? 1 : 0);
+                return true;
+            case mongo::Date: {
+                int64_t millis;
+                std::memcpy(&millis, e.value(), sizeof(millis));
+                appendBigEndian(flipSign(millis), out);
+                return true;
+            }
+            case mongo::Timestamp:
+                appendBigEndian(e.timestampValue(), out);
+                return true;
+            default:
+                return false;
+            }
+        }
+    }  //namespace
+
+    KeyEncoder::KeyEncoder(const mongo::BSONObj& sortIndex, Source source) :
+            _source(source)
+    {
+        for (mongo::BSONObjIterator i(sortIndex); i.more();) {
+            mongo::BSONElement key = i.next();
+            _fields.push_back(key.fieldName());
+            //Same rule as Ordering::make, hashed and the like are ascending
+            _descending.push_back(key.isNumber() && key.numberInt() < 0);
+        }
+    }
+
+    mongo::BSONElement KeyEncoder::value(mongo::BSONObjIterator* i, const mongo::BSONObj& obj,
+                                         size_t field) const {
+        if (_source == Source::DOCUMENT) return obj.getField(_fields[field]);
+        return i->more() ? i->next() : mongo::BSONElement();
+    }
+
+    bool KeyEncoder::encode(const mongo::BSONObj& obj, std::string* out) const {
+        out->clear();
+        mongo::BSONObjIterator i(obj);
+        for (size_t field = 0; field < _fields.size(); ++field) {
+            mongo::BSONElement e = value(&i, obj, field);
+            //A short key sorts first as with woCompare, a missing document field before any value
+            if (e.eoo()) {
+                if (_source == Source::KEY) break;
+                out->push_back(_descending[field] ? char(0xfe) : char(1));
+                continue;
+            }
+            size_t start = out->size();
+            if (!appendElement(e, out)) return false;
+            if (_descending[field])
+                for (size_t pos = start; pos < out->size(); ++pos)
+                    (*out)[pos] = ~(*out)[pos];
+        }
+        return true;
+    }
+
+    bool KeyEncoder::encode(const mongo::BSONObj& obj, uint64_t* out) const {
+        if (_fields.size() != 1) return false;
+        mongo::BSONObjIterator i(obj);
+        mongo::BSONElement e = value(&i, obj, 0);
+        if (e.type() != mongo::NumberLong && e.type() != mongo::NumberInt) return false;
+        *out = flipSign(e.numberLong());
+        if (_descending[0]) *out = ~*out;
+        return true;
+    }
+
+    bool parallelRanges(size_t count, size_t threads,
+                        const std::function<bool(size_t range, size_t begin, size_t end)>& work) {
+        size_t ranges = rangeCount(count, threads);
+        if (ranges == 1) return work(0, 0, count);
+        std::vector<char> results(ranges);
+        std::vector<std::function<void()>> tasks;
+        for (size_t range = 0; range < ranges; ++range)
+            tasks.emplace_back([&, range] {
+                results[range] = work(range, count * range / ranges, count * (range + 1) / ranges);
+            });
+        runAll(tasks);
+        return std::find(results.begin(), results.end(), false) == results.end();
+    }
+
+    void radixSort(FixedKeyRecord* records, size_t count, size_t threads) {
+        if (count < 2) return;
+        std::vector<FixedKeyRecord> scratch(count);
+        FixedKeyRecord* from = records;
+        FixedKeyRecord* to = scratch.data();
+        std::vector<std::array<size_t, 256>> counts(rangeCount(count, threads));
+        for (int shift = 0; shift < 64; shift += 8) {
+            parallelRanges(count, threads, [&](size_t range, size_t begin, size_t end) {
+                auto& histogram = counts[range];
+                histogram.fill(0);
+                for (size_t i = begin; i < end; ++i)
+                    ++histogram[(from[i].key >> shift) & 0xff];
+                return true;
+            });
+            //Each range scatters to its own slice of every bucket so the sort stays stable
+            size_t offset = 0;
+            bool skip = false;
+            for (size_t digit = 0; digit < 256; ++digit) {
+                size_t begin = offset;
+                for (auto&& histogram : counts) {
+                    size_t n = histogram[digit];
+                    histogram[digit] = offset;
+                    offset += n;
+                }
+                if (offset - begin == count) skip = true;
+            }
+            if (skip) continue;
+            parallelRanges(count, threads, [&](size_t range, size_t begin, size_t end) {
+                auto& next = counts[range];
+                for (size_t i = begin; i < end; ++i)
+                    to[next[(from[i].key >> shift) & 0xff]++] = from[i];
+                return true;
+            });
+            std::swap(from, to);
+        }
+        if (from != records) std::copy(from, from + count, records);
+    }
+
+    void parallelSort(BytesKeyRecord* records, size_t count, size_t threads) {
+        size_t ranges = rangeCount(count, threads);
+        if (ranges == 1) {
+            std::sort(records, records + count);
+            return;
+        }
+        std::vector<size_t> bounds;
+        for (size_t range = 0; range <= ranges; ++range)
+            bounds.push_back(count * range / ranges);
+        std::vector<BytesKeyRecord> scratch(count);
+        BytesKeyRecord* from = records;
+        BytesKeyRecord* to = scratch.data();
+        parallelRanges(count, threads, [from](size_t, size_t begin, size_t end) {
+            std::sort(from + begin, from + end);
+            return true;
+        });
+        while (bounds.size() > 2) {
+            std::vector<size_t> merged;
+            std::vector<std::function<void()>> tasks;
+            for (size_t block = 0; block + 1 < bounds.size(); block += 2) {
+                merged.push_back(bounds[block]);
+                if (block + 2 < bounds.size()) {
+                    size_t begin = bounds[block], middle = bounds[block + 1],
+                            end = bounds[block + 2];
+                    tasks.emplace_back([from, to, begin, middle, end] {
+                        std::merge(from + begin, from + middle, from + middle, from + end,
+                                   to + begin);
+                    });
+                }
+                else {
+                    //An odd block out is carried to the next round
+                    std::copy(from + bounds[block], from + bounds[block + 1], to + bounds[block]);
+                }
+            }
+            merged.push_back(count);
+            runAll(tasks);
+            bounds.swap(merged);
+            std::swap(from, to);
+        }
+        if (from != records) std::copy(from, from + count, records);
+    }
+
+}  //namespace tools
@@ -0,0 +1,253 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+#include "mongo_cxxdriver.h"
+#include "threading.h"
+
+namespace tools {
+
+    /**
+     * Normalizes shard key values into a form that compares with memcmp (std::string) or as
+     * an unsigned integer (uint64_t), in the same order BSONObjCmp gives with woCompare.
+     * The idea is KeyString's: pay to walk the BSON once per document, then sort and route on
+     * plain bytes.
+     * Numbers are exact across int, long and double.  Strings, OIDs, bools, dates, timestamps,
+     * null, MinKey and MaxKey are encoded.  Other types are not, encode() returns false and
+     * the caller has to stay on BSONObjCmp.
+     */
+    class KeyEncoder {
+    public:
+        enum class Source {
+            //The values are the fields of a key object, in order, the names don't matter
+            KEY,
+            //The values are the fields of a document named by the sort index
+            DOCUMENT
+        };
+
+        KeyEncoder(const mongo::BSONObj& sortIndex, Source source);
+
+        /**
+         * Appends the memcmp ordered form of the key values in obj to out
+         * @return false if a value can't be encoded
+         */
+        bool encode(const mongo::BSONObj& obj, std::string* out) const;
+
+        /**
+         * Fixed width form, only single field keys with integer values (i.e. hashes) fit
+         * @return false if the key doesn't fit, the string form may still work
+         */
+        bool encode(const mongo::BSONObj& obj, uint64_t* out) const;
+
+    private:
+        std::vector<std::string> _fields;
+        //True for descending fields
+        std::vector<bool> _descending;
+        const Source _source;
+
+        mongo::BSONElement value(mongo::BSONObjIterator* i, const mongo::BSONObj& obj,
+                                 size_t field) const;
+    };
+
+    /**
+     * Fixed width key and the position of what it was encoded from
+     */
+    struct FixedKeyRecord {
+        uint64_t key;
+        size_t position;
+
+        bool operator<(const FixedKeyRecord& rhs) const {
+            return key < rhs.key;
+        }
+    };
+
+    /**
+     * String key, the bytes are held elsewhere, and the position of what it was encoded from
+     */
+    struct BytesKeyRecord {
+        const char* key;
+        size_t size;
+        size_t position;
+
+        bool operator<(const BytesKeyRecord& rhs) const {
+            int cmp = std::memcmp(key, rhs.key, std::min(size, rhs.size));
+            return cmp < 0 || (cmp == 0 && size < rhs.size);
+        }
+    };
+
+    /**
+     * Runs work over [0, count) split into a contiguous range per thread.  Small counts or one
+     * thread are a single range on the caller's thread.
+     * @return false if work returned false for any range
+     */
+    bool parallelRanges(size_t count, size_t threads,
+                        const std::function<bool(size_t range, size_t begin, size_t end)>& work);
+
+    /**
+     * LSD radix sort a byte at a time, passes where every key has the same byte are skipped.
+     * The histograms and scatters are split over threads.
+     */
+    void radixSort(FixedKeyRecord* records, size_t count, size_t threads);
+
+    /**
+     * Sorts a block per thread, then merges the blocks pairwise in parallel
+     */
+    void parallelSort(BytesKeyRecord* records, size_t count, size_t threads);
+
+    inline void sortRecords(FixedKeyRecord* records, size_t count, size_t threads) {
+        radixSort(records, count, threads);
+    }
+
+    inline void sortRecords(BytesKeyRecord* records, size_t count, size_t threads) {
+        parallelSort(records, count, threads);
+    }
+
+    /**
+     * Encodes keyOf(value) of each value of a random access container in fixed width
+     * @return false if a key doesn't fit
+     */
+    template<typename Container, typename KeyOf>
+    bool encodeRecords(const KeyEncoder& encoder, const Container& container, KeyOf keyOf,
+                       size_t threads, std::vector<FixedKeyRecord>* records) {
+        records->resize(container.size());
+        return parallelRanges(records->size(), threads, [&](size_t, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                (*records)[i].position = i;
+                if (!encoder.encode(keyOf(container[i]), &(*records)[i].key)) return false;
+            }
+            return true;
+        });
+    }
+
+    /**
+     * Encodes keyOf(value) of each value of a random access container as bytes
+     * @param buffers holds the bytes the records point to
+     * @return false if a key can't be encoded
+     */
+    template<typename Container, typename KeyOf>
+    bool encodeRecords(const KeyEncoder& encoder, const Container& container, KeyOf keyOf,
+                       size_t threads, std::vector<BytesKeyRecord>* records,
+                       std::vector<std::string>* buffers) {
+        records->resize(container.size());
+        //A buffer per range, the records point into them once they stop growing
+        buffers->assign(std::max<size_t>(threads, 1), std::string());
+        std::vector<size_t> offsets(records->size());
+        return parallelRanges(records->size(), threads, [&](size_t range, size_t begin,
+                                                            size_t end) {
+            std::string& buffer = (*buffers)[range];
+            for (size_t i = begin; i < end; ++i) {
+                offsets[i] = buffer.size();
+                if (!encoder.encode(keyOf(container[i]), &buffer)) return false;
+                (*records)[i].size = buffer.size() - offsets[i];
+                (*records)[i].position = i;
+            }
+            for (size_t i = begin; i < end; ++i)
+                (*records)[i].key = buffer.data() + offsets[i];
+            return true;
+        });
+    }
+
+    //Input in more ascending runs than this is sorted instead of merged
+    constexpr size_t MERGE_RUNS_MAX = 16;
+
+    /**
+     * Puts records that arrive in a few ascending runs, i.e. input exported in key order, into
+     * key order by merging the runs.  Equal keys keep their order.
+     * @return the runs found: 1 if the records were already in order and 0 if there are more
+     * than MERGE_RUNS_MAX, the records are then unchanged
+     */
+    template<typename Record>
+    size_t mergeRuns(Record* records, size_t count) {
+        std::vector<size_t> bounds {0};
+        for (size_t i = 1; i < count; ++i) {
+            if (!(records[i] < records[i - 1])) continue;
+            if (bounds.size() == MERGE_RUNS_MAX) return 0;
+            bounds.push_back(i);
+        }
+        size_t runs = bounds.size();
+        bounds.push_back(count);
+        //Neighbouring runs are merged pairwise until one is left
+        while (bounds.size() > 2) {
+            std::vector<size_t> merged {0};
+            for (size_t run = 0; run + 2 < bounds.size(); run += 2) {
+                std::inplace_merge(records + bounds[run], records + bounds[run + 1],
+                                   records + bounds[run + 2]);
+                merged.push_back(bounds[run + 2]);
+            }
+            if (merged.back() != count) merged.push_back(count);
+            bounds.swap(merged);
+        }
+        return runs;
+    }
+
+    namespace detail {
+        /**
+         * Moves the container's values into the order of the sorted records
+         */
+        template<typename Container, typename Record>
+        void permute(Container* container, const std::vector<Record>& records) {
+            Container sorted(container->size());
+            for (size_t i = 0; i < records.size(); ++i)
+                sorted[i] = std::move((*container)[records[i].position]);
+            container->swap(sorted);
+        }
+
+        template<typename Container, typename KeyOf>
+        bool sortFixed(const KeyEncoder& encoder, Container* container, KeyOf keyOf,
+                       size_t threads) {
+            std::vector<FixedKeyRecord> records;
+            if (!encodeRecords(encoder, *container, keyOf, threads, &records)) return false;
+            size_t runs = mergeRuns(records.data(), records.size());
+            if (!runs) radixSort(records.data(), records.size(), threads);
+            if (runs != 1) permute(container, records);
+            return true;
+        }
+
+        template<typename Container, typename KeyOf>
+        bool sortBytes(const KeyEncoder& encoder, Container* container, KeyOf keyOf,
+                       size_t threads) {
+            std::vector<BytesKeyRecord> records;
+            std::vector<std::string> buffers;
+            if (!encodeRecords(encoder, *container, keyOf, threads, &records, &buffers))
+                return false;
+            size_t runs = mergeRuns(records.data(), records.size());
+            if (!runs) parallelSort(records.data(), records.size(), threads);
+            if (runs != 1) permute(container, records);
+            return true;
+        }
+    }  //namespace detail
+
+    /**
+     * Sorts a random access container by the encoded key of keyOf(value), fixed width when
+     * every key fits.  Encoding and sorting use up to threads threads.  Containers already in
+     * key order are left as they are, those in a few runs are merged, see mergeRuns().
+     * @return false if a key can't be encoded, the container is unchanged
+     */
+    template<typename Container, typename KeyOf>
+    bool sortEncoded(const KeyEncoder& encoder, Container* container, KeyOf keyOf,
+                     size_t threads = 1) {
+        return detail::sortFixed(encoder, container, keyOf, threads)
+               || detail::sortBytes(encoder, container, keyOf, threads);
+    }
+
+}  //namespace tools
@@ -0,0 +1,123 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "line_scan.h"
+#include <cstring>
+#include <cstdint>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LINE_SCAN_X86
+#endif
+
+namespace tools {
+
+    namespace {
+#ifdef LINE_SCAN_X86
+        inline const char* findNewlineTail(const char* pos, const char* end) {
+            const void* found = memchr(pos, '\n', end - pos);
+            return found ? static_cast<const char*>(found) : end;
+        }
+
+        __attribute__((target("sse2")))
+        const char* findNewlineSse2(const char* pos, const char* end) {
+            const __m128i newline = _mm_set1_epi8('\n');
+            for (; end - pos >= 16; pos += 16) {
+                __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pos));
+                int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+                if (mask) return pos + __builtin_ctz(mask);
+            }
+            return findNewlineTail(pos, end);
+        }
+
+        __attribute__((target("avx2")))
+        const char* findNewlineAvx2(const char* pos, const char* end) {
+            const __m256i newline = _mm256_set1_epi8('\n');
+            //Two blocks at a time, JSON lines are usually longer than 64 bytes
+            for (; end - pos >= 64; pos += 64) {
+                __m256i first = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pos));
+                __m256i second = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pos + 32));
+                uint32_t firstMask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(first, newline));
+                uint32_t secondMask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(second, newline));
+                if (firstMask) return pos + __builtin_ctz(firstMask);
+                if (secondMask) return pos + 32 + __builtin_ctz(secondMask);
+            }
+            return findNewlineSse2(pos, end);
+        }
+
+        using FindNewlineFunc = const char* (*)(const char*, const char*);
+
+        FindNewlineFunc selectFindNewline() {
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2")) return &findNewlineAvx2;
+            return &findNewlineSse2;
+        }
+
+        const FindNewlineFunc findNewlineImpl = selectFindNewline();
+#endif
+    }  //namespace
+
+    const char* findNewline(const char* begin, const char* end) {
+#ifdef LINE_SCAN_X86
+        return findNewlineImpl(begin, end);
+#else
+        const void* found = memchr(begin, '\n', end - begin);
+        return found ? static_cast<const char*>(found) : end;
+#endif
+    }
+
+    bool LineReader::next(char** line, size_t* lineSize) {
+        for (;;) {
+            char* begin = _buffer.data() + _lineStart;
+            const char* end = _buffer.data() + _dataEnd;
+            const char* newline = findNewline(begin + _scanned, end);
+            if (newline != end) {
+                *line = begin;
+                *lineSize = newline - begin;
+                begin[*lineSize] = '\0';
+                _lineStart += *lineSize + 1;
+                _position += *lineSize + 1;
+                _scanned = 0;
+                return true;
+            }
+            _scanned = end - begin;
+            if (!fill()) break;
+        }
+        //No newline at the end of the stream
+        if (_lineStart == _dataEnd) return false;
+        *line = _buffer.data() + _lineStart;
+        *lineSize = _dataEnd - _lineStart;
+        _buffer[_dataEnd] = '\0';
+        _position += *lineSize;
+        _lineStart = _dataEnd;
+        _scanned = 0;
+        return true;
+    }
+
+    bool LineReader::fill() {
+        if (!_input || !*_input) return false;
+        if (_lineStart) {
+            std::memmove(_buffer.data(), _buffer.data() + _lineStart, _dataEnd - _lineStart);
+            _dataEnd -= _lineStart;
+            _lineStart = 0;
+        }
+        //A line larger than the buffer
+        if (_dataEnd == _buffer.size() - 1) _buffer.resize(_buffer.size() * 2);
+        _input->read(_buffer.data() + _dataEnd, _buffer.size() - 1 - _dataEnd);
+        size_t count = _input->gcount();
+        _dataEnd += count;
+        return count;
+    }
+
+}  //namespace tools
@@ -0,0 +1,81 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <istream>
+#include <vector>
+
+namespace tools {
+
+    /**
+     * Finds the first newline using the widest vector instructions the cpu has (AVX2/SSE2).
+     * @return pointer to the first '\n' in [begin, end), end if there isn't one
+     */
+    const char* findNewline(const char* begin, const char* end);
+
+    /**
+     * Reads lines out of large blocks of a stream.
+     * Lines are handed out in place and null terminated (the newline is overwritten), they are
+     * valid until the next call to next or reset.  Lines may be modified, i.e. in situ parsing.
+     */
+    class LineReader {
+    public:
+        static constexpr size_t DEFAULT_BLOCK_SIZE = 4 * 1024 * 1024;
+
+        explicit LineReader(size_t blockSize = DEFAULT_BLOCK_SIZE) :
+                _buffer(blockSize + 1) { }
+
+        /**
+         * @param position the offset the stream is currently at, used for position()
+         */
+        void reset(std::istream* input, long long position) {
+            _input = input;
+            _position = position;
+            _lineStart = _dataEnd = _scanned = 0;
+        }
+
+        /**
+         * Gets the next line, without the newline.  The last line doesn't require a newline.
+         * @return false at the end of the stream
+         */
+        bool next(char** line, size_t* lineSize);
+
+        /**
+         * @return the stream offset of the start of the next line
+         */
+        long long position() const {
+            return _position;
+        }
+
+    private:
+        /**
+         * Moves the partial line to the front of the buffer and reads more
+         * @return false if nothing more could be read
+         */
+        bool fill();
+
+        std::istream* _input{};
+        //The last byte is never read into so there is always room for a terminator
+        std::vector<char> _buffer;
+        long long _position{};
+        size_t _lineStart{};
+        size_t _dataEnd{};
+        //Bytes of the current line that are known not to hold a newline
+        size_t _scanned{};
+    };
+
+}  //namespace tools
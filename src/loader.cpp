@@ -15,10 +15,24 @@
 
 #include "loader.h"
 #include <algorithm>
+#include <cstdio>
 #include <exception>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <thread>
 #include <tuple>
+#include <unordered_set>
 #include "input_processor.h"
+#include "memory_budget.h"
+#include "pipeline.h"
+#include "placement.h"
+#include "trace.h"
+#include "wire_stats.h"
 #include "mongo_cxxdriver.h"
 
 /*
@@ -33,8 +47,60 @@
 namespace loader {
 
     void Loader::Settings::process() {
+        if (database.empty() || collection.empty()) {
+            std::cerr << "db and coll are required unless loading a mongodump directory"
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
         endPointSettings.startImmediate = false;
+        if (!dryRun.empty() && dryRun != "discard" && dryRun != "checksum") {
+            std::cerr << "Unknown dry run: " << dryRun << "\nValues are discard, checksum"
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (!chunkMap.empty() && dryRun.empty()) {
+            std::cerr << "A chunk map can only be used for a dry run" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        //Set here so that the end point queues are built with a queue per node
+        if (!tools::Placement::policySet(placement)) {
+            std::cerr << "Unknown placement: " << placement << "\nValues are "
+                      << tools::Placement::policyPretty() << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (endPointSettings.shardDocsPerSecond < 0 || endPointSettings.shardMBPerSecond < 0
+            || endPointSettings.clusterDocsPerSecond < 0
+            || endPointSettings.clusterMBPerSecond < 0 || endPointSettings.maxLag < 0) {
+            std::cerr << "Rate limits and maxLag can't be negative" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        endPointSettings.dryRun = !dryRun.empty();
+        endPointSettings.dryRunChecksum = dryRun == "checksum";
+        if (!transformJson.empty()) {
+            std::string error;
+            if (!transform.specSet(mongo::fromjson(transformJson), &error)) {
+                std::cerr << "Invalid transform: " << error << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        csvSchema.headerSet(csvHeader);
+        if (!csvSchemaFile.empty()) {
+            std::ifstream schemaFile(csvSchemaFile);
+            std::string json((std::istreambuf_iterator<char>(schemaFile)),
+                             std::istreambuf_iterator<char>());
+            std::string error;
+            if (!schemaFile.is_open() || !csvSchema.specSet(mongo::fromjson(json), &error)) {
+                std::cerr << "Invalid csv schema " << csvSchemaFile << ": "
+                          << (schemaFile.is_open() ? error : "unable to open") << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        if ((inputType == "csv" || inputType == "tsv") && csvSchema.empty() && !csvHeader) {
+            std::cerr << "Without a header line csv input needs csv.schema" << std::endl;
+            exit(EXIT_FAILURE);
+        }
         indexHas_id = false;
+        hashed = false;
         indexPos_id = size_t(-1);
         size_t count {};
         if(sharded) {
@@ -63,12 +129,62 @@ namespace loader {
                           << std::endl;
                 exit(EXIT_FAILURE);
             }
+            //Routing reads the shard key from the transformed documents
+            for (auto&& field : shardKeyFields) {
+                if (!transform.produces(field)) {
+                    std::cerr << "The transform removes shard key field: " << field << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+            }
         }
 
         if (!indexHas_id) add_id = false;
+        if (add_idPerChunk && (!add_id || hashed || shardKeyFields.size() != 1
+                || shardKeysBson.firstElement().numberInt() != 1)) {
+            std::cerr << "add_id.perChunk requires add_id and a {_id: 1} shard key" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (!presplitFile.empty()) {
+            if (!sharded || hashed) {
+                std::cerr << "presplit.file needs a range shard key" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            std::ifstream splitFile(presplitFile);
+            std::string json((std::istreambuf_iterator<char>(splitFile)),
+                             std::istreambuf_iterator<char>());
+            mongo::BSONObj saved = splitFile.is_open() ? mongo::fromjson(json) : mongo::BSONObj();
+            if (saved["splits"].type() != mongo::Array) {
+                std::cerr << "No splits in presplit.file: " << presplitFile << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            //Splits of another key would put every document in the wrong chunks
+            if (saved["shardKey"].type() != mongo::Object
+                || saved["shardKey"].Obj().woCompare(shardKeysBson)) {
+                std::cerr << "presplit.file " << presplitFile << " was saved for shard key "
+                          << saved["shardKey"] << ", the load's shard key is "
+                          << shardKeysBson.jsonString() << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            presplitKeys.clear();
+            for (mongo::BSONObjIterator i(saved["splits"].Obj()); i.more();) {
+                mongo::BSONElement split = i.next();
+                if (split.type() != mongo::Object
+                    || split.Obj().nFields() != shardKeysBson.nFields()) {
+                    std::cerr << "Split " << split << " in " << presplitFile
+                              << " isn't a shard key" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                presplitKeys.push_back(split.Obj().getOwned());
+            }
+        }
         dispatchSettings.sortIndex = shardKeysBson;
+        dispatchSettings.shardKeyUnique = shardKeyUnique;
         batcherSettings.sortIndex = shardKeysBson;
 
+        batcherSettings.batchBytes = batchBytes;
+        dispatchSettings.batchBytes = batchBytes;
+        //Coalesced inserts stay within what a single batch may be
+        endPointSettings.coalesceBytes = batchBytes;
         dispatchSettings.workPath = workPath;
         dispatchSettings.directLoad = endPointSettings.directLoad;
 
@@ -91,6 +207,36 @@ namespace loader {
             exit(EXIT_FAILURE);
         }
         chunksPerShard = loadQueues.size();
+        using Dedupe = dispatch::ChunkDispatcher::Dedupe;
+        if (dedupe == "none") dispatchSettings.dedupe = Dedupe::NONE;
+        else if (dedupe == "first") dispatchSettings.dedupe = Dedupe::FIRST;
+        else if (dedupe == "last") dispatchSettings.dedupe = Dedupe::LAST;
+        else if (dedupe == "reject") dispatchSettings.dedupe = Dedupe::REJECT;
+        else {
+            std::cerr << "Unknown dedupe: " << dedupe << "\nValues are none, first, last, reject"
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (dispatchSettings.dedupe != Dedupe::NONE) {
+            //Only the sorting queues see the documents of a key together
+            for (auto&& queue : loadQueues) {
+                if (queue != "ram" && queue != "disk") {
+                    std::cerr << "dedupe needs ram or disk queues, not: " << queue << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+            }
+            //Hashed keys sort by hash, so it is only a match of hashes
+            if (!sharded || hashed) {
+                std::cerr << "dedupe needs a range shard key" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            if (dispatchSettings.dedupe == Dedupe::REJECT && dedupeFile.empty()) {
+                std::cerr << "dedupe reject needs dedupe.file" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        dispatchSettings.dedupeFile = dedupeFile;
+        dispatchSettings.trackWrites = false;
         batcherSettings.loadQueues = &loadQueues;
         dispatchSettings.loadQueues = &loadQueues;
 
@@ -108,6 +254,48 @@ namespace loader {
 
         if (endPointSettings.directLoad) stopBalancer = true;
 
+        tools::mtools::WireStats::compressEstimateSet(compressEstimate);
+
+        if (writeMode == "insert")
+            dispatchSettings.writeMode = dispatch::ChunkDispatcher::WriteMode::INSERT;
+        else if (writeMode == "replace")
+            dispatchSettings.writeMode = dispatch::ChunkDispatcher::WriteMode::REPLACE;
+        else if (writeMode == "merge")
+            dispatchSettings.writeMode = dispatch::ChunkDispatcher::WriteMode::MERGE;
+        else {
+            std::cerr << "Unknown write mode: " << writeMode << "\nValues are insert, replace, merge"
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (dispatchSettings.writeMode != dispatch::ChunkDispatcher::WriteMode::INSERT) {
+            //Upserts refresh what is there, so nothing is dropped and the indexes stay up
+            if (dropDb || dropColl || dropIndexes || deferIndexes)
+                std::cout << "Upserting, nothing is dropped" << std::endl;
+            dropDb = dropColl = dropIndexes = deferIndexes = false;
+            if (batcherSettings.wireBatches) {
+                std::cout << "Wire batches are OP_INSERT messages, not used with upserts"
+                        << std::endl;
+                batcherSettings.wireBatches = false;
+            }
+        }
+
+        if (batcherSettings.wireBatches && dispatchSettings.bulkWriteVersion != 0) {
+            std::cout << "Wire batches are OP_INSERT messages, not used with bulk write version "
+                    << dispatchSettings.bulkWriteVersion << std::endl;
+            batcherSettings.wireBatches = false;
+        }
+
+        if (resume) {
+            //What was loaded before is kept, documents that are written again are duplicates
+            if (dropDb || dropColl || dropIndexes)
+                std::cout << "Resuming, nothing is dropped" << std::endl;
+            dropDb = dropColl = dropIndexes = false;
+            tools::mtools::duplicatesAcceptSet(true);
+            //A generated _id differs each run, so what is written again wouldn't be a duplicate
+            if (add_id) std::cout << "Resuming, _id isn't added" << std::endl;
+            add_id = add_idPerChunk = false;
+        }
+
         if (connstr.substr(0,mongo::uriStart.size()) != mongo::uriStart) {
             connstr = mongo::uriStart + connstr;
         }
@@ -119,22 +307,79 @@ namespace loader {
         }
     }
 
-    Loader::Loader(Settings settings) :
+    Loader::Loader(Settings settings, EndPointHolder* endPoints) :
             _settings(std::move(settings)),
-            _mCluster {_settings.connstr},
-            _ramMax {tools::getTotalSystemMemory()},
+            _mCluster {_settings.connstr, _settings.chunkMap,
+                      tools::mtools::MongoCluster::LoadSettings {_settings.ns(),
+                              _settings.metadataCache, !_settings.chunkMapSave.empty()}},
+            _endPoints(endPoints),
+            _ramMax {_settings.ramBudget ? _settings.ramBudget * 1024 * 1024
+                                         : tools::getTotalSystemMemory() / 4 * 3},
             _threadsMax {(size_t) _settings.threads}
     {
         _writeOps = 0;
-        setupLoad();
-        _mCluster.loadCluster();
-        _endPoints.reset(new EndPointHolder(settings.endPointSettings, _mCluster));
-        _chunkDispatch.reset(new dispatch::ChunkDispatcher(_settings.dispatchSettings,
+        //Started first, chunks tag their work when they are created
+        if (!_settings.traceFile.empty()) tools::Trace::start(_settings.traceFile,
+                                                              _settings.traceSpans);
+        tools::MemoryBudget::limitSet(_ramMax);
+        //A dry run writes nothing, so it has no progress to journal
+        _journal.reset(new Journal(!_settings.dryRun.empty() ? std::string()
+                                   : (_settings.workPath.empty() ? std::string(".")
+                                                                 : _settings.workPath)
+                                     + "/mlightning." + _settings.ns() + ".journal",
+                                   _settings.resume));
+        _segmentJournal = std::all_of(_settings.loadQueues.begin(), _settings.loadQueues.end(),
+                                      [](const std::string& queue) {return queue == "direct";});
+        _queueSettings = _settings.batcherSettings;
+        _queueSettings.journal = _journal.get();
+        _queueSettings.sharedBatches = nullptr;
+        if (_settings.sharedBatches) {
+            _sharedBatches.reset(new docbuilder::SharedBatchPool());
+            _queueSettings.sharedBatches = _sharedBatches.get();
+        }
+        if (_settings.dryRun.empty()) {
+            setupLoad();
+            _mCluster.loadCluster();
+        }
+        else setupDryRun();
+        if (!_settings.chunkMapSave.empty()) _mCluster.chunkMapSave(_settings.chunkMapSave);
+        dispatch::ChunkDispatcher::Settings dispatchSettings = _settings.dispatchSettings;
+        //An existing collection's uniqueness is what its upserts can rely on
+        if (const tools::mtools::MongoCluster::MetaNameSpace* coll =
+                _mCluster.collection(_settings.ns()))
+            dispatchSettings.shardKeyUnique = coll->unique;
+        if (!_endPoints) {
+            tools::mtools::MongoEndPointSettings endPointSettings = _settings.endPointSettings;
+            //Direct writes carry no shard version, so a shard that lost a chunk to a migration
+            //keeps taking its documents rather than rejecting them.  run() watches the chunk
+            //version for that, this only reroutes what a shard does reject
+            if (endPointSettings.directLoad)
+                endPointSettings.reroute = [this](const std::string& ns,
+                                                  tools::mtools::DataQueue* docs) {
+                    return this->_chunkDispatch->reroute(ns, docs);
+                };
+            _ownEndPoints.reset(new EndPointHolder(endPointSettings, _mCluster));
+            _endPoints = _ownEndPoints.get();
+        }
+        //Shared end points outlive the load, so it waits for its own writes instead
+        else dispatchSettings.trackWrites = true;
+        _chunkDispatch.reset(new dispatch::ChunkDispatcher(std::move(dispatchSettings),
                                                            _mCluster,
-                                                           _endPoints.get(),
+                                                           _endPoints,
                                                            _settings.ns()));
     }
 
+    void Loader::setupDryRun() {
+        if (!_mCluster.isSharded() || !_mCluster.chunksCount(_settings.ns())) {
+            std::cerr << "A dry run needs " << _settings.ns() << " to already be sharded, there "
+                    "are no chunks for it in the cluster metadata" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::cout << "Dry run (" << _settings.dryRun << ") over "
+                  << _mCluster.chunksCount(_settings.ns()) << " chunks, nothing will be written"
+                  << std::endl;
+    }
+
     void Loader::setupLoad() {
         if (_settings.sharded) {
             if (!_mCluster.isSharded()) {
@@ -169,13 +414,33 @@ namespace loader {
         else if (_settings.dropIndexes) {
             conn->dropIndexes(_settings.ns());
         }
+        deferIndexes(conn.get());
 
         if (_mCluster.isSharded() && _settings.stopBalancer)
-            if(_mCluster.stopBalancerWait(std::chrono::seconds(120))) {
+            if (!_mCluster.stopBalancerWait(std::chrono::seconds(120))) {
                 std::cerr << "Unable to stop the balancer" << std::endl;
                 exit(EXIT_FAILURE);
             }
 
+        //Upserts into a collection that is already sharded keep its chunks
+        if (_settings.sharded
+            && _settings.dispatchSettings.writeMode != dispatch::ChunkDispatcher::WriteMode::INSERT
+            && _mCluster.chunksCount(_settings.ns())) {
+            //Upserts are matched and routed on the load's key, another one would mismatch them
+            const tools::mtools::MongoCluster::MetaNameSpace* coll =
+                    _mCluster.collection(_settings.ns());
+            if (!coll || coll->key.woCompare(_settings.shardKeysBson)) {
+                std::cerr << _settings.ns() << " is sharded on "
+                          << (coll ? coll->key.jsonString() : std::string("an unknown key"))
+                          << ", the load's shard key is " << _settings.shardKeysBson.jsonString()
+                          << ".  Upserts need the same key, fields and order" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            std::cout << "Upserting into the " << _mCluster.chunksCount(_settings.ns())
+                      << " chunks of " << _settings.ns() << std::endl;
+            return;
+        }
+
         if (_settings.sharded) {
             //TODO: make these checks more sophisticated (i.e. conditions already true? success!)
             mongo::BSONObj info;
@@ -186,25 +451,361 @@ namespace loader {
             }
             assert(_settings.chunksPerShard > 0);
             if (_settings.hashed) {
-                int totalChunks = _settings.chunksPerShard * _mCluster.shards().size();
+                //A single chunk, the split points are known so the layout is built here
                 if (!_mCluster.shardCollection(_settings.ns(), _settings.shardKeysBson,
-                                               _settings.shardKeyUnique, totalChunks, &info)) {
+                                               _settings.shardKeyUnique, 1, &info)) {
                     std::cerr << "Sharding collection failed: " << info << "\nExiting" << std::endl;
                     exit(EXIT_FAILURE);
                 }
-                _mCluster.waitForChunksPerShard(_settings.ns(),_settings.chunksPerShard);
+                splitAndPlace(hashedSplits(_settings.chunksPerShard * _mCluster.shards().size()),
+                              ChunkSpread::BLOCKS);
             }
             else {
-                //Don't do presplits for non-hashed here, no idea what the data is yet
                 if (!_mCluster.shardCollection(_settings.ns(), _settings.shardKeysBson,
                                                _settings.shardKeyUnique,  &info)) {
                     std::cerr << "Sharding collection failed: " << info << "\nExiting" << std::endl;
                     exit(EXIT_FAILURE);
                 }
+                //Range keys need a look at the data to know where to split
+                presplit();
             }
         }
     }
 
+    void Loader::presplit() {
+        _mCluster.loadCluster();
+        //Only a new collection, one that is already split has its own data distribution
+        if (_mCluster.chunksCount(_settings.ns()) != 1) return;
+        size_t chunks = _settings.chunksPerShard * _mCluster.shards().size();
+        std::vector<mongo::BSONObj> splits;
+        //A clone splits where its source is split, a load where its scan suggested
+        if (_settings.cloneLoad || !_settings.presplitFile.empty()) {
+            splits = _settings.presplitKeys;
+            std::cout << "Presplitting " << _settings.ns() << " at the "
+                      << (_settings.cloneLoad ? "source's " : "scanned ") << splits.size() + 1
+                      << " chunks" << std::endl;
+        }
+        //The ids are generated into the chunks, there is nothing in the input to sample
+        else if (_settings.add_idPerChunk) {
+            splits = oidSplits(chunks);
+            std::cout << "Presplitting " << _settings.ns() << " into " << splits.size() + 1
+                      << " chunks of generated _ids" << std::endl;
+        }
+        else if (_settings.presplitSamples && chunks > 1
+            && !StreamInputProcessor::isStream(_settings.loadDir)) {
+            std::vector<mongo::BSONObj> sample = FileInputProcessor::sampleKeys(_settings.loadDir,
+                    _settings.fileRegex, _settings.inputType, _settings.shardKeysBson,
+                    chunks * _settings.presplitSamples, &_settings.transform,
+                    &_settings.csvSchema);
+            tools::BSONObjCmp compare(_settings.shardKeysBson);
+            std::sort(sample.begin(), sample.end(), compare);
+            for (size_t chunk = 1; chunk < chunks && !sample.empty(); ++chunk) {
+                const mongo::BSONObj& split = sample[chunk * sample.size() / chunks];
+                //Skewed keys can repeat across quantiles, a chunk is needed between splits
+                if (splits.empty() || compare(splits.back(), split)) splits.push_back(split);
+            }
+            std::cout << "Presplitting " << _settings.ns() << " from " << sample.size()
+                      << " sampled keys into " << splits.size() + 1 << " chunks" << std::endl;
+        }
+        splitAndPlace(std::move(splits), ChunkSpread::ROUND_ROBIN);
+    }
+
+    std::vector<mongo::BSONObj> Loader::hashedSplits(size_t chunks) const {
+        std::vector<mongo::BSONObj> splits;
+        //Hashes are the whole signed 64 bit range
+        const uint64_t step = std::numeric_limits<uint64_t>::max() / std::max(chunks, size_t(1));
+        const uint64_t base = uint64_t(std::numeric_limits<int64_t>::min());
+        for (size_t chunk = 1; chunk < chunks; ++chunk) {
+            mongo::BSONObjBuilder split;
+            for (mongo::BSONObjIterator i(_settings.shardKeysBson); i.more();) {
+                mongo::BSONElement field = i.next();
+                if (field.type() == mongo::String && std::string(field.valuestr()) == "hashed")
+                    split.append(field.fieldName(), static_cast<long long>(base + chunk * step));
+                else
+                    split.appendMinKey(field.fieldName());
+            }
+            splits.push_back(split.obj());
+        }
+        return splits;
+    }
+
+    std::vector<mongo::BSONObj> Loader::oidSplits(size_t chunks) const {
+        std::vector<mongo::BSONObj> splits;
+        const tools::OidGenerator::Value step =
+                tools::OidGenerator::VALUE_END / std::max(chunks, size_t(1));
+        for (size_t chunk = 1; chunk < chunks; ++chunk)
+            splits.push_back(tools::OidGenerator::idObj(step * chunk));
+        return splits;
+    }
+
+    void Loader::splitAndPlace(std::vector<mongo::BSONObj> splits, ChunkSpread spread) {
+        _mCluster.loadCluster();
+        auto tags = _mCluster.nsTagRanges().find(_settings.ns());
+        bool tagged = tags != _mCluster.nsTagRanges().end() && tags->second.size();
+        if (splits.empty() && !tagged) return;
+        tools::SimpleTimer<> timerSplit;
+        tools::BSONObjCmp compare(_settings.shardKeysBson);
+        //Chunks can't straddle a zone, so there are bounds at every tag range end
+        if (tagged) {
+            for (auto&& range : tags->second) {
+                for (auto&& bound : {range.second.min, range.second.max}) {
+                    mongo::BSONType type = bound.firstElement().type();
+                    if (type != mongo::MinKey && type != mongo::MaxKey) splits.push_back(bound);
+                }
+            }
+        }
+        //Bounds the namespace already has can't be split at again
+        auto& chunks = _mCluster.nsChunks(_settings.ns());
+        std::vector<mongo::BSONObj> bounds;
+        for (auto&& chunk : chunks)
+            bounds.push_back(chunk.first);
+        std::sort(splits.begin(), splits.end(), compare);
+        auto same = [&compare](const mongo::BSONObj& l, const mongo::BSONObj& r) {
+            return !compare(l, r) && !compare(r, l);
+        };
+        splits.erase(std::unique(splits.begin(), splits.end(), same), splits.end());
+        splits.erase(std::remove_if(splits.begin(), splits.end(),
+                                    [&](const mongo::BSONObj& split) {
+                                        return std::binary_search(bounds.begin(), bounds.end(),
+                                                                  split, compare);}),
+                     splits.end());
+
+        /*
+         * The layout: chunk i starts at mins[i].  Chunks in a zone go round robin over the zone's
+         * shards, the others go where spread puts them.
+         */
+        std::vector<std::string> shards;
+        _mCluster.getShardList(&shards);
+        std::sort(shards.begin(), shards.end());
+        mongo::BSONObjBuilder minKey;
+        for (mongo::BSONObjIterator i(_settings.shardKeysBson); i.more();)
+            minKey.appendMinKey(i.next().fieldName());
+        std::vector<mongo::BSONObj> mins {minKey.obj()};
+        mins.insert(mins.end(), splits.begin(), splits.end());
+        std::vector<const std::string*> targets(mins.size());
+        std::unordered_map<tools::mtools::MongoCluster::ShardTag, size_t> tagNext;
+        size_t untagged = 0;
+        for (size_t chunk = 0; tagged && chunk < mins.size(); ++chunk) {
+            auto& ranges = tags->second;
+            auto range = std::upper_bound(ranges.begin(), ranges.end(), mins[chunk],
+                                          ranges.compare());
+            if (range != ranges.end() && !compare(mins[chunk], range->second.min)) {
+                auto& tagShards = range->second.tagShards;
+                if (!tagShards->second.empty())
+                    targets[chunk] = &tagShards->second[tagNext[tagShards->first]++
+                                                        % tagShards->second.size()]->first;
+            }
+        }
+        for (auto&& target : targets)
+            untagged += !target;
+        for (size_t chunk = 0, next = 0; chunk < mins.size(); ++chunk) {
+            if (targets[chunk]) continue;
+            switch (spread) {
+            case ChunkSpread::STAY:
+                targets[chunk] = &chunks.upperBoundSafe(mins[chunk])->first;
+                break;
+            case ChunkSpread::ROUND_ROBIN:
+                targets[chunk] = &shards[next % shards.size()];
+                break;
+            case ChunkSpread::BLOCKS:
+                targets[chunk] = &shards[next * shards.size() / untagged];
+                break;
+            }
+            ++next;
+        }
+
+        //Split between shards, move everything at once, then split within a shard
+        std::vector<mongo::BSONObj> between;
+        std::vector<mongo::BSONObj> within;
+        for (size_t chunk = 1; chunk < mins.size(); ++chunk)
+            (*targets[chunk - 1] != *targets[chunk] ? between : within).push_back(mins[chunk]);
+        std::cout << "Presplitting " << _settings.ns() << " at " << splits.size() << " bounds, "
+                  << between.size() << " between shards" << std::endl;
+        splitParallel(between);
+
+        _mCluster.loadCluster();
+        std::vector<ChunkMove> moves;
+        mongo::BSONObj chunkMin = mins.front();
+        for (auto&& chunk : _mCluster.nsChunks(_settings.ns())) {
+            size_t layout = std::upper_bound(mins.begin(), mins.end(), chunkMin, compare)
+                            - mins.begin() - 1;
+            if (chunk.second->first != *targets[layout])
+                moves.push_back(ChunkMove{chunkMin, chunk.first, chunk.second->first,
+                                          *targets[layout]});
+            chunkMin = chunk.first;
+        }
+        moveParallel(std::move(moves));
+        splitParallel(within);
+
+        _mCluster.flushRouterConfigs();
+        timerSplit.stop();
+        std::cout << "Presplit time: " << timerSplit.seconds() << "s" << std::endl;
+    }
+
+    void Loader::splitParallel(const std::vector<mongo::BSONObj>& points) {
+        if (points.empty()) return;
+        _mCluster.loadCluster();
+        auto& chunks = _mCluster.nsChunks(_settings.ns());
+        //Ranges of points in the same chunk
+        using Range = std::pair<size_t, size_t>;
+        std::vector<Range> ranges;
+        for (size_t first = 0, last; first < points.size(); first = last) {
+            const auto* chunk = &chunks.upperBoundSafe(points[first]);
+            for (last = first + 1;
+                 last < points.size() && &chunks.upperBoundSafe(points[last]) == chunk; ++last);
+            ranges.emplace_back(first, last);
+        }
+        size_t split = 0;
+        while (!ranges.empty()) {
+            std::vector<mongo::BSONObj> commands;
+            std::vector<Range> next;
+            for (auto&& range : ranges) {
+                size_t middle = range.first + (range.second - range.first) / 2;
+                commands.push_back(tools::mtools::MongoCluster::splitCommand(_settings.ns(),
+                                                                             points[middle]));
+                if (range.first < middle) next.emplace_back(range.first, middle);
+                if (middle + 1 < range.second) next.emplace_back(middle + 1, range.second);
+            }
+            split += presplitCommands(commands);
+            std::cout << "Presplit: split " << split << "/" << points.size() << std::endl;
+            ranges.swap(next);
+        }
+    }
+
+    void Loader::moveParallel(std::vector<ChunkMove> moves) {
+        const size_t total = moves.size();
+        size_t moved = 0;
+        while (!moves.empty()) {
+            std::unordered_set<std::string> busy;
+            std::vector<mongo::BSONObj> commands;
+            std::vector<ChunkMove> later;
+            for (auto&& move : moves) {
+                if (busy.count(move.from) || busy.count(move.to)) {
+                    later.push_back(std::move(move));
+                    continue;
+                }
+                busy.insert(move.from);
+                busy.insert(move.to);
+                commands.push_back(tools::mtools::MongoCluster::moveCommand(_settings.ns(),
+                        move.min, move.max, move.to));
+            }
+            moved += presplitCommands(commands);
+            std::cout << "Presplit: moved " << moved << "/" << total << std::endl;
+            moves.swap(later);
+        }
+    }
+
+    size_t Loader::presplitCommands(const std::vector<mongo::BSONObj>& commands) {
+        std::vector<mongo::BSONObj> replies;
+        size_t succeeded = _mCluster.runCommands(commands,
+                _mCluster.shards().size() * PRESPLIT_SHARD_COMMANDS, &replies);
+        if (succeeded == commands.size()) return succeeded;
+        std::vector<mongo::BSONObj> retries;
+        for (size_t i = 0; i < commands.size(); ++i)
+            if (!replies[i]["ok"].trueValue()) retries.push_back(commands[i]);
+        succeeded += _mCluster.runCommands(retries, 1, &replies);
+        for (size_t i = 0; i < retries.size(); ++i)
+            if (!replies[i]["ok"].trueValue())
+                std::cerr << "Presplit command failed: " << retries[i] << ": " << replies[i]
+                          << std::endl;
+        return succeeded;
+    }
+
+    std::string Loader::deferredIndexesPath() const {
+        return (_settings.workPath.empty() ? std::string(".") : _settings.workPath)
+                + "/mlightning." + _settings.ns() + ".indexes";
+    }
+
+    void Loader::deferIndexes(mongo::DBClientBase* conn) {
+        const std::string path = deferredIndexesPath();
+        //Indexes an earlier run dropped and didn't get to build are only known from its file
+        std::unordered_set<std::string> names;
+        {
+            std::ifstream saved(path);
+            std::string line;
+            while (std::getline(saved, line)) {
+                if (line.empty()) continue;
+                mongo::BSONObj spec = mongo::fromjson(line);
+                if (names.insert(spec.getStringField("name")).second)
+                    _deferredIndexes.push_back(spec.getOwned());
+            }
+        }
+        if (!_deferredIndexes.empty())
+            std::cout << "Building the " << _deferredIndexes.size()
+                      << " indexes an earlier load deferred, from " << path << std::endl;
+        if (!_settings.deferIndexes) return;
+        std::vector<mongo::BSONObj> dropping;
+        for (auto&& spec : conn->getIndexSpecs(_settings.ns())) {
+            mongo::BSONObj key = spec.getObjectField("key");
+            if (key.binaryEqual(BSON("_id" << 1)) || spec["unique"].trueValue()
+                || shardKeyPrefixes(key))
+                continue;
+            //createIndexes takes the namespace from the command
+            dropping.push_back(spec.removeField("ns").getOwned());
+            if (names.insert(spec.getStringField("name")).second)
+                _deferredIndexes.push_back(dropping.back());
+        }
+        if (dropping.empty()) return;
+        //The specs are saved before anything is dropped, so a failed load can't lose them
+        const std::string temp = path + ".tmp";
+        {
+            std::ofstream file(temp, std::ios_base::out | std::ios_base::trunc);
+            for (auto&& spec : _deferredIndexes)
+                file << spec.jsonString() << "\n";
+            file.close();
+            if (!file || std::rename(temp.c_str(), path.c_str())) {
+                std::cerr << "Unable to save the deferred indexes to " << path << "\nExiting"
+                          << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (auto&& spec : dropping) {
+            std::cout << "Deferring index: " << spec << std::endl;
+            if (!conn->dropIndex(_settings.ns(), spec.getStringField("name"))) {
+                std::cerr << "Unable to drop index " << spec.getStringField("name") << "\nExiting"
+                          << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    bool Loader::shardKeyPrefixes(const mongo::BSONObj& key) const {
+        if (_settings.shardKeysBson.isEmpty()) return false;
+        mongo::BSONObjIterator keyItr(key);
+        for (mongo::BSONObjIterator shardItr(_settings.shardKeysBson); shardItr.more();) {
+            if (!keyItr.more()) return false;
+            //Same field and direction (or hashed)
+            if (shardItr.next().woCompare(keyItr.next()) != 0) return false;
+        }
+        return true;
+    }
+
+    long Loader::rebuildIndexes() {
+        if (_deferredIndexes.empty()) return 0;
+        tools::SimpleTimer<> timerIndex;
+        std::string error;
+        std::unique_ptr<mongo::DBClientBase> conn(_settings.cs.connect(error));
+        if (!conn) {
+            std::cerr << "Unable to connect to build indexes: " << error << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::cout << "Building " << _deferredIndexes.size() << " deferred indexes" << std::endl;
+        mongo::BSONArrayBuilder indexes;
+        for (auto&& spec : _deferredIndexes)
+            indexes.append(spec);
+        mongo::BSONObj info;
+        //One command builds all of the indexes in a single pass of every shard
+        if (!conn->runCommand(_settings.database, BSON("createIndexes" << _settings.collection
+                                                       << "indexes" << indexes.arr()), info)) {
+            std::cerr << "Unable to build indexes: " << info << "\nThey are kept in "
+                      << deferredIndexesPath() << " for the next load to build" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::remove(deferredIndexesPath().c_str());
+        timerIndex.stop();
+        return timerIndex.seconds();
+    }
+
     void Loader::setEndPoints() {
         _endPoints->start();
     }
@@ -222,9 +823,137 @@ namespace loader {
         for (;;) {
             dispatch::AbstractChunkDispatch* prep = getNextPrep();
             if (prep == nullptr) break;
+            if (!prep->holdsInput()) {
+                prepLoad(prep);
+                continue;
+            }
+            //Every batch the chunk sends holds the token, it is journaled once they are written
+            std::string record = Journal::chunkRecord(prep->settings().chunkUB);
+            if (_journal->done(record)) continue;
+            Journal::Holds holds {_journal->start(std::move(record))};
+            //Batches streamed while the input was read are still in the end point queues
+            prep->sentAheadJoin(holds);
+            Journal::Attach attach(&holds, true);
+            prepLoad(prep);
+        }
+    }
+
+    void Loader::prepLoad(dispatch::AbstractChunkDispatch* prep) {
+        {
+            tools::Trace::Span span("prep", prep->traceTag());
             prep->prep();
-            prep->doLoad();
         }
+        tools::Trace::Span span("doLoad", prep->traceTag());
+        prep->doLoad();
+    }
+
+    void Loader::metricsRegister(const InputProcessor* input, const tools::ThreadPool* finalize) {
+        auto gauge = [this](std::string name, tools::Metrics::Gauge read) {
+            tools::Metrics::gaugeAdd(name, std::move(read));
+            _gauges.push_back(std::move(name));
+        };
+        const double MB = 1024 * 1024;
+        gauge("input.totalBytes", [input] {return input->totalBytes();});
+        gauge("input.readBytes", [] {return tools::ReadAheadStreamBuf::stats().bytesRead;});
+        gauge("queue.input", [input] {return input->queued();});
+        gauge("queue.finalize", [finalize] {return finalize->size();});
+        gauge("queue.queuedMB", [MB] {return tools::MemoryBudget::queued() / MB;});
+        gauge("queue.inFlightMB", [MB] {return tools::MemoryBudget::inFlight() / MB;});
+        //Routing skew shows as the spread between the busiest and quietest chunk
+        gauge("route.docs", [this] {
+            size_t routed = 0;
+            for (auto docs : _chunkDispatch->docsRouted())
+                routed += docs;
+            return routed;
+        });
+        gauge("route.chunkMax", [this] {
+            std::vector<size_t> routed = _chunkDispatch->docsRouted();
+            return routed.empty() ? 0 : *std::max_element(routed.begin(), routed.end());
+        });
+        gauge("route.chunkMin", [this] {
+            std::vector<size_t> routed = _chunkDispatch->docsRouted();
+            return routed.empty() ? 0 : *std::min_element(routed.begin(), routed.end());
+        });
+        gauge("sent.docs", [this] {return _chunkDispatch->docsSent();});
+        gauge("sent.bytes", [this] {return _chunkDispatch->bytesSent();});
+        for (auto&& ep : _endPoints->endPoints()) {
+            const EndPointHolder::MongoEndPoint* endPoint = ep.second.get();
+            gauge("endpoint." + ep.first + ".queued", [endPoint] {return endPoint->queued();});
+            gauge("endpoint." + ep.first + ".inFlight", [endPoint] {return endPoint->inFlight();});
+            gauge("endpoint." + ep.first + ".p99Ms",
+                  [endPoint] {return endPoint->latency().percentile(99) / 1000.0;});
+        }
+        gauge("send.queued", [this] {
+            double queued = 0;
+            for (auto&& ep : _endPoints->endPoints())
+                queued += ep.second->queued();
+            return queued;
+        });
+        gauge("send.inFlight", [this] {
+            size_t inFlight = 0;
+            for (auto&& ep : _endPoints->endPoints())
+                inFlight += ep.second->inFlight();
+            return inFlight;
+        });
+        //Blocked time is summed across the threads of a stage
+        gauge("blocked.readMs", [] {return tools::ReadAheadStreamBuf::stats().waitNanos / 1e6;});
+        gauge("blocked.budgetMs", [] {return tools::MemoryBudget::waitNanos() / 1e6;});
+        gauge("blocked.handoffMs", [this] {return _chunkDispatch->handoffWaitNanos() / 1e6;});
+        gauge("blocked.sendQueueMs", [this] {
+            unsigned long long nanos = 0;
+            for (auto&& ep : _endPoints->endPoints())
+                nanos += ep.second->pushWaitNanos();
+            return nanos / 1e6;
+        });
+        gauge("idle.sendMs", [this] {
+            unsigned long long nanos = 0;
+            for (auto&& ep : _endPoints->endPoints())
+                nanos += ep.second->parkedNanos();
+            return nanos / 1e6;
+        });
+    }
+
+    void Loader::metricsUnregister() {
+        for (auto&& name : _gauges)
+            tools::Metrics::gaugeRemove(name);
+        _gauges.clear();
+    }
+
+    std::string Loader::metricsSummary(const tools::Metrics::Snapshot& now,
+                                       const tools::Metrics::Snapshot& last,
+                                       double seconds, double interval)
+    {
+        auto value = [](const tools::Metrics::Snapshot& snapshot, const std::string& name) {
+            auto i = snapshot.find(name);
+            return i == snapshot.end() ? 0.0 : i->second;
+        };
+        auto rate = [&](const std::string& name) {
+            return (value(now, name) - value(last, name)) / std::max(interval, 1e-9);
+        };
+        std::ostringstream line;
+        line << std::fixed << std::setprecision(0)
+             << "[" << seconds << "s] parsed: " << value(now, "parse.docs") << " docs ("
+             << rate("parse.docs") << "/s), " << value(now, "parse.bytes") / 1024 / 1024
+             << "MB (" << rate("parse.bytes") / 1024 / 1024 << "MB/s)";
+        //Only plain files are read through the read ahead buffers, so only they have an ETA
+        double total = value(now, "input.totalBytes");
+        double read = value(now, "input.readBytes");
+        if (total && read) {
+            double done = std::min(read / total, 1.0);
+            long eta = long(seconds * (1 - done) / done);
+            line << " " << done * 100 << "% ETA " << eta / 60 << "m" << eta % 60 << "s";
+        }
+        line << " | routed: " << value(now, "route.docs") << " (chunk max "
+             << value(now, "route.chunkMax") << " min " << value(now, "route.chunkMin") << ")"
+             << " | sent: " << value(now, "sent.docs") << " (" << rate("sent.docs") << "/s)"
+             << " | queued: input " << value(now, "queue.input") << ", held "
+             << value(now, "queue.queuedMB") + value(now, "queue.inFlightMB") << "MB, finalize "
+             << value(now, "queue.finalize") << ", ops " << value(now, "send.queued")
+             << ", in flight " << value(now, "send.inFlight")
+             << " | blocked(ms): read " << value(now, "blocked.readMs") << ", budget "
+             << value(now, "blocked.budgetMs") << ", handoff " << value(now, "blocked.handoffMs")
+             << ", send " << value(now, "blocked.sendQueueMs");
+        return line.str();
     }
 
     void Loader::run() {
@@ -232,22 +961,30 @@ namespace loader {
         tools::SimpleTimer<> timerLoad;
         tools::SimpleTimer<> timerRead;
         /*
-         * The hardware parameters we are working with. Note that ram is free RAM when this program
-         * started.  i.e. the working ram available.
+         * The hardware parameters we are working with. Note that ram is the budget for documents
+         * held in queues, not all of the RAM in use.
          */
-        std::cout << "Threads: " << _settings.threads << " RAM(Mb): "
+        std::cout << "Threads: " << _settings.threads << " RAM budget(Mb): "
                   << _ramMax / 1024 / 1024
                   << "\nStarting read of data"
                   << std::endl;
 
 
+        //Chunks that move while a direct load writes are sent to their new shards
+        const bool chunksWatch = _settings.endPointSettings.directLoad && _settings.dryRun.empty();
+        if (chunksWatch) _chunkDispatch->chunksWatchStart(_mCluster.chunksVersion().getOwned());
+
         std::unique_ptr<InputProcessor> inputProcessor;
-        inputProcessor.reset(new FileInputProcessor(this, _settings.threads, _settings.inputType,
+        if (_settings.cloneLoad)
+            inputProcessor.reset(new ClusterInputProcessor(this, _settings.threads,
+                                         _settings.loadDir, _settings.cloneShardThreads,
+                                         _settings.ns()));
+        else if (StreamInputProcessor::isStream(_settings.loadDir))
+            inputProcessor.reset(new StreamInputProcessor(this, _settings.threads,
+                                         _settings.inputType, _settings.loadDir, _settings.ns()));
+        else
+            inputProcessor.reset(new FileInputProcessor(this, _settings.threads, _settings.inputType,
                                          _settings.loadDir, _settings.fileRegex, _settings.ns()));
-        inputProcessor->run();
-
-        std::this_thread::sleep_for(std::chrono::seconds(1));
-        setEndPoints();
 
         /*
          * After the load is complete hit all queues and call any additional actions.
@@ -256,40 +993,137 @@ namespace loader {
          * waiting.  The general assumption is that there are more chunks than threads available
          */
         size_t finalizeThreads = _threadsMax;
-        tools::ThreadPool tpFinalize(finalizeThreads);
+        tools::ThreadPool tpFinalize(finalizeThreads, tools::Placement::pin);
         _wf = _chunkDispatch->getWaterFall();
-        //Wait for all threads to finish processing segments
-        inputProcessor->wait();
-        timerRead.stop();
 
-        std::cout << "Entering finalize phase" << std::endl;
-
-        for (size_t i = 0; i < finalizeThreads; i++)
-            tpFinalize.queue([this] {this->threadPrepQueue();});
-
-        /*
-        if (!enabledEndPoints()) {
-            std::this_thread::sleep_for(std::chrono::seconds(1));
-            setEndPoints();
+        tools::Pipeline pipeline;
+        pipeline.add({"read/parse", size_t(_settings.threads),
+                      [&inputProcessor] {inputProcessor->run();},
+                      [&] {
+                          //Wait for all threads to finish processing segments
+                          inputProcessor->wait();
+                          if (_sharedBatches) _sharedBatches->flush();
+                          timerRead.stop();
+                      }, nullptr});
+        pipeline.add({"route/batch", 0, nullptr, nullptr, nullptr});
+        //Documents held for finalize are the dispatch stage's backlog
+        pipeline.add({"dispatch", finalizeThreads, nullptr,
+                      [&] {
+                          std::cout << "Entering finalize phase, send pressure: "
+                                    << pipeline.pressure(pipeline.stage("dispatch")) << std::endl;
+                          for (size_t i = 0; i < finalizeThreads; i++)
+                              tpFinalize.queue([this] {this->threadPrepQueue();});
+                          //Wait for all threads to shutdown prior to exit
+                          tpFinalize.endWaitInitiate();
+                          tpFinalize.joinAll();
+                      },
+                      [] {
+                          return tools::MemoryBudget::limit()
+                                 ? double(tools::MemoryBudget::held())
+                                   / tools::MemoryBudget::limit() : 0;
+                      }});
+        pipeline.add({"send", _endPoints->size() * _settings.endPointSettings.threadCount,
+                      [this] {if (_ownEndPoints) this->setEndPoints();},
+                      [this] {
+                          if (_ownEndPoints) _endPoints->gracefulShutdownJoin();
+                          else _chunkDispatch->writesWait();
+                      },
+                      [this] {return _endPoints->pressure();}});
+        //Gauges are by name, loads sharing end points would read each other's
+        if (_ownEndPoints) metricsRegister(inputProcessor.get(), &tpFinalize);
+        {
+            tools::MetricsReporter reporter(_settings.metricsInterval, _settings.metricsFile,
+                                            &Loader::metricsSummary);
+            pipeline.start();
+            pipeline.finish();
         }
-        */
-
-        //Make sure all threads are kicked off
-        std::this_thread::sleep_for(std::chrono::seconds(2));
-
-        /*
-         *  Wait for all threads to shutdown prior to exit.
-         */
-        tpFinalize.endWaitInitiate();
-        tpFinalize.joinAll();
-
-        _endPoints->gracefulShutdownJoin();
+        metricsUnregister();
+        pipeline.report(&std::cout);
+        //A MultiLoader traces all of its loads, it writes the trace once they are done
+        if (!_settings.traceFile.empty()) tools::Trace::write();
+        if (chunksWatch && !_chunkDispatch->chunksWatchStop()) exit(EXIT_FAILURE);
+        //Every write is done, a new load may start the journal over
+        _journal->finish();
 
         timerLoad.stop();
+        long indexSeconds = rebuildIndexes();
         long loadSeconds = timerLoad.seconds();
         long readSeconds = timerRead.seconds();
         std::cout << "\nLoad time: " << loadSeconds / 60 << "m" << loadSeconds % 60 << "s"
             << "\nRead time: " << readSeconds / 60 << "m" << readSeconds % 60 << "s" << std::endl;
+        if (!_deferredIndexes.empty()) {
+            long totalSeconds = loadSeconds + indexSeconds;
+            std::cout << "Index build time: " << indexSeconds / 60 << "m" << indexSeconds % 60
+                    << "s\nTotal time, index builds included: " << totalSeconds / 60 << "m"
+                    << totalSeconds % 60 << "s" << std::endl;
+        }
+        //Read bandwidth, disk and wait times are summed across the input threads
+        tools::ReadAheadStats readStats = tools::ReadAheadStreamBuf::stats();
+        double readMb = double(readStats.bytesRead) / 1024 / 1024;
+        std::cout << "Read: " << readMb << "MB; " << readMb / std::max(timerRead.nanos() / 1e9, 1e-9)
+                << "MB/s; read calls: " << readStats.readNanos / 1000000 << "ms; waiting on reads: "
+                << readStats.waitNanos / 1000000 << "ms" << std::endl;
+        size_t batches = std::max<size_t>(_chunkDispatch->batchesSent(), 1);
+        size_t avgBatchKb = _chunkDispatch->bytesSent() / batches / 1024;
+        std::cout << "Batches: " << _chunkDispatch->batchesSent() << "; average "
+                << _chunkDispatch->docsSent() / batches << " docs, " << avgBatchKb << "KB"
+                << std::endl;
+        std::cout << "Batch handoff lock waits: " << _chunkDispatch->handoffWaitNanos() / 1000000
+                << "ms; lock free retries: " << _chunkDispatch->handoffRetries() << std::endl;
+        size_t logicalMb = tools::mtools::WireStats::logicalBytes() / 1024 / 1024;
+        size_t wireMb = tools::mtools::WireStats::wireBytes() / 1024 / 1024;
+        std::cout << "Sent: " << logicalMb << "MB of BSON; " << wireMb << "MB on the wire";
+        if (tools::mtools::WireStats::compressMBps())
+            std::cout << " (zlib estimate, not compressed); sampled at "
+                    << tools::mtools::WireStats::compressMBps() << "MB/s";
+        std::cout << std::endl;
+        //Batch latency by end point, a slow shard stands out against the others
+        tools::Histogram latency;
+        std::ostringstream latencyByShard;
+        std::cout << "Insert latency(ms) p50/p99/max by end point:";
+        for (auto&& ep : _endPoints->endPoints()) {
+            const EndPointHolder::MongoEndPoint& endPoint = *ep.second;
+            latency.merge(endPoint.latency());
+            std::ostringstream percentiles;
+            percentiles << endPoint.latency().percentile(50) / 1000.0 << "/"
+                    << endPoint.latency().percentile(99) / 1000.0 << "/"
+                    << endPoint.latency().max() / 1000.0;
+            latencyByShard << (latencyByShard.tellp() ? " " : "") << ep.first << ":"
+                    << percentiles.str();
+            std::cout << "\n  " << ep.first << ": " << percentiles.str() << "; batches: "
+                    << endPoint.latency().count() << "; docs/batch p50: "
+                    << endPoint.batchDocs().percentile(50) << ", KB/batch p50: "
+                    << endPoint.batchBytes().percentile(50) / 1024;
+            if (endPoint.coalesced()) std::cout << "; coalesced: " << endPoint.coalesced();
+            if (endPoint.throttledNanos())
+                std::cout << "; rate limited: " << endPoint.throttledNanos() / 1000000 << "ms";
+            if (endPoint.rerouted()) std::cout << "; rerouted: " << endPoint.rerouted();
+            if (endPoint.retried())
+                std::cout << "; retried: " << endPoint.retried() << ", reconnects: "
+                        << endPoint.reconnects() << ", duplicates tolerated: "
+                        << endPoint.retryDuplicates();
+        }
+        std::cout << std::endl;
+        if (_chunkDispatch->duplicates())
+            std::cout << "Duplicate shard keys dropped: " << _chunkDispatch->duplicates()
+                    << std::endl;
+        double latencyP50 = latency.percentile(50) / 1000.0;
+        double latencyP99 = latency.percentile(99) / 1000.0;
+        double latencyMax = latency.max() / 1000.0;
+        if (!_settings.dryRun.empty()) {
+            unsigned long long checksum = 0;
+            for (auto&& ep : _endPoints->endPoints())
+                checksum += ep.second->checksum();
+            std::cout << "Dry run dropped " << _chunkDispatch->docsSent() << " docs, "
+                    << _chunkDispatch->bytesSent() / 1024 / 1024 << "MB";
+            if (_settings.endPointSettings.dryRunChecksum)
+                std::cout << "; checksum: " << std::hex << checksum << std::dec;
+            std::cout << std::endl;
+        }
+        size_t peakRssMb = tools::MemoryBudget::peakRss() / 1024 / 1024;
+        size_t peakHeldMb = tools::MemoryBudget::peak() / 1024 / 1024;
+        std::cout << "Peak RSS: " << peakRssMb << "MB; peak documents held: " << peakHeldMb
+                << "MB of " << _ramMax / 1024 / 1024 << "MB budget" << std::endl;
 
         /*
          * Output the stats if requested
@@ -310,6 +1144,16 @@ namespace loader {
                         << "\"threads\","
                         << "\"endpoint conns\","
                         << "\"wc\","
+                        << "\"peak rss(MB)\","
+                        << "\"peak held(MB)\","
+                        << "\"avg batch(KB)\","
+                        << "\"logical(MB)\","
+                        << "\"wire(MB)\","
+                        << "\"index build(s)\","
+                        << "\"insert p50(ms)\","
+                        << "\"insert p99(ms)\","
+                        << "\"insert max(ms)\","
+                        << "\"insert p50/p99/max by shard(ms)\","
                         << "\"note\""
                 << std::endl;
             }
@@ -324,6 +1168,16 @@ namespace loader {
                     << "\"" << _settings.threads << "\", "
                     << "\"" << _settings.endPointSettings.threadCount << "\", "
                     << "\"" << _settings.dispatchSettings.writeConcern << "\", "
+                    << "\"" << peakRssMb << "\", "
+                    << "\"" << peakHeldMb << "\", "
+                    << "\"" << avgBatchKb << "\", "
+                    << "\"" << logicalMb << "\", "
+                    << "\"" << wireMb << "\", "
+                    << "\"" << indexSeconds << "\", "
+                    << "\"" << latencyP50 << "\", "
+                    << "\"" << latencyP99 << "\", "
+                    << "\"" << latencyMax << "\", "
+                    << "\"" << latencyByShard.str() << "\", "
                     << "\"" << _settings.statsFileNote << "\""
                     << std::endl;
             }
@@ -335,6 +1189,71 @@ namespace loader {
             }
         }
 
+        /*
+         * JSON summary, one object per line.  Numbers are doubles so they print as plain JSON.
+         */
+        if (!_settings.statsJsonFile.empty()) {
+            const double MB = 1024 * 1024;
+            //Throughput is over the load, the total of the phases adds the index builds after it
+            double loadTime = std::max(timerLoad.nanos() / 1e9, 1e-9);
+            double scanTime = inputProcessor->scanSeconds();
+            double parsedAt = pipeline.drained(pipeline.stage("read/parse"));
+            double finalizedAt = pipeline.drained(pipeline.stage("dispatch"));
+            double drainedAt = pipeline.drained(pipeline.stage("send"));
+            mongo::BSONObjBuilder stats;
+            stats.append("ns", _settings.ns());
+            stats.append("note", _settings.statsFileNote);
+            stats.append("phases", BSON("scan" << scanTime
+                                        << "readParse" << parsedAt - scanTime
+                                        << "finalize" << finalizedAt - parsedAt
+                                        << "sendDrain" << drainedAt - finalizedAt
+                                        << "indexBuild" << double(indexSeconds)
+                                        << "total" << loadTime + indexSeconds));
+            stats.append("throughput", BSON("docs" << double(_chunkDispatch->docsSent())
+                                            << "MB" << _chunkDispatch->bytesSent() / MB
+                                            << "docsPerSec" << _chunkDispatch->docsSent() / loadTime
+                                            << "MBPerSec" << _chunkDispatch->bytesSent() / MB / loadTime));
+            //End points are shards on direct loads, mongoS otherwise
+            mongo::BSONObjBuilder endPoints;
+            for (auto&& ep : _endPoints->endPoints()) {
+                const EndPointHolder::MongoEndPoint& endPoint = *ep.second;
+                endPoints.append(ep.first, BSON("docs" << double(endPoint.docsWritten())
+                        << "MB" << endPoint.bytesWritten() / MB
+                        << "docsPerSec" << endPoint.docsWritten() / loadTime
+                        << "MBPerSec" << endPoint.bytesWritten() / MB / loadTime
+                        << "batches" << double(endPoint.latency().count())
+                        << "p50Ms" << endPoint.latency().percentile(50) / 1000.0
+                        << "p99Ms" << endPoint.latency().percentile(99) / 1000.0
+                        << "maxMs" << endPoint.latency().max() / 1000.0));
+            }
+            stats.append("endPoints", endPoints.obj());
+            std::map<tools::mtools::MongoCluster::ShardName, double> shardChunks;
+            for (auto&& chunk : _mCluster.nsChunks(_settings.ns()))
+                ++shardChunks[chunk.second->first];
+            mongo::BSONObjBuilder chunks;
+            for (auto&& shard : shardChunks)
+                chunks.append(shard.first, shard.second);
+            stats.append("chunks", chunks.obj());
+            stats.append("hardware", BSON("hardwareThreads" << double(std::thread::hardware_concurrency())
+                    << "systemMemoryMB" << tools::getTotalSystemMemory() / MB
+                    << "ramBudgetMB" << _ramMax / MB
+                    << "threads" << double(_settings.threads)
+                    << "endPointThreads" << double(_settings.endPointSettings.threadCount)
+                    << "placement" << _settings.placement
+                    << "nodes" << double(tools::Placement::nodes())
+                    << "peakRssMB" << double(peakRssMb)
+                    << "peakHeldMB" << double(peakHeldMb)));
+            stats.append("settings", BSON("inputType" << _settings.inputType
+                    << "queuing" << _settings.loadQueueJson
+                    << "shardKey" << _settings.shardKeyJson
+                    << "bypass" << _settings.endPointSettings.directLoad
+                    << "batchSize" << double(_settings.batcherSettings.queueSize)
+                    << "writeConcern" << _settings.dispatchSettings.writeConcern));
+            std::ofstream statsJson(_settings.statsJsonFile, std::ios_base::out | std::ios_base::app);
+            if (statsJson.is_open()) statsJson << stats.obj().jsonString() << std::endl;
+            else std::cerr << "Unable to open stats file: " << _settings.statsJsonFile << std::endl;
+        }
+
     }
 
 }  //namespace loader
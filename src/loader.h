@@ -22,8 +22,11 @@
 #include <vector>
 #include "bson_tools.h"
 #include "concurrent_container.h"
+#include "field_transform.h"
 #include "input_processor.h"
+#include "journal.h"
 #include "loader_defs.h"
+#include "metrics.h"
 #include "mongo_cxxdriver.h"
 #include "mongo_end_point.h"
 #include "batch_dispatch.h"
@@ -45,8 +48,6 @@ namespace loader {
 
     class Loader {
     public:
-        using MissTime = std::chrono::milliseconds;
-
         /**
          * Values required to setup the loader
          */
@@ -55,6 +56,14 @@ namespace loader {
             using FieldKeys = std::vector<std::string>;
             std::string statsFile;
             std::string statsFileNote;
+            //JSON line per load with phase timings, throughput and the hardware used
+            std::string statsJsonFile;
+            //Seconds between progress lines, 0 for none
+            size_t metricsInterval;
+            std::string metricsFile;
+            //Chrome trace events file, empty for no tracing, and the spans kept per thread
+            std::string traceFile;
+            size_t traceSpans;
             std::string loadDir;
             std::string fileRegex;
             std::string inputType;
@@ -68,13 +77,28 @@ namespace loader {
             LoadQueues loadQueues;
             int syncDelay;
             int threads;
+            //Pin threads by NUMA node: none, node or core
+            std::string placement;
+            size_t readAheadBuffers;
             size_t mongoLocklessMissWait;
             bool add_id;
+            //Generate the added ids inside the chunks of a {_id: 1} key, not by time
+            bool add_idPerChunk;
+            //Fields included, excluded, renamed and coerced as the input is parsed
+            std::string transformJson;
+            FieldTransform transform;
+            //File of {column: type} for csv and tsv input, and if files start with a header line
+            std::string csvSchemaFile;
+            bool csvHeader;
+            CsvSchema csvSchema;
             bool indexHas_id;
             size_t indexPos_id;
             bool hashed;
             size_t chunksPerShard;
             bool shardKeyUnique;
+            //Documents sharing a shard key in the ram and disk queues: none, first, last or reject
+            std::string dedupe;
+            std::string dedupeFile;
             std::string shardKeyJson;
             mongo::BSONObj shardKeysBson;
             FieldKeys shardKeyFields;
@@ -83,6 +107,60 @@ namespace loader {
             bool stopBalancer;
             bool sharded;
             bool dropIndexes;
+            bool deferIndexes;
+            size_t presplitSamples;
+            //MB of documents the load may hold in RAM, 0 for 3/4 of system memory
+            size_t ramBudget;
+            size_t batchBytes;
+            bool sharedBatches;
+            //Skip the work that the journal has as finished by an earlier run
+            bool resume;
+            //insert, or upsert by shard key: replace or merge
+            std::string writeMode;
+            //discard or checksum to run without writing to the cluster, empty to load
+            std::string dryRun;
+            //Cluster metadata file to use instead of the cluster, and a file to save it to
+            std::string chunkMap;
+            std::string chunkMapSave;
+            //Directory to cache the namespace's chunks in between loads, empty for none
+            std::string metadataCache;
+            //Estimate a zlib compressed wire's bytes from samples, nothing is compressed
+            bool compressEstimate;
+            bool dumpLoad;
+            std::string dumpShardKeysJson;
+            //Timed trials over a sample of the input to search for the fastest settings
+            bool calibrate;
+            size_t calibrateSampleMB;
+            size_t calibrateTrials;
+            std::string calibrateSave;
+            //Read the whole input without a cluster and report on it instead of loading
+            bool scan;
+            size_t scanChunks;
+            std::string scanSave;
+            //File of JSON lines mapping file regexes to namespaces, loaded together
+            std::string multiMap;
+            size_t multiConcurrent;
+            //loadDir is a cluster to clone the sharded collections of
+            bool cloneLoad;
+            //Chunk ranges of a source shard read at once
+            size_t cloneShardThreads;
+            //Apply the source's oplogs after the copy, until within cloneOplogLag seconds
+            bool cloneOplog;
+            size_t cloneOplogLag;
+            size_t cloneOplogBatch;
+            //Where the oplog positions reached are saved, cloneOplogResume tails from them only
+            std::string cloneOplogFile;
+            bool cloneOplogResume;
+            //Directory to export ns to by chunk range instead of loading, bson or json files
+            std::string exportDir;
+            std::string exportFormat;
+            size_t exportFileMB;
+            size_t exportShardThreads;
+            bool exportManifest;
+            //Saved scan with the split points to presplit at instead of sampling the input
+            std::string presplitFile;
+            //Split points to presplit at instead of sampling the input, i.e. the source's chunks
+            std::vector<mongo::BSONObj> presplitKeys;
 
             docbuilder::InputNameSpaceContainer::Settings batcherSettings;
             dispatch::ChunkDispatcher::Settings dispatchSettings;
@@ -104,21 +182,25 @@ namespace loader {
         };
 
         /**
-         * LoaderStats is currently "dead".  It is being kept around for the next round of optimizations.
+         * Live counters for the load, they are also reported through tools::Metrics
          */
         struct LoaderStats {
-            std::atomic<size_t> feederMisses;
-            MissTime feederMissTime;
-            size_t docFails;
+            tools::Counter* const docsParsed;
+            tools::Counter* const bytesParsed;
 
             LoaderStats() :
-                    feederMisses(), feederMissTime(), docFails()
+                    docsParsed(tools::Metrics::counter("parse.docs")),
+                    bytesParsed(tools::Metrics::counter("parse.bytes"))
             {
             }
 
         };
 
-        explicit Loader(Settings settings);
+        /**
+         * @param endPoints end points shared with other loads running at the same time, they are
+         * started and shut down by the caller.  nullptr for the load to have its own.
+         */
+        explicit Loader(Settings settings, EndPointHolder* endPoints = nullptr);
 
         /**
          * Gets stats
@@ -158,29 +240,94 @@ namespace loader {
          * Returns the settings for loader queues.
          */
         const docbuilder::InputNameSpaceContainer::Settings& queueSettings() const {
-            return _settings.batcherSettings;
+            return _queueSettings;
+        }
+
+        /**
+         * @return the progress journal
+         */
+        Journal* journal() {
+            return _journal.get();
+        }
+
+        /**
+         * @return the journal if input segments are journaled, nullptr if not.  Segments are
+         * only finished by their own writes if every queue sends documents as they are pushed.
+         */
+        Journal* segmentJournal() {
+            return _segmentJournal ? _journal.get() : nullptr;
         }
 
     private:
         using IndexObj = mongo::BSONObj;
 
+        /**
+         * Where presplit chunks outside of a zone are placed
+         * STAY: on the shard that has them
+         * ROUND_ROBIN: chunk by chunk over the shards
+         * BLOCKS: contiguous runs of chunks per shard, a move per shard
+         */
+        enum class ChunkSpread {
+            STAY, ROUND_ROBIN, BLOCKS
+        };
+
+        struct ChunkMove {
+            mongo::BSONObj min;
+            mongo::BSONObj max;
+            std::string from;
+            std::string to;
+        };
+
+        //Presplit commands run at once per shard
+        static constexpr size_t PRESPLIT_SHARD_COMMANDS = 4;
+
         LoaderStats _stats;
         const Settings _settings;
         tools::mtools::MongoCluster _mCluster;
-        std::unique_ptr<EndPointHolder> _endPoints;
+        //Outlives the end points and queues that hold its tokens
+        std::unique_ptr<Journal> _journal;
+        bool _segmentJournal{};
+        std::unique_ptr<EndPointHolder> _ownEndPoints;
+        EndPointHolder* _endPoints;
         std::unique_ptr<dispatch::ChunkDispatcher> _chunkDispatch;
+        std::unique_ptr<docbuilder::SharedBatchPool> _sharedBatches;
+        //The batcher settings with the shared batches filled in
+        docbuilder::InputNameSpaceContainer::Settings _queueSettings;
 
+        //Specs of the indexes dropped for the load
+        std::vector<mongo::BSONObj> _deferredIndexes;
         size_t _ramMax;
         size_t _threadsMax;
         std::atomic<unsigned long long> _writeOps;
         dispatch::ChunkDispatcher::OrderedWaterFall _wf;
         tools::Mutex _prepSetMutex;
+        //Gauges registered for the load, removed before what they read goes away
+        std::vector<std::string> _gauges;
+
+
+        /**
+         * Registers gauges over the pipeline's queues and wait times
+         */
+        void metricsRegister(const InputProcessor* input, const tools::ThreadPool* finalize);
 
+        void metricsUnregister();
+
+        /**
+         * @return the progress line for a metrics snapshot
+         */
+        static std::string metricsSummary(const tools::Metrics::Snapshot& now,
+                                          const tools::Metrics::Snapshot& last,
+                                          double seconds, double interval);
 
         bool enabledEndPoints() {
             return _endPoints->isRunning();
         }
 
+        /**
+         * Checks the cluster metadata has what a dry run needs, nothing is changed on the cluster
+         */
+        void setupDryRun();
+
         /**
          * Setup the environment for loading
          * 1)Check to make sure we are sharded or not as user indicates
@@ -193,6 +340,73 @@ namespace loader {
          */
         void setupLoad();
 
+        /**
+         * Splits a new range sharded collection at quantiles of a sample of the input and
+         * spreads the chunks over the shards, so that the load starts with chunksPerShard
+         * chunks on every shard as a hashed load does.
+         */
+        void presplit();
+
+        /**
+         * @return the split points of chunks equal ranges of the hashed shard key
+         */
+        std::vector<mongo::BSONObj> hashedSplits(size_t chunks) const;
+
+        /**
+         * @return the split points of chunks equal ranges of the ObjectId space
+         */
+        std::vector<mongo::BSONObj> oidSplits(size_t chunks) const;
+
+        /**
+         * Splits at splits and at the namespace's tag range bounds, chunks in a tag range go onto
+         * the tag's shards.  Only the bounds between chunks placed on different shards are split
+         * before the moves, the rest are split afterward on the shards the chunks end up on.
+         * @param spread where the untagged chunks go
+         */
+        void splitAndPlace(std::vector<mongo::BSONObj> splits, ChunkSpread spread);
+
+        /**
+         * Splits at the sorted points.  Each round splits every chunk with points left in it at
+         * its middle point, so each command of a round is on a different chunk.
+         */
+        void splitParallel(const std::vector<mongo::BSONObj>& points);
+
+        /**
+         * Moves chunks, each round moves at most one chunk to or from a shard
+         */
+        void moveParallel(std::vector<ChunkMove> moves);
+
+        /**
+         * Runs the presplit commands at once, those that fail are retried one at a time as
+         * older servers take a collection lock for each
+         * @return the count of commands that succeeded
+         */
+        size_t presplitCommands(const std::vector<mongo::BSONObj>& commands);
+
+        /**
+         * Saves the specs of the non-unique secondary indexes to workPath, then drops them.
+         * _id, unique indexes (they reject duplicates as the load writes) and indexes prefixed
+         * by the shard key (sharding needs one) are kept.  Specs an earlier load saved and
+         * didn't build are taken up either way.
+         */
+        void deferIndexes(mongo::DBClientBase* conn);
+
+        /**
+         * @return true if the index key starts with the shard key
+         */
+        bool shardKeyPrefixes(const mongo::BSONObj& key) const;
+
+        /**
+         * @return the file of deferred index specs, one JSON spec a line
+         */
+        std::string deferredIndexesPath() const;
+
+        /**
+         * Builds the deferred indexes, mongoS has every shard build them at once
+         * @return seconds taken
+         */
+        long rebuildIndexes();
+
         /**
          * Start end points up
          */
@@ -205,6 +419,11 @@ namespace loader {
          */
         void threadPrepQueue();
 
+        /**
+         * Finalizes one chunk: its queue is prepared then loaded
+         */
+        void prepLoad(dispatch::AbstractChunkDispatch* prep);
+
         /**
          * Get the next chunk to notify of input file completion in shard chunk order.
          * Thread safe
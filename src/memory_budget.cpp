@@ -0,0 +1,68 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "memory_budget.h"
+#include <chrono>
+#include <sys/resource.h>
+
+namespace tools {
+
+    size_t MemoryBudget::_limit {};
+    std::atomic<size_t> MemoryBudget::_queued {};
+    std::atomic<size_t> MemoryBudget::_inFlight {};
+    std::atomic<size_t> MemoryBudget::_peak {};
+    std::atomic<size_t> MemoryBudget::_waiting {};
+    std::atomic<unsigned long long> MemoryBudget::_waitNanos {};
+    tools::Mutex MemoryBudget::_roomMutex;
+    tools::ConditionVariable MemoryBudget::_roomNotify;
+
+    void MemoryBudget::add(Use use, size_t bytes) {
+        (use == Use::QUEUED ? _queued : _inFlight) += bytes;
+        size_t now = held();
+        size_t peak = _peak;
+        while (now > peak && !_peak.compare_exchange_weak(peak, now))
+            ;
+    }
+
+    void MemoryBudget::remove(Use use, size_t bytes) {
+        (use == Use::QUEUED ? _queued : _inFlight) -= bytes;
+        //Taking the mutex orders this against a waiter between its check and its wait
+        if (_waiting) {
+            MutexLockGuard lock(_roomMutex);
+            _roomNotify.notify_all();
+        }
+    }
+
+    void MemoryBudget::waitForRoom() {
+        if (!full()) return;
+        ++_waiting;
+        auto start = std::chrono::steady_clock::now();
+        {
+            MutexUniqueLock lock(_roomMutex);
+            _roomNotify.wait(lock, [] {return !full() || !_inFlight;});
+        }
+        _waitNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        --_waiting;
+    }
+
+    size_t MemoryBudget::peakRss() {
+        rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage)) return 0;
+        //Linux reports kilobytes
+        return size_t(usage.ru_maxrss) * 1024;
+    }
+
+}  //namespace tools
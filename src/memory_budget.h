@@ -0,0 +1,114 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include "threading.h"
+
+namespace tools {
+
+    /**
+     * Accounts for the document bytes the load holds in RAM against a budget.
+     * QUEUED bytes are held until finalize (i.e. RAM queues), IN_FLIGHT bytes leave on their own
+     * (operations waiting on an end point, runs being spilled).  Queues that hold documents
+     * should divert to disk once the budget is full, producers wait for room while there are
+     * IN_FLIGHT bytes that will free it.
+     */
+    class MemoryBudget {
+    public:
+        enum class Use {
+            QUEUED, IN_FLIGHT
+        };
+
+        /**
+         * @param bytes the budget, 0 for no limit
+         */
+        static void limitSet(size_t bytes) {
+            _limit = bytes;
+        }
+
+        static size_t limit() {
+            return _limit;
+        }
+
+        static void add(Use use, size_t bytes);
+
+        static void remove(Use use, size_t bytes);
+
+        /**
+         * Moves bytes between uses without a window where they aren't counted
+         */
+        static void move(Use from, Use to, size_t bytes) {
+            add(to, bytes);
+            remove(from, bytes);
+        }
+
+        /**
+         * @return true if the held bytes have reached the budget
+         */
+        static bool full() {
+            return _limit && held() >= _limit;
+        }
+
+        /**
+         * Blocks while the budget is full and IN_FLIGHT bytes are draining
+         */
+        static void waitForRoom();
+
+        static size_t held() {
+            return _queued + _inFlight;
+        }
+
+        static size_t queued() {
+            return _queued;
+        }
+
+        static size_t inFlight() {
+            return _inFlight;
+        }
+
+        /**
+         * @return time producers have spent in waitForRoom, summed across threads
+         */
+        static unsigned long long waitNanos() {
+            return _waitNanos;
+        }
+
+        /**
+         * @return the most bytes held at once
+         */
+        static size_t peak() {
+            return _peak;
+        }
+
+        /**
+         * @return peak resident set size of the process in bytes
+         */
+        static size_t peakRss();
+
+    private:
+        static size_t _limit;
+        static std::atomic<size_t> _queued;
+        static std::atomic<size_t> _inFlight;
+        static std::atomic<size_t> _peak;
+        static std::atomic<size_t> _waiting;
+        static std::atomic<unsigned long long> _waitNanos;
+        static tools::Mutex _roomMutex;
+        static tools::ConditionVariable _roomNotify;
+    };
+
+}  //namespace tools
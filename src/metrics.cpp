@@ -0,0 +1,170 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "metrics.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+
+namespace tools {
+
+    constexpr size_t Counter::SLOTS;
+
+    size_t Counter::slot() {
+        static std::atomic<size_t> next{};
+        static thread_local size_t slot = next++ % SLOTS;
+        return slot;
+    }
+
+    constexpr size_t Histogram::SUB_BITS;
+    constexpr size_t Histogram::SUB_BUCKETS;
+    constexpr size_t Histogram::BUCKETS;
+
+    Histogram::Histogram() {
+        for (auto&& bucket : _buckets)
+            bucket.store(0, std::memory_order_relaxed);
+    }
+
+    void Histogram::merge(const Histogram& other) {
+        for (size_t i = 0; i < BUCKETS; ++i)
+            _buckets[i].fetch_add(other._buckets[i].load(std::memory_order_relaxed),
+                                  std::memory_order_relaxed);
+        unsigned long long max = _max.load(std::memory_order_relaxed);
+        unsigned long long otherMax = other.max();
+        while (otherMax > max && !_max.compare_exchange_weak(max, otherMax,
+                                                             std::memory_order_relaxed)) { }
+    }
+
+    unsigned long long Histogram::count() const {
+        unsigned long long count = 0;
+        for (auto&& bucket : _buckets)
+            count += bucket.load(std::memory_order_relaxed);
+        return count;
+    }
+
+    unsigned long long Histogram::percentile(double percent) const {
+        unsigned long long total = count();
+        if (!total) return 0;
+        unsigned long long rank = std::max<unsigned long long>(1,
+                (unsigned long long)(total * percent / 100 + 0.5));
+        unsigned long long seen = 0;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            seen += _buckets[i].load(std::memory_order_relaxed);
+            if (seen >= rank) return std::min(bucketTop(i), max());
+        }
+        return max();
+    }
+
+    unsigned long long Histogram::bucketTop(size_t index) {
+        if (index < SUB_BUCKETS) return index;
+        size_t magnitude = index / SUB_BUCKETS + SUB_BITS - 1;
+        unsigned long long step = 1ULL << (magnitude - SUB_BITS);
+        unsigned long long bottom = (SUB_BUCKETS + index % SUB_BUCKETS) * step;
+        return bottom + step - 1;
+    }
+
+    Mutex& Metrics::mutex() {
+        static Mutex mutex;
+        return mutex;
+    }
+
+    std::map<std::string, std::unique_ptr<Counter>>& Metrics::counters() {
+        static std::map<std::string, std::unique_ptr<Counter>> counters;
+        return counters;
+    }
+
+    std::map<std::string, Metrics::Gauge>& Metrics::gauges() {
+        static std::map<std::string, Gauge> gauges;
+        return gauges;
+    }
+
+    Counter* Metrics::counter(const std::string& name) {
+        MutexLockGuard lock(mutex());
+        auto& counter = counters()[name];
+        if (!counter) counter.reset(new Counter());
+        return counter.get();
+    }
+
+    void Metrics::gaugeAdd(const std::string& name, Gauge gauge) {
+        MutexLockGuard lock(mutex());
+        gauges()[name] = std::move(gauge);
+    }
+
+    void Metrics::gaugeRemove(const std::string& name) {
+        MutexLockGuard lock(mutex());
+        gauges().erase(name);
+    }
+
+    Metrics::Snapshot Metrics::snapshot() {
+        MutexLockGuard lock(mutex());
+        Snapshot snapshot;
+        for (auto&& counter : counters())
+            snapshot[counter.first] = counter.second->value();
+        for (auto&& gauge : gauges())
+            snapshot[gauge.first] = gauge.second();
+        return snapshot;
+    }
+
+    MetricsReporter::MetricsReporter(size_t intervalSeconds, std::string jsonFile,
+                                     Summary summary) :
+            _interval(intervalSeconds), _jsonFile(std::move(jsonFile)), _summary(std::move(summary))
+    {
+        if (_interval) _thread = std::thread([this] {this->run();});
+    }
+
+    MetricsReporter::~MetricsReporter() {
+        {
+            MutexLockGuard lock(_mutex);
+            _stop = true;
+        }
+        _stopNotify.notify_all();
+        if (_thread.joinable()) _thread.join();
+    }
+
+    void MetricsReporter::run() {
+        std::ofstream json;
+        if (!_jsonFile.empty()) {
+            json.open(_jsonFile, std::ios_base::out | std::ios_base::app);
+            if (!json.is_open())
+                std::cerr << "Unable to open metrics file: " << _jsonFile << std::endl;
+        }
+        auto start = std::chrono::steady_clock::now();
+        auto lastTime = start;
+        Metrics::Snapshot last;
+        bool stop = false;
+        while (!stop) {
+            {
+                MutexUniqueLock lock(_mutex);
+                stop = _stopNotify.wait_for(lock, std::chrono::seconds(_interval),
+                                            [this] {return _stop;});
+            }
+            auto now = std::chrono::steady_clock::now();
+            Metrics::Snapshot snapshot = Metrics::snapshot();
+            double seconds = std::chrono::duration<double>(now - start).count();
+            double interval = std::chrono::duration<double>(now - lastTime).count();
+            std::cout << _summary(snapshot, last, seconds, interval) << std::endl;
+            if (json.is_open()) {
+                json << "{\"time\":" << seconds;
+                for (auto&& metric : snapshot)
+                    json << ",\"" << metric.first << "\":" << metric.second;
+                json << "}" << std::endl;
+            }
+            last.swap(snapshot);
+            lastTime = now;
+        }
+    }
+
+}  //namespace tools
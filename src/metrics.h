@@ -0,0 +1,181 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include "threading.h"
+
+namespace tools {
+
+    /**
+     * Counter that threads add to without sharing a cache line, reads sum the slots.
+     * Cheap enough to be bumped per document.
+     */
+    class Counter {
+    public:
+        void add(unsigned long long count = 1) {
+            _slots[slot()].value.fetch_add(count, std::memory_order_relaxed);
+        }
+
+        unsigned long long value() const {
+            unsigned long long total = 0;
+            for (auto&& slot : _slots)
+                total += slot.value.load(std::memory_order_relaxed);
+            return total;
+        }
+
+    private:
+        static constexpr size_t SLOTS = 64;
+        static constexpr size_t CACHE_LINE = 64;
+        //Padded rather than aligned, new doesn't honor extended alignment before C++17
+        struct Slot {
+            std::atomic<unsigned long long> value{};
+            char pad[CACHE_LINE - sizeof(std::atomic<unsigned long long>)];
+        };
+        Slot _slots[SLOTS];
+
+        /**
+         * @return the calling thread's slot, threads are given slots in turn
+         */
+        static size_t slot();
+    };
+
+    /**
+     * HDR style histogram: buckets are 16 linear steps per power of two, so a value is recorded to
+     * within about 6% at any magnitude.  Recording is lock free.
+     */
+    class Histogram {
+    public:
+        Histogram();
+
+        void record(unsigned long long value) {
+            _buckets[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+            unsigned long long max = _max.load(std::memory_order_relaxed);
+            while (value > max && !_max.compare_exchange_weak(max, value,
+                                                              std::memory_order_relaxed)) { }
+        }
+
+        /**
+         * Adds other's values to this histogram
+         */
+        void merge(const Histogram& other);
+
+        unsigned long long count() const;
+
+        /**
+         * @param percent i.e. 99 for p99
+         * @return the top of the bucket the percentile falls in, at most max()
+         */
+        unsigned long long percentile(double percent) const;
+
+        unsigned long long max() const {
+            return _max.load(std::memory_order_relaxed);
+        }
+
+    private:
+        static constexpr size_t SUB_BITS = 4;
+        static constexpr size_t SUB_BUCKETS = 1 << SUB_BITS;
+        static constexpr size_t BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+        std::atomic<unsigned long long> _buckets[BUCKETS];
+        std::atomic<unsigned long long> _max{};
+
+        static size_t bucket(unsigned long long value) {
+            if (value < SUB_BUCKETS) return value;
+            size_t magnitude = 63 - __builtin_clzll(value);
+            size_t sub = (value >> (magnitude - SUB_BITS)) & (SUB_BUCKETS - 1);
+            return (magnitude - SUB_BITS + 1) * SUB_BUCKETS + sub;
+        }
+
+        /**
+         * @return the largest value recorded in bucket index
+         */
+        static unsigned long long bucketTop(size_t index);
+    };
+
+    /**
+     * Registry of the load's live metrics.  Counters are owned by the registry and live for the
+     * process.  Gauges are functions read when a snapshot is taken, whoever registers a gauge
+     * must remove it before what it reads goes away.
+     */
+    class Metrics {
+    public:
+        using Gauge = std::function<double()>;
+        using Snapshot = std::map<std::string, double>;
+
+        /**
+         * @return the counter called name, created on first use
+         */
+        static Counter* counter(const std::string& name);
+
+        static void gaugeAdd(const std::string& name, Gauge gauge);
+
+        static void gaugeRemove(const std::string& name);
+
+        /**
+         * @return every counter and gauge by name
+         */
+        static Snapshot snapshot();
+
+    private:
+        static Mutex& mutex();
+        static std::map<std::string, std::unique_ptr<Counter>>& counters();
+        static std::map<std::string, Gauge>& gauges();
+    };
+
+    /**
+     * Takes a snapshot of the metrics every interval, prints a summary line of it and optionally
+     * appends it as a JSON line to a file.
+     */
+    class MetricsReporter {
+    public:
+        /**
+         * @param summary makes the line to print from the snapshot, the last snapshot and the
+         * seconds since start and since the last snapshot
+         */
+        using Summary = std::function<std::string(const Metrics::Snapshot& now,
+                                                  const Metrics::Snapshot& last,
+                                                  double seconds, double interval)>;
+
+        /**
+         * @param intervalSeconds 0 to not report
+         * @param jsonFile file to append JSON lines to, empty for none
+         */
+        MetricsReporter(size_t intervalSeconds, std::string jsonFile, Summary summary);
+
+        /**
+         * Stops reporting, a final snapshot is taken
+         */
+        ~MetricsReporter();
+
+    private:
+        const size_t _interval;
+        const std::string _jsonFile;
+        const Summary _summary;
+        Mutex _mutex;
+        ConditionVariable _stopNotify;
+        bool _stop{};
+        std::thread _thread;
+
+        void run();
+    };
+
+}  //namespace tools
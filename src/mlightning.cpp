@@ -14,8 +14,14 @@
  */
 
 #include <iostream>
+#include "calibrate.h"
+#include "clone.h"
+#include "dump_loader.h"
+#include "exporter.h"
+#include "input_scan.h"
 #include "loader.h"
 #include "mongo_cxxdriver.h"
+#include "multi_loader.h"
 #include "program_options.h"
 #include "tools.h"
 
@@ -29,7 +35,6 @@
  * # disk queues
  * # _id optimizations (drop, insert at end point, etc)
  * # moving index fields forward
- * # transforms
  * # support M to N moves
  */
 int main(int argc, char* argv[]) {
@@ -41,6 +46,101 @@ int main(int argc, char* argv[]) {
     //Read settings, then hand those settings off to the loader.
     loader::Loader::Settings settings;
     loader::setProgramOptions(settings, argc, argv);
+
+    //Exports read the cluster instead of loading it
+    if (!settings.exportDir.empty()) {
+        try {
+            loader::Exporter exporter(settings);
+            exporter.run();
+        } catch (std::exception &e) {
+            std::cerr << "Failure exporting: " << e.what() << std::endl;
+            returnValue = EXIT_FAILURE;
+        }
+        totalTimer.stop();
+        long totalSeconds = totalTimer.seconds();
+        std::cout << "\nTotal time: " << totalSeconds / 60 << "m" << totalSeconds % 60 << "s"
+                  << std::endl;
+        return returnValue;
+    }
+    if (settings.loadDir.empty()) {
+        std::cerr << "loadPath is required" << std::endl;
+        return EXIT_FAILURE;
+    }
+    //Scans read the input to report on it, nothing is loaded
+    if (settings.scan) {
+        try {
+            loader::InputScan scan(settings);
+            scan.run();
+        } catch (std::exception &e) {
+            std::cerr << "Failure scanning: " << e.what() << std::endl;
+            returnValue = EXIT_FAILURE;
+        }
+        totalTimer.stop();
+        long totalSeconds = totalTimer.seconds();
+        std::cout << "\nTotal time: " << totalSeconds / 60 << "m" << totalSeconds % 60 << "s"
+                  << std::endl;
+        return returnValue;
+    }
+    //Calibration loads a sample over and over to find the fastest settings
+    if (settings.calibrate) {
+        try {
+            loader::Calibrator calibrator(settings);
+            calibrator.run();
+        } catch (std::exception &e) {
+            std::cerr << "Failure calibrating: " << e.what() << std::endl;
+            returnValue = EXIT_FAILURE;
+        }
+        totalTimer.stop();
+        long totalSeconds = totalTimer.seconds();
+        std::cout << "\nTotal time: " << totalSeconds / 60 << "m" << totalSeconds % 60 << "s"
+                  << std::endl;
+        return returnValue;
+    }
+    //Dumps are loaded a collection at a time, each with its own processed settings
+    if (settings.dumpLoad) {
+        try {
+            loader::DumpLoader dumpLoader(settings);
+            dumpLoader.run();
+        } catch (std::exception &e) {
+            std::cerr << "Failure loading dump: " << e.what() << std::endl;
+            returnValue = EXIT_FAILURE;
+        }
+        totalTimer.stop();
+        long totalSeconds = totalTimer.seconds();
+        std::cout << "\nTotal time: " << totalSeconds / 60 << "m" << totalSeconds % 60 << "s"
+                  << std::endl;
+        return returnValue;
+    }
+    //Namespaces from a map are loaded side by side through shared end points
+    if (!settings.multiMap.empty()) {
+        try {
+            loader::MultiLoader multiLoader(settings);
+            multiLoader.run();
+        } catch (std::exception &e) {
+            std::cerr << "Failure loading namespaces: " << e.what() << std::endl;
+            returnValue = EXIT_FAILURE;
+        }
+        totalTimer.stop();
+        long totalSeconds = totalTimer.seconds();
+        std::cout << "\nTotal time: " << totalSeconds / 60 << "m" << totalSeconds % 60 << "s"
+                  << std::endl;
+        return returnValue;
+    }
+    //Clones are loaded a sharded collection at a time, like dumps
+    if (settings.cloneLoad) {
+        try {
+            cloner::Clone clone(settings);
+            clone.run();
+        } catch (std::exception &e) {
+            std::cerr << "Failure cloning: " << e.what() << std::endl;
+            returnValue = EXIT_FAILURE;
+        }
+        totalTimer.stop();
+        long totalSeconds = totalTimer.seconds();
+        std::cout << "\nTotal time: " << totalSeconds / 60 << "m" << totalSeconds % 60 << "s"
+                  << std::endl;
+        return returnValue;
+    }
     try {
         settings.process();
     } catch (std::exception &e) {
@@ -14,7 +14,12 @@
  */
 
 #include <algorithm>
+#include <atomic>
 #include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
 #include "mongo_cluster.h"
 #include "mongo_cxxdriver.h"
 
@@ -23,9 +28,36 @@ namespace tools {
 
         const mongo::BSONObj MongoCluster::CHUNK_SORT = BSON("max" << 1);
 
+        namespace {
+            /**
+             * Reads the next raw BSON document of a chunk map or snapshot into buffer
+             * @return false at the end of the file, exits if it is corrupt
+             */
+            bool bsonRead(std::istream* file, std::vector<char>* buffer, const std::string& path) {
+                int32_t size;
+                if (!file->read(reinterpret_cast<char*>(&size), sizeof(size))) return false;
+                if (size < int32_t(sizeof(size)) + 1) {
+                    std::cerr << "Corrupt cluster metadata: " << path << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                buffer->resize(size);
+                std::memcpy(buffer->data(), &size, sizeof(size));
+                if (!file->read(buffer->data() + sizeof(size), size - sizeof(size))) {
+                    std::cerr << "Truncated cluster metadata: " << path << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                return true;
+            }
+        }  //namespace
+
         MongoCluster::MongoCluster(const std::string& connStr) :
-                _sharded(false)
+                _fromChunkMap(false), _load(), _sharded(false)
         {
+            connect(connStr);
+            loadCluster();
+        }
+
+        void MongoCluster::connect(const std::string& connStr) {
             std::string error;
             _connStr = mongo::ConnectionString::parse(connStr, error);
             if (!error.empty()) {
@@ -40,12 +72,151 @@ namespace tools {
                 std::cerr << "Unable to connect: " << error << std::endl;
                 throw std::logic_error("Unable to connect to the mongo cluster");
             }
+        }
+
+        MongoCluster::MongoCluster(const std::string& connStr, const std::string& chunkMap,
+                                   LoadSettings load) :
+                _fromChunkMap(!chunkMap.empty()), _load(std::move(load)), _sharded(false)
+        {
+            if (!_fromChunkMap) {
+                connect(connStr);
+                loadCluster();
+                return;
+            }
+            //Each document is {ns: <config namespace>, doc: <config document>}, raw BSON
+            std::ifstream file(chunkMap, std::ios_base::in | std::ios_base::binary);
+            if (!file.is_open()) {
+                std::cerr << "Unable to open chunk map: " << chunkMap << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            std::vector<char> buffer;
+            while (bsonRead(&file, &buffer, chunkMap)) {
+                mongo::BSONObj entry(buffer.data());
+                _config[entry.getStringField("ns")].push_back(
+                        entry.getObjectField("doc").getOwned());
+            }
+            std::cout << "Cluster metadata from " << chunkMap << std::endl;
             loadCluster();
         }
 
         MongoCluster::~MongoCluster() {
         }
 
+        void MongoCluster::chunkMapSave(const std::string& path) const {
+            std::ofstream file(path, std::ios_base::out | std::ios_base::binary
+                                     | std::ios_base::trunc);
+            for (auto&& ns : _config)
+                for (auto&& doc : ns.second) {
+                    mongo::BSONObj entry = BSON("ns" << ns.first << "doc" << doc);
+                    file.write(entry.objdata(), entry.objsize());
+                }
+            if (!file) {
+                std::cerr << "Unable to write chunk map: " << path << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        void MongoCluster::configForEach(const NameSpace& ns, const mongo::BSONObj& query,
+                                         const mongo::BSONObj& fields,
+                                         const mongo::BSONObj& sort, const ConfigFunction& each)
+        {
+            //Saved documents were saved in the order they were queried
+            if (_fromChunkMap) {
+                for (auto&& doc : _config[ns])
+                    each(doc);
+                return;
+            }
+            std::vector<mongo::BSONObj>* keep = nullptr;
+            if (_load.keepConfig) {
+                keep = &_config[ns];
+                keep->clear();
+            }
+            ConfigFunction emit = [keep, &each](const mongo::BSONObj& doc) {
+                if (keep) keep->push_back(doc.getOwned());
+                each(doc);
+            };
+            if (ns == "config.chunks" && !_load.snapshotDir.empty() && !_load.ns.empty()) {
+                mongo::BSONObj key = snapshotKey();
+                if (!key.isEmpty()) {
+                    snapshotForEach(key, query, fields, sort, emit);
+                    return;
+                }
+            }
+            mongo::Cursor cur = _dbConn->query(ns, sort.isEmpty() ? mongo::Query(query)
+                                                                  : mongo::Query(query).sort(sort),
+                                               0, 0, fields.isEmpty() ? nullptr : &fields);
+            while (cur->more())
+                emit(cur->next());
+        }
+
+        mongo::BSONObj MongoCluster::configQuery(const NameSpace& ns) const {
+            if (_load.ns.empty()) return mongo::BSONObj();
+            if (ns == "config.chunks" || ns == "config.tags") return BSON("ns" << _load.ns);
+            if (ns == "config.collections") return BSON("_id" << _load.ns);
+            if (ns == "config.databases")
+                return BSON("_id" << _load.ns.substr(0, _load.ns.find('.')));
+            return mongo::BSONObj();
+        }
+
+        mongo::BSONObj MongoCluster::snapshotKey() {
+            mongo::BSONObj version = _dbConn->findOne("config.version", mongo::Query());
+            mongo::BSONObj coll = _dbConn->findOne("config.collections",
+                                                   mongo::Query(BSON("_id" << _load.ns)));
+            //Chunk versions only grow, any split, merge or move changes the newest
+            mongo::BSONObj fields = BSON("lastmod" << 1);
+            mongo::BSONObj newest = _dbConn->findOne("config.chunks", mongo::Query(
+                    BSON("ns" << _load.ns)).sort(BSON("lastmod" << -1)), &fields);
+            mongo::BSONElement clusterId = version.getField("clusterId");
+            mongo::BSONElement epoch = coll.getField("lastmodEpoch");
+            mongo::BSONElement lastmod = newest.getField("lastmod");
+            if (coll.getBoolField("dropped") || clusterId.eoo() || epoch.eoo() || lastmod.eoo())
+                return mongo::BSONObj();
+            mongo::BSONObjBuilder key;
+            key.append("ns", _load.ns);
+            key.appendAs(clusterId, "clusterId");
+            key.appendAs(epoch, "epoch");
+            key.appendAs(lastmod, "lastmod");
+            return key.obj();
+        }
+
+        void MongoCluster::snapshotForEach(const mongo::BSONObj& key, const mongo::BSONObj& query,
+                                           const mongo::BSONObj& fields,
+                                           const mongo::BSONObj& sort, const ConfigFunction& each)
+        {
+            //The key then the chunks, raw BSON
+            const std::string path = _load.snapshotDir + "/mlightning." + _load.ns + ".chunks";
+            {
+                std::ifstream file(path, std::ios_base::in | std::ios_base::binary);
+                std::vector<char> buffer;
+                if (file.is_open() && bsonRead(&file, &buffer, path)
+                    && !mongo::BSONObj(buffer.data()).woCompare(key)) {
+                    size_t chunks = 0;
+                    for (; bsonRead(&file, &buffer, path); ++chunks)
+                        each(mongo::BSONObj(buffer.data()));
+                    std::cout << _load.ns << ": " << chunks << " chunks from snapshot " << path
+                              << std::endl;
+                    return;
+                }
+            }
+            //Stale or missing, it is rewritten as the chunks stream in and renamed into place
+            const std::string temp = path + ".tmp";
+            std::ofstream file(temp, std::ios_base::out | std::ios_base::binary
+                                     | std::ios_base::trunc);
+            file.write(key.objdata(), key.objsize());
+            mongo::Cursor cur = _dbConn->query("config.chunks", mongo::Query(query).sort(sort), 0, 0,
+                                               fields.isEmpty() ? nullptr : &fields);
+            while (cur->more()) {
+                mongo::BSONObj doc = cur->next();
+                each(doc);
+                file.write(doc.objdata(), doc.objsize());
+            }
+            file.close();
+            if (!file || std::rename(temp.c_str(), path.c_str())) {
+                std::cerr << "Unable to write cluster metadata snapshot: " << path << std::endl;
+                std::remove(temp.c_str());
+            }
+        }
+
         void MongoCluster::clear() {
             _shards.clear();
             _nsChunks.clear();
@@ -57,15 +228,16 @@ namespace tools {
 
         template<typename IndexType, typename MappingType>
         void MongoCluster::loadIndex(IndexType* index, const std::string& queryNs, MappingType* linkmap,
-                                     const std::string& mappingName, const std::string group,
+                                     const std::string& mappingName,
+                                     const mongo::BSONObj& fields, const std::string group,
                                      const mongo::BSONObj& key) {
             //The indexes held type
             using index_mapped_type = typename IndexType::mapped_type;
             index_mapped_type* idx = nullptr;
-            mongo::Cursor cur = _dbConn->query(queryNs, mongo::Query().sort(BSON(group << 1)));
             std::string prevNs;
-            while (cur->more()) {
-                mongo::BSONObj obj = cur->next();
+            //Chunks in a namespace are contiguous so the min order is the max order
+            configForEach(queryNs, configQuery(queryNs), fields, BSON(group << 1 << "min" << 1),
+                          [&](const mongo::BSONObj& obj) {
                 std::string mappingValue = obj.getStringField(mappingName);
                 assert(!mappingValue.empty());
                 std::string ns = obj.getStringField(group);
@@ -76,22 +248,22 @@ namespace tools {
                     idx = &index->emplace(ns, index_mapped_type(tools::BSONObjCmp(key))).first->second;
                 }
                 idx->insertUnordered(obj.getField("max").Obj().getOwned(), linkmap->find(mappingValue));
-            }
+            });
             //Sort chunks here.
             if (idx) idx->finalize();
         }
 
         template<typename MappingType>
         void MongoCluster::loadIndex(NsTagUBIndex* index, const std::string& queryNs, MappingType* linkmap,
-                                     const std::string& mappingName, const std::string group,
+                                     const std::string& mappingName,
+                                     const mongo::BSONObj& fields, const std::string group,
                                      const mongo::BSONObj& key) {
             //The indexes held type
             using index_mapped_type = typename NsTagUBIndex::mapped_type;
             index_mapped_type* idx = nullptr;
-            mongo::Cursor cur = _dbConn->query(queryNs, mongo::Query().sort(BSON(group << 1)));
             std::string prevNs;
-            while (cur->more()) {
-                mongo::BSONObj obj = cur->next();
+            configForEach(queryNs, configQuery(queryNs), fields, BSON(group << 1 << "min" << 1),
+                          [&](const mongo::BSONObj& obj) {
                 std::string mappingValue = obj.getStringField(mappingName);
                 assert(!mappingValue.empty());
                 std::string ns = obj.getStringField(group);
@@ -105,7 +277,7 @@ namespace tools {
                                      TagRange(linkmap->find(mappingValue),
                                               obj.getField("max").Obj().getOwned(),
                                               obj.getField("min").Obj().getOwned()));
-            }
+            });
             //Sort chunks here.
             if (idx) idx->finalize();
         }
@@ -114,9 +286,9 @@ namespace tools {
             clear();
             //TODO: Add a sanity check this is actually a mongoS/ config server
             //Load shards && tag map
-            mongo::Cursor cur = _dbConn->query("config.shards", mongo::BSONObj());
-            while (cur->more()) {
-                mongo::BSONObj obj = cur->next();
+            std::vector<std::pair<ShardName, ShardTag>> shardTags;
+            configForEach("config.shards", mongo::BSONObj(), mongo::BSONObj(), mongo::BSONObj(),
+                          [this, &shardTags](const mongo::BSONObj& obj) {
                 std::string shard = obj.getStringField("_id");
                 std::string connect = obj.getStringField("host");
                 size_t shardnamepos = connect.find_first_of('/');
@@ -128,41 +300,56 @@ namespace tools {
                 if (shard.empty() || connect.empty())
                     throw std::logic_error("Couldn't load shards, empty values, is this a "
                             "sharded cluster?");
-                std::string tag = obj.getStringField("tag");
-                auto sharditr = _shards.emplace(std::move(shard), std::move(connect)).first;
-                if (!tag.empty())
-                    _shardTags[tag].push_back(sharditr);
-            }
+                //A shard's zones are an array of tag names
+                for (mongo::BSONObjIterator i(obj.getObjectField("tags")); i.more();) {
+                    mongo::BSONElement tag = i.next();
+                    if (tag.type() == mongo::String && tag.valuestrsize() > 1)
+                        shardTags.emplace_back(shard, tag.String());
+                }
+                _shards.emplace(std::move(shard), std::move(connect));
+            });
             _sharded = _shards.size();
-
-            //Load shard chunk ranges
-            loadIndex(&_nsChunks, "config.chunks", &_shards, "shard");
+            //Inserting shards rehashes, their iterators are only taken once all are in
+            for (auto&& shardTag : shardTags)
+                _shardTags[shardTag.second].push_back(_shards.find(shardTag.first));
+            //A zone without shards still gets an entry so its ranges point somewhere, placement
+            //then treats them as untagged
+            configForEach("config.tags", configQuery("config.tags"), BSON("_id" << 0 << "tag" << 1),
+                          mongo::BSONObj(), [this](const mongo::BSONObj& obj) {
+                std::string tag = obj.getStringField("tag");
+                if (tag.empty() || _shardTags.count(tag)) return;
+                std::cerr << "Warning: zone " << tag << " has no shards, its ranges are placed as "
+                        "untagged" << std::endl;
+                _shardTags[tag];
+            });
+
+            //Load shard chunk ranges, streamed straight into the index with only what it needs
+            loadIndex(&_nsChunks, "config.chunks", &_shards, "shard",
+                      BSON("_id" << 0 << "ns" << 1 << "shard" << 1 << "max" << 1));
             //Load tag bound ranges
-            loadIndex(&_nsTagRanges, "config.tags", &_shardTags, "tag");
+            loadIndex(&_nsTagRanges, "config.tags", &_shardTags, "tag",
+                      BSON("_id" << 0 << "ns" << 1 << "tag" << 1 << "min" << 1 << "max" << 1));
 
             //Get all the mongoS
-            cur = _dbConn->query("config.mongos", mongo::BSONObj());
-            while (cur->more()) {
-                mongo::BSONObj o = cur->next();
+            configForEach("config.mongos", mongo::BSONObj(), BSON("_id" << 1), mongo::BSONObj(),
+                          [this](const mongo::BSONObj& o) {
                 _mongos.emplace_back(std::string("mongodb://") + o.getStringField("_id"));
-            }
+            });
 
-            cur = _dbConn->query("config.databases", mongo::BSONObj());
-            while (cur->more()) {
-                mongo::BSONObj obj = cur->next();
+            configForEach("config.databases", configQuery("config.databases"), mongo::BSONObj(),
+                          mongo::BSONObj(), [this](const mongo::BSONObj& obj) {
                 std::string dbName = obj.getStringField("_id");
                 _dbs.emplace(std::make_pair(dbName,
                         MetaDatabase(dbName, obj.getBoolField("partitioned"), obj.getStringField("primary"))));
-            }
+            });
 
-            cur = _dbConn->query("config.collections", mongo::BSONObj());
-            DatabaseName prevDb;
-            while (cur->more()) {
-                mongo::BSONObj obj = cur->next();
+            configForEach("config.collections", configQuery("config.collections"),
+                          BSON("_id" << 1 << "dropped" << 1 << "key" << 1 << "unique" << 1),
+                          mongo::BSONObj(), [this](const mongo::BSONObj& obj) {
                 NameSpace currNs = obj.getStringField("_id");
                 _colls.emplace(std::make_pair(currNs, MetaNameSpace(currNs, obj.getBoolField("dropped"),
                                obj.getObjectField("key").getOwned(), obj.getBoolField("unique"))));
-            }
+            });
 
         }
 
@@ -172,6 +359,10 @@ namespace tools {
         }
 
         bool MongoCluster::balancerIsRunning() {
+            //3.4+ reports the round, older servers hold locks while balancing or migrating
+            mongo::BSONObj info;
+            if (_dbConn->runCommand("admin", BSON("balancerStatus" << 1), info))
+                return info.getBoolField("inBalancerRound");
             mongo::Cursor cursor = _dbConn->query("config.locks", BSON("state" << BSON("$gt" << 0)));
             if (!cursor->more())
                 return false;
@@ -184,6 +375,8 @@ namespace tools {
             mongo::BSONObj info;
 
             _dbConn->update("config.settings", query, update, true);
+            //3.4+ keeps the setting on the config servers, older servers reply with an error
+            _dbConn->runCommand("admin", BSON("balancerStop" << 1), info);
         }
 
         bool MongoCluster::stopBalancerWait(std::chrono::seconds wait) {
@@ -194,43 +387,16 @@ namespace tools {
                 while (balancerIsRunning() && (time::now() - start < wait)) {
                     std::this_thread::sleep_for(std::chrono::seconds(1));
                 }
-                return balancerIsRunning();
+                return !balancerIsRunning();
             }
             else {
                 while (balancerIsRunning())
                     std::this_thread::sleep_for(std::chrono::seconds(1));
-                return false;
+                return true;
             }
 
         }
 
-        void MongoCluster::waitForChunksPerShard(std::string ns, int chunksPerShard) {
-            mongo::BSONObj aggOpts = mongo::BSONObjBuilder().append("allowDiskUse", true)
-                        .append("cursor", BSON("batchSize" << 10000)).obj();
-
-            mongo::BSONObj agg = BSON_ARRAY(BSON("$match" << BSON("ns" << ns))
-                    << BSON("$group" << BSON("_id" << "$shard" << "chunkCount" << BSON("$sum" << 1))));
-
-            bool done;
-            do {
-                done = true;
-                mongo::Cursor cursor = _dbConn->aggregate("config.chunks", agg, &aggOpts);
-                if(!cursor->more()) {
-                    std::cerr << "Unable to find chunks for namespace: " << ns << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                while(cursor->more()) {
-                    mongo::BSONObj obj = cursor->next();
-                    mongo::BSONElement count = obj.getField("chunkCount");
-                    if (count.Int() < chunksPerShard) {
-                        done = false;
-                        std::this_thread::sleep_for(std::chrono::seconds(1));
-                        continue;
-                    }
-                }
-            } while (!done);
-        }
-
         bool MongoCluster::enableSharding(const DatabaseName &dbName, mongo::BSONObj* info) {
             mongo::BSONObj cmd = BSON("enableSharding" << dbName);
             return _dbConn->runCommand("admin", cmd, *info);
@@ -252,6 +418,55 @@ namespace tools {
             return _dbConn->runCommand("admin", shardCmd, *info);
         }
 
+        bool MongoCluster::splitChunk(const NameSpace& ns, const mongo::BSONObj& middle,
+                                      mongo::BSONObj* info) {
+            return _dbConn->runCommand("admin", splitCommand(ns, middle), *info);
+        }
+
+        bool MongoCluster::moveChunk(const NameSpace& ns, const mongo::BSONObj& min,
+                                     const mongo::BSONObj& max, const ShardName& to,
+                                     mongo::BSONObj* info) {
+            return _dbConn->runCommand("admin", moveCommand(ns, min, max, to), *info);
+        }
+
+        mongo::BSONObj MongoCluster::splitCommand(const NameSpace& ns,
+                                                  const mongo::BSONObj& middle) {
+            return BSON("split" << ns << "middle" << middle);
+        }
+
+        mongo::BSONObj MongoCluster::moveCommand(const NameSpace& ns, const mongo::BSONObj& min,
+                                                 const mongo::BSONObj& max, const ShardName& to) {
+            return BSON("moveChunk" << ns << "bounds" << BSON_ARRAY(min << max) << "to" << to);
+        }
+
+        size_t MongoCluster::runCommands(const std::vector<mongo::BSONObj>& commands,
+                                         size_t threads, std::vector<mongo::BSONObj>* replies) {
+            replies->assign(commands.size(), mongo::BSONObj());
+            std::atomic<size_t> next(0);
+            std::atomic<size_t> succeeded(0);
+            auto run = [&]() {
+                std::string error;
+                std::unique_ptr<mongo::DBClientBase> conn(_connStr.connect(error));
+                if (!error.empty()) {
+                    std::cerr << "Unable to connect: " << error << std::endl;
+                    return;
+                }
+                for (size_t i; (i = next++) < commands.size();) {
+                    mongo::BSONObj info;
+                    if (conn->runCommand("admin", commands[i], info)) ++succeeded;
+                    (*replies)[i] = info.getOwned();
+                }
+            };
+            threads = std::min(threads, commands.size());
+            std::vector<std::thread> workers;
+            for (size_t i = 1; i < threads; ++i)
+                workers.emplace_back(run);
+            if (threads) run();
+            for (auto&& worker : workers)
+                worker.join();
+            return succeeded;
+        }
+
         void MongoCluster::flushRouterConfigs() {
             std::unique_ptr<mongo::DBClientBase> conn;
             for (auto&& itr : _mongos) {
@@ -15,6 +15,7 @@
 
 #pragma once
 
+#include <functional>
 #include <list>
 #include <unordered_map>
 #include <unordered_set>
@@ -106,8 +107,29 @@ namespace tools {
             using TagBsonIndex = tools::Index<ChunkIndexKey, TagRange, tools::BSONObjCmp>;
             using NsTagUBIndex = std::unordered_map<NameSpace, TagBsonIndex>;
             using Mongos = std::vector<std::string>;
+
+            /**
+             * What loadCluster reads
+             */
+            struct LoadSettings {
+                //Only this namespace's chunks, tags, collection and database, empty for all
+                NameSpace ns;
+                //Directory of chunk snapshots that are used while the namespace's chunk version
+                //is unchanged, empty for none.  Needs ns.
+                std::string snapshotDir;
+                //Keep the config documents read for chunkMapSave, value initialize for false
+                bool keepConfig;
+            };
+
             MongoCluster() = delete;
             explicit MongoCluster(const std::string& conn);
+            /**
+             * @param chunkMap file saved by chunkMapSave to take the metadata from instead of the
+             * cluster, empty to connect to conn.  A cluster loaded from a file has no connection,
+             * only the metadata accessors can be used.
+             */
+            MongoCluster(const std::string& conn, const std::string& chunkMap,
+                         LoadSettings load = LoadSettings());
             virtual ~MongoCluster();
 
             /**
@@ -121,6 +143,14 @@ namespace tools {
                 return _colls.count(ns) > 0;
             }
 
+            /**
+             * @return the sharded collection ns, nullptr if it isn't sharded
+             */
+            const MetaNameSpace* collection(const NameSpace& ns) const {
+                auto i = _colls.find(ns);
+                return i == _colls.end() ? nullptr : &i->second;
+            }
+
             mongo::ConnectionString& connStr() {
                 return _connStr;
             }
@@ -201,6 +231,27 @@ namespace tools {
             bool shardCollection(const NameSpace& ns, const mongo::BSONObj& shardKey,
                                  const bool unique, int chunk, mongo::BSONObj *info);
 
+            //Split the chunk containing middle at middle
+            bool splitChunk(const NameSpace& ns, const mongo::BSONObj& middle,
+                            mongo::BSONObj* info);
+
+            //Move the chunk [min, max) to a shard, bounds work for hashed keys too
+            bool moveChunk(const NameSpace& ns, const mongo::BSONObj& min, const mongo::BSONObj& max,
+                           const ShardName& to, mongo::BSONObj* info);
+
+            static mongo::BSONObj splitCommand(const NameSpace& ns, const mongo::BSONObj& middle);
+
+            static mongo::BSONObj moveCommand(const NameSpace& ns, const mongo::BSONObj& min,
+                                              const mongo::BSONObj& max, const ShardName& to);
+
+            /**
+             * Runs admin commands at once over up to threads connections of their own
+             * @param replies the reply to each command, in order
+             * @return the count of commands that succeeded
+             */
+            size_t runCommands(const std::vector<mongo::BSONObj>& commands, size_t threads,
+                               std::vector<mongo::BSONObj>* replies);
+
             //Flush all router configs
             void flushRouterConfigs();
 
@@ -217,15 +268,19 @@ namespace tools {
              */
             void balancerStop();
             /**
-             * Stops the balancer and then checks to see if it is running
-             * @return true if running, false if not
+             * Stops the balancer and then waits for it to finish its round
+             * @param wait how long to wait, 0 for as long as it takes
+             * @return true once it is stopped, false if it is still running after wait
              */
             bool stopBalancerWait(std::chrono::seconds wait);
 
             /**
-             * Wait for all shards in a namespace to have X or more chunks
+             * @return the cluster id, collection epoch and newest chunk version of the load's
+             * namespace, any split, merge or migration changes it.  Empty if it isn't sharded.
              */
-            void waitForChunksPerShard(std::string ns, int chunksPerShard);
+            mongo::BSONObj chunksVersion() {
+                return snapshotKey();
+            }
 
             /**
              * @return count of chunks for a single namespace
@@ -251,10 +306,17 @@ namespace tools {
             }
 
             /**
-             * loads values from the cluster from the _connStr string
+             * loads values from the cluster from the _connStr string, or the chunk map file
              */
             void loadCluster();
 
+            /**
+             * Saves the config documents of the last load so a later run can use them without the
+             * cluster, i.e. a dry run.  Needs keepConfig unless the load was from a chunk map.
+             * Exits on failure.
+             */
+            void chunkMapSave(const std::string& path) const;
+
             /**
              * Appends to a container a list of the shards.
              * The container is NOT cleared.
@@ -280,6 +342,10 @@ namespace tools {
             std::unordered_map<DatabaseName, MetaDatabase> _dbs;
             std::unordered_map<NameSpace, MetaNameSpace> _colls;
             std::unique_ptr<mongo::DBClientBase> _dbConn;
+            //Config documents by namespace as last queried, or as read from the chunk map
+            std::unordered_map<NameSpace, std::vector<mongo::BSONObj>> _config;
+            const bool _fromChunkMap;
+            const LoadSettings _load;
             /*
              * Stores if sharding info could be loaded
              */
@@ -290,6 +356,41 @@ namespace tools {
              */
             void clear();
 
+            /**
+             * Connects _dbConn to connStr, throws on failure
+             */
+            void connect(const std::string& connStr);
+
+            using ConfigFunction = std::function<void(const mongo::BSONObj&)>;
+
+            /**
+             * Streams the documents of config namespace ns matching query to each in sort order.
+             * Only fields are read, all if it's empty.  Chunks come from a snapshot when one is
+             * current.
+             */
+            void configForEach(const NameSpace& ns, const mongo::BSONObj& query,
+                               const mongo::BSONObj& fields, const mongo::BSONObj& sort,
+                               const ConfigFunction& each);
+
+            /**
+             * @return the query limiting config namespace ns to the load's namespace
+             */
+            mongo::BSONObj configQuery(const NameSpace& ns) const;
+
+            /**
+             * @return what identifies the version of the load's namespace chunks: the cluster id,
+             * collection epoch and newest chunk version.  Empty if it isn't sharded.
+             */
+            mongo::BSONObj snapshotKey();
+
+            /**
+             * Streams the namespace's chunks from the snapshot if it is current for key.  If not
+             * they are queried and a new snapshot is written as they are.
+             */
+            void snapshotForEach(const mongo::BSONObj& key, const mongo::BSONObj& query,
+                                 const mongo::BSONObj& fields, const mongo::BSONObj& sort,
+                                 const ConfigFunction& each);
+
             //These private use templates are defined in the .cpp file
             /**
              * Loads an index from a config collection.  ns and max are always true at this time
@@ -298,14 +399,15 @@ namespace tools {
              */
             template<typename IndexType, typename MappingType>
             void loadIndex(IndexType* index, const std::string& queryNs, MappingType* linkmap,
-                 const std::string& mappingName, const std::string group = "ns",
-                 const mongo::BSONObj& key = CHUNK_SORT);
+                 const std::string& mappingName, const mongo::BSONObj& fields,
+                 const std::string group = "ns", const mongo::BSONObj& key = CHUNK_SORT);
             /**
              * Specialization for more complex mapping
              */
             template<typename MappingType>
             void loadIndex(NsTagUBIndex* index, const std::string& queryNs, MappingType* linkmap,
-                             const std::string& mappingName, const std::string group = "ns",
+                             const std::string& mappingName, const mongo::BSONObj& fields,
+                             const std::string group = "ns",
                              const mongo::BSONObj& key = CHUNK_SORT);
         };
 
@@ -15,12 +15,22 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <deque>
+#include <functional>
 #include <memory>
+#include <thread>
 #include <unordered_map>
+#include <vector>
+#include "concurrency_control.h"
+#include "metrics.h"
 #include "mongo_cxxdriver.h"
 #include "mongo_cluster.h"
 #include "mongo_operations.h"
+#include "placement.h"
+#include "rate_limit.h"
 #include "threading.h"
 
 namespace tools {
@@ -30,11 +40,52 @@ namespace tools {
          * The settings for an MongoEndPoint.  The settings aren't a template so they are a separate.
          */
         struct MongoEndPointSettings {
+            /**
+             * Writes documents a shard rejected for stale routing to where their chunks are now
+             * @return false if they couldn't be
+             */
+            using Reroute = std::function<bool(const std::string& ns, DataQueue* docs)>;
+
             bool startImmediate;
             bool directLoad;
             size_t maxQueueSize;
             size_t threadCount;
             size_t sleepTime;
+            /*
+             * Writer threads each end point thread hands batches to, 1 writes on the end point
+             * thread itself.  Each writer has its own connection and writes one batch at a time,
+             * the legacy driver has no pipelining on a connection, so this is concurrency.
+             */
+            size_t writerThreads;
+            //Vary the threads running between 1 and threadCount with the end point's latency
+            bool adaptiveThreads;
+            //Most threads running across all end points when adaptive, 0 for no limit
+            size_t clusterThreads;
+            //Operations popped at once and the bytes they may be absorbed into one insert up to
+            size_t coalesceOps;
+            size_t coalesceBytes;
+            //Operations are dropped instead of written and no connections are made
+            bool dryRun;
+            //Dry runs checksum the documents they drop
+            bool dryRunChecksum;
+            //Writes a second each end point (the shard for direct loads, otherwise the mongoS)
+            //and all of them together may make, 0 for no limit
+            double shardDocsPerSecond;
+            double shardMBPerSecond;
+            double clusterDocsPerSecond;
+            double clusterMBPerSecond;
+            //Seconds a secondary may lag before the writes back off, 0 for no guard
+            double maxLag;
+            size_t lagPollSeconds;
+            //Direct loads only, empty to fail rejected writes.  Unversioned writes aren't
+            //rejected for a committed migration, the dispatcher's chunk watch handles those
+            Reroute reroute;
+            //Times a failed batch is run again before the load exits, the first after
+            //retryBackoffMs and each after that twice as long
+            size_t retries;
+            size_t retryBackoffMs;
+            //Failed batches a run loop holds for retry, past it the loop takes no new batches
+            size_t retryQueueMax;
         };
 
         /**
@@ -46,11 +97,36 @@ namespace tools {
         template<typename TOpQueue>
         class BasicMongoEndPoint {
         public:
-            BasicMongoEndPoint(MongoEndPointSettings settings, std::string connStr) :
-                    _threadPool(settings.threadCount),
+            /**
+             * @param clusterActive threads running across the cluster, shared by its end points
+             * @param clusterLimit, lagGuard rate limits shared by the end points, nullptr for none
+             * @param lanes loads sharing the end points, nullptr if only one load uses them
+             */
+            BasicMongoEndPoint(MongoEndPointSettings settings, std::string connStr,
+                               std::atomic<size_t>* clusterActive = nullptr,
+                               RateLimit* clusterLimit = nullptr, LagGuard* lagGuard = nullptr,
+                               std::atomic<size_t>* lanes = nullptr) :
+                    _threadPool(settings.threadCount, tools::Placement::pin),
                     _opQueue(settings.maxQueueSize),
                     _sleepTime(settings.sleepTime),
-                    _threadCount(settings.threadCount)
+                    _threadCount(settings.threadCount),
+                    _writerThreads(std::max<size_t>(settings.writerThreads, 1)),
+                    _coalesceOps(std::max<size_t>(settings.coalesceOps, 1)),
+                    _coalesceBytes(settings.coalesceBytes),
+                    _control(connStr, settings.adaptiveThreads, settings.threadCount,
+                             settings.clusterThreads ? clusterActive : nullptr,
+                             settings.clusterThreads),
+                    _maxQueueSize(settings.maxQueueSize),
+                    _limit(settings.shardDocsPerSecond, settings.shardMBPerSecond * 1024 * 1024),
+                    _clusterLimit(clusterLimit),
+                    _lagGuard(lagGuard),
+                    _lanes(lanes),
+                    _dryRun(settings.dryRun),
+                    _dryRunChecksum(settings.dryRunChecksum),
+                    _reroute(std::move(settings.reroute)),
+                    _retries(settings.retries),
+                    _retryBackoff(settings.retryBackoffMs),
+                    _retryQueueMax(std::max<size_t>(settings.retryQueueMax, 1))
             {
                 std::string error;
                 _connStr = mongo::ConnectionString::parse(connStr, error);
@@ -86,7 +162,7 @@ namespace tools {
             void start() {
                 assert(!isRunning());
                 for (size_t i = 0; i < _threadCount; ++i)
-                    _threadPool.queue([this] () {this->run();});
+                    _threadPool.queue([this, i] () {this->run(i);});
             }
 
             /**
@@ -102,7 +178,12 @@ namespace tools {
             void gracefulShutdownJoin() {
                 _opQueue.endWait();
                 _threadPool.endWaitInitiate();
+                _control.release();
                 joinAll();
+                if (_opQueue.popWaits())
+                    std::cout << _connStr.toString() << ": parked waiting for work: "
+                              << _opQueue.parkedNanos() / 1000000 << "ms across "
+                              << _threadCount << " threads" << std::endl;
             }
 
             /**
@@ -110,6 +191,7 @@ namespace tools {
              */
             void shutdown() {
                 _threadPool.terminateInitiate();
+                _control.release();
             }
 
             /**
@@ -120,6 +202,122 @@ namespace tools {
                 _threadPool.joinAll();
             }
 
+            /**
+             * @return pressure of the operation queue
+             */
+            double pressure() const {
+                return _opQueue.pressure();
+            }
+
+            /**
+             * @return operations waiting in the queue
+             */
+            double queued() const {
+                return _opQueue.pressure() * _maxQueueSize;
+            }
+
+            /**
+             * @return operations being written right now
+             */
+            size_t inFlight() const {
+                return _inFlight.load(std::memory_order_relaxed);
+            }
+
+            /**
+             * @return time producers waited on a full queue and time threads parked on an empty one
+             */
+            unsigned long long pushWaitNanos() const {
+                return _opQueue.pushWaitNanos();
+            }
+
+            unsigned long long parkedNanos() const {
+                return _opQueue.parkedNanos();
+            }
+
+            /**
+             * @return latency of each batch written in microseconds
+             */
+            const tools::Histogram& latency() const {
+                return _latency;
+            }
+
+            /**
+             * @return documents and bytes of each batch written
+             */
+            const tools::Histogram& batchDocs() const {
+                return _batchDocs;
+            }
+
+            const tools::Histogram& batchBytes() const {
+                return _batchBytes;
+            }
+
+            /**
+             * @return sum of the checksums of the documents a dry run dropped
+             */
+            unsigned long long checksum() const {
+                return _checksum;
+            }
+
+            /**
+             * @return totals written by the end point
+             */
+            unsigned long long docsWritten() const {
+                return _docsWritten;
+            }
+
+            unsigned long long bytesWritten() const {
+                return _bytesWritten;
+            }
+
+            /**
+             * @return operations absorbed into the one before them
+             */
+            unsigned long long coalesced() const {
+                return _coalesced;
+            }
+
+            /**
+             * @return time threads waited on the rate limits
+             */
+            unsigned long long throttledNanos() const {
+                return _throttledNanos;
+            }
+
+            /**
+             * @return documents shards rejected for stale routing that were written elsewhere
+             */
+            unsigned long long rerouted() const {
+                return _rerouted;
+            }
+
+            /**
+             * @return batches run again after failing, and connections made again for them
+             */
+            unsigned long long retried() const {
+                return _retried;
+            }
+
+            /**
+             * @return duplicate key errors retries took as documents an earlier run wrote
+             */
+            unsigned long long retryDuplicates() const {
+                return _retryDuplicates;
+            }
+
+            unsigned long long reconnects() const {
+                return _reconnects;
+            }
+
+            /**
+             * @return the expected wait for a new operation: queued operations times the recent
+             * batch latency.  Latency counts as 1ns until the first batch is written.
+             */
+            double load() const {
+                return (queued() + 1)
+                        * std::max<unsigned long long>(_latencyNanos.load(std::memory_order_relaxed), 1);
+            }
+
             /**
              * Push onto the thread queue
              */
@@ -129,48 +327,82 @@ namespace tools {
                 return true;
             }
 
+            /**
+             * Push for one of the loads sharing the end point (i.e. a MultiLoader's namespaces).
+             * While more than one is open each has an equal share of the queue, one at its share
+             * waits until one of its operations is written.  A load with more input can't
+             * crowd the others out.
+             * @param lane identifies the load
+             */
+            bool push(DbOpPointer dbOp, const void* lane) {
+                if (!_lanes || *_lanes < 2) return push(std::move(dbOp));
+                {
+                    tools::MutexUniqueLock lock(_laneMutex);
+                    //Entries are never erased, so the reference stays valid while waiting
+                    size_t& queued = _laneQueued[lane];
+                    _laneNotify.wait(lock, [this, &queued] {return queued < laneShare();});
+                    ++queued;
+                }
+                dbOp->holds.emplace_back(static_cast<void*>(this), [this, lane](void*) {
+                    tools::MutexLockGuard lock(_laneMutex);
+                    --_laneQueued[lane];
+                    _laneNotify.notify_all();
+                });
+                return push(std::move(dbOp));
+            }
+
+            /**
+             * Wakes lanes waiting on their share, i.e. once a load sharing the end point is done
+             */
+            void lanesChanged() {
+                tools::MutexLockGuard lock(_laneMutex);
+                _laneNotify.notify_all();
+            }
+
             /**
              * thread work loop
-             *
+             * @param index the thread's number, threads past the active count are parked
              */
-            void run() {
+            void run(size_t index) {
+                if (_dryRun) {
+                    runDry(index);
+                    return;
+                }
+                if (_writerThreads > 1) {
+                    runWriters(index);
+                    return;
+                }
                 //dbConn used in exception catching to see what db is connected to
-                mongo::DBClientBase* dbConn = nullptr;
+                std::unique_ptr<mongo::DBClientBase> dbConn;
                 try {
                     DbOpPointer currentOp;
-                    //TODO: Implement a retry on connect failed DbConnection
-                    std::string error;
-                    int retries = 3;
-                    for (;;) {
-                        dbConn = _connStr.connect(error);
-                        if(dbConn || !retries) break;
-                        --retries;
-                        sleep(1);
-                    }
-                    if (!dbConn) {
-                        std::cerr << "Unable to connect to: " << _connStr.toString()
-                                << "\nError: " << error
-                                << "\nExiting" << std::endl;
-                        exit(EXIT_FAILURE);
-                    }
-
+                    Pending pending;
+                    Retries retries;
+                    dbConn.reset(connect());
 
                     //Discount the first miss as the loop is probably starting dry
                     bool miss = false;
                     bool firstmiss = true;
+                    bool ending = false;
                     size_t missCount {};
                     while (!_threadPool.terminate()) {
-                        if (pop(currentOp)) {
+                        if (pending.empty() && retries.empty()) _control.admit(index);
+                        if (popRetry(&retries, currentOp, ending)
+                            || (!ending && pop(currentOp, &pending))) {
                             if (miss) {
                                 miss = false;
                                 firstmiss = false;
                                 std::cout << dbConn->toString() << ": Hitting" << std::endl;
                             }
-                            if(!currentOp->run(dbConn))
-                                throw std::logic_error("Insert failed, terminating shoot out");
+                            runTimed(&currentOp, &dbConn, &retries);
                         }
                         else {
-                            if (_threadPool.endWait()) break;
+                            //A parking queue only comes back empty once the work has ended
+                            if (_opQueue.popWaits() || _threadPool.endWait()) {
+                                if (retries.empty()) break;
+                                ending = true;
+                                continue;
+                            }
                             //TODO: log levels.  If you are seeing misses std::cout is cheap
                             if (!miss && !firstmiss) {
                                 std::cout << dbConn->toString() << ": Missing" << std::endl;
@@ -202,8 +434,424 @@ namespace tools {
             }
 
         private:
-            bool pop(DbOpPointer& dbOp) {
-                return _opQueue.pop(dbOp);
+            /**
+             * The result of a single batch written by a Writer
+             */
+            struct Completion {
+                size_t writer;
+                size_t batch;
+                bool ok;
+                std::string error;
+                //The operation if it failed, to be run again
+                DbOpPointer op;
+            };
+            using CompletionQueue = tools::WaitQueue<Completion>;
+
+            /**
+             * Counts an operation as in flight for its scope
+             */
+            struct InFlight {
+                explicit InFlight(std::atomic<size_t>* count) : count(count) {
+                    ++*count;
+                }
+
+                ~InFlight() {
+                    --*count;
+                }
+
+                std::atomic<size_t>* const count;
+            };
+
+            /**
+             * A connection with a thread that runs one operation at a time for a run loop.
+             * The legacy driver is synchronous, so each write in flight needs its own socket.
+             */
+            struct Writer {
+                tools::Mutex mutex;
+                tools::ConditionVariable notify;
+                DbOpPointer op;
+                size_t batch {};
+                bool stop {};
+                std::unique_ptr<mongo::DBClientBase> conn;
+                std::thread thread;
+            };
+
+            /**
+             * A failed operation waiting out its backoff
+             */
+            struct Retry {
+                DbOpPointer op;
+                std::chrono::steady_clock::time_point due;
+            };
+
+            /**
+             * Failed operations a run loop holds, at most _retryQueueMax
+             */
+            using Retries = std::vector<Retry>;
+
+            //Backoffs stop doubling here
+            static constexpr std::chrono::milliseconds::rep MAX_BACKOFF_MS = 30000;
+
+            /**
+             * Operations a run loop popped together, they are written before it pops again
+             */
+            struct Pending {
+                DbOpPointers ops;
+                size_t next {};
+
+                bool empty() const {
+                    return next == ops.size();
+                }
+            };
+
+            /**
+             * Takes the next operation, popping up to _coalesceOps at once.  The operations
+             * after it are absorbed into it while they fit in _coalesceBytes, so small
+             * batches for the same namespace go out as one insert.  An admitted thread writes
+             * all that it popped before it is admitted again.
+             */
+            bool pop(DbOpPointer& dbOp, Pending* pending) {
+                if (pending->empty()) {
+                    pending->ops.clear();
+                    pending->next = 0;
+                    if (!_opQueue.popMany(&pending->ops, _coalesceOps)) return false;
+                }
+                dbOp = std::move(pending->ops[pending->next++]);
+                while (!pending->empty()
+                       && dbOp->absorb(pending->ops[pending->next].get(), _coalesceBytes)) {
+                    pending->ops[pending->next++].reset();
+                    _coalesced.fetch_add(1, std::memory_order_relaxed);
+                }
+                throttle(dbOp.get());
+                return true;
+            }
+
+            /**
+             * @return the operations each lane may have pushed and not yet written
+             */
+            size_t laneShare() const {
+                return std::max<size_t>(_maxQueueSize / std::max<size_t>(*_lanes, 1), 1);
+            }
+
+            /**
+             * Waits until the operation is within the rate limits, it is counted against them
+             * before it runs
+             */
+            void throttle(DbOp* op) {
+                size_t docs = op->docs();
+                size_t bytes = op->bytes();
+                unsigned long long waited = _limit.take(docs, bytes);
+                if (_clusterLimit) waited += _clusterLimit->take(docs, bytes);
+                if (_lagGuard) waited += _lagGuard->take(bytes);
+                if (waited) _throttledNanos.fetch_add(waited, std::memory_order_relaxed);
+            }
+
+            /**
+             * Drops a failed operation without destroying it, the load is exiting and what the
+             * operation holds (i.e. journal progress) must not be let go of as if it were written
+             */
+            static void abandon(DbOpPointer* op) {
+                op->release();
+            }
+
+            /**
+             * Runs an operation, what a shard rejected for stale routing is rerouted
+             * @return true if all of it was written
+             */
+            bool runRouted(DbOp* op, mongo::DBClientBase* dbConn) {
+                if (op->run(dbConn)) return true;
+                std::string ns;
+                DataQueue docs;
+                if (!_reroute || !op->rejected(&ns, &docs)) return false;
+                _rerouted.fetch_add(docs.size(), std::memory_order_relaxed);
+                return _reroute(ns, &docs);
+            }
+
+            /**
+             * Runs an operation, feeding its latency to the controller if it is written
+             * @param error is set to why the operation failed
+             * @return true if all of it was written
+             */
+            bool attempt(DbOp* op, mongo::DBClientBase* dbConn, std::string* error) {
+                size_t bytes = op->bytes();
+                size_t docs = op->docs();
+                auto start = std::chrono::steady_clock::now();
+                bool ok = false;
+                try {
+                    tools::Trace::Span span("insert", op->traceTag);
+                    InFlight inFlight(&_inFlight);
+                    ok = runRouted(op, dbConn);
+                }
+                catch (mongo::DBException& e) {
+                    *error = std::string("DBException: ") + e.what();
+                }
+                catch (std::exception& e) {
+                    *error = std::string("std::exception: ") + e.what();
+                }
+                if (!ok) return false;
+                if (op->duplicates)
+                    _retryDuplicates.fetch_add(op->duplicates, std::memory_order_relaxed);
+                recordLatency(bytes, docs, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start).count());
+                return true;
+            }
+
+            /**
+             * Runs an operation, a failed one is held for a retry and the connection is made
+             * again in case it is what failed
+             */
+            void runTimed(DbOpPointer* op, std::unique_ptr<mongo::DBClientBase>* dbConn,
+                          Retries* retries) {
+                std::string error;
+                if (attempt(op->get(), dbConn->get(), &error)) return;
+                retry(op, error, retries);
+                reconnect(dbConn);
+            }
+
+            /**
+             * Holds a failed operation to be run again once its backoff is up.  Exits if it is
+             * out of retries or has nothing left to run again, i.e. it was rerouted.
+             */
+            void retry(DbOpPointer* op, const std::string& error, Retries* retries) {
+                size_t attempts = ++(*op)->attempts;
+                std::cerr << "End point failed: " << _connStr.toString() << " attempt "
+                        << attempts << " of " << _retries + 1 << (error.empty() ? "" : "\n")
+                        << error << std::endl;
+                if (attempts > _retries || !(*op)->docs()) {
+                    std::cerr << _connStr.toString() << ": out of retries, terminating shoot out"
+                            << std::endl;
+                    abandon(op);
+                    exit(EXIT_FAILURE);
+                }
+                retries->push_back(Retry {std::move(*op),
+                                          std::chrono::steady_clock::now() + backoff(attempts)});
+                _retried.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            /**
+             * Takes the retry due first if it is due.  It is waited for if the loop holds too
+             * many to take new work, if there is no new work queued or if the work has ended.
+             * @param wait waits until the time point it is passed, false if it was cut short by
+             * something that can change the retries, which are then looked at again
+             * @return false if no retry was taken
+             */
+            template<typename Wait>
+            bool popRetry(Retries* retries, DbOpPointer& dbOp, bool ending, Wait wait) {
+                typename Retries::iterator next;
+                for (;;) {
+                    if (retries->empty()) return false;
+                    next = std::min_element(retries->begin(), retries->end(),
+                                            [](const Retry& l, const Retry& r) {
+                        return l.due < r.due;});
+                    if (next->due <= std::chrono::steady_clock::now()) break;
+                    if (!ending && retries->size() < _retryQueueMax && queued() >= 1)
+                        return false;
+                    if (wait(next->due)) break;
+                }
+                dbOp = std::move(next->op);
+                retries->erase(next);
+                throttle(dbOp.get());
+                return true;
+            }
+
+            bool popRetry(Retries* retries, DbOpPointer& dbOp, bool ending) {
+                return popRetry(retries, dbOp, ending,
+                                [](const std::chrono::steady_clock::time_point& due) {
+                    std::this_thread::sleep_until(due);
+                    return true;});
+            }
+
+            /**
+             * @return the wait before a retry, doubling with the attempts
+             */
+            std::chrono::milliseconds backoff(size_t attempts) const {
+                auto wait = _retryBackoff.count() << std::min<size_t>(attempts - 1, 16);
+                return std::chrono::milliseconds(wait < MAX_BACKOFF_MS ? wait : MAX_BACKOFF_MS);
+            }
+
+            /**
+             * Replaces a connection after a failed write.  A replica set's connection string
+             * finds the set's primary again, so writes follow a stepdown to the new primary.
+             */
+            void reconnect(std::unique_ptr<mongo::DBClientBase>* dbConn) {
+                dbConn->reset(connect());
+                _reconnects.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            /**
+             * Feeds a written batch's latency to the controller, the moving average and the
+             * histograms
+             */
+            void recordLatency(size_t bytes, size_t docs, unsigned long long nanos) {
+                _control.record(bytes, nanos);
+                _latency.record(nanos / 1000);
+                _batchDocs.record(docs);
+                _batchBytes.record(bytes);
+                _docsWritten.fetch_add(docs, std::memory_order_relaxed);
+                _bytesWritten.fetch_add(bytes, std::memory_order_relaxed);
+                unsigned long long average = _latencyNanos.load(std::memory_order_relaxed);
+                _latencyNanos.store(average ? average - average / 8 + nanos / 8 : nanos,
+                                    std::memory_order_relaxed);
+            }
+
+            /**
+             * Connects to the end point, retrying with the batches' backoff and at least a few
+             * times.  Exits on failure.
+             */
+            mongo::DBClientBase* connect() {
+                std::string error;
+                mongo::DBClientBase* dbConn = nullptr;
+                const size_t retries = std::max<size_t>(_retries, 3);
+                for (size_t attempts = 1;; ++attempts) {
+                    dbConn = _connStr.connect(error);
+                    if (dbConn || attempts > retries) break;
+                    std::this_thread::sleep_for(backoff(attempts));
+                }
+                if (!dbConn) {
+                    std::cerr << "Unable to connect to: " << _connStr.toString()
+                            << "\nError: " << error
+                            << "\nExiting" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                return dbConn;
+            }
+
+            /**
+             * Work loop for dry runs, operations are dropped as they arrive.  Dropping is timed as
+             * the operation's latency so the end point stats still show the work done.
+             */
+            void runDry(size_t index) {
+                DbOpPointer currentOp;
+                Pending pending;
+                while (!_threadPool.terminate()) {
+                    if (pending.empty()) _control.admit(index);
+                    if (!pop(currentOp, &pending)) {
+                        if (_opQueue.popWaits() || _threadPool.endWait()) break;
+                        std::this_thread::sleep_for(std::chrono::milliseconds(_sleepTime));
+                        continue;
+                    }
+                    size_t bytes = currentOp->bytes();
+                    size_t docs = currentOp->docs();
+                    unsigned long long checksum = 0;
+                    auto start = std::chrono::steady_clock::now();
+                    {
+                        tools::Trace::Span span("sink", currentOp->traceTag);
+                        currentOp->sink(_dryRunChecksum ? &checksum : nullptr);
+                        currentOp.reset();
+                    }
+                    recordLatency(bytes, docs, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start).count());
+                    if (checksum) _checksum.fetch_add(checksum, std::memory_order_relaxed);
+                }
+            }
+
+            /**
+             * Work loop that keeps _writerThreads writers busy, a batch each on its own
+             * connection.  Operations are handed to idle writers and their results come back on a completion
+             * queue, so a failed batch is held for a retry while the rest stay in flight.
+             */
+            void runWriters(size_t index) {
+                CompletionQueue completions(_writerThreads);
+                std::vector<std::unique_ptr<Writer>> writers;
+                std::vector<size_t> idle;
+                for (size_t i = 0; i < _writerThreads; ++i) {
+                    writers.emplace_back(new Writer);
+                    writers.back()->conn.reset(connect());
+                    idle.push_back(i);
+                }
+                for (size_t i = 0; i < _writerThreads; ++i)
+                    writers[i]->thread = std::thread([this, &writers, &completions, i] () {
+                        tools::Placement::pin();
+                        this->write(writers[i].get(), i, &completions);
+                    });
+
+                size_t batch {};
+                Retries retries;
+                auto taken = [&] (Completion& done) {
+                    if (!done.ok) retry(&done.op, "batch " + std::to_string(done.batch) + ": "
+                                        + done.error, &retries);
+                    idle.push_back(done.writer);
+                };
+                auto complete = [&] () {
+                    Completion done;
+                    completions.pop(done);
+                    taken(done);
+                };
+                //A retry's backoff is spent taking the completions of the writes still out
+                auto backoff = [&] (const std::chrono::steady_clock::time_point& due) {
+                    if (idle.size() == writers.size()) {
+                        std::this_thread::sleep_until(due);
+                        return true;
+                    }
+                    Completion done;
+                    if (!completions.popUntil(done, due)) return true;
+                    taken(done);
+                    return false;
+                };
+
+                DbOpPointer currentOp;
+                Pending pending;
+                bool ending = false;
+                while (!_threadPool.terminate()) {
+                    if (idle.empty()) {
+                        complete();
+                        continue;
+                    }
+                    if (pending.empty() && retries.empty()) _control.admit(index);
+                    if (!popRetry(&retries, currentOp, ending, backoff)
+                        && (ending || !pop(currentOp, &pending))) {
+                        if (ending || _opQueue.popWaits() || _threadPool.endWait()) {
+                            ending = true;
+                            //Writes still out can fail and come back to be retried
+                            if (idle.size() < writers.size()) complete();
+                            else if (retries.empty()) break;
+                            continue;
+                        }
+                        std::this_thread::sleep_for(std::chrono::milliseconds(_sleepTime));
+                        continue;
+                    }
+                    Writer* writer = writers[idle.back()].get();
+                    idle.pop_back();
+                    {
+                        tools::MutexLockGuard lock(writer->mutex);
+                        writer->op = std::move(currentOp);
+                        writer->batch = ++batch;
+                    }
+                    writer->notify.notify_one();
+                }
+                while (idle.size() < writers.size())
+                    complete();
+                for (auto&& writer : writers) {
+                    {
+                        tools::MutexLockGuard lock(writer->mutex);
+                        writer->stop = true;
+                    }
+                    writer->notify.notify_one();
+                    writer->thread.join();
+                }
+            }
+
+            /**
+             * Writer thread loop, runs each operation handed to it and posts the result.  A failed
+             * operation is posted back with the result and the writer connects again.
+             */
+            void write(Writer* writer, size_t index, CompletionQueue* completions) {
+                for (;;) {
+                    {
+                        tools::MutexUniqueLock lock(writer->mutex);
+                        writer->notify.wait(lock, [writer] () {return writer->op || writer->stop;});
+                        if (!writer->op) return;
+                    }
+                    Completion done {index, writer->batch, false, {}, {}};
+                    done.ok = attempt(writer->op.get(), writer->conn.get(), &done.error);
+                    if (!done.ok) reconnect(&writer->conn);
+                    {
+                        tools::MutexLockGuard lock(writer->mutex);
+                        if (done.ok) writer->op.reset();
+                        else done.op = std::move(writer->op);
+                    }
+                    completions->push(std::move(done));
+                }
             }
 
             tools::ThreadPool _threadPool;
@@ -211,6 +859,40 @@ namespace tools {
             TOpQueue _opQueue;
             size_t _sleepTime;
             size_t _threadCount;
+            size_t _writerThreads;
+            const size_t _coalesceOps;
+            const size_t _coalesceBytes;
+            ConcurrencyControl _control;
+            const size_t _maxQueueSize;
+            RateLimit _limit;
+            RateLimit* const _clusterLimit;
+            LagGuard* const _lagGuard;
+            std::atomic<size_t>* const _lanes;
+            //Operations each lane has pushed and not yet written
+            tools::Mutex _laneMutex;
+            tools::ConditionVariable _laneNotify;
+            std::unordered_map<const void*, size_t> _laneQueued;
+            std::atomic<unsigned long long> _throttledNanos {};
+            //Moving average of batch latency, racing updates only lose a sample
+            std::atomic<unsigned long long> _latencyNanos {};
+            std::atomic<size_t> _inFlight {};
+            tools::Histogram _latency;
+            tools::Histogram _batchDocs;
+            tools::Histogram _batchBytes;
+            std::atomic<unsigned long long> _docsWritten {};
+            std::atomic<unsigned long long> _bytesWritten {};
+            std::atomic<unsigned long long> _coalesced {};
+            std::atomic<unsigned long long> _rerouted {};
+            const bool _dryRun;
+            const bool _dryRunChecksum;
+            const MongoEndPointSettings::Reroute _reroute;
+            const size_t _retries;
+            const std::chrono::milliseconds _retryBackoff;
+            const size_t _retryQueueMax;
+            std::atomic<unsigned long long> _retried {};
+            std::atomic<unsigned long long> _retryDuplicates {};
+            std::atomic<unsigned long long> _reconnects {};
+            std::atomic<unsigned long long> _checksum {};
         };
 
         /**
@@ -218,7 +900,7 @@ namespace tools {
          * All endpoints should either be monogS or mongoD
          */
         //template<typename TOpQueue = tools::mtools::OpQueueNoLock>
-        template<typename TOpQueue = tools::mtools::OpQueueLocking1>
+        template<typename TOpQueue = tools::mtools::OpQueueSpinPark>
         class MongoEndPointHolder {
         public:
             using MongoEndPoint = BasicMongoEndPoint<TOpQueue>;
@@ -228,21 +910,34 @@ namespace tools {
                     MongoEndPointPtr>;
 
             MongoEndPointHolder(const MongoEndPointSettings &settings, const MongoCluster& mCluster) :
+                    _clusterLimit(settings.clusterDocsPerSecond,
+                                  settings.clusterMBPerSecond * 1024 * 1024),
                     _started( false)
             {
+                //A dry run has no secondaries to fall behind
+                if (settings.maxLag > 0 && !settings.dryRun) {
+                    std::vector<std::string> shards;
+                    for (auto& shard : mCluster.shards())
+                        shards.push_back(shard.second);
+                    _lagGuard.reset(new LagGuard(std::move(shards), settings.maxLag,
+                                                 settings.lagPollSeconds));
+                }
+                RateLimit* clusterLimit = _clusterLimit.limited() ? &_clusterLimit : nullptr;
                 if (settings.directLoad) {
                     for (auto& shard : mCluster.shards())
                         _epm.emplace(std::make_pair(shard.first, MongoEndPointPtr(
-                                new MongoEndPoint {settings, shard.second})));
+                                new MongoEndPoint {settings, shard.second, &_clusterActive,
+                                                  clusterLimit, _lagGuard.get(), &_lanes})));
                 }
                 else {
                     for (auto& mongoS : mCluster.mongos())
                         _epm.emplace(std::make_pair(mongoS, MongoEndPointPtr(new MongoEndPoint {
-                                settings, mongoS})));
+                                settings, mongoS, &_clusterActive, clusterLimit,
+                                _lagGuard.get(), &_lanes})));
                 }
                 assert(_epm.size());
-                //We like to start with edge cases
-                _cycleItr = _epm.begin();
+                for (auto&& ep : _epm)
+                    _cycle.push_back(ep.second.get());
                 if (settings.startImmediate) start();
             }
 
@@ -258,10 +953,27 @@ namespace tools {
              * Hand out end points in a round robin, use for mongoS
              */
             MongoEndPoint* getMongoSCycle() {
-                tools::MutexLockGuard lock(_cycleMutex);
-                ++_cycleItr;
-                if (_cycleItr == _epm.end()) _cycleItr = _epm.begin();
-                return _cycleItr->second.get();
+                //We like to start with edge cases
+                return _cycle[++_cycleNext % _cycle.size()];
+            }
+
+            /**
+             * @return the end point with the least expected wait, use for mongoS per batch.  The
+             * scan starts in a round robin so that ties spread out.
+             */
+            MongoEndPoint* getMongoSLeastLoaded() {
+                size_t start = _cycleNext++;
+                MongoEndPoint* best = nullptr;
+                double bestLoad = 0;
+                for (size_t i = 0; i < _cycle.size(); ++i) {
+                    MongoEndPoint* ep = _cycle[(start + i) % _cycle.size()];
+                    double load = ep->load();
+                    if (!best || load < bestLoad) {
+                        best = ep;
+                        bestLoad = load;
+                    }
+                }
+                return best;
             }
 
             /**
@@ -277,21 +989,66 @@ namespace tools {
              */
             void start() {
                 _started = true;
+                if (_lagGuard) _lagGuard->start();
                 for (auto&& i : _epm)
                     i.second->start();
             }
 
+            size_t size() const {
+                return _epm.size();
+            }
+
+            /**
+             * A load starts sharing the end points, they split their queues evenly between the
+             * loads from then on
+             */
+            void laneOpen() {
+                ++_lanes;
+            }
+
+            void laneClose() {
+                --_lanes;
+                for (auto&& ep : _epm)
+                    ep.second->lanesChanged();
+            }
+
+            /**
+             * @return the end points by name
+             */
+            const MongoEndPointMap& endPoints() const {
+                return _epm;
+            }
+
+            /**
+             * @return the pressure of the fullest end point
+             */
+            double pressure() const {
+                double pressure = 0;
+                for (auto&& ep : _epm)
+                    pressure = std::max(pressure, ep.second->pressure());
+                return pressure;
+            }
+
             /**
              * Have all of the end points shutdown when their queues are cleared, join those threads.
              */
             void gracefulShutdownJoin() {
                 for (auto&& ep : _epm)
                     ep.second->gracefulShutdownJoin();
+                if (_lagGuard) _lagGuard->stop();
             }
 
         private:
-            tools::Mutex _cycleMutex;
-            typename MongoEndPointMap::iterator _cycleItr;
+            //The end points in _epm order, for handing out without a lock
+            std::vector<MongoEndPoint*> _cycle;
+            std::atomic<size_t> _cycleNext {};
+            //Threads running across the end points when their concurrency is adaptive
+            std::atomic<size_t> _clusterActive {};
+            //Loads sharing the end points
+            std::atomic<size_t> _lanes {};
+            //Shared by the end points, so they go before them
+            RateLimit _clusterLimit;
+            std::unique_ptr<LagGuard> _lagGuard;
             MongoEndPointMap _epm;
             bool _started;
 
@@ -14,6 +14,13 @@
  */
 
 #include "mongo_operations.h"
+#include <chrono>
+#include <cstring>
+#include <iterator>
+#include <unordered_set>
+#include <thread>
+#include "memory_budget.h"
+#include "wire_stats.h"
 
 namespace tools {
     namespace mtools {
@@ -31,20 +38,204 @@ namespace tools {
                 ;
         }
 
+        const size_t OpQueueSpinPark::SPIN_TRIES;
+
+        OpQueueSpinPark::~OpQueueSpinPark() {
+            //defensive: clear the queue so that pointers are deleted
+            DbOpPointer dbOp;
+            while (tryPop(dbOp))
+                ;
+        }
+
+        OpReturnCode OpQueueSpinPark::push(DbOpPointer& dbOp) {
+            pushQueued(dbOp);
+            //A parked consumer registers before it checks, so it sees this value or the count
+            if (_popWaiters) {
+                MutexLockGuard lock(_mutex);
+                _workNotify.notify_one();
+            }
+            return true;
+        }
+
+        OpReturnCode OpQueueSpinPark::pushMany(DbOpPointers* dbOps) {
+            for (auto&& dbOp : *dbOps) {
+                //Consumers have to be awake to make room
+                if (_size >= _queueMaxSize && _popWaiters) {
+                    MutexLockGuard lock(_mutex);
+                    _workNotify.notify_all();
+                }
+                pushQueued(dbOp);
+            }
+            bool pushed = !dbOps->empty();
+            dbOps->clear();
+            if (pushed && _popWaiters) {
+                MutexLockGuard lock(_mutex);
+                _workNotify.notify_all();
+            }
+            return true;
+        }
+
+        void OpQueueSpinPark::pushQueued(DbOpPointer& dbOp) {
+            if (_size >= _queueMaxSize) {
+                ++_pushWaiters;
+                auto start = std::chrono::steady_clock::now();
+                {
+                    MutexUniqueLock lock(_mutex);
+                    _spaceNotify.wait(lock, [this] {return _size < _queueMaxSize;});
+                }
+                _pushWaitNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start).count();
+                --_pushWaiters;
+            }
+            ++_size;
+            _queues[tools::Placement::node() % _queues.size()]->push(dbOp.release());
+        }
+
+        bool OpQueueSpinPark::tryPop(DbOpPointer& dbOp, bool locked) {
+            DbOp* rawptr = nullptr;
+            size_t node = tools::Placement::node();
+            for (size_t i = 0; i < _queues.size() && !rawptr; ++i)
+                if (!_queues[(node + i) % _queues.size()]->pop(rawptr)) rawptr = nullptr;
+            if (!rawptr) return false;
+            dbOp.reset(rawptr);
+            --_size;
+            if (_pushWaiters) {
+                if (locked) _spaceNotify.notify_one();
+                else {
+                    MutexLockGuard lock(_mutex);
+                    _spaceNotify.notify_one();
+                }
+            }
+            return true;
+        }
+
+        OpReturnCode OpQueueSpinPark::pop(DbOpPointer& dbOp) {
+            for (size_t tries = 0; tries < SPIN_TRIES; ++tries) {
+                if (tryPop(dbOp)) return true;
+                std::this_thread::yield();
+            }
+            ++_popWaiters;
+            auto start = std::chrono::steady_clock::now();
+            bool popped;
+            {
+                MutexUniqueLock lock(_mutex);
+                _workNotify.wait(lock, [&] {return (popped = tryPop(dbOp, true)) || _endWait;});
+            }
+            --_popWaiters;
+            _parkedNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+            return popped || tryPop(dbOp);
+        }
+
+        OpReturnCode OpQueueSpinPark::popMany(DbOpPointers* dbOps, size_t max) {
+            DbOpPointer dbOp;
+            if (!max || !pop(dbOp)) return false;
+            size_t count = 0;
+            do
+                dbOps->push_back(std::move(dbOp));
+            while (++count < max && tryPop(dbOp));
+            return true;
+        }
+
+        void OpQueueSpinPark::endWait() {
+            _endWait = true;
+            MutexLockGuard lock(_mutex);
+            _workNotify.notify_all();
+        }
+
         namespace {
+            std::atomic<bool> duplicatesAccepted {};
+
+            bool duplicateKey(int code) {
+                return code == 11000 || code == 11001;
+            }
+
+            /**
+             * Errors of shards that no longer own the chunk written to: StaleConfig,
+             * StaleShardVersion, StaleEpoch and the 2.x RecvStaleConfig
+             */
+            bool staleRouting(int code) {
+                return code == 13388 || code == 63 || code == 150 || code == 9996;
+            }
+
+            /**
+             * @return if duplicate key errors count as written, a retry's duplicates are its own
+             * earlier run's documents
+             */
+            bool duplicatesTaken(const DbOp& op) {
+                return duplicatesAccepted || op.attempts;
+            }
+
+            /**
+             * Counts duplicate key errors a retry took as its earlier run's writes
+             */
+            void duplicatesTolerated(DbOp* op, size_t count) {
+                if (op->attempts) op->duplicates += count;
+            }
+
             //TODO: change error code impl to inspect and handle different codes
-            OpReturnCode opCheckError(Connection* conn) {
-                //TODO: mongo::BSONObj le = GetLastErrorDetailed
-                std::string error = conn->getLastError();
+            OpReturnCode opCheckError(const mongo::BSONObj& info, bool duplicates) {
+                std::string error = Connection::getLastErrorString(info);
                 if (!error.empty()) {
+                    if (duplicates && duplicateKey(info.getIntField("code"))) return true;
                     std::cerr << error << std::endl;
                     return false;
                 }
                 return true;
             }
-            OpReturnCode opCheckError(const mongo::WriteResult& result) {
+            OpReturnCode opCheckError(Connection* conn, bool duplicates) {
+                return opCheckError(conn->getLastErrorDetailed(), duplicates);
+            }
+
+            /**
+             * getLastError only has the last error of a ContinueOnError insert, so a duplicate it
+             * reports can hide other failures.  The insert is only taken as written once every
+             * document's _id is in the collection.
+             * @param forEach calls its argument with each document of the insert
+             */
+            template<typename ForEach>
+            OpReturnCode idsWritten(Connection* conn, const std::string& ns, ForEach forEach) {
+                mongo::BSONArrayBuilder ids;
+                //Repeats of an _id in the batch are counted once
+                std::unordered_set<std::string> distinct;
+                bool idless = false;
+                forEach([&](const mongo::BSONObj& doc) {
+                    mongo::BSONElement id = doc["_id"];
+                    if (id.eoo()) {
+                        idless = true;
+                        return;
+                    }
+                    if (distinct.emplace(std::string(1, char(id.type()))
+                                         + std::string(id.value(), id.valuesize())).second)
+                        ids.append(id);
+                });
+                if (idless) {
+                    std::cerr << "Unable to confirm an insert that reported a duplicate key, it has "
+                            "documents without _id" << std::endl;
+                    return false;
+                }
+                mongo::BSONObjBuilder in;
+                in.appendArray("$in", ids.arr());
+                if (conn->count(ns, BSON("_id" << in.obj())) == distinct.size()) return true;
+                std::cerr << "An insert that reported a duplicate key didn't write all of its "
+                        "documents: " << ns << std::endl;
+                return false;
+            }
+            /**
+             * @param taken if set, the duplicate key errors taken as written are added to it
+             */
+            OpReturnCode opCheckError(const mongo::WriteResult& result, bool duplicates,
+                                      size_t* taken = nullptr) {
                 if (!result.hasErrors())
                     return true;
+                if (duplicates && !result.hasWriteConcernErrors()) {
+                    auto errors = result.writeErrors();
+                    if (std::all_of(errors.begin(), errors.end(), [](const mongo::BSONObj& error) {
+                            return duplicateKey(error.getIntField("code"));})) {
+                        if (taken) *taken += errors.size();
+                        return true;
+                    }
+                }
                 if (result.hasWriteConcernErrors()) {
                     std::cerr << "Write concern errors:\n";
                     for (auto&& ist : result.writeConcernErrors())
@@ -58,37 +249,355 @@ namespace tools {
                     std::cerr << std::endl;                }
                 return false;
             }
+
+            /**
+             * Moves the documents rejected for stale routing to rejected if that and accepted
+             * duplicates are all that went wrong
+             */
+            void dataReject(const mongo::WriteResult& result, DataQueue* data,
+                            DataQueue* rejected, bool duplicates) {
+                if (!result.hasWriteErrors() || result.hasWriteConcernErrors()) return;
+                auto errors = result.writeErrors();
+                bool stale = false;
+                for (auto&& error : errors) {
+                    int code = error.getIntField("code");
+                    if (staleRouting(code)) stale = true;
+                    else if (!duplicates || !duplicateKey(code)) return;
+                }
+                if (!stale) return;
+                for (auto&& error : errors) {
+                    size_t index = error.getIntField("index");
+                    if (staleRouting(error.getIntField("code")) && index < data->size())
+                        rejected->push_back(std::move((*data)[index]));
+                }
+            }
+
+            size_t dataBytes(const DataQueue& data) {
+                size_t bytes = 0;
+                for (auto&& doc : data)
+                    bytes += doc.objsize();
+                tools::MemoryBudget::add(tools::MemoryBudget::Use::IN_FLIGHT, bytes);
+                return bytes;
+            }
+
+            /**
+             * Cheap checksum of a document's bytes, a word at a time
+             */
+            unsigned long long docChecksum(const char* data, size_t size) {
+                unsigned long long hash = 0x9e3779b97f4a7c15ULL ^ size;
+                size_t i = 0;
+                for (; i + sizeof(hash) <= size; i += sizeof(hash)) {
+                    unsigned long long word;
+                    std::memcpy(&word, data + i, sizeof(word));
+                    hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+                    hash ^= hash >> 32;
+                }
+                for (; i < size; ++i)
+                    hash = (hash ^ static_cast<unsigned char>(data[i])) * 0x100000001b3ULL;
+                return hash;
+            }
+
+            void dataChecksum(const DataQueue& data, unsigned long long* checksum) {
+                if (!checksum) return;
+                for (auto&& doc : data)
+                    *checksum += docChecksum(doc.objdata(), doc.objsize());
+            }
+
+            /**
+             * The documents are done with, their arena blocks can be recycled
+             */
+            void dataRelease(DataQueue* data, size_t* bytes) {
+                tools::BsonArena::release(data);
+                tools::MemoryBudget::remove(tools::MemoryBudget::Use::IN_FLIGHT, *bytes);
+                *bytes = 0;
+            }
+        }
+
+        /**
+         * Moves from's documents onto the end of op's if they are written the same way and fit
+         */
+        template<typename Op>
+        bool dataAbsorb(Op* op, DbOp* other, size_t maxBytes) {
+            Op* from = dynamic_cast<Op*>(other);
+            if (!from || from->_ns != op->_ns || from->_flags != op->_flags || from->_wc != op->_wc
+                || op->_bytes + from->_bytes > maxBytes)
+                return false;
+            op->_data.insert(op->_data.end(), std::make_move_iterator(from->_data.begin()),
+                             std::make_move_iterator(from->_data.end()));
+            from->_data.clear();
+            //The in flight bytes move with the documents
+            op->_bytes += from->_bytes;
+            from->_bytes = 0;
+            op->holds.insert(op->holds.end(), std::make_move_iterator(from->holds.begin()),
+                             std::make_move_iterator(from->holds.end()));
+            from->holds.clear();
+            return true;
+        }
+
+        void duplicatesAcceptSet(bool accept) {
+            duplicatesAccepted = accept;
+        }
+
+        bool duplicatesAccept() {
+            return duplicatesAccepted;
         }
 
         OpQueueBulkInsertUnorderedv24_0::OpQueueBulkInsertUnorderedv24_0(std::string ns,
                                                                DataQueue* data,
                                                                int flags,
                                                                const WriteConcern* wc) :
-                _ns(std::move(ns)), _data(std::move(*data)), _flags(flags), _wc(wc)
+                _ns(std::move(ns)), _data(std::move(*data)), _bytes(dataBytes(_data)), _flags(flags),
+                _wc(wc)
         {
         }
 
+        OpQueueBulkInsertUnorderedv24_0::~OpQueueBulkInsertUnorderedv24_0() {
+            dataRelease(&_data, &_bytes);
+            tools::BsonArena::release(&_rejected);
+        }
+
+        void OpQueueBulkInsertUnorderedv24_0::sink(unsigned long long* checksum) {
+            dataChecksum(_data, checksum);
+            dataRelease(&_data, &_bytes);
+        }
+
+        bool OpQueueBulkInsertUnorderedv24_0::absorb(DbOp* other, size_t maxBytes) {
+            return dataAbsorb(this, other, maxBytes);
+        }
+
         OpReturnCode OpQueueBulkInsertUnorderedv24_0::run(Connection* conn) {
-            conn->insert(_ns, _data, _flags, _wc);
-            if (!_wc || !_wc->requiresConfirmation()) return true;
-            return opCheckError(conn);
+            WireStats::record(_data);
+            const bool duplicates = duplicatesTaken(*this);
+            conn->insert(_ns, _data, duplicates
+                         ? _flags | mongo::InsertOption_ContinueOnError : _flags, _wc);
+            if (!_wc || !_wc->requiresConfirmation()) {
+                //The documents have been sent
+                dataRelease(&_data, &_bytes);
+                return true;
+            }
+            //A shard checks its version before the first insert, so all or none are rejected
+            mongo::BSONObj info = conn->getLastErrorDetailed();
+            if (staleRouting(info.getIntField("code"))) _rejected.swap(_data);
+            bool ok = _rejected.empty() && opCheckError(info, duplicates);
+            if (ok && duplicates && duplicateKey(info.getIntField("code"))) {
+                ok = idsWritten(conn, _ns,
+                                [this](const std::function<void(const mongo::BSONObj&)>& f) {
+                                    for (auto&& doc : _data)
+                                        f(doc);
+                                });
+                //getLastError only reports the last of them
+                if (ok) duplicatesTolerated(this, 1);
+            }
+            //Failed documents are kept for a retry
+            if (ok || !_rejected.empty()) dataRelease(&_data, &_bytes);
+            return ok;
+        }
+
+        bool OpQueueBulkInsertUnorderedv24_0::rejected(std::string* ns, DataQueue* docs) {
+            if (_rejected.empty()) return false;
+            *ns = _ns;
+            docs->swap(_rejected);
+            _rejected.clear();
+            return true;
         }
 
         OpQueueBulkInsertUnorderedv26_0::OpQueueBulkInsertUnorderedv26_0(std::string ns,
                                                                        DataQueue* data,
                                                                        int flags,
                                                                        const WriteConcern* wc) :
-                _ns(std::move(ns)), _data(std::move(*data)), _flags(flags), _wc(wc)
+                _ns(std::move(ns)), _data(std::move(*data)), _bytes(dataBytes(_data)), _flags(flags),
+                _wc(wc)
         {
         }
 
+        OpQueueBulkInsertUnorderedv26_0::~OpQueueBulkInsertUnorderedv26_0() {
+            dataRelease(&_data, &_bytes);
+            tools::BsonArena::release(&_rejected);
+        }
+
+        OpQueueWireInsert::OpQueueWireInsert(WireBatchPointer batch, const WriteConcern* wc) :
+                _batch(std::move(batch)), _bytes(_batch->bytes()), _wc(wc)
+        {
+            tools::MemoryBudget::add(tools::MemoryBudget::Use::IN_FLIGHT, _bytes);
+        }
+
+        OpQueueWireInsert::~OpQueueWireInsert() {
+            tools::MemoryBudget::remove(tools::MemoryBudget::Use::IN_FLIGHT, _bytes);
+        }
+
+        void OpQueueWireInsert::sink(unsigned long long* checksum) {
+            if (checksum) {
+                //The documents are back to back in the message
+                const char* doc = _batch->docsData();
+                const char* end = doc + _batch->bytes();
+                while (doc < end) {
+                    int32_t size;
+                    std::memcpy(&size, doc, sizeof(size));
+                    if (size <= 0) break;
+                    *checksum += docChecksum(doc, size);
+                    doc += size;
+                }
+            }
+            _batch.reset();
+            tools::MemoryBudget::remove(tools::MemoryBudget::Use::IN_FLIGHT, _bytes);
+            _bytes = 0;
+        }
+
+        OpReturnCode OpQueueWireInsert::run(Connection* conn) {
+            WireStats::record(_batch->docsData(), _batch->bytes());
+            const bool duplicates = duplicatesTaken(*this);
+            _batch->send(conn, duplicates ? mongo::InsertOption_ContinueOnError : 0);
+            if (_wc && _wc->requiresConfirmation()) {
+                mongo::BSONObj info = conn->getLastErrorDetailed();
+                if (!opCheckError(info, duplicates)) return false;
+                //The documents are back to back in the message
+                auto forEach = [this](const std::function<void(const mongo::BSONObj&)>& f) {
+                    const char* doc = _batch->docsData();
+                    const char* end = doc + _batch->bytes();
+                    while (doc < end) {
+                        mongo::BSONObj obj(doc);
+                        f(obj);
+                        doc += obj.objsize();
+                    }
+                };
+                if (duplicates && duplicateKey(info.getIntField("code"))) {
+                    if (!idsWritten(conn, _batch->ns(), forEach)) return false;
+                    duplicatesTolerated(this, 1);
+                }
+            }
+            //The message is only let go of once written, a failed one is sent again
+            _batch->clear();
+            tools::MemoryBudget::remove(tools::MemoryBudget::Use::IN_FLIGHT, _bytes);
+            _bytes = 0;
+            return true;
+        }
+
         //TODO: move this further up the stack if possible
+        void OpQueueBulkInsertUnorderedv26_0::sink(unsigned long long* checksum) {
+            dataChecksum(_data, checksum);
+            dataRelease(&_data, &_bytes);
+        }
+
+        bool OpQueueBulkInsertUnorderedv26_0::absorb(DbOp* other, size_t maxBytes) {
+            return dataAbsorb(this, other, maxBytes);
+        }
+
         OpReturnCode OpQueueBulkInsertUnorderedv26_0::run(Connection* conn) {
+            WireStats::record(_data);
+            const bool duplicates = duplicatesTaken(*this);
             auto bulker = conn->initializeUnorderedBulkOp(_ns);
             for (auto&& itr: _data)
                 bulker.insert(itr);
             bulker.execute(_wc, &_writeResult);
-            return opCheckError(_writeResult);
+            dataReject(_writeResult, &_data, &_rejected, duplicates);
+            size_t taken = 0;
+            bool ok = _rejected.empty() && opCheckError(_writeResult, duplicates, &taken);
+            if (ok) duplicatesTolerated(this, taken);
+            //Failed documents are kept for a retry, the rest of a rejected write was written
+            if (ok || !_rejected.empty()) dataRelease(&_data, &_bytes);
+            return ok;
+        }
+
+        bool OpQueueBulkInsertUnorderedv26_0::rejected(std::string* ns, DataQueue* docs) {
+            if (_rejected.empty()) return false;
+            *ns = _ns;
+            docs->swap(_rejected);
+            _rejected.clear();
+            return true;
+        }
+
+        OpQueueBulkUpsertUnorderedv26_0::OpQueueBulkUpsertUnorderedv26_0(std::string ns,
+                                                                       DataQueue* data,
+                                                                       mongo::BSONObj shardKey,
+                                                                       bool keyUnique,
+                                                                       bool merge,
+                                                                       const WriteConcern* wc) :
+                _ns(std::move(ns)), _data(std::move(*data)), _bytes(dataBytes(_data)), _flags(0),
+                _wc(wc), _shardKey(std::move(shardKey)), _keyUnique(keyUnique), _merge(merge)
+        {
+        }
+
+        OpQueueBulkUpsertUnorderedv26_0::~OpQueueBulkUpsertUnorderedv26_0() {
+            dataRelease(&_data, &_bytes);
+            tools::BsonArena::release(&_rejected);
+        }
+
+        void OpQueueBulkUpsertUnorderedv26_0::sink(unsigned long long* checksum) {
+            dataChecksum(_data, checksum);
+            dataRelease(&_data, &_bytes);
+        }
+
+        bool OpQueueBulkUpsertUnorderedv26_0::absorb(DbOp* other, size_t maxBytes) {
+            OpQueueBulkUpsertUnorderedv26_0* from = dynamic_cast<OpQueueBulkUpsertUnorderedv26_0*>(
+                    other);
+            if (!from || from->_merge != _merge) return false;
+            return dataAbsorb(this, other, maxBytes);
+        }
+
+        mongo::BSONObj OpQueueBulkUpsertUnorderedv26_0::selector(const Data& doc,
+                                                                 const mongo::BSONObj& shardKey,
+                                                                 bool keyUnique) {
+            mongo::BSONObjBuilder query;
+            bool hasId = false;
+            for (mongo::BSONObjIterator i(shardKey); i.more();) {
+                const char* field = i.next().fieldName();
+                if (!std::strcmp(field, "_id")) hasId = true;
+                mongo::BSONElement value = doc.getFieldDotted(field);
+                //A document without a shard key field is routed as if it were null
+                if (value.eoo()) query.appendNull(field);
+                else query.appendAs(value, field);
+            }
+            if (!hasId) {
+                mongo::BSONElement id = doc.getField("_id");
+                if (!id.eoo()) query.append(id);
+                else if (!keyUnique) return mongo::BSONObj();
+            }
+            return query.obj();
+        }
+
+        OpReturnCode OpQueueBulkUpsertUnorderedv26_0::run(Connection* conn) {
+            WireStats::record(_data);
+            const bool duplicates = duplicatesTaken(*this);
+            auto bulker = conn->initializeUnorderedBulkOp(_ns);
+            for (auto&& doc : _data) {
+                mongo::BSONObj query = selector(doc, _shardKey, _keyUnique);
+                if (query.isEmpty()) {
+                    std::cerr << "Upsert into " << _ns << " of a document without an _id, the "
+                            "shard key isn't unique so it would replace any document with the "
+                            "same key: " << doc << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                if (_merge) {
+                    //The matched fields are set by the query if the document is inserted
+                    mongo::BSONObjBuilder fields;
+                    for (mongo::BSONObjIterator i(doc); i.more();) {
+                        mongo::BSONElement field = i.next();
+                        if (!query.hasField(field.fieldName())) fields.append(field);
+                    }
+                    mongo::BSONObj set = fields.obj();
+                    if (!set.isEmpty()) {
+                        bulker.find(query).upsert().updateOne(BSON("$set" << set));
+                        continue;
+                    }
+                }
+                bulker.find(query).upsert().replaceOne(doc);
+            }
+            bulker.execute(_wc, &_writeResult);
+            dataReject(_writeResult, &_data, &_rejected, duplicates);
+            size_t taken = 0;
+            bool ok = _rejected.empty() && opCheckError(_writeResult, duplicates, &taken);
+            if (ok) duplicatesTolerated(this, taken);
+            //Failed documents are kept for a retry, the rest of a rejected write was written
+            if (ok || !_rejected.empty()) dataRelease(&_data, &_bytes);
+            return ok;
+        }
+
+        bool OpQueueBulkUpsertUnorderedv26_0::rejected(std::string* ns, DataQueue* docs) {
+            if (_rejected.empty()) return false;
+            *ns = _ns;
+            docs->swap(_rejected);
+            _rejected.clear();
+            return true;
         }
     }
 }  //namespace mtools
@@ -15,9 +15,17 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
 #include <boost/lockfree/queue.hpp>
+#include "bson_arena.h"
 #include "mongo_cxxdriver.h"
+#include "placement.h"
 #include "threading.h"
+#include "trace.h"
+#include "wire_batch.h"
 
 /*
  * virtual inline ... final
@@ -43,6 +51,8 @@ namespace tools {
          */
         struct DbOp {
         public:
+            using Holds = std::vector<std::shared_ptr<void>>;
+
             //TODO: use return codes for real async.  Just a function, keep empty base class.
             DbOp() {
             }
@@ -52,8 +62,66 @@ namespace tools {
              * Executes the operation against the database connection
              */
             virtual OpReturnCode run(Connection* conn) = 0;
+
+            /**
+             * @return document bytes the operation writes, 0 once they have been written
+             */
+            virtual size_t bytes() const {
+                return 0;
+            }
+
+            /**
+             * @return documents the operation writes, 0 once they have been written
+             */
+            virtual size_t docs() const {
+                return 0;
+            }
+
+            /**
+             * Drops the operation's documents instead of writing them, for dry runs
+             * @param checksum if set, each document's checksum is added to it.  Sums don't depend
+             * on how documents were batched or routed, so runs over the same input match.
+             */
+            virtual void sink(unsigned long long* checksum) {
+            }
+
+            /**
+             * Takes other's documents so that the two are written as one operation
+             * @return false if other can't be written with this, other is then unchanged
+             */
+            virtual bool absorb(DbOp* other, size_t maxBytes) {
+                return false;
+            }
+
+            /**
+             * Takes the documents a shard rejected as not its own, i.e. their chunk migrated and
+             * the write went out with stale routing
+             * @return false if nothing was rejected that way, the failure was something else
+             */
+            virtual bool rejected(std::string* ns, DataQueue* docs) {
+                return false;
+            }
+
+            //Let go of once the operation is done with, i.e. progress waiting on the write
+            Holds holds;
+            //Failed runs so far.  A failed operation keeps its documents to be run again, and a
+            //retry accepts duplicates of what an earlier run got written.
+            size_t attempts {};
+            //Duplicate key errors a retry took as written, getLastError only reports one a run
+            size_t duplicates {};
+            //What the operation is traced as, the chunk it writes to
+            const Trace::Tag* traceTag {};
         };
         using DbOpPointer = std::unique_ptr<DbOp>;
+        using DbOpPointers = std::vector<DbOpPointer>;
+
+        /**
+         * Duplicate key errors are taken as success and inserts continue past errors, so that
+         * documents an interrupted load already wrote can be written again
+         */
+        void duplicatesAcceptSet(bool accept);
+
+        bool duplicatesAccept();
 
         /**
          * Public interface for a queue of database operations
@@ -67,10 +135,60 @@ namespace tools {
 
             virtual OpReturnCode push(DbOpPointer& dbOp) = 0;
             virtual OpReturnCode pop(DbOpPointer& dbOp) = 0;
+
+            /**
+             * Pushes every operation in dbOps, which is left empty
+             */
+            virtual OpReturnCode pushMany(DbOpPointers* dbOps) {
+                for (auto&& dbOp : *dbOps)
+                    push(dbOp);
+                dbOps->clear();
+                return true;
+            }
+
+            /**
+             * Pops up to max operations onto the back of dbOps.  The first is popped as pop()
+             * does, the rest only if they are already queued.
+             * @return false if nothing was popped
+             */
+            virtual OpReturnCode popMany(DbOpPointers* dbOps, size_t max) {
+                DbOpPointer dbOp;
+                if (!max || !pop(dbOp)) return false;
+                dbOps->push_back(std::move(dbOp));
+                return true;
+            }
             /**
              * Called when the queue should exit with no more work to do
              */
             virtual void endWait() = 0;
+
+            /**
+             * @return how full the queue is, 1 when pushes block.  0 if it can't tell
+             */
+            virtual double pressure() const {
+                return 0;
+            }
+
+            /**
+             * @return true if pop() waits for work instead of missing
+             */
+            virtual bool popWaits() const {
+                return false;
+            }
+
+            /**
+             * @return nanoseconds consumers spent parked waiting for work
+             */
+            virtual unsigned long long parkedNanos() const {
+                return 0;
+            }
+
+            /**
+             * @return nanoseconds producers spent waiting for room to push
+             */
+            virtual unsigned long long pushWaitNanos() const {
+                return 0;
+            }
         };
 
         /**
@@ -96,6 +214,14 @@ namespace tools {
                 return result;
             }
 
+            virtual OpReturnCode popMany(DbOpPointers* dbOps, size_t max) final {
+                DbOp* rawptr;
+                size_t count = 0;
+                for (; count < max && _queue.pop(rawptr); ++count)
+                    dbOps->emplace_back(rawptr);
+                return count;
+            }
+
             //Nothing to do here.
             virtual inline void endWait() final {}
 
@@ -127,12 +253,111 @@ namespace tools {
                 return result;
             }
 
+            virtual OpReturnCode pushMany(DbOpPointers* dbOps) final {
+                std::vector<DbOp*> rawptrs;
+                rawptrs.reserve(dbOps->size());
+                for (auto&& dbOp : *dbOps)
+                    rawptrs.push_back(dbOp.release());
+                dbOps->clear();
+                _queue.pushMany(rawptrs.begin(), rawptrs.end());
+                return true;
+            }
+
+            virtual OpReturnCode popMany(DbOpPointers* dbOps, size_t max) final {
+                std::vector<DbOp*> rawptrs;
+                if (!max || !_queue.popMany(&rawptrs, max)) return false;
+                for (auto rawptr : rawptrs)
+                    dbOps->emplace_back(rawptr);
+                return true;
+            }
+
             virtual inline void endWait() final { _queue.endWait(); }
 
+            virtual double pressure() const final {
+                return _queue.pressure();
+            }
+
         private:
             tools::WaitQueue<DbOp*> _queue;
         };
 
+        /**
+         * Lock free fast path, spins briefly on a miss and then parks on a condition variable.
+         * Pushes only touch the mutex when a consumer is parked, so a busy queue never locks.
+         * Pushes past queueSize park the producer the same way.
+         * With thread placement there is a queue per node, operations are pushed onto the
+         * producer's node and consumers take from their own node before the others.
+         */
+        class OpQueueSpinPark : public OpQueue {
+        public:
+            //Attempts on an empty queue before parking
+            static const size_t SPIN_TRIES = 256;
+
+            OpQueueSpinPark(size_t queueSize) :
+                    _queueMaxSize(std::max<size_t>(queueSize, 1))
+            {
+                size_t nodes = tools::Placement::nodes();
+                for (size_t node = 0; node < nodes; ++node)
+                    _queues.emplace_back(new boost::lockfree::queue<DbOp*>(queueSize / nodes + 1));
+            }
+            virtual ~OpQueueSpinPark() final;
+
+            virtual OpReturnCode push(DbOpPointer& dbOp) final;
+
+            /**
+             * Waits for work, false only once endWait() is called and the queue is empty
+             */
+            virtual OpReturnCode pop(DbOpPointer& dbOp) final;
+
+            /**
+             * Wakes parked consumers once for the lot
+             */
+            virtual OpReturnCode pushMany(DbOpPointers* dbOps) final;
+
+            virtual OpReturnCode popMany(DbOpPointers* dbOps, size_t max) final;
+
+            virtual void endWait() final;
+
+            virtual double pressure() const final {
+                return double(_size) / _queueMaxSize;
+            }
+
+            virtual bool popWaits() const final {
+                return true;
+            }
+
+            virtual unsigned long long parkedNanos() const final {
+                return _parkedNanos;
+            }
+
+            virtual unsigned long long pushWaitNanos() const final {
+                return _pushWaitNanos;
+            }
+
+        private:
+            std::vector<std::unique_ptr<boost::lockfree::queue<DbOp*>>> _queues;
+            const size_t _queueMaxSize;
+            std::atomic<size_t> _size {};
+            std::atomic<size_t> _popWaiters {};
+            std::atomic<size_t> _pushWaiters {};
+            std::atomic<bool> _endWait {};
+            std::atomic<unsigned long long> _parkedNanos {};
+            std::atomic<unsigned long long> _pushWaitNanos {};
+            tools::Mutex _mutex;
+            tools::ConditionVariable _workNotify;
+            tools::ConditionVariable _spaceNotify;
+
+            /**
+             * @param locked the caller holds _mutex
+             */
+            bool tryPop(DbOpPointer& dbOp, bool locked = false);
+
+            /**
+             * Pushes without waking consumers, waits for room past the max size
+             */
+            void pushQueued(DbOpPointer& dbOp);
+        };
+
         /**
          * Bulk insert operation.  Unordered.
          */
@@ -141,11 +366,25 @@ namespace tools {
                                        DataQueue* data,
                                        int flags = 0,
                                        const WriteConcern* wc = DEFAULT_WRITE_CONCERN);
+            ~OpQueueBulkInsertUnorderedv24_0();
             OpReturnCode run(Connection* conn);
+            bool rejected(std::string* ns, DataQueue* docs);
+            size_t bytes() const {
+                return _bytes;
+            }
+            size_t docs() const {
+                return _data.size();
+            }
+            void sink(unsigned long long* checksum);
+            bool absorb(DbOp* other, size_t maxBytes);
             std::string _ns;
             DataQueue _data;
+            //Bytes of _data counted as in flight by the MemoryBudget
+            size_t _bytes;
             int _flags;
             const WriteConcern* _wc;
+            //Documents kept back from a write rejected for stale routing
+            DataQueue _rejected;
 
             static DbOpPointer make(std::string ns,
                                     DataQueue* data,
@@ -161,12 +400,25 @@ namespace tools {
                                        DataQueue* data,
                                        int flags = 0,
                                        const WriteConcern* wc = DEFAULT_WRITE_CONCERN);
+            ~OpQueueBulkInsertUnorderedv26_0();
             OpReturnCode run(Connection* conn);
+            bool rejected(std::string* ns, DataQueue* docs);
+            size_t bytes() const {
+                return _bytes;
+            }
+            size_t docs() const {
+                return _data.size();
+            }
+            void sink(unsigned long long* checksum);
+            bool absorb(DbOp* other, size_t maxBytes);
             std::string _ns;
             DataQueue _data;
+            //Bytes of _data counted as in flight by the MemoryBudget
+            size_t _bytes;
             int _flags;
             const WriteConcern* _wc;
             mongo::WriteResult _writeResult;
+            DataQueue _rejected;
 
             static DbOpPointer make(std::string ns,
                                     DataQueue* data,
@@ -177,6 +429,90 @@ namespace tools {
             }
         };
 
+        /**
+         * Bulk upsert operation.  Unordered.
+         * Each document is matched on its shard key and _id, so the write routes like an insert.
+         * A match is replaced by the document, or with merge only the document's other fields
+         * are set on it.
+         */
+        struct OpQueueBulkUpsertUnorderedv26_0 : public DbOp {
+            OpQueueBulkUpsertUnorderedv26_0(std::string ns,
+                                       DataQueue* data,
+                                       mongo::BSONObj shardKey,
+                                       bool keyUnique,
+                                       bool merge,
+                                       const WriteConcern* wc = DEFAULT_WRITE_CONCERN);
+            ~OpQueueBulkUpsertUnorderedv26_0();
+            OpReturnCode run(Connection* conn);
+            bool rejected(std::string* ns, DataQueue* docs);
+            size_t bytes() const {
+                return _bytes;
+            }
+            size_t docs() const {
+                return _data.size();
+            }
+            void sink(unsigned long long* checksum);
+            bool absorb(DbOp* other, size_t maxBytes);
+
+            /**
+             * @return the query matching doc: the shard key fields, missing ones as null, and _id.
+             * Empty if doc has no _id and the key isn't unique, the key alone could match any
+             * document that shares it.
+             */
+            static mongo::BSONObj selector(const Data& doc, const mongo::BSONObj& shardKey,
+                                           bool keyUnique);
+
+            std::string _ns;
+            DataQueue _data;
+            //Bytes of _data counted as in flight by the MemoryBudget
+            size_t _bytes;
+            int _flags;
+            const WriteConcern* _wc;
+            mongo::BSONObj _shardKey;
+            bool _keyUnique;
+            bool _merge;
+            mongo::WriteResult _writeResult;
+            DataQueue _rejected;
+
+            static DbOpPointer make(std::string ns,
+                                    DataQueue* data,
+                                    mongo::BSONObj shardKey,
+                                    bool keyUnique,
+                                    bool merge,
+                                    const WriteConcern* wc = DEFAULT_WRITE_CONCERN)
+            {
+                return DbOpPointer(new OpQueueBulkUpsertUnorderedv26_0(ns, data,
+                                                                       std::move(shardKey),
+                                                                       keyUnique, merge, wc));
+            }
+        };
+
+
+        /**
+         * Bulk insert of a WireBatch, the message is already built.  Unordered, 2.4 protocol.
+         */
+        struct OpQueueWireInsert : public DbOp {
+            OpQueueWireInsert(WireBatchPointer batch, const WriteConcern* wc);
+            ~OpQueueWireInsert();
+            OpReturnCode run(Connection* conn);
+            size_t bytes() const {
+                return _bytes;
+            }
+            size_t docs() const {
+                return _bytes ? _batch->docs() : 0;
+            }
+            void sink(unsigned long long* checksum);
+            WireBatchPointer _batch;
+            //Bytes of _batch counted as in flight by the MemoryBudget
+            size_t _bytes;
+            const WriteConcern* _wc;
+
+            static DbOpPointer make(WireBatchPointer batch,
+                                    const WriteConcern* wc = DEFAULT_WRITE_CONCERN)
+            {
+                return DbOpPointer(new OpQueueWireInsert(std::move(batch), wc));
+            }
+        };
 
     }  //namespace mtools
 }  //namespace tools
@@ -0,0 +1,181 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "multi_loader.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include "trace.h"
+
+namespace loader {
+
+    MultiLoader::MultiLoader(Loader::Settings settings) :
+            _settings(std::move(settings))
+    {
+        readMap();
+    }
+
+    void MultiLoader::readMap() {
+        std::ifstream infile(_settings.multiMap);
+        if (!infile.is_open()) {
+            std::cerr << "Unable to open namespace map: " << _settings.multiMap << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::set<std::string> namespaces;
+        std::string line;
+        for (size_t lineNumber = 1; std::getline(infile, line); ++lineNumber) {
+            if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+            mongo::BSONObj entry;
+            try {
+                entry = mongo::fromjson(line);
+            } catch (std::exception& e) {
+                std::cerr << "Invalid namespace map line " << lineNumber << ": " << e.what()
+                          << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            NameSpaceLoad load;
+            load.fileRegex = entry.getStringField("fileRegex");
+            std::string ns = entry.getStringField("ns");
+            size_t dot = ns.find('.');
+            if (load.fileRegex.empty() || dot == std::string::npos || !dot
+                || dot + 1 == ns.size()) {
+                std::cerr << "Namespace map line " << lineNumber
+                          << " needs a fileRegex and an ns of db.coll" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            load.database = ns.substr(0, dot);
+            load.collection = ns.substr(dot + 1);
+            mongo::BSONElement shardKey = entry.getField("shardKey");
+            if (!shardKey.eoo()) {
+                if (!shardKey.isABSONObj()) {
+                    std::cerr << "Namespace map line " << lineNumber
+                              << " has a shardKey that isn't an object" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                load.shardKeyJson = shardKey.Obj().jsonString();
+            }
+            if (!namespaces.insert(ns).second) {
+                std::cerr << "Namespace map has " << ns << " more than once" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            _loads.push_back(std::move(load));
+        }
+        if (_loads.empty()) {
+            std::cerr << "No namespaces in the namespace map: " << _settings.multiMap << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    Loader::Settings MultiLoader::loadSettings(const NameSpaceLoad& load) const {
+        Loader::Settings settings = _settings;
+        settings.database = load.database;
+        settings.collection = load.collection;
+        settings.fileRegex = load.fileRegex;
+        if (!load.shardKeyJson.empty()) settings.shardKeyJson = load.shardKeyJson;
+        //Loads run side by side, a database dropped by one would take the others with it
+        if (settings.dropDb) {
+            settings.dropDb = false;
+            settings.dropColl = true;
+        }
+        //Both are process wide.  The trace covers every load and is written by run(), metrics
+        //would mix the loads together
+        settings.traceFile.clear();
+        settings.metricsInterval = 0;
+        try {
+            settings.process();
+        } catch (std::exception &e) {
+            std::cerr << "Unable to process settings for " << load.ns() << ": " << e.what()
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return settings;
+    }
+
+    void MultiLoader::loadNameSpace(Loader::Settings settings) {
+        const std::string ns = settings.ns();
+        std::cout << "\nLoading: " << ns << " files: " << settings.fileRegex << " shard key: "
+                  << settings.shardKeyJson << std::endl;
+        try {
+            Loader loader(std::move(settings), _endPoints.get());
+            {
+                tools::MutexLockGuard lock(_runningMutex);
+                _running[ns] = &loader;
+            }
+            //The namespaces running share the end points' queues evenly
+            _endPoints->laneOpen();
+            loader.run();
+            _endPoints->laneClose();
+            tools::MutexLockGuard lock(_runningMutex);
+            _running.erase(ns);
+        } catch (std::exception &e) {
+            std::cerr << "Failure loading " << ns << ": " << e.what() << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    bool MultiLoader::reroute(const std::string& ns, tools::mtools::DataQueue* docs) {
+        Loader* loader;
+        {
+            tools::MutexLockGuard lock(_runningMutex);
+            auto i = _running.find(ns);
+            if (i == _running.end()) return false;
+            loader = i->second;
+        }
+        //The load waits for its writes, so it is still there while one of them is rejected
+        return loader->chunkDispatcher().reroute(ns, docs);
+    }
+
+    void MultiLoader::run() {
+        std::cout << "Namespaces: " << _loads.size() << std::endl;
+        //Everything is checked before anything is loaded
+        std::vector<Loader::Settings> settings;
+        for (auto&& load : _loads)
+            settings.push_back(loadSettings(load));
+        size_t concurrent = std::max<size_t>(1, std::min(_settings.multiConcurrent,
+                                                         _loads.size()));
+        int threads = std::max<int>(1, settings.front().threads / int(concurrent));
+        for (auto&& load : settings)
+            load.threads = threads;
+        std::cout << "Loading " << concurrent << " namespaces at once, " << threads
+                  << " threads each" << std::endl;
+
+        const Loader::Settings& first = settings.front();
+        tools::mtools::MongoCluster cluster(first.connstr, first.chunkMap,
+                tools::mtools::MongoCluster::LoadSettings {first.ns(), std::string(), false});
+        tools::mtools::MongoEndPointSettings endPointSettings = first.endPointSettings;
+        if (endPointSettings.directLoad)
+            endPointSettings.reroute = [this](const std::string& ns,
+                                              tools::mtools::DataQueue* docs) {
+                return this->reroute(ns, docs);
+            };
+        _endPoints.reset(new EndPointHolder(endPointSettings, cluster));
+        _endPoints->start();
+        //Spans are tagged by shard and chunk, so the namespaces' work stays apart
+        if (!_settings.traceFile.empty()) tools::Trace::start(_settings.traceFile,
+                                                              _settings.traceSpans);
+
+        //Namespaces start in map order as earlier ones finish
+        tools::ThreadPool tpLoad(concurrent);
+        for (size_t i = 0; i < settings.size(); ++i)
+            tpLoad.queue([this, &settings, i] {this->loadNameSpace(std::move(settings[i]));});
+        tpLoad.endWaitInitiate();
+        tpLoad.joinAll();
+        _endPoints->gracefulShutdownJoin();
+        if (!_settings.traceFile.empty()) tools::Trace::write();
+        std::cout << "\nLoaded " << _loads.size() << " namespaces" << std::endl;
+    }
+
+}  //namespace loader
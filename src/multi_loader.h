@@ -0,0 +1,82 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "loader.h"
+#include "threading.h"
+
+namespace loader {
+
+    /**
+     * Loads many namespaces in one run, each from the files matching its regex.  The namespaces
+     * share one set of end points, so connections and end point threads are set up once.  Up to
+     * multiConcurrent namespaces load at once, each with an equal share of the input threads
+     * and of every end point's queue, and the next in the map starts as one finishes.
+     */
+    class MultiLoader {
+    public:
+        /**
+         * @param settings as read from the command line, i.e. before Settings::process()
+         */
+        explicit MultiLoader(Loader::Settings settings);
+
+        void run();
+
+    private:
+        struct NameSpaceLoad {
+            std::string fileRegex;
+            std::string database;
+            std::string collection;
+            std::string shardKeyJson;
+
+            std::string ns() const {
+                return database + "." + collection;
+            }
+        };
+
+        const Loader::Settings _settings;
+        std::vector<NameSpaceLoad> _loads;
+        std::unique_ptr<EndPointHolder> _endPoints;
+        //The loads running, by namespace, for rerouting rejected writes
+        tools::Mutex _runningMutex;
+        std::unordered_map<std::string, Loader*> _running;
+
+        /**
+         * Reads the namespace map file
+         */
+        void readMap();
+
+        /**
+         * @return the processed settings of a namespace's load
+         */
+        Loader::Settings loadSettings(const NameSpaceLoad& load) const;
+
+        /**
+         * Runs the namespace's load on the shared end points
+         */
+        void loadNameSpace(Loader::Settings settings);
+
+        /**
+         * Hands documents a shard rejected for stale routing to the load of their namespace
+         */
+        bool reroute(const std::string& ns, tools::mtools::DataQueue* docs);
+    };
+
+}  //namespace loader
@@ -0,0 +1,98 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "oid_generator.h"
+#include <chrono>
+#include <cstring>
+#include <random>
+
+namespace tools {
+
+    std::atomic<size_t> OidGenerator::_slotNext{};
+
+    OidGenerator::OidGenerator() : _slot(_slotNext++ % SLOTS) {
+        std::random_device device;
+        std::mt19937 random(device());
+        for (auto& c : _random)
+            c = char(random());
+    }
+
+    void OidGenerator::next(char* oid) {
+        while (!_cursors.empty()) {
+            if (_cursor == _cursors.size()) _cursor = 0;
+            Cursor& cursor = _cursors[_cursor];
+            if (cursor.next == cursor.end) {
+                _cursors.erase(_cursors.begin() + _cursor);
+                continue;
+            }
+            write(cursor.next++, oid);
+            ++_cursor;
+            return;
+        }
+        if (!_blockLeft) {
+            uint32_t now = uint32_t(std::chrono::duration_cast<std::chrono::seconds>(
+                    std::chrono::system_clock::now().time_since_epoch()).count());
+            if (now > _time) _time = now;
+            _blockLeft = COUNTER_BLOCK;
+        }
+        --_blockLeft;
+        if (++_counter == (1u << 24)) {
+            _counter = 0;
+            ++_time;
+        }
+        for (int i = 0; i < 4; ++i)
+            oid[i] = char(_time >> (24 - 8 * i));
+        std::memcpy(oid + 4, _random, sizeof(_random));
+        for (int i = 0; i < 3; ++i)
+            oid[9 + i] = char(_counter >> (16 - 8 * i));
+    }
+
+    void OidGenerator::rangesSet(const std::vector<Range>& ranges) {
+        _cursors.clear();
+        _cursor = 0;
+        //Later runs start further into their slots so they don't reuse earlier runs' ids
+        Value later = Value(std::chrono::duration_cast<std::chrono::seconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count()) << 32;
+        for (auto&& range : ranges) {
+            Value slice = (range.max - range.min) / SLOTS;
+            if (!slice) continue;
+            Value start = range.min + slice * _slot;
+            if (slice > later) start += later;
+            _cursors.push_back(Cursor {start, range.min + slice * (_slot + 1)});
+        }
+    }
+
+    OidGenerator::Value OidGenerator::value(const char* oid) {
+        Value value {};
+        for (int i = 0; i < mongo::OID::kOIDLen; ++i)
+            value = (value << 8) | uint8_t(oid[i]);
+        return value;
+    }
+
+    void OidGenerator::write(Value value, char* oid) {
+        for (int i = mongo::OID::kOIDLen - 1; i >= 0; --i) {
+            oid[i] = char(value);
+            value >>= 8;
+        }
+    }
+
+    mongo::BSONObj OidGenerator::idObj(Value value) {
+        //size, type, "_id", the id and the terminating eoo
+        char data[22] = {22, 0, 0, 0, mongo::jstOID, '_', 'i', 'd', 0};
+        write(value, data + 9);
+        return mongo::BSONObj(data).getOwned();
+    }
+
+}  //namespace tools
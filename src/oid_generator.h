@@ -0,0 +1,90 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include "mongo_cxxdriver.h"
+
+namespace tools {
+
+    /**
+     * Generates ObjectIds without any shared state, each input thread has its own generator.
+     * Ids are the usual timestamp, 5 random bytes picked per generator and a 3 byte counter.
+     * The clock is read once per COUNTER_BLOCK ids rather than per id.  If the counter wraps
+     * within a second the timestamp is bumped instead of waiting on the clock, so the ids of a
+     * generator always increase.
+     *
+     * Once ranges are set ids are instead spread round robin over the ranges (i.e. chunks).
+     * Every generator has its own slot in each range that it counts up through, so each range
+     * only ever has its ids appended to.
+     */
+    class OidGenerator {
+    public:
+        //An ObjectId as a big endian 96 bit number, so that it orders as the ids do
+        using Value = unsigned __int128;
+        //[min, max) of the ids that may go in a range
+        struct Range {
+            Value min;
+            Value max;
+        };
+
+        static constexpr Value VALUE_END = Value(1) << 96;
+        //Slots each range is split into, generators past this many share slots
+        static constexpr size_t SLOTS = 4096;
+        static constexpr uint32_t COUNTER_BLOCK = 4096;
+
+        OidGenerator();
+
+        /**
+         * Writes the next id, kOIDLen bytes
+         */
+        void next(char* oid);
+
+        /**
+         * Spreads the ids from here on over ranges, ranges too small for a slot are skipped.
+         * If every slot fills up the generator goes back to timestamped ids.
+         */
+        void rangesSet(const std::vector<Range>& ranges);
+
+        static Value value(const char* oid);
+
+        static void write(Value value, char* oid);
+
+        /**
+         * @return {_id: value}
+         */
+        static mongo::BSONObj idObj(Value value);
+
+    private:
+        struct Cursor {
+            Value next;
+            Value end;
+        };
+
+        uint32_t _time{};
+        uint32_t _counter{};
+        uint32_t _blockLeft{};
+        char _random[5];
+        std::vector<Cursor> _cursors;
+        size_t _cursor{};
+        const size_t _slot;
+
+        static std::atomic<size_t> _slotNext;
+    };
+
+}  //namespace tools
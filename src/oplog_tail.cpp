@@ -0,0 +1,278 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "oplog_tail.h"
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <thread>
+#include "threading.h"
+#include "tools.h"
+
+namespace cloner {
+
+    namespace {
+        mongo::BSONObj tsAfter(unsigned long long ts) {
+            mongo::BSONObjBuilder gt;
+            gt.appendTimestamp("$gt", ts);
+            mongo::BSONObjBuilder query;
+            query.append("ts", gt.obj());
+            return query.obj();
+        }
+
+        unsigned long long seconds(unsigned long long ts) {
+            return ts >> 32;
+        }
+
+        //Oplog timestamps are seconds and an increment within the second
+        std::string tsPretty(unsigned long long ts) {
+            return std::to_string(ts >> 32) + ":" + std::to_string(ts & 0xffffffff);
+        }
+
+        //What a write is matched on: _id, and the shard key so that mongoS can target upserts
+        mongo::BSONObj selector(const mongo::BSONObj& doc, const mongo::BSONObj& shardKey) {
+            mongo::BSONObjBuilder selector;
+            selector.append(doc["_id"]);
+            for (mongo::BSONObjIterator i(shardKey); i.more();) {
+                const char* field = i.next().fieldName();
+                if (!std::strcmp(field, "_id")) continue;
+                mongo::BSONElement value = doc.getFieldDotted(field);
+                if (!value.eoo()) selector.appendAs(value, field);
+            }
+            return selector.obj();
+        }
+    }  //namespace
+
+    const std::string OplogTail::OPLOG_NS = "local.oplog.rs";
+
+    OplogTail::OplogTail(tools::mtools::MongoCluster& source, std::string targetConn) :
+        _source(source),
+        _targetConn(std::move(targetConn)) {
+    }
+
+    mongo::DBClientBase* OplogTail::connect(const std::string& conn) {
+        std::string error;
+        mongo::ConnectionString cs = mongo::ConnectionString::parse(conn, error);
+        mongo::DBClientBase* client = nullptr;
+        if (error.empty()) client = cs.connect(error);
+        if (!error.empty() || !client) {
+            std::cerr << "Unable to connect to " << conn << ": " << error << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return client;
+    }
+
+    unsigned long long OplogTail::oplogEnd(mongo::DBClientBase* conn, int natural) {
+        mongo::BSONObj entry = conn->findOne(OPLOG_NS,
+                                             mongo::Query().sort(BSON("$natural" << natural)));
+        if (entry.isEmpty()) {
+            std::cerr << "No oplog on " << conn->toString() << ", shards must be replica sets"
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return entry["ts"].timestampValue();
+    }
+
+    void OplogTail::mark() {
+        _shards.clear();
+        for (auto&& shard : _source.shards()) {
+            std::unique_ptr<mongo::DBClientBase> conn(connect(shard.second));
+            ShardPosition position;
+            position.shard = shard.first;
+            position.conn = shard.second;
+            position.ts = oplogEnd(conn.get(), -1);
+            _shards.push_back(std::move(position));
+        }
+        std::cout << "Oplog positions marked on " << _shards.size() << " source shards"
+                  << std::endl;
+    }
+
+    void OplogTail::save(const std::string& file) const {
+        mongo::BSONObjBuilder positions;
+        for (auto&& position : _shards)
+            positions.appendTimestamp(position.shard, position.ts);
+        std::ofstream out(file, std::ios_base::out | std::ios_base::trunc);
+        out << positions.obj().jsonString() << std::endl;
+        if (!out) {
+            std::cerr << "Unable to save the oplog positions to " << file << std::endl;
+            return;
+        }
+        std::cout << "Oplog positions saved to " << file << std::endl;
+    }
+
+    void OplogTail::load(const std::string& file) {
+        std::ifstream in(file);
+        std::string json((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if (!in.is_open() || json.empty()) {
+            std::cerr << "Unable to read the oplog positions in " << file << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        mongo::BSONObj positions = mongo::fromjson(json);
+        _shards.clear();
+        for (auto&& shard : _source.shards()) {
+            mongo::BSONElement ts = positions[shard.first];
+            if (ts.type() != mongo::Timestamp) {
+                std::cerr << "No oplog position for shard " << shard.first << " in " << file
+                          << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            ShardPosition position;
+            position.shard = shard.first;
+            position.conn = shard.second;
+            position.ts = ts.timestampValue();
+            _shards.push_back(std::move(position));
+        }
+        std::cout << "Oplog positions of " << _shards.size() << " source shards read from " << file
+                  << std::endl;
+    }
+
+    void OplogTail::catchUp(const Settings& settings) {
+        _caughtUp = 0;
+        std::cout << "\nApplying source oplogs until every shard is within "
+                  << settings.lagSeconds << "s" << std::endl;
+        tools::SimpleTimer<> timerCatchUp;
+        tools::ThreadPool tpTail(_shards.size());
+        for (auto&& position : _shards) {
+            ShardPosition* shard = &position;
+            tpTail.queue([this, shard, &settings]() {this->tailShard(shard, settings);});
+        }
+        tpTail.endWaitInitiate();
+        tpTail.joinAll();
+        timerCatchUp.stop();
+        for (auto&& position : _shards)
+            std::cout << position.shard << ": applied " << position.applied << " ops, skipped "
+                      << position.skipped << ", lag " << position.lagSeconds << "s, at "
+                      << tsPretty(position.ts) << std::endl;
+        std::cout << "Oplog catch up time: " << timerCatchUp.seconds() << "s" << std::endl;
+    }
+
+    void OplogTail::tailShard(ShardPosition* position, const Settings& settings) {
+        std::unique_ptr<mongo::DBClientBase> source(connect(position->conn));
+        std::unique_ptr<mongo::DBClientBase> target(connect(_targetConn));
+        if (oplogEnd(source.get(), 1) > position->ts) {
+            std::cerr << "The oplog of " << position->shard << " rolled over during the copy, "
+                    "it can't be caught up" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        bool under = false;
+        auto underSet = [this, &under](bool now) {
+            if (now == under) return;
+            under = now;
+            if (now) ++_caughtUp;
+            else --_caughtUp;
+        };
+        std::vector<mongo::BSONObj> ops;
+        ops.reserve(settings.batchSize);
+        while (_caughtUp < _shards.size()) {
+            mongo::Cursor cur = source->query(OPLOG_NS, mongo::Query(tsAfter(position->ts)), 0, 0,
+                                              nullptr, mongo::QueryOption_CursorTailable
+                                              | mongo::QueryOption_AwaitData
+                                              | mongo::QueryOption_OplogReplay
+                                              | mongo::QueryOption_NoCursorTimeout);
+            if (!cur) {
+                std::cerr << "Unable to tail the oplog of " << position->shard << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            while (_caughtUp < _shards.size()) {
+                //Nothing new before the await timed out, as caught up as it gets
+                if (!cur->more()) {
+                    position->lagSeconds = 0;
+                    underSet(true);
+                    if (cur->isDead()) break;
+                    continue;
+                }
+                //What the server has already sent goes in one batch
+                do {
+                    ops.push_back(cur->nextSafe().getOwned());
+                } while (ops.size() < settings.batchSize && cur->objsLeftInBatch());
+                apply(target.get(), ops, settings, position);
+                position->ts = ops.back()["ts"].timestampValue();
+                ops.clear();
+                //Timestamps compare as (seconds, increment), ops in the same second as the
+                //newest are still behind it
+                unsigned long long newest = oplogEnd(source.get(), -1);
+                bool current = position->ts >= newest;
+                position->lagSeconds = current ? 0 : seconds(newest) - seconds(position->ts);
+                underSet(current || (settings.lagSeconds
+                                     && position->lagSeconds <= settings.lagSeconds));
+            }
+        }
+    }
+
+    void OplogTail::apply(mongo::DBClientBase* target, const std::vector<mongo::BSONObj>& ops,
+                          const Settings& settings, ShardPosition* position)
+    {
+        std::string bulkNs;
+        std::unique_ptr<mongo::BulkOperationBuilder> bulk;
+        auto execute = [&]() {
+            if (!bulk) return;
+            mongo::WriteResult result;
+            bulk->execute(&mongo::WriteConcern::acknowledged, &result);
+            if (result.hasErrors()) {
+                std::cerr << "Applying the oplog of " << position->shard << " to " << bulkNs
+                          << " failed:\n";
+                for (auto&& error : result.writeErrors())
+                    std::cerr << tojson(error) << std::endl;
+                for (auto&& error : result.writeConcernErrors())
+                    std::cerr << tojson(error) << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            bulk.reset();
+        };
+        for (auto&& op : ops) {
+            std::string ns = op.getStringField("ns");
+            auto shardKey = settings.shardKeys.find(ns);
+            std::string type = op.getStringField("op");
+            //Other namespaces, no-ops and chunk migrations' own writes
+            if (shardKey == settings.shardKeys.end() || type == "n"
+                || op.getBoolField("fromMigrate")) {
+                ++position->skipped;
+                continue;
+            }
+            if (type == "c") {
+                std::cout << "Skipping command on " << position->shard << ": "
+                          << op.getObjectField("o") << std::endl;
+                ++position->skipped;
+                continue;
+            }
+            if (ns != bulkNs) {
+                execute();
+                bulkNs = ns;
+            }
+            if (!bulk)
+                bulk.reset(new mongo::BulkOperationBuilder(target->initializeOrderedBulkOp(ns)));
+            mongo::BSONObj o = op.getObjectField("o");
+            //The copy may already have the document, inserts replace it
+            if (type == "i")
+                bulk->find(selector(o, shardKey->second)).upsert().replaceOne(o);
+            else if (type == "u") {
+                mongo::BSONObj query = op.getObjectField("o2");
+                if (o.firstElement().fieldName()[0] == '$') bulk->find(query).updateOne(o);
+                else bulk->find(query).replaceOne(o);
+            }
+            else if (type == "d")
+                bulk->find(o).removeOne();
+            else {
+                ++position->skipped;
+                continue;
+            }
+            ++position->applied;
+        }
+        execute();
+    }
+
+} /* namespace cloner */
@@ -0,0 +1,114 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "mongo_cxxdriver.h"
+#include "mongo_cluster.h"
+
+namespace cloner {
+
+    /*
+     * Catches a clone up with the writes made to the source while it was being copied.
+     * mark() records where each source shard's oplog is before the copy, catchUp() then tails
+     * every shard's oplog from there at once and applies the operations to the target through
+     * its mongoS, which routes them.  Once every shard is applied to within the lag the target
+     * is ready to cut over to.  The positions reached are saved so that a later catch up, i.e.
+     * after the source's writes are stopped, applies the rest.
+     */
+    class OplogTail {
+    public:
+        struct Settings {
+            //Shard key by namespace, only operations on these are applied
+            std::unordered_map<std::string, mongo::BSONObj> shardKeys;
+            //Tailing stops once every shard is applied to within this many seconds of its oplog,
+            //0 for once no operations are waiting
+            size_t lagSeconds;
+            //Operations at most in a bulk write
+            size_t batchSize;
+        };
+
+        /**
+         * @param targetConn mongoS of the target cluster
+         */
+        OplogTail(tools::mtools::MongoCluster& source, std::string targetConn);
+
+        /**
+         * Records the newest oplog entry of each source shard
+         */
+        void mark();
+
+        /**
+         * Saves the position of each source shard, applying resumes from there
+         */
+        void save(const std::string& file) const;
+
+        /**
+         * Takes the positions save() wrote instead of marking them, exits if a shard is missing
+         */
+        void load(const std::string& file);
+
+        /**
+         * Applies what the source shards wrote since mark() until every shard is within the lag
+         */
+        void catchUp(const Settings& settings);
+
+    private:
+        struct ShardPosition {
+            tools::mtools::MongoCluster::ShardName shard;
+            tools::mtools::MongoCluster::ShardConn conn;
+            //Timestamp of the last operation applied
+            unsigned long long ts{};
+            size_t applied{};
+            size_t skipped{};
+            unsigned long long lagSeconds{};
+        };
+
+        static const std::string OPLOG_NS;
+
+        tools::mtools::MongoCluster& _source;
+        const std::string _targetConn;
+        std::vector<ShardPosition> _shards;
+        //Shards currently within the lag, tailing ends once all of them are
+        std::atomic<size_t> _caughtUp{};
+
+        /**
+         * Connects or exits
+         */
+        static mongo::DBClientBase* connect(const std::string& conn);
+
+        /**
+         * @return the timestamp of the newest (natural -1) or oldest (1) oplog entry
+         */
+        static unsigned long long oplogEnd(mongo::DBClientBase* conn, int natural);
+
+        /**
+         * Tails a shard's oplog until all the shards are caught up
+         */
+        void tailShard(ShardPosition* position, const Settings& settings);
+
+        /**
+         * Writes the operations to the target in order, consecutive ones on a namespace go in
+         * one ordered bulk write
+         */
+        void apply(mongo::DBClientBase* target, const std::vector<mongo::BSONObj>& ops,
+                   const Settings& settings, ShardPosition* position);
+    };
+
+} /* namespace cloner */
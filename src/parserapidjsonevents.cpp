@@ -6,12 +6,51 @@
  */
 
 #include "parserapidjsonevents.h"
+#include <cstring>
+#include <ctime>
 
 namespace loader {
 
+    ParseRapidJsonEvents::State ParseRapidJsonEvents::specialKeyState(const Ch* str,
+                                                                      rapidjson::SizeType size)
+    {
+        //Dispatch on the length and then a distinguishing character, one compare confirms it
+        //str[0] is always '$'
+        auto is = [str, size](const char* key) { return memcmp(str + 1, key, size - 1) == 0; };
+        auto isNoCase = [str, size](const char* key) {
+            return strncasecmp(str + 1, key, size - 1) == 0; };
+        switch (size) {
+        case 4:
+            if (str[1] == 'o' && is("oid")) return OID;
+            if (str[1] == 'r' && is("ref")) return Ref;
+            break;
+        case 5:
+            if (is("date")) return Date;
+            break;
+        case 6:
+            if (is("regex")) return Regex;
+            break;
+        case 7:
+            if (str[1] == 'b' && is("binary")) return Binary;
+            //Strict writes $maxKey/$minKey, older exports the lowercase form
+            if (str[2] == 'a' && isNoCase("maxkey")) return MaxKey;
+            if (str[2] == 'i' && isNoCase("minkey")) return MinKey;
+            break;
+        case 10:
+            if (str[1] == 't' && is("timestamp")) return TimeStampStartSubObj;
+            if (str[1] == 'u' && is("undefined")) return Undefined;
+            break;
+        case 11:
+            if (is("numberLong")) return NumberLong;
+            break;
+        }
+        return Field;
+    }
+
     //TODO: Add $<special> keys such that mongoexport is supported
     //size doesn't include the null character
     bool ParseRapidJsonEvents::Key(const Ch* str, rapidjson::SizeType size, bool copy) {
+        if (_skipping) return true;
         switch (_state) {
         //{ "_id" : { "$oid" : "54320744335b5783110229ef" }, "b" : NaN, "c" : { "$undefined" : true }, "d" : Infinity, "e" : -Infinity }
         case EmbeddedStart:
@@ -21,62 +60,24 @@ namespace loader {
              * Ensure that we have a stack, and if so the owner of this obj isn't an array
              */
             if(str[0] == '$' && _stack.size() && _stack.top().array == false) {
-                if (strcmp(str + 1, "maxkey") == 0) {
-                    _bob->appendMaxKey(_field);
-                    _state = MaxKey;
-                    _unwind = 1;
-                    return true;
-                }
-                if (strcmp(str + 1, "minkey") == 0) {
-                    _state = MinKey;
-                    _unwind = 1;
-                    return true;
-                }
-                if (strcmp(str + 1, "oid") == 0) {
-                    //"field" : { "$oid" : "5431efe9f7f864f612455fed" }
-                    _state = OID;
-                    _unwind = 1;
-                    return true;
-                }
-                if (strcmp(str + 1, "binary") == 0) {
-                    //TOOD: implement binary
-                    _state = Binary;
-                    _unwind = 1;
-                    return true;
-                }
-                if (strcmp(str + 1, "date") == 0) {
-                    //"field" : { "$date" : "2014-10-05T21:26:58.957-0400" }
-                    _state = Date;
-                    _unwind = 1;
-                    return true;
-                }
-                if (strcmp(str + 1, "timestamp") == 0) {
+                State special = specialKeyState(str, size);
+                switch (special) {
+                case Field:
+                    break;
+                case TimeStampStartSubObj:
                     //"field" : { "$timestamp" : { "t" : 1412558825, "i" : 1 } }
                     //We assume that t is ALWAYS first
                     _state = TimeStampStartSubObj;
                     _count = 0;
                     _unwind = 1;
                     return true;
-                }
-                if (strcmp(str + 1, "regex") == 0) {
-                    //TODO: implement regex
-                    _state = Regex;
-                    _unwind = 1;
-                    return true;
-                }
-                if (strcmp(str + 1, "ref") == 0) {
-                    //TODO implement Ref
-                    _state = Ref;
-                    _unwind = 1;
-                    return true;
-                }
-                if (strcmp(str + 1, "undefined") == 0) {
-                    _state = Undefined;
-                    _unwind = 1;
-                    return true;
-                }
-                if (strcmp(str + 1, "numberLong") == 0) {
-                    _state = NumberLong;
+                default:
+                    //"field" : { "$oid" : "5431efe9f7f864f612455fed" }
+                    //"field" : { "$date" : "2014-10-05T21:26:58.957-0400" }
+                    //"field" : { "$numberLong" : "1412558825" }
+                    //"field" : { "$maxKey" : 1 }
+                    //TODO: implement binary, regex and ref
+                    _state = special;
                     _unwind = 1;
                     return true;
                 }
@@ -86,20 +87,65 @@ namespace loader {
             subObjStart(_field);
             //No break, if the start isn't special let it fall through
         case Field:
-            _field.assign(str, size);
+            if (_transform && _stack.size() == 1) return transformKey(str, size, copy);
+            if (_stack.size() == 1 && !_captureFields.empty()) captureField(str, size);
+            fieldSet(str, size, copy);
             _state = Value;
             return true;
         case TimeStampStartSubObj:
             //We hit this when starting the "t" field.
             _subField.assign(str, size);
             return true;
+        case DateSubObj:
+            if (size != 11 || memcmp(str, "$numberLong", size)) return false;
+            _state = DateNumberLong;
+            return true;
         default :
             return false;
         }
     }
 
 //TODO: add special objects from json.tools line 199
+    bool ParseRapidJsonEvents::transformKey(const Ch* str, rapidjson::SizeType size, bool copy) {
+        if (!coercePending()) return false;
+        const FieldTransform::Field* field = _transform->field(str, size);
+        if (field) {
+            if (field->drop) {
+                _skipping = true;
+                _skipDepth = 0;
+                return true;
+            }
+            //The transform's name outlives the document
+            str = field->name.data();
+            size = field->name.size();
+            copy = false;
+            _coerce = field->coerce;
+            _coerceOffset = _bob->len();
+        }
+        if (!_captureFields.empty()) captureField(str, size);
+        fieldSet(str, size, copy);
+        _state = Value;
+        return true;
+    }
+
+    bool ParseRapidJsonEvents::coercePending() {
+        if (_coerce == FieldTransform::Coerce::NONE) return true;
+        FieldTransform::Coerce to = _coerce;
+        _coerce = FieldTransform::Coerce::NONE;
+        mongo::BSONElement value(_bob->bb().buf() + _coerceOffset);
+        _coerceBuffer.reset();
+        mongo::BSONObjBuilder coerced(_coerceBuffer);
+        if (!FieldTransform::coerce(value, to, value.fieldNameStringData(), &coerced))
+            return false;
+        mongo::BSONObj obj = coerced.done();
+        //Nothing follows the element, so it is cut off and the coerced one goes in its place
+        _bob->bb().setlen(_coerceOffset);
+        _bob->append(obj.firstElement());
+        return true;
+    }
+
     bool ParseRapidJsonEvents::String(const Ch* str, rapidjson::SizeType size, bool copy) {
+        if (_skipping) return skipped();
         switch (_state) {
         case Value:
             //TODO: move this out to checkSpecial so string and handle special types
@@ -132,7 +178,7 @@ namespace loader {
                     _state = Field;
                     return true;
                 }
-                if (strcmp(str + 1, "umberLong(") == 0) {
+                if (size > 11 && strncmp(str + 1, "umberLong(", 10) == 0) {
                     //TODO:Support NaN & -/Infinity casting in number long (-Inf w/shell for all)
                     if (str[size - 1] != ')') return false;
                     long long value;
@@ -147,20 +193,29 @@ namespace loader {
             _state = Field;
             return true;
         case OID:
-            //Ensure that if OID is represented as a string it is the proper size for the ctor
-            if (size != mongo::OID::kOIDSize) return false;
+            //Ensure that if OID is represented as a string it is the proper size for the ctor, two
+            //hex characters per byte
+            if (size != mongo::OID::kOIDSize * 2) return false;
             //Ensure that the string is a hex string
             for(size_t pos = 0; pos < size; ++pos)
                 if (!isxdigit(str[pos])) return false;
             _bob->append(_field, mongo::OID(str));
             _state = Unwind;
             return true;
-        case Date:
-            //TODO: add number long support
-            return false;
+        case Date: {
+            long long millis;
+            if (!convertIsoDate(&millis, str, size)) return false;
+            return dateSet(millis);
+        }
+        case DateNumberLong: {
+            long long millis;
+            if (!convertNumberLong(&millis, str, size)) return false;
+            return dateSet(millis);
+        }
         case NumberLong:
+            //Strict quotes the value, { "$numberLong" : "1412558825" }
             long long value;
-            if (!convertNumberLong(&value, str + 1, size - 2)) return false;
+            if (!convertNumberLong(&value, str, size)) return false;
             _bob->append(_field, value);
             _state = Unwind;
             return true;
@@ -169,4 +224,49 @@ namespace loader {
         }
     }
 
+    bool ParseRapidJsonEvents::convertIsoDate(long long *millis, const char* str, size_t size) {
+        const char* const end = str + size;
+        //Reads exactly digits characters
+        auto number = [&str, end](int digits, int* value) {
+            if (end - str < digits) return false;
+            *value = 0;
+            for (int i = 0; i < digits; ++i, ++str) {
+                if (!isdigit(*str)) return false;
+                *value = *value * 10 + (*str - '0');
+            }
+            return true;
+        };
+        auto literal = [&str, end](char c) {
+            if (str == end || *str != c) return false;
+            ++str;
+            return true;
+        };
+        std::tm tm{};
+        if (!(number(4, &tm.tm_year) && literal('-') && number(2, &tm.tm_mon) && literal('-')
+              && number(2, &tm.tm_mday) && literal('T') && number(2, &tm.tm_hour) && literal(':')
+              && number(2, &tm.tm_min) && literal(':') && number(2, &tm.tm_sec)))
+            return false;
+        if (tm.tm_mon < 1 || tm.tm_mon > 12 || tm.tm_mday < 1 || tm.tm_mday > 31
+            || tm.tm_hour > 23 || tm.tm_min > 59 || tm.tm_sec > 60)
+            return false;
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        int fraction = 0;
+        if (literal('.') && !number(3, &fraction)) return false;
+        long long offset = 0;
+        if (!literal('Z')) {
+            if (str == end || (*str != '+' && *str != '-')) return false;
+            int sign = *str++ == '-' ? -1 : 1;
+            int hours, minutes;
+            if (!number(2, &hours)) return false;
+            literal(':');
+            if (!number(2, &minutes)) return false;
+            offset = sign * (hours * 60 + minutes) * 60;
+        }
+        if (str != end) return false;
+        //The local time less its zone offset is UTC
+        *millis = (static_cast<long long>(timegm(&tm)) - offset) * 1000 + fraction;
+        return true;
+    }
+
 } /* namespace loader */
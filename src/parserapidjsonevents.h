@@ -8,10 +8,15 @@
 #pragma once
 
 #include <mongo/client/dbclient.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
 #include <string>
 #include <stdlib.h>
+#include <vector>
 #include "rapidjson/reader.h"
 #include "rapidjson/error/en.h"
+#include "field_transform.h"
 
 
 namespace loader {
@@ -34,11 +39,12 @@ namespace loader {
         loader::BaseReaderHandler> {
     public:
         /**
-         * @Param size Size of the builder buffer
+         * @Param size initial size of the builder buffer, the buffer is reused between documents
+         * so it only grows to the largest document
          * _state is initially set to Value so that StartObject will call properly
          */
         ParseRapidJsonEvents(size_t size = 512) :
-            _size{size} {
+            _buffer(size) {
             reset();
         }
 
@@ -51,9 +57,40 @@ namespace loader {
             _bob = nullptr;
             _count = 0;
             _unwind = 0;
+            _skipping = false;
+            _skipDepth = 0;
+            _coerce = FieldTransform::Coerce::NONE;
+            std::fill(_captureOffsets.begin(), _captureOffsets.end(), -1);
         }
 
-        void bufferSizeSet(size_t size) { _size = size; }
+        /**
+         * Top level fields are dropped, renamed and coerced by transform as they are parsed.
+         * Captured fields are named by their output names.
+         */
+        void transformSet(const FieldTransform* transform) {
+            _transform = transform && !transform->empty() ? transform : nullptr;
+        }
+
+        /**
+         * Top level fields to record the elements of as they are emitted, i.e. the shard key.
+         * Saves another pass over the document to find them.
+         */
+        void captureFieldsSet(const mongo::BSONObj& fields) {
+            _captureFields.clear();
+            for (mongo::BSONObjIterator itr(fields); itr.more();)
+                _captureFields.emplace_back(itr.next().fieldName());
+            _captureOffsets.assign(_captureFields.size(), -1);
+        }
+
+        /**
+         * Gets the capture fields in capture field order, eoo if missing.
+         * @param obj must be the result of obj() for the last parse
+         */
+        void capturedFields(const mongo::BSONObj& obj, mongo::BSONElement* elements) const {
+            for (size_t i = 0; i < _captureOffsets.size(); ++i)
+                elements[i] = _captureOffsets[i] < 0 ? mongo::BSONElement()
+                        : mongo::BSONElement(obj.objdata() + _captureOffsets[i]);
+        }
 
         /**
          * Fail unhandled events
@@ -62,12 +99,15 @@ namespace loader {
 
         /**
          * Use this to get the resultant object
+         * The object is in the parser's buffer, it is only valid until the next parse.  Copy it
+         * (i.e. to an arena) to keep it.
          */
-        mongo::BSONObj obj() { return _bob->obj(); }
+        mongo::BSONObj obj() { return _bob->done(); }
 
         bool Key(const Ch* str, rapidjson::SizeType len, bool copy);
 
         bool Null() {
+            if (_skipping) return skipped();
             switch (_state) {
             case Value:
                 _bob->appendNull();
@@ -79,6 +119,7 @@ namespace loader {
         }
 
         bool Bool(bool value) {
+            if (_skipping) return skipped();
             switch (_state) {
             case Value:
                 _bob->append(_field, value);
@@ -90,6 +131,7 @@ namespace loader {
         }
 
         bool Int(int value) {
+            if (_skipping) return skipped();
             switch (_state) {
             case Value:
                 _bob->append(_field, value);
@@ -101,6 +143,8 @@ namespace loader {
                 _bob->append(_field, (long long)value);
                 _state = Unwind;
                 return true;
+            case Date:
+                return dateSet(value);
             case MinKey :
                 _bob->appendMinKey(_field);
                 _state = Unwind;
@@ -108,13 +152,14 @@ namespace loader {
             case MaxKey :
                 _bob->appendMaxKey(_field);
                 _state = Unwind;
-                return false;
+                return true;
             default :
                 return false;
             }
         }
 
         bool Uint(unsigned value) {
+            if (_skipping) return skipped();
             switch (_state) {
             case Value:
                 _bob->append(_field, value);
@@ -126,12 +171,24 @@ namespace loader {
                 _bob->append(_field, (long long)value);
                 _state = Unwind;
                 return true;
+            case Date:
+                return dateSet(value);
+            //Strict writes the keys as { "$minKey" : 1 }, which parses unsigned
+            case MinKey :
+                _bob->appendMinKey(_field);
+                _state = Unwind;
+                return true;
+            case MaxKey :
+                _bob->appendMaxKey(_field);
+                _state = Unwind;
+                return true;
             default :
                 return false;
             }
         }
 
         bool Int64(int64_t value) {
+            if (_skipping) return skipped();
             switch (_state) {
             case Value:
                 _bob->append(_field, (long long)value);
@@ -143,12 +200,15 @@ namespace loader {
                 _bob->append(_field, (long long)value);
                 _state = Unwind;
                 return true;
+            case Date:
+                return dateSet(value);
             default :
                 return false;
             }
         }
 
         bool Uint64(uint64_t value) {
+            if (_skipping) return skipped();
             switch (_state) {
             case Value:
                 _bob->append(_field, (long long)value);
@@ -160,12 +220,15 @@ namespace loader {
                 _bob->append(_field, (long long)value);
                 _state = Unwind;
                 return true;
+            case Date:
+                return dateSet(value);
             default :
                 return false;
             }
         }
 
         bool Double(double value) {
+            if (_skipping) return skipped();
             switch (_state) {
             case Value:
                 _bob->append(_field, value);
@@ -181,11 +244,26 @@ namespace loader {
          */
         bool String(const Ch* str, rapidjson::SizeType size, bool copy);
 
+        /**
+         * The whole of [str, str + size) must be the number
+         */
         bool convertNumberLong(long long *value, const char* const str, size_t size) {
+            if (!size) return false;
             char* endptr;
+            errno = 0;
             *value = strtoll(str, &endptr, 10);
-            //Size doesn't include \0
-            if (str + size + 1 != endptr) return false;
+            return errno == 0 && str + size == endptr;
+        }
+
+        /**
+         * Strict $date, "2014-10-05T21:26:58.957-0400", the fraction is optional and the zone is
+         * Z, +/-HHMM or +/-HH:MM
+         */
+        static bool convertIsoDate(long long *millis, const char* str, size_t size);
+
+        bool dateSet(long long millis) {
+            _bob->appendDate(_field, mongo::Date_t(millis));
+            _state = Unwind;
             return true;
         }
 
@@ -196,6 +274,7 @@ namespace loader {
         }
 
         bool StartObject() {
+            if (_skipping) return skipStart();
             switch (_state) {
             case Value:
                 _state = EmbeddedStart;
@@ -205,12 +284,18 @@ namespace loader {
                 _state = TimeStamp;
                 ++_unwind;
                 return true;
+            case Date :
+                //Strict writes dates it can't format as { "$date" : { "$numberLong" : "-1" } }
+                _state = DateSubObj;
+                ++_unwind;
+                return true;
             default :
                 return false;
             }
         }
 
         bool EndObject(rapidjson::SizeType) {
+            if (_skipping) return skipEnd();
             switch (_state) {
             /*
              * EndEmbedded objects, i.e. not real bson subobjects
@@ -232,6 +317,7 @@ namespace loader {
         }
 
         bool StartArray() {
+            if (_skipping) return skipStart();
             switch (_state) {
             case Value:
                 subArrayStart(_field);
@@ -242,6 +328,7 @@ namespace loader {
         }
 
         bool EndArray(rapidjson::SizeType) {
+            if (_skipping) return skipEnd();
             switch (_state) {
             case Field:
                 return subArrayEnd();
@@ -279,8 +366,14 @@ namespace loader {
 
         /**
          * The current field name to operate on
+         * Points into the parse buffer for in situ parsing, otherwise into _fieldCopy
          */
-        std::string _field;
+        mongo::StringData _field;
+
+        /**
+         * Holds the field name when the parser doesn't leave it in place
+         */
+        std::string _fieldCopy;
 
         /**
          * Temp value for the stack
@@ -301,7 +394,8 @@ namespace loader {
          * State tracks what the next valid values are for translation
          */
         enum State { EmbeddedStart, Unwind, Field, Value, OID, Binary, Date, TimeStampStartSubObj,
-            TimeStamp, Regex, Ref, Undefined, NumberLong, MinKey, MaxKey, Finalized } _state;
+            TimeStamp, Regex, Ref, Undefined, NumberLong, MinKey, MaxKey, DateSubObj, DateNumberLong,
+            Finalized } _state;
 
         /**
          * Pointer to the current builder, this allows seamless transition to subobjects and arrays
@@ -309,9 +403,9 @@ namespace loader {
         mongo::BSONObjBuilder* _bob;
 
         /**
-         * Size parameter to use with first _stack frame
+         * Buffer for the first _stack frame, kept so each document doesn't allocate
          */
-        size_t _size;
+        mongo::BufBuilder _buffer;
 
         /**
          * Stack that holds the reference to the current builder
@@ -323,10 +417,92 @@ namespace loader {
          */
         long long _stackTimeStampT = 0;
 
+        /**
+         * Fields to capture and the offset of their elements in the top level builder
+         */
+        std::vector<std::string> _captureFields;
+        std::vector<int> _captureOffsets;
+
+        const FieldTransform* _transform {};
+
+        /**
+         * A dropped field's value is being skipped, _skipDepth deep in it
+         */
+        bool _skipping;
+        size_t _skipDepth;
+
+        /**
+         * The last top level field is coerced once its element is complete, it starts at
+         * _coerceOffset.  Coercing goes through _coerceBuffer.
+         */
+        FieldTransform::Coerce _coerce;
+        int _coerceOffset {};
+        mongo::BufBuilder _coerceBuffer;
+
+        /**
+         * A scalar value while skipping, one at the top ends the skip
+         */
+        bool skipped() {
+            if (!_skipDepth) {
+                _skipping = false;
+                _state = Field;
+            }
+            return true;
+        }
+
+        bool skipStart() {
+            ++_skipDepth;
+            return true;
+        }
+
+        bool skipEnd() {
+            if (!_skipDepth) return false;
+            return --_skipDepth ? true : skipped();
+        }
+
+        /**
+         * Handles a top level key when there is a transform
+         */
+        bool transformKey(const Ch* str, rapidjson::SizeType size, bool copy);
+
+        /**
+         * Replaces the last top level element with its coerced value if it is to be coerced
+         * @return false if it can't be coerced
+         */
+        bool coercePending();
+
+        /**
+         * Records where the element for a top level field will start if it's captured
+         * Nothing is appended between the key and its element, so the builder length is it
+         */
+        void captureField(const Ch* str, rapidjson::SizeType size) {
+            for (size_t i = 0; i < _captureFields.size(); ++i) {
+                if (_captureOffsets[i] < 0 && _captureFields[i].size() == size
+                    && memcmp(_captureFields[i].data(), str, size) == 0) {
+                    _captureOffsets[i] = _bob->len();
+                    return;
+                }
+            }
+        }
+
         void setFrame() {
             _bob = &_stack.top().bob;
         }
 
+        void fieldSet(const Ch* str, rapidjson::SizeType size, bool copy) {
+            if (copy) {
+                _fieldCopy.assign(str, size);
+                _field = mongo::StringData(_fieldCopy.data(), size);
+            }
+            else _field = mongo::StringData(str, size);
+        }
+
+        /**
+         * Maps a key to the mongo meta-type it starts, i.e. "$oid" to OID
+         * @return Field if the key isn't a meta-type
+         */
+        static State specialKeyState(const Ch* str, rapidjson::SizeType size);
+
         /*
          * The first object is signified by a pull pointer.
          * All other objects would use a parent supplied buffer
@@ -335,7 +511,8 @@ namespace loader {
             if (_bob)
                 _stack.emplace(false, std::ref(_bob->subobjStart(fieldName)));
             else {
-                _stack.emplace(false, _size);
+                _buffer.reset();
+                _stack.emplace(false, std::ref(_buffer));
             }
             setFrame();
         }
@@ -344,6 +521,7 @@ namespace loader {
             if (_stack.size() == 0 || _stack.top().array != false) return false;
             //Is this the top frame, don't release it
             if(_stack.size() == 1) {
+                if (!coercePending()) return false;
                 _state = Finalized;
                 setFrame();
                 return true;
@@ -6,7 +6,51 @@
  */
 
 #include "pipeline.h"
+#include <iostream>
 
 namespace tools {
 
+    void Pipeline::start() {
+        assert(_state == State::idle);
+        _started = std::chrono::steady_clock::now();
+        for (auto stage = _stages.rbegin(); stage != _stages.rend(); ++stage)
+            if (stage->start) stage->start();
+        _state = State::active;
+    }
+
+    void Pipeline::finish() {
+        assert(_state == State::active);
+        _state = State::draining;
+        for (size_t stage = 0; stage < _stages.size(); ++stage) {
+            if (_stages[stage].finish) _stages[stage].finish();
+            _seconds[stage] = std::chrono::duration<double>(std::chrono::steady_clock::now()
+                                                            - _started).count();
+        }
+        _state = State::complete;
+    }
+
+    double Pipeline::pressure(size_t stage) const {
+        double pressure = 0;
+        for (size_t downstream = stage + 1; downstream < _stages.size(); ++downstream)
+            if (_stages[downstream].pressure)
+                pressure = std::max(pressure, _stages[downstream].pressure());
+        return pressure;
+    }
+
+    size_t Pipeline::stage(const std::string& name) const {
+        size_t stage = 0;
+        while (stage < _stages.size() && _stages[stage].name != name)
+            ++stage;
+        return stage;
+    }
+
+    void Pipeline::report(std::ostream* out) const {
+        for (size_t stage = 0; stage < _stages.size(); ++stage) {
+            *out << "Stage " << _stages[stage].name << ": ";
+            if (_stages[stage].threads) *out << _stages[stage].threads << " threads";
+            else *out << "upstream threads";
+            *out << "; drained at " << _seconds[stage] << "s" << std::endl;
+        }
+    }
+
 } /* namespace tools */
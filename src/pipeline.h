@@ -7,20 +7,100 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "threading.h"
+
 namespace tools {
 
-    template< typename in, typename out>
+    /**
+     * A load as a chain of stages, i.e. read -> parse -> route -> batch -> dispatch -> send.
+     * Stages own their threads, the pipeline owns the order they run in:
+     * start() goes downstream first so that every queue has a consumer before it has a producer,
+     * finish() goes upstream first and each stage drains before the next one is told its input
+     * is over.  That ordering replaces waiting a fixed time for stages to settle.
+     *
+     * The pipeline doesn't queue between stages itself, pressure moves upstream through what
+     * the stages hand off with: an end point's operation queue blocks the thread pushing past
+     * its maxQueueSize, and documents held for finalize are bounded by the MemoryBudget
+     * (producers wait for room, RAM queues divert to disk).  A stage's pressure() reports how
+     * close that bound is, it is for reporting and doesn't throttle anything.
+     */
     class Pipeline {
     public:
-        enum class State { active, pause, complete };
+        enum class State {
+            idle, active, draining, complete
+        };
+
+        //0 is idle, 1 or more is the stage's input is at its bound
+        using Pressure = std::function<double()>;
+
+        struct Stage {
+            std::string name;
+            /*
+             * Threads the stage runs, 0 if it runs on the threads of the stage before it
+             * (i.e. routing and batching are done on the parse threads)
+             */
+            size_t threads;
+            //Launches the stage's threads, it may not block on input
+            std::function<void()> start;
+            //Called once the upstream is drained, returns when this stage is
+            std::function<void()> finish;
+            Pressure pressure;
+        };
+
+        void add(Stage stage) {
+            _stages.push_back(std::move(stage));
+            _seconds.push_back(0);
+        }
+
+        State state() const {
+            return _state;
+        }
+
+        /**
+         * Starts all stages, last to first
+         */
+        void start();
 
-        State state() { return _state; }
-        void pressure(int pressure) { _pressure = pressure; }
+        /**
+         * Drains all stages, first to last
+         */
+        void finish();
+
+        /**
+         * @return the highest pressure of a stage downstream of stage
+         */
+        double pressure(size_t stage) const;
+
+        /**
+         * @return index of the stage named name, the stage count if there isn't one
+         */
+        size_t stage(const std::string& name) const;
+
+        /**
+         * @return seconds from start() to stage being drained
+         */
+        double drained(size_t stage) const {
+            return _seconds.at(stage);
+        }
+
+        /**
+         * Prints each stage's threads and how long after start it drained
+         */
+        void report(std::ostream* out) const;
 
     private:
-        State _state;
-        int _pressure;
+        std::vector<Stage> _stages;
+        //Seconds from start() to each stage being drained
+        std::vector<double> _seconds;
+        std::atomic<State> _state {State::idle};
+        std::chrono::steady_clock::time_point _started;
     };
 
 } /* namespace tools */
-
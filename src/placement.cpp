@@ -0,0 +1,131 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "placement.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string.h>
+#include <thread>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace tools {
+
+    Placement::Policy Placement::_policy {Placement::Policy::NONE};
+    std::vector<std::vector<int>> Placement::_nodes;
+    std::vector<size_t> Placement::_cpuNodes;
+    std::atomic<size_t> Placement::_nextSlot {};
+
+    namespace {
+        //The calling thread's node, -1 until it is pinned
+        thread_local long pinnedNode = -1;
+
+        /**
+         * Parses a sysfs CPU list, i.e. "0-7,16-23"
+         */
+        std::vector<int> cpuList(const std::string& list) {
+            std::vector<int> cpus;
+            std::stringstream ranges(list);
+            std::string range;
+            while (std::getline(ranges, range, ',')) {
+                if (range.empty() || range == "\n") continue;
+                size_t dash = range.find('-');
+                int first = std::stoi(range.substr(0, dash));
+                int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+                for (int cpu = first; cpu <= last; ++cpu)
+                    cpus.push_back(cpu);
+            }
+            return cpus;
+        }
+    }  //namespace
+
+    bool Placement::policySet(const std::string& policy) {
+        if (policy.empty() || policy == "none") _policy = Policy::NONE;
+        else if (policy == "node") _policy = Policy::NODE;
+        else if (policy == "core") _policy = Policy::CORE;
+        else return false;
+        if (enabled() && _nodes.empty()) topologyLoad();
+        return true;
+    }
+
+    void Placement::topologyLoad() {
+#ifdef __linux__
+        //Only the CPUs the process may run on, i.e. inside a cpuset
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        sched_getaffinity(0, sizeof(allowed), &allowed);
+#endif
+        for (size_t node = 0;; ++node) {
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(node)
+                               + "/cpulist");
+            if (!file) break;
+            std::string list;
+            std::getline(file, list);
+            std::vector<int> cpus = cpuList(list);
+#ifdef __linux__
+            cpus.erase(std::remove_if(cpus.begin(), cpus.end(), [&allowed](int cpu) {
+                return !CPU_ISSET(cpu, &allowed);}), cpus.end());
+#endif
+            //Memory only nodes have no CPUs to place threads on
+            if (cpus.empty()) continue;
+            _nodes.push_back(std::move(cpus));
+        }
+        if (_nodes.empty()) {
+            _nodes.emplace_back();
+            for (unsigned cpu = 0; cpu < std::max(1U, std::thread::hardware_concurrency()); ++cpu)
+                _nodes.back().push_back(cpu);
+        }
+        for (size_t node = 0; node < _nodes.size(); ++node)
+            for (int cpu : _nodes[node]) {
+                if (size_t(cpu) >= _cpuNodes.size()) _cpuNodes.resize(cpu + 1);
+                _cpuNodes[cpu] = node;
+            }
+        std::cout << "Placement: " << _nodes.size() << " nodes" << std::endl;
+    }
+
+    void Placement::pin() {
+        if (!enabled() || pinnedNode >= 0) return;
+        size_t slot = _nextSlot.fetch_add(1);
+        size_t node = slot % _nodes.size();
+        const std::vector<int>& cpus = _nodes[node];
+        pinnedNode = node;
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (_policy == Policy::CORE) CPU_SET(cpus[slot / _nodes.size() % cpus.size()], &set);
+        else
+            for (int cpu : cpus)
+                CPU_SET(cpu, &set);
+        int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (error) std::cerr << "Unable to pin thread to node " << node << ": "
+                             << strerror(error) << std::endl;
+#endif
+    }
+
+    size_t Placement::node() {
+        if (!enabled()) return 0;
+        if (pinnedNode >= 0) return pinnedNode;
+#ifdef __linux__
+        int cpu = sched_getcpu();
+        if (cpu >= 0 && size_t(cpu) < _cpuNodes.size()) return _cpuNodes[cpu];
+#endif
+        return 0;
+    }
+
+}  //namespace tools
@@ -0,0 +1,87 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace tools {
+
+    /**
+     * Places the load's threads on CPUs by NUMA node.  Pinned threads are handed out in turn
+     * over the nodes, so input, dispatch and end point threads spread evenly.  Memory a thread
+     * touches first is allocated on its own node by Linux, so batches built by a pinned input
+     * thread are local to it.  Queues that hand work between threads use node() to prefer
+     * consumers on the producer's node.
+     *
+     * Topology is read from /sys, a system without it is one node of every CPU.
+     */
+    class Placement {
+    public:
+        enum class Policy {
+            NONE, NODE, CORE
+        };
+
+        /**
+         * @param policy none, node to pin threads to a node's CPUs or core to pin each to a CPU
+         * @return false if policy is unknown
+         */
+        static bool policySet(const std::string& policy);
+
+        static Policy policy() {
+            return _policy;
+        }
+
+        static bool enabled() {
+            return _policy != Policy::NONE;
+        }
+
+        /**
+         * Pins the calling thread to the next slot, slots go round robin over the nodes.
+         * A thread that is already pinned keeps its place.  Nothing happens without a policy.
+         */
+        static void pin();
+
+        /**
+         * @return the calling thread's node, 0 without a policy
+         */
+        static size_t node();
+
+        /**
+         * @return the number of nodes, 1 without a policy
+         */
+        static size_t nodes() {
+            return enabled() ? _nodes.size() : 1;
+        }
+
+        static std::string policyPretty() {
+            return "none, node, core";
+        }
+
+    private:
+        static Policy _policy;
+        //CPUs of each node
+        static std::vector<std::vector<int>> _nodes;
+        //Node of each CPU
+        static std::vector<size_t> _cpuNodes;
+        static std::atomic<size_t> _nextSlot;
+
+        static void topologyLoad();
+    };
+
+}  //namespace tools
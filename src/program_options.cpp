@@ -32,8 +32,6 @@ namespace loader {
 //TODO: convert to YAML setup file
 //TODO: config file
 //TODO: logging queue and output file
-//TODO: Option to discard fields (i.e. _id for fast right inserts)
-//TODO: option to change field names
     /*
      * Takes argc and argv, uses boost to transform them into program options
      */
@@ -48,50 +46,200 @@ namespace loader {
                 + loader::docbuilder::ChunkBatchFactory::getKeysPretty() + "\nDirect between 10 and 100 is recommended";
         const std::string supportedInputTypes = "Input types: " +
                 loader::Loader::Settings::inputTypesPretty();
+        const std::string supportedCsvSchema = "file of the csv and tsv columns in order with "
+                "the type each is stored as: '{column: type, ...}', types are "
+                + loader::CsvSchema::typesPretty();
+        const std::string supportedTransforms = "top level field transform applied while parsing: "
+                "'{include: [fields], exclude: [fields], rename: {from: to}, coerce: {field: type}}'"
+                "\nCoerce types: " + loader::FieldTransform::typesPretty();
         generic.add_options()
             ("help,h", "print this help message")
             ("record.statFile,S", po::value<std::string>(&settings.statsFile),
                     "will output csv run summary to this file")
             ("record.note", po::value<std::string>(&settings.statsFileNote), "note in final stats file column")
+            ("record.statJson", po::value<std::string>(&settings.statsJsonFile),
+                    "will append a JSON run summary, with phase timings and per shard "
+                    "throughput, to this file")
+            ("record.interval", po::value<size_t>(&settings.metricsInterval)->default_value(10),
+                    "seconds between progress lines during the load, 0 for none")
+            ("record.metricsFile", po::value<std::string>(&settings.metricsFile),
+                    "append every progress snapshot to this file as a JSON line")
+            ("record.trace", po::value<std::string>(&settings.traceFile),
+                    "write a timeline of what every thread works on to this file as Chrome trace "
+                    "events, for Perfetto or chrome://tracing")
+            ("record.traceSpans", po::value<size_t>(&settings.traceSpans)->default_value(65536),
+                    "spans each thread keeps for the trace, older ones are overwritten")
             //TODO:log file
             /*("logFile,l", po::value<std::string>(),
                     "logFile - NOT YET IMPLEMENTED")*/
             ("inputType,T", po::value<std::string>(&settings.inputType)->default_value("json"),
                     supportedInputTypes.c_str())
-            ("loadPath,p", po::value<std::string>(&settings.loadDir)->required(),
-                    "directory to load files from")
+            ("loadPath,p", po::value<std::string>(&settings.loadDir),
+                    "directory to load files from, '-' for stdin or a named pipe.  The source "
+                    "cluster URI for a clone")
             ("fileRegex,r", po::value<std::string>(&settings.fileRegex),
                     "regular expression to match files on: (.*)(json)")
+            ("dump", po::value<bool>(&settings.dumpLoad)->default_value(false),
+                    "loadPath is a mongodump directory, load every collection in it "
+                    "(limited by db and coll if given) then rebuild the indexes")
+            ("dump.shardKeys", po::value<std::string>(&settings.dumpShardKeysJson),
+                    "shard keys by namespace for dump loads, others use shardKey: "
+                    "'{\"db.coll\": {\"_id\": \"hashed\"}}'")
+            ("calibrate", po::value<bool>(&settings.calibrate)->default_value(false),
+                    "run timed trials on a sample of the input, against the cluster or the "
+                    "dryRun end point, to find the fastest inputThreads, batchSize, "
+                    "ramQueueBatchSize, mongo.threads and queuing.  Nothing is loaded into ns")
+            ("calibrate.sampleMB", po::value<size_t>(&settings.calibrateSampleMB)
+                    ->default_value(256), "MB of input each calibration trial loads")
+            ("calibrate.trials", po::value<size_t>(&settings.calibrateTrials)
+                    ->default_value(24), "most calibration trials to run")
+            ("calibrate.save", po::value<std::string>(&settings.calibrateSave),
+                    "file to save the best calibrated settings to as JSON")
+            ("scan", po::value<bool>(&settings.scan)->default_value(false),
+                    "read all of the input without a cluster and report parse errors, missing "
+                    "shard keys, distinct keys, key order and the documents per chunk, with "
+                    "suggested split points and queuing.  Nothing is loaded")
+            ("scan.chunks", po::value<size_t>(&settings.scanChunks)->default_value(0),
+                    "prospective chunks to report on and split into, usually chunks per shard "
+                    "times shards.  0 for the chunks per shard of the queuing")
+            ("scan.save", po::value<std::string>(&settings.scanSave),
+                    "file to save the scan's statistics and split points to as JSON")
+            ("multi", po::value<std::string>(&settings.multiMap),
+                    "load many namespaces in one run through the same end points.  A file of JSON "
+                    "lines: '{\"fileRegex\": \"(.*)users(.*)\", \"ns\": \"db.users\", "
+                    "\"shardKey\": {\"_id\": \"hashed\"}}', shardKey defaults to shardKey")
+            ("multi.concurrent", po::value<size_t>(&settings.multiConcurrent)->default_value(4),
+                    "namespaces loaded at once, the threads are split evenly between them")
+            ("clone", po::value<bool>(&settings.cloneLoad)->default_value(false),
+                    "loadPath is the mongodb URI of another sharded cluster, copy every sharded "
+                    "collection in it (limited by db and coll if given) a chunk range at a time "
+                    "straight from its shards")
+            ("clone.shardThreads", po::value<size_t>(&settings.cloneShardThreads)
+                    ->default_value(2), "chunk ranges read at once from each source shard")
+            ("clone.oplog", po::value<bool>(&settings.cloneOplog)->default_value(true),
+                    "mark each source shard's oplog before the copy and apply what was written "
+                    "since afterwards, so the source doesn't need to be frozen for the copy")
+            ("clone.oplogLag", po::value<size_t>(&settings.cloneOplogLag)->default_value(5),
+                    "applying the oplogs stops once every shard is within this many seconds")
+            ("clone.oplogBatch", po::value<size_t>(&settings.cloneOplogBatch)
+                    ->default_value(1000), "oplog operations at most in a bulk write")
+            ("clone.oplogFile", po::value<std::string>(&settings.cloneOplogFile),
+                    "file the shards' oplog positions are saved to once caught up, defaults to "
+                    "mlightning.oplog.json in workPath")
+            ("clone.oplogResume", po::value<bool>(&settings.cloneOplogResume)
+                    ->default_value(false), "skip the copy and apply the oplogs from the positions "
+                    "in clone.oplogFile, i.e. with clone.oplogLag 0 once the source's writes are "
+                    "stopped to cut over")
+            ("export", po::value<std::string>(&settings.exportDir),
+                    "export db.coll from the cluster at uri to files in this directory instead of "
+                    "loading, each chunk range read straight from its shard")
+            ("export.format", po::value<std::string>(&settings.exportFormat)
+                    ->default_value("bson"), "export files as bson or json lines")
+            ("export.fileMB", po::value<size_t>(&settings.exportFileMB)->default_value(256),
+                    "export files are cut at this many MB of documents")
+            ("export.shardThreads", po::value<size_t>(&settings.exportShardThreads)
+                    ->default_value(2), "chunk ranges read at once from each shard")
+            ("export.manifest", po::value<bool>(&settings.exportManifest)->default_value(true),
+                    "write <coll>.manifest.json with the shard key bounds of every file")
             ("workPath", po::value<std::string>(&settings.workPath),
                     "directory to save temporary work in")
+            ("dryRun", po::value<std::string>(&settings.dryRun),
+                    "read, parse, route and batch without writing: 'discard' drops the batches, "
+                    "'checksum' also sums a checksum of every document.  The collection must already "
+                    "be sharded, nothing on the cluster is changed")
+            ("chunkMap", po::value<std::string>(&settings.chunkMap),
+                    "dry runs take the cluster metadata from this file instead of the cluster")
+            ("chunkMap.save", po::value<std::string>(&settings.chunkMapSave),
+                    "save the cluster metadata to this file for later dry runs")
+            ("chunkMap.cache", po::value<std::string>(&settings.metadataCache),
+                    "directory to cache the collection's chunks in, they are read from the cache "
+                    "while the collection's chunk version is unchanged")
+            ("writeMode", po::value<std::string>(&settings.writeMode)->default_value("insert"),
+                    "'insert' the documents, or upsert them by shard key and _id into the existing "
+                    "collection: 'replace' the documents they match or 'merge' their fields into them")
+            ("resume", po::value<bool>(&settings.resume)->default_value(false),
+                    "skip the segments and chunks the journal in workPath has as finished and "
+                    "accept duplicate keys for what is written again.  Documents need their own _id")
             ("uri,u", po::value<std::string>(&settings.connstr)
                     ->default_value("mongodb://127.0.0.1:27017"), "mongodb connection URI")
-            ("db,d", po::value<std::string>(&settings.database)->required(), "database")
-            ("coll,c", po::value<std::string>(&settings.collection)->required(), "collection")
+            ("db,d", po::value<std::string>(&settings.database), "database")
+            ("coll,c", po::value<std::string>(&settings.collection), "collection")
             ("directLoad,D", po::value<bool>(&settings.endPointSettings.directLoad)
-                    , "Directly load into mongoD, bypass mongoS")
+                    , "Directly load into mongoD, bypass mongoS.  The balancer is stopped, chunks "
+                    "moved anyway are sent to their new shards")
             ("dropDb", po::value<bool>(&settings.dropDb)->default_value(false),
                     "DANGER: Drop the database")
             ("dropColl", po::value<bool>(&settings.dropColl)->default_value(false),
                     "DANGER: Drop the collection")
+            ("dropIndexes", po::value<bool>(&settings.dropIndexes)->default_value(false),
+                    "DANGER: Drop the collection's indexes")
+            ("deferIndexes", po::value<bool>(&settings.deferIndexes)->default_value(false),
+                    "drop the non-unique secondary indexes before loading and build them again "
+                    "after.  _id, unique indexes and those prefixed by the shard key are kept")
             ("stopBalancer", po::value<bool>(&settings.stopBalancer)->default_value(true),
                     "stop the balancer")
-            ("shardKey,k", po::value<std::string>(&settings.shardKeyJson)->required(),
+            ("shardKey,k", po::value<std::string>(&settings.shardKeyJson),
                     "Dotted fields not supported (i.e. subdoc.field) must quote fields "
                     "'(\"_id\":\"hashed\"'")
+            ("dedupe", po::value<std::string>(&settings.dedupe)->default_value("none"),
+                    "ram and disk queues keep one document per shard key as they sort: 'first' or "
+                    "'last' pushed to the queue, or 'reject' to keep the first and append the others "
+                    "to dedupe.file.  'none' sends them all")
+            ("dedupe.file", po::value<std::string>(&settings.dedupeFile),
+                    "BSON file that documents rejected as duplicates are appended to")
             ("shardKeyUnique", po::value<bool>(&settings.shardKeyUnique)->default_value(false),
                     "Is the shard key unique")
             ("add_id", po::value<bool>(&settings.add_id)->default_value(true),
                     "Add _id if it doesn't exist, operations will error if _id is required")
+            ("add_id.perChunk", po::value<bool>(&settings.add_idPerChunk)->default_value(false),
+                    "With a {_id: 1} shard key, generate the added _ids inside each chunk instead of "
+                    "by time so every shard is appended to.  The collection is presplit over the "
+                    "_id space")
+            ("transform", po::value<std::string>(&settings.transformJson),
+                    supportedTransforms.c_str())
+            ("csv.schema", po::value<std::string>(&settings.csvSchemaFile),
+                    supportedCsvSchema.c_str())
+            ("csv.header", po::value<bool>(&settings.csvHeader)->default_value(true),
+                    "csv and tsv files start with a line of column names, it is skipped if there "
+                    "is a csv.schema")
             ("queuing,q", po::value<std::string>(&settings.loadQueueJson)->default_value("\"direct\":10"),
                     supportedLoadStrategies.c_str())
             ("load.batchSize", po::value<long unsigned int>(&settings.batcherSettings.queueSize)
                     ->default_value(1000), "Read queue size")
+            ("load.batchBytes", po::value<size_t>(&settings.batchBytes)
+                    ->default_value(47 * 1000 * 1000), "Batches are also cut at this many bytes "
+                    "of documents, the default leaves room under the 48MB max message size")
+            ("load.sharedBatches", po::value<bool>(&settings.sharedBatches)
+                    ->default_value(false), "Input threads fill shared per chunk batches, memory "
+                    "for partial batches is then bounded by chunks instead of threads x chunks")
+            ("load.wireBatches", po::value<bool>(&settings.batcherSettings.wireBatches)
+                    ->default_value(false), "Direct queues append documents straight into insert "
+                    "messages that are sent as they are, batches aren't sorted.  2.4 protocol only")
             ("load.inputThreads,t", po::value<int>(&settings.threads)
                     ->default_value(0), "threads, 0 for auto limit, "
                     "-x for a limit from the max hardware threads(default: 0)")
+            ("load.placement", po::value<std::string>(&settings.placement)
+                    ->default_value("none"), "pin input, dispatch and end point threads round "
+                    "robin over the NUMA nodes: none; node, to the node's cores; core, each to a "
+                    "single core.  Batches are built in node local memory and handed to end point "
+                    "threads on the same node first")
+            ("load.presplitSamples", po::value<size_t>(&settings.presplitSamples)
+                    ->default_value(100), "documents sampled per chunk to presplit range shard "
+                    "keys on, 0 for no presplit")
+            ("presplit.file", po::value<std::string>(&settings.presplitFile),
+                    "scan.save file to take the split points of a range shard key from, instead "
+                    "of sampling the input")
+            ("load.ramBudget", po::value<size_t>(&settings.ramBudget)->default_value(0),
+                    "MB of documents queues may hold in RAM before RAM queues spill to disk and "
+                    "input waits on the end points, 0 for 3/4 of system memory")
+            ("load.readAheadBuffers", po::value<size_t>(&settings.readAheadBuffers)
+                    ->default_value(4), "4MB buffers each input thread reads ahead, "
+                    "0 for synchronous reads")
             ("dispatch.threads", po::value<size_t>(&settings.dispatchSettings.workThreads)
                     ->default_value(10), "Threads available to the dispatcher to do work (i.e. spill to disk)")
+            ("dispatch.sortThreads", po::value<size_t>(&settings.dispatchSettings.sortThreads)
+                    ->default_value(0), "Threads each RAM queue sorts with when finalizing, "
+                    "0 for the hardware threads divided by the number of chunks")
             ("dispatch.ramQueueBatchSize,B",
                     po::value<size_t>(&settings.dispatchSettings.ramQueueBatchSize)
                     ->default_value(10000), "load queue size to pass on to dispatcher")
@@ -103,8 +251,57 @@ namespace loader {
                     ->default_value(100), "Maximum queue size for an endpoint before halting read threads")
             ("mongo.threads,e", po::value<size_t>(&settings.endPointSettings.threadCount)
                     ->default_value(2), "threads per end point")
+            ("mongo.writerThreads", po::value<size_t>(&settings.endPointSettings.writerThreads)
+                    ->default_value(1), "writer threads each end point thread hands its batches "
+                    "to, each writes one batch at a time on its own connection")
+            ("mongo.coalesce", po::value<size_t>(&settings.endPointSettings.coalesceOps)
+                    ->default_value(4), "batches each end point thread takes at once, adjacent "
+                    "ones for the same namespace are sent as one insert while they fit in "
+                    "load.batchBytes.  1 to send every batch as it was cut")
+            ("mongo.routerByLoad", po::value<bool>(&settings.dispatchSettings.routerByLoad)
+                    ->default_value(true), "send each batch to the mongoS with the least queued "
+                    "work times recent latency, false pins each chunk to a mongoS")
+            ("mongo.compressEstimate", po::value<bool>(&settings.compressEstimate)
+                    ->default_value(false), "estimate the bytes a zlib compressed wire would take "
+                    "by deflating a sample of the batches on a thread of its own.  Nothing is "
+                    "compressed, the legacy driver has no OP_COMPRESSED")
+            ("mongo.shardDocsPerSec", po::value<double>(&settings.endPointSettings.shardDocsPerSecond)
+                    ->default_value(0), "most documents a second written to each end point, the "
+                    "shard for direct loads, otherwise the mongoS.  0 for no limit")
+            ("mongo.shardMBPerSec", po::value<double>(&settings.endPointSettings.shardMBPerSecond)
+                    ->default_value(0), "most MB a second written to each end point, 0 for no limit")
+            ("mongo.clusterDocsPerSec",
+                    po::value<double>(&settings.endPointSettings.clusterDocsPerSecond)
+                    ->default_value(0), "most documents a second written across all end points, "
+                    "0 for no limit")
+            ("mongo.clusterMBPerSec",
+                    po::value<double>(&settings.endPointSettings.clusterMBPerSecond)
+                    ->default_value(0), "most MB a second written across all end points, 0 for no "
+                    "limit")
+            ("mongo.maxLag", po::value<double>(&settings.endPointSettings.maxLag)->default_value(0),
+                    "seconds a shard's secondary may fall behind before writes are slowed, the "
+                    "rate is halved while it lags and grows back once it catches up.  0 for no "
+                    "replication lag guard")
+            ("mongo.lagPoll", po::value<size_t>(&settings.endPointSettings.lagPollSeconds)
+                    ->default_value(5), "seconds between replication lag polls")
+            ("mongo.retries", po::value<size_t>(&settings.endPointSettings.retries)
+                    ->default_value(5), "times a failed batch is written again, on a new "
+                    "connection, before the load exits.  A retry takes duplicate keys as what the "
+                    "failed write got in.  0 to exit on the first failure")
+            ("mongo.retryBackoffMs", po::value<size_t>(&settings.endPointSettings.retryBackoffMs)
+                    ->default_value(500), "ms before a failed batch is retried, doubled for each "
+                    "retry after that up to 30s")
+            ("mongo.retryQueue", po::value<size_t>(&settings.endPointSettings.retryQueueMax)
+                    ->default_value(16), "failed batches each end point thread holds for retry, "
+                    "past it the thread takes no new batches until they are written")
+            ("mongo.adaptiveThreads", po::value<bool>(&settings.endPointSettings.adaptiveThreads)
+                    ->default_value(false), "grow and shrink the threads each end point runs with "
+                    "its latency, mongo.threads is then the most it can run")
+            ("mongo.clusterThreads", po::value<size_t>(&settings.endPointSettings.clusterThreads)
+                    ->default_value(0), "most end point threads running across the cluster with "
+                    "adaptive threads, 0 for no limit")
             ("mongo.LocklessMissWait", po::value<size_t>(&settings.endPointSettings.sleepTime)
-                    ->default_value(10), "Wait time for mongo connections with a lockless miss method")
+                    ->default_value(10), "Wait time for mongo connections with a lockless miss method, unused by the default parking queue")
             ("mongo.sharded,s", po::value<bool>(&settings.sharded)->default_value(true), "Used a sharded setup")
             ;
         /*cmdline.add_options()
@@ -131,5 +328,7 @@ namespace loader {
         //drop and recreate if the collection is empty
         wrapJson(&settings.shardKeyJson);
         wrapJson(&settings.loadQueueJson);
+        wrapJson(&settings.dumpShardKeysJson);
+        wrapJson(&settings.transformJson);
     }
 }  //namespace loader
@@ -0,0 +1,165 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "rate_limit.h"
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include "mongo_cxxdriver.h"
+
+namespace tools {
+    namespace mtools {
+
+        constexpr double LagGuard::RATE_MIN;
+
+        TokenBucket::TokenBucket(double rate) :
+                _rate(rate), _tokens(rate), _last(Clock::now())
+        {
+        }
+
+        unsigned long long TokenBucket::take(double tokens) {
+            double rate = _rate.load(std::memory_order_relaxed);
+            if (!rate) return 0;
+            double debt;
+            {
+                tools::MutexLockGuard lock(_mutex);
+                Clock::time_point now = Clock::now();
+                double elapsed = std::chrono::duration<double>(now - _last).count();
+                _last = now;
+                _tokens = std::min(rate, _tokens + elapsed * rate) - tokens;
+                debt = -_tokens;
+            }
+            if (debt <= 0) return 0;
+            std::chrono::nanoseconds wait(static_cast<long long>(debt / rate * 1e9));
+            std::this_thread::sleep_for(wait);
+            return wait.count();
+        }
+
+        void TokenBucket::rateSet(double rate) {
+            tools::MutexLockGuard lock(_mutex);
+            //Tokens past a second at the new rate are dropped, debt is still owed
+            _tokens = std::min(_tokens, rate);
+            _last = Clock::now();
+            _rate = rate;
+        }
+
+        LagGuard::LagGuard(std::vector<std::string> shards, double maxLag, size_t pollSeconds) :
+                _shards(std::move(shards)), _maxLag(maxLag),
+                _pollSeconds(std::max<size_t>(pollSeconds, 1))
+        {
+        }
+
+        LagGuard::~LagGuard() {
+            stop();
+        }
+
+        void LagGuard::start() {
+            if (_thread.joinable()) return;
+            _thread = std::thread([this] {this->run();});
+        }
+
+        void LagGuard::stop() {
+            {
+                tools::MutexLockGuard lock(_mutex);
+                _stop = true;
+            }
+            _stopNotify.notify_all();
+            if (_thread.joinable()) _thread.join();
+        }
+
+        double LagGuard::lag(const std::string& shard, std::string* error) {
+            mongo::ConnectionString cs = mongo::ConnectionString::parse(shard, *error);
+            if (!error->empty()) return 0;
+            std::unique_ptr<mongo::DBClientBase> conn(cs.connect(*error));
+            if (!conn) return 0;
+            mongo::BSONObj status;
+            if (!conn->runCommand("admin", BSON("replSetGetStatus" << 1), status)) {
+                *error = status.toString();
+                return 0;
+            }
+            //Primary state is 1, secondary 2
+            long long primary = 0;
+            long long slowest = 0;
+            for (mongo::BSONObjIterator i(status.getObjectField("members")); i.more();) {
+                mongo::BSONObj member = i.next().Obj();
+                int state = member.getIntField("state");
+                //Arbiters and members that are down or syncing have no optime to compare
+                mongo::BSONElement optimeDate = member.getField("optimeDate");
+                if ((state != 1 && state != 2) || optimeDate.type() != mongo::Date) continue;
+                long long optime = optimeDate.Date().millis;
+                if (state == 1) primary = optime;
+                else if (state == 2 && (!slowest || optime < slowest)) slowest = optime;
+            }
+            if (!primary || !slowest) return 0;
+            return std::max(0LL, primary - slowest) / 1000.0;
+        }
+
+        void LagGuard::run() {
+            std::vector<bool> warned(_shards.size());
+            unsigned long long lastTaken = 0;
+            for (;;) {
+                {
+                    tools::MutexUniqueLock lock(_mutex);
+                    if (_stopNotify.wait_for(lock, std::chrono::seconds(_pollSeconds),
+                                             [this] {return _stop;}))
+                        return;
+                }
+                //The guard only slows the load, a failed poll mustn't end it
+                try {
+                    unsigned long long taken = _taken.load(std::memory_order_relaxed);
+                    double written = double(taken - lastTaken) / _pollSeconds;
+                    lastTaken = taken;
+                    double worst = 0;
+                    std::string worstShard;
+                    for (size_t shard = 0; shard < _shards.size(); ++shard) {
+                        std::string error;
+                        double shardLag = lag(_shards[shard], &error);
+                        if (!error.empty() && !warned[shard]) {
+                            warned[shard] = true;
+                            std::cerr << "Unable to read the replication lag of "
+                                      << _shards[shard] << ": " << error << std::endl;
+                        }
+                        if (shardLag > worst) {
+                            worst = shardLag;
+                            worstShard = _shards[shard];
+                        }
+                    }
+                    double rate = _limit.rate();
+                    if (worst > _maxLag) {
+                        if (!rate) _peak = written;
+                        rate = std::max(RATE_MIN, (rate ? rate : written) / 2);
+                        _limit.rateSet(rate);
+                        std::cout << "Replication lag " << worst << "s on " << worstShard
+                                  << ", writes limited to " << rate / 1024 / 1024 << "MB/s"
+                                  << std::endl;
+                    }
+                    else if (rate && worst < _maxLag / 2) {
+                        rate *= 1.25;
+                        if (rate > _peak) {
+                            rate = 0;
+                            std::cout << "Replication lag is down to " << worst
+                                      << "s, lifting the write limit" << std::endl;
+                        }
+                        _limit.rateSet(rate);
+                    }
+                }
+                catch (std::exception& e) {
+                    std::cerr << "Replication lag poll failed: " << e.what() << std::endl;
+                }
+            }
+        }
+
+    }  //namespace mtools
+}  //namespace tools
@@ -0,0 +1,144 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "threading.h"
+
+namespace tools {
+    namespace mtools {
+
+        /**
+         * Token bucket, tokens refill at rate per second up to a second's worth.  A take larger
+         * than what is there goes into debt and waits it off, so batches bigger than the bucket
+         * still pass and the average holds to the rate.
+         */
+        class TokenBucket {
+        public:
+            /**
+             * @param rate tokens per second, 0 for no limit
+             */
+            explicit TokenBucket(double rate = 0);
+
+            /**
+             * Takes tokens, sleeping until the bucket is out of debt.  Thread safe.
+             * @return nanoseconds slept
+             */
+            unsigned long long take(double tokens);
+
+            void rateSet(double rate);
+
+            double rate() const {
+                return _rate.load(std::memory_order_relaxed);
+            }
+
+        private:
+            using Clock = std::chrono::steady_clock;
+
+            std::atomic<double> _rate;
+            tools::Mutex _mutex;
+            double _tokens;
+            Clock::time_point _last;
+        };
+
+        /**
+         * Documents per second and bytes per second limits
+         */
+        class RateLimit {
+        public:
+            RateLimit(double docsPerSecond = 0, double bytesPerSecond = 0) :
+                    _docs(docsPerSecond), _bytes(bytesPerSecond)
+            {
+            }
+
+            /**
+             * Waits until a write of docs and bytes is within the limits
+             * @return nanoseconds waited
+             */
+            unsigned long long take(size_t docs, size_t bytes) {
+                return _docs.take(docs) + _bytes.take(bytes);
+            }
+
+            bool limited() const {
+                return _docs.rate() || _bytes.rate();
+            }
+
+        private:
+            TokenBucket _docs;
+            TokenBucket _bytes;
+        };
+
+        /**
+         * Polls the replica set status of the shards and backs the write rate off while a
+         * secondary lags.  Lag past maxLag halves the bytes per second allowed, starting from
+         * the rate writes were going at.  Once the lag is under half of maxLag the limit grows
+         * back a quarter a poll and is lifted when it passes the rate before the first back off.
+         */
+        class LagGuard {
+        public:
+            //Slowest the guard will take the writes to, bytes per second
+            static constexpr double RATE_MIN = 64 * 1024;
+
+            /**
+             * @param shards connection strings of the replica sets to poll
+             * @param maxLag seconds a secondary may be behind its primary
+             * @param pollSeconds between polls
+             */
+            LagGuard(std::vector<std::string> shards, double maxLag, size_t pollSeconds);
+
+            ~LagGuard();
+
+            void start();
+
+            void stop();
+
+            /**
+             * Waits until a write of bytes is within the guard's limit
+             * @return nanoseconds waited
+             */
+            unsigned long long take(size_t bytes) {
+                _taken.fetch_add(bytes, std::memory_order_relaxed);
+                return _limit.take(bytes);
+            }
+
+        private:
+            const std::vector<std::string> _shards;
+            const double _maxLag;
+            const size_t _pollSeconds;
+            TokenBucket _limit;
+            std::atomic<unsigned long long> _taken {};
+            //Rate writes were going at when the guard first backed off
+            double _peak {};
+            tools::Mutex _mutex;
+            tools::ConditionVariable _stopNotify;
+            bool _stop {};
+            std::thread _thread;
+
+            void run();
+
+            /**
+             * @return the most any secondary of the shard is behind its primary in seconds, 0 if
+             * the status can't be read
+             */
+            static double lag(const std::string& shard, std::string* error);
+        };
+
+    }  //namespace mtools
+}  //namespace tools
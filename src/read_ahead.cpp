@@ -0,0 +1,172 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "read_ahead.h"
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace tools {
+
+    std::atomic<unsigned long long> ReadAheadStreamBuf::_bytesRead{};
+    std::atomic<unsigned long long> ReadAheadStreamBuf::_readNanos{};
+    std::atomic<unsigned long long> ReadAheadStreamBuf::_waitNanos{};
+
+    namespace {
+        using Clock = std::chrono::steady_clock;
+
+        unsigned long long nanosSince(Clock::time_point start) {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start)
+                    .count();
+        }
+    }  //namespace
+
+    ReadAheadStreamBuf::~ReadAheadStreamBuf() {
+        close();
+    }
+
+    bool ReadAheadStreamBuf::open(const std::string& fileName, long long begin, long long end,
+                                  size_t buffers, size_t bufferSize)
+    {
+        close();
+        _fd = ::open(fileName.c_str(), O_RDONLY);
+        if (_fd == -1) return false;
+        //Let the kernel read ahead as well, it's free when it's right
+        posix_fadvise(_fd, begin, end ? end - begin : 0, POSIX_FADV_SEQUENTIAL);
+        _bufferSize = bufferSize;
+        _offset = begin;
+        _readAheadEnd = end;
+        _finished = _stop = _consumerWaiting = _consuming = false;
+        _consume = _produce = 0;
+        setg(nullptr, nullptr, nullptr);
+        if (!buffers) {
+            _syncBuffer.data.resize(bufferSize);
+            return true;
+        }
+        _buffers.resize(buffers);
+        for (auto& buffer : _buffers) {
+            buffer.data.resize(bufferSize);
+            buffer.ready = false;
+        }
+        _reader = std::thread([this]() {this->threadRead();});
+        return true;
+    }
+
+    void ReadAheadStreamBuf::close() {
+        if (_reader.joinable()) {
+            {
+                tools::MutexLockGuard lock(_mutex);
+                _stop = true;
+            }
+            _freeNotify.notify_all();
+            _reader.join();
+        }
+        if (_fd != -1) ::close(_fd);
+        _fd = -1;
+        _buffers.clear();
+        setg(nullptr, nullptr, nullptr);
+    }
+
+    ReadAheadStats ReadAheadStreamBuf::stats() {
+        return ReadAheadStats{_bytesRead, _readNanos, _waitNanos};
+    }
+
+    void ReadAheadStreamBuf::readBuffer(Buffer* buffer) {
+        Clock::time_point start = Clock::now();
+        size_t size = 0;
+        while (size < _bufferSize) {
+            ssize_t count = pread(_fd, buffer->data.data() + size, _bufferSize - size,
+                                  _offset + size);
+            if (count < 0 && errno == EINTR) continue;
+            if (count < 0) {
+                std::cerr << "Read failed: " << strerror(errno) << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            if (!count) break;
+            size += count;
+        }
+        _readNanos += nanosSince(start);
+        _bytesRead += size;
+        _offset += size;
+        buffer->size = size;
+    }
+
+    void ReadAheadStreamBuf::threadRead() {
+        for (;;) {
+            Buffer* buffer;
+            {
+                tools::MutexUniqueLock lock(_mutex);
+                //Past the end only read when the consumer needs it to finish a record
+                _freeNotify.wait(lock, [this]() {
+                    return this->_stop || (!this->_buffers[this->_produce].ready
+                        && (!this->_readAheadEnd || this->_offset < this->_readAheadEnd
+                            || this->_consumerWaiting));
+                });
+                if (_stop) return;
+                buffer = &_buffers[_produce];
+            }
+            readBuffer(buffer);
+            bool finished = !buffer->size;
+            {
+                tools::MutexLockGuard lock(_mutex);
+                buffer->ready = true;
+                _produce = (_produce + 1) % _buffers.size();
+            }
+            _readyNotify.notify_one();
+            //An empty buffer marks the end of the file
+            if (finished) return;
+        }
+    }
+
+    ReadAheadStreamBuf::int_type ReadAheadStreamBuf::underflow() {
+        if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+        if (_finished || _fd == -1) return traits_type::eof();
+        Buffer* buffer;
+        if (_buffers.empty()) {
+            buffer = &_syncBuffer;
+            readBuffer(buffer);
+        }
+        else {
+            tools::MutexUniqueLock lock(_mutex);
+            //Hand the buffer that was just read back to the reader thread
+            if (_consuming) {
+                _buffers[_consume].ready = false;
+                _consume = (_consume + 1) % _buffers.size();
+                _consuming = false;
+                _freeNotify.notify_one();
+            }
+            buffer = &_buffers[_consume];
+            if (!buffer->ready) {
+                Clock::time_point start = Clock::now();
+                _consumerWaiting = true;
+                _freeNotify.notify_one();
+                _readyNotify.wait(lock, [buffer]() {return buffer->ready;});
+                _consumerWaiting = false;
+                _waitNanos += nanosSince(start);
+            }
+            _consuming = true;
+        }
+        if (!buffer->size) {
+            _finished = true;
+            return traits_type::eof();
+        }
+        setg(buffer->data.data(), buffer->data.data(), buffer->data.data() + buffer->size);
+        return traits_type::to_int_type(*gptr());
+    }
+
+}  //namespace tools
@@ -0,0 +1,159 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <istream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+#include "threading.h"
+
+namespace tools {
+
+    /**
+     * Totals for all read ahead streams
+     */
+    struct ReadAheadStats {
+        unsigned long long bytesRead;
+        //Time spent in read calls, summed across streams
+        unsigned long long readNanos;
+        //Time readers spent waiting for data, i.e. I/O bound time
+        unsigned long long waitNanos;
+    };
+
+    /**
+     * File stream buffer that keeps a number of large buffers being read ahead of the reader.
+     * A thread per stream does the reads so that the disk (or network storage) and parsing
+     * overlap.  With no buffers the reads are done synchronously by the reader.
+     */
+    class ReadAheadStreamBuf : public std::streambuf {
+    public:
+        static constexpr size_t DEFAULT_BUFFER_SIZE = 4 * 1024 * 1024;
+
+        ReadAheadStreamBuf() { }
+        ~ReadAheadStreamBuf();
+
+        /**
+         * @param begin offset to start reading at
+         * @param end offset reading ahead should stop near, reading continues on demand so
+         * records can be completed.  0 for the end of the file
+         * @param buffers number of buffers in flight, 0 for synchronous reads
+         */
+        bool open(const std::string& fileName, long long begin, long long end, size_t buffers,
+                  size_t bufferSize = DEFAULT_BUFFER_SIZE);
+
+        void close();
+
+        bool is_open() const {
+            return _fd != -1;
+        }
+
+        /**
+         * @return totals across all streams
+         */
+        static ReadAheadStats stats();
+
+    protected:
+        int_type underflow();
+
+    private:
+        struct Buffer {
+            std::vector<char> data;
+            size_t size{};
+            bool ready{};
+        };
+
+        int _fd{-1};
+        std::vector<Buffer> _buffers;
+        //Single buffer for synchronous reads
+        Buffer _syncBuffer;
+        size_t _bufferSize{};
+        size_t _consume{};
+        size_t _produce{};
+        bool _consuming{};
+        long long _offset{};
+        long long _readAheadEnd{};
+        bool _finished{};
+        bool _stop{};
+        bool _consumerWaiting{};
+        tools::Mutex _mutex;
+        tools::ConditionVariable _readyNotify;
+        tools::ConditionVariable _freeNotify;
+        std::thread _reader;
+
+        static std::atomic<unsigned long long> _bytesRead;
+        static std::atomic<unsigned long long> _readNanos;
+        static std::atomic<unsigned long long> _waitNanos;
+
+        /**
+         * Reads the next buffer at _offset
+         */
+        void readBuffer(Buffer* buffer);
+
+        void threadRead();
+    };
+
+    /**
+     * istream over a ReadAheadStreamBuf
+     */
+    class ReadAheadInputStream : public std::istream {
+    public:
+        ReadAheadInputStream() : std::istream(&_buf) { }
+
+        void open(const std::string& fileName, long long begin, long long end, size_t buffers) {
+            clear();
+            if (!_buf.open(fileName, begin, end, buffers))
+                setstate(std::ios_base::failbit);
+        }
+
+        void close() {
+            _buf.close();
+        }
+
+        bool is_open() const {
+            return _buf.is_open();
+        }
+
+    private:
+        ReadAheadStreamBuf _buf;
+    };
+
+    /**
+     * istream over a buffer that is read in place
+     */
+    class MemoryInputStream : public std::istream {
+    public:
+        MemoryInputStream() : std::istream(&_buf) { }
+
+        void reset(const char* data, size_t size) {
+            clear();
+            _buf.reset(data, size);
+        }
+
+    private:
+        struct MemoryStreamBuf : public std::streambuf {
+            void reset(const char* data, size_t size) {
+                char* begin = const_cast<char*>(data);
+                setg(begin, begin, begin + size);
+            }
+        };
+
+        MemoryStreamBuf _buf;
+    };
+
+}  //namespace tools
@@ -17,17 +17,180 @@
 
 namespace tools {
 
-    void ThreadPool::_workLoop() {
-        MutexUniqueLock lock(_workMutex, std::defer_lock);
+    namespace {
+        /**
+         * The pool and worker the current thread is, so work it queues stays on its deque
+         */
+        struct CurrentWorker {
+            const ThreadPool* pool {};
+            size_t index {};
+            //Round robin position for inboxes, starts apart so threads don't queue in step
+            size_t next = std::hash<std::thread::id>()(std::this_thread::get_id());
+        };
+
+        thread_local CurrentWorker currentWorker;
+
+        //A return list whose thread has exited, tasks returned to it are freed
+        Task* const RETURNS_CLOSED = reinterpret_cast<Task*>(1);
+
+        /**
+         * Tasks queued by a thread, reused by the tasks that thread queues.  Threads that run
+         * them push them onto returns without a lock, the owner takes the list whole.
+         */
+        struct TaskCache {
+            static constexpr size_t MAX = 1024;
+            std::vector<Task*> tasks;
+            //Never freed, a task still running may be returned after the thread is gone
+            std::atomic<Task*>* const returns = new std::atomic<Task*>(nullptr);
+
+            ~TaskCache() {
+                for (auto task : tasks)
+                    delete task;
+                Task* task = returns->exchange(RETURNS_CLOSED, std::memory_order_acquire);
+                while (task) {
+                    Task* next = task->next;
+                    delete task;
+                    task = next;
+                }
+            }
+        };
+
+        thread_local TaskCache taskCache;
+    }  //namespace
+
+    ThreadPool::~ThreadPool() {
+        //If the pool ended with endwait all work should be complete
+        //This can be broken if something is still inserting, this will just "warn" of that
+        if (_endWait && !_terminate) assert(!size());
+        terminateInitiate();
+        joinAll();
+        //Terminating can leave work, the workers are gone so the deques can be emptied here
+        for (size_t index = 0; index < _workers.size(); ++index) {
+            drainInbox(_workers[index].get(), index);
+            while (Task* task = _workers[index]->deque.pop())
+                delete task;
+        }
+    }
+
+    Task* ThreadPool::taskGet() {
+        if (taskCache.tasks.empty()) {
+            Task* returned = taskCache.returns->exchange(nullptr, std::memory_order_acquire);
+            while (returned) {
+                Task* next = returned->next;
+                if (taskCache.tasks.size() < TaskCache::MAX) taskCache.tasks.push_back(returned);
+                else delete returned;
+                returned = next;
+            }
+        }
+        Task* task;
+        if (taskCache.tasks.empty()) task = new Task();
+        else {
+            task = taskCache.tasks.back();
+            taskCache.tasks.pop_back();
+        }
+        task->next = nullptr;
+        task->home = taskCache.returns;
+        return task;
+    }
+
+    void ThreadPool::taskRelease(Task* task) {
+        std::atomic<Task*>* home = task->home;
+        if (!home || home == taskCache.returns) {
+            if (taskCache.tasks.size() >= TaskCache::MAX) {
+                delete task;
+                return;
+            }
+            task->next = nullptr;
+            taskCache.tasks.push_back(task);
+            return;
+        }
+        Task* head = home->load(std::memory_order_relaxed);
+        do {
+            if (head == RETURNS_CLOSED) {
+                delete task;
+                return;
+            }
+            task->next = head;
+        } while (!home->compare_exchange_weak(head, task, std::memory_order_release,
+                                              std::memory_order_relaxed));
+    }
+
+    void ThreadPool::submit(Task* task) {
+        if (currentWorker.pool == this) {
+            _workers[currentWorker.index]->deque.push(task);
+            return;
+        }
+        Worker* worker = _workers[currentWorker.next++ % _workers.size()].get();
+        Task* head = worker->inbox.load(std::memory_order_relaxed);
+        do
+            task->next = head;
+        while (!worker->inbox.compare_exchange_weak(head, task, std::memory_order_release,
+                                                    std::memory_order_relaxed));
+    }
+
+    bool ThreadPool::drainInbox(Worker* inbox, size_t index) {
+        if (!inbox->inbox.load(std::memory_order_relaxed)) return false;
+        //Whoever exchanges the inbox owns all of it, so taking it is safe from any worker
+        Task* task = inbox->inbox.exchange(nullptr, std::memory_order_acquire);
+        if (!task) return false;
+        Task* oldest = nullptr;
+        while (task) {
+            Task* next = task->next;
+            task->next = oldest;
+            oldest = task;
+            task = next;
+        }
+        WorkStealingDeque& deque = _workers[index]->deque;
+        while (oldest) {
+            Task* next = oldest->next;
+            oldest->next = nullptr;
+            deque.push(oldest);
+            oldest = next;
+        }
+        return true;
+    }
+
+    Task* ThreadPool::findWork(size_t index) {
+        Worker* own = _workers[index].get();
+        Task* task = own->deque.pop();
+        if (task) return task;
+        if (drainInbox(own, index) && (task = own->deque.pop())) return task;
+        //Steal the oldest work of the others, their inboxes are taken whole when they're busy
+        size_t count = _workers.size();
+        for (size_t offset = 1; offset < count; ++offset) {
+            size_t victim = (index + offset) % count;
+            if ((task = _workers[victim]->deque.steal())) return task;
+            if (drainInbox(_workers[victim].get(), index) && (task = own->deque.pop()))
+                return task;
+        }
+        return nullptr;
+    }
+
+    void ThreadPool::_workLoop(size_t index) {
+        currentWorker.pool = this;
+        currentWorker.index = index;
+        if (_workerStart) _workerStart();
         for (;;) {
-            lock.lock();
-            _workNotify.wait(lock, [this]() {return !this->_workQueue.empty() || this->terminate()
-                                    || endWait();});
-            if (terminate() || (_workQueue.empty() && endWait())) break;
-            ThreadFunction func = std::move(_workQueue.front());
-            _workQueue.pop_front();
-            lock.unlock();
-            func();
+            if (terminate()) break;
+            Task* task = findWork(index);
+            if (task) {
+                _queued.fetch_sub(1);
+                task->run();
+                taskRelease(task);
+                continue;
+            }
+            if (endWait() && !_queued.load()) break;
+            //Lost wake ups: queue() counts before checking sleepers, this counts before checking
+            _sleepers.fetch_add(1);
+            {
+                MutexUniqueLock lock(_workMutex);
+                _workNotify.wait(lock, [this]() {return this->_queued.load() || this->terminate()
+                                        || this->endWait();});
+            }
+            _sleepers.fetch_sub(1);
+            //Work counted but not yet reachable is only a few instructions from being so
+            if (!terminate() && _queued.load()) std::this_thread::yield();
         }
+        currentWorker.pool = nullptr;
     }
 }  //namespace tools
@@ -15,13 +15,19 @@
 
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <assert.h>
 #include <condition_variable>
 #include <deque>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <queue>
 #include <thread>
+#include <type_traits>
+#include <vector>
 
 namespace tools {
 
@@ -34,53 +40,233 @@ namespace tools {
 //TODO: refactor everything to PIMPL
     class ThreadPool;
 
+    /**
+     * A queued work function.  Callables that fit inline are stored in the task itself so
+     * queueing one doesn't allocate for it the way std::function can, larger ones are moved
+     * to the heap.  Tasks are nodes, next links them on a thread pool inbox.
+     */
+    class Task {
+    public:
+        static constexpr size_t INLINE_SIZE = 64;
+
+        Task() = default;
+        Task(const Task&) = delete;
+        Task& operator=(const Task&) = delete;
+
+        ~Task() {
+            clear();
+        }
+
+        /**
+         * Stores func to be run, the task must be empty
+         */
+        template<typename Func>
+        void set(Func&& func) {
+            using Callable = typename std::decay<Func>::type;
+            set(std::forward<Func>(func), std::integral_constant<bool,
+                sizeof(Callable) <= INLINE_SIZE && alignof(Callable) <= alignof(Storage)>());
+        }
+
+        /**
+         * Runs the function then releases it, the task is left empty
+         */
+        void run() {
+            _invoke(&_storage);
+            clear();
+        }
+
+        Task* next {};
+        //Return list of the thread that queued the task, it is reused by that thread
+        std::atomic<Task*>* home {};
+
+    private:
+        using Storage = typename std::aligned_storage<INLINE_SIZE>::type;
+        Storage _storage;
+        void (*_invoke)(void*) {};
+        void (*_destroy)(void*) {};
+
+        void clear() {
+            if (_destroy) _destroy(&_storage);
+            _invoke = nullptr;
+            _destroy = nullptr;
+        }
+
+        template<typename Func>
+        void set(Func&& func, std::true_type) {
+            using Callable = typename std::decay<Func>::type;
+            new (&_storage) Callable(std::forward<Func>(func));
+            _invoke = [](void* storage) {(*static_cast<Callable*>(storage))();};
+            _destroy = [](void* storage) {static_cast<Callable*>(storage)->~Callable();};
+        }
+
+        template<typename Func>
+        void set(Func&& func, std::false_type) {
+            using Callable = typename std::decay<Func>::type;
+            *reinterpret_cast<Callable**>(&_storage) = new Callable(std::forward<Func>(func));
+            _invoke = [](void* storage) {(**static_cast<Callable**>(storage))();};
+            _destroy = [](void* storage) {delete *static_cast<Callable**>(storage);};
+        }
+    };
+
+    /**
+     * Chase-Lev work stealing deque of tasks (Le, Pop, Cohen, Nardelli, "Correct and Efficient
+     * Work-Stealing for Weak Memory Models").  The owning thread pushes and pops at the bottom,
+     * any thread can steal from the top.  The ring grows when full, outgrown rings are kept
+     * until the deque is destroyed as a thief may still be reading them.
+     */
+    class WorkStealingDeque {
+    public:
+        explicit WorkStealingDeque(size_t capacity = 256) {
+            _rings.emplace_back(new Ring(capacity));
+            _ring = _rings.back().get();
+        }
+
+        /**
+         * Owner only
+         */
+        void push(Task* task) {
+            long long bottom = _bottom.load(std::memory_order_relaxed);
+            long long top = _top.load(std::memory_order_acquire);
+            Ring* ring = _ring.load(std::memory_order_relaxed);
+            if (bottom - top > static_cast<long long>(ring->mask)) ring = grow(ring, top, bottom);
+            ring->put(bottom, task);
+            _bottom.store(bottom + 1, std::memory_order_release);
+        }
+
+        /**
+         * Owner only
+         * @return the newest task, nullptr if empty
+         */
+        Task* pop() {
+            long long bottom = _bottom.load(std::memory_order_relaxed) - 1;
+            Ring* ring = _ring.load(std::memory_order_relaxed);
+            _bottom.store(bottom, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            long long top = _top.load(std::memory_order_relaxed);
+            if (top > bottom) {
+                _bottom.store(bottom + 1, std::memory_order_relaxed);
+                return nullptr;
+            }
+            Task* task = ring->get(bottom);
+            if (top == bottom) {
+                //Last task, race the thieves for it
+                if (!_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                                  std::memory_order_relaxed))
+                    task = nullptr;
+                _bottom.store(bottom + 1, std::memory_order_relaxed);
+            }
+            return task;
+        }
+
+        /**
+         * Thread safe
+         * @return the oldest task, nullptr if empty or another thread won it
+         */
+        Task* steal() {
+            long long top = _top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            long long bottom = _bottom.load(std::memory_order_acquire);
+            if (top >= bottom) return nullptr;
+            Task* task = _ring.load(std::memory_order_acquire)->get(top);
+            if (!_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                              std::memory_order_relaxed))
+                return nullptr;
+            return task;
+        }
+
+        bool empty() const {
+            return _bottom.load(std::memory_order_acquire)
+                   <= _top.load(std::memory_order_acquire);
+        }
+
+    private:
+        struct Ring {
+            explicit Ring(size_t capacity) : mask(capacity - 1),
+                    slots(new std::atomic<Task*>[capacity]) { }
+
+            Task* get(long long index) const {
+                return slots[index & mask].load(std::memory_order_acquire);
+            }
+
+            void put(long long index, Task* task) {
+                slots[index & mask].store(task, std::memory_order_release);
+            }
+
+            const size_t mask;
+            std::unique_ptr<std::atomic<Task*>[]> slots;
+        };
+
+        Ring* grow(Ring* ring, long long top, long long bottom) {
+            _rings.emplace_back(new Ring((ring->mask + 1) * 2));
+            Ring* grown = _rings.back().get();
+            for (long long index = top; index < bottom; ++index)
+                grown->put(index, ring->get(index));
+            _ring.store(grown, std::memory_order_release);
+            return grown;
+        }
+
+        std::atomic<long long> _top {};
+        std::atomic<long long> _bottom {};
+        std::atomic<Ring*> _ring;
+        std::vector<std::unique_ptr<Ring>> _rings;
+    };
+
     /**
      * Thread pool worker thread, shouldn't exist outside of threadpool
      */
     class ThreadPoolWorker {
     public:
-        ThreadPoolWorker(ThreadPool& pool) : _pool(pool) { }
+        ThreadPoolWorker(ThreadPool& pool, size_t index) : _pool(pool), _index(index) { }
 
         void operator()();
 
     private:
         ThreadPool &_pool;
+        size_t _index;
     };
 
     /**
      * Basic thread management object.
-     * Accepts work functions and runs threads against them serially
+     * Accepts work functions and runs threads against them
      * Does not schedule against different functions
      * All work functions must be void fun(void)
+     *
+     * Every worker has its own work stealing deque and an inbox.  Work queued by a worker goes
+     * on its own deque, other threads round robin work into the inboxes.  A worker runs its
+     * own work newest first and when out of work steals the oldest from the other workers, so
+     * the only lock is the one idle workers park on and it is only taken if one is parked.
      */
     class ThreadPool {
     public:
-        ThreadPool(size_t size) :
-                _terminate( false), _endWait( false)
+        /**
+         * @param workerStart run by each worker thread before it takes work, i.e. to place it
+         */
+        ThreadPool(size_t size, ThreadFunction workerStart = ThreadFunction()) :
+                _terminate( false), _endWait( false), _workerStart(std::move(workerStart))
         {
-            do {
-                _threads.push_back(std::thread(ThreadPoolWorker(*this)));
-            }
-            while (--size);
+            if (!size) size = 1;
+            for (size_t index = 0; index < size; ++index)
+                _workers.emplace_back(new Worker());
+            for (size_t index = 0; index < size; ++index)
+                _threads.push_back(std::thread(ThreadPoolWorker(*this, index)));
         }
 
-        ~ThreadPool() {
-            //If the pool ended with endwait all work should be complete
-            //This can be broken if something is still inserting, this will just "warn" of that
-            if (_endWait && !_terminate) assert(!size());
-            _terminate = true;
-            _workNotify.notify_all();
-            joinAll();
-
-        }
+        ~ThreadPool();
 
         /**
          * Enqueus a work function
          */
-        void queue(ThreadFunction func) {
-            MutexLockGuard lock(_workMutex);
-            _workQueue.push_back(func);
-            _workNotify.notify_one();
+        template<typename Func>
+        void queue(Func&& func) {
+            Task* task = taskGet();
+            task->set(std::forward<Func>(func));
+            //Counted first so that it can't be taken before it's counted
+            _queued.fetch_add(1);
+            submit(task);
+            if (_sleepers.load()) {
+                MutexLockGuard lock(_workMutex);
+                _workNotify.notify_one();
+            }
         }
 
         /**
@@ -111,6 +297,7 @@ namespace tools {
         void terminateInitiate() {
             _terminate = true;
             _endWait = true;
+            MutexLockGuard lock(_workMutex);
             _workNotify.notify_all();
         }
 
@@ -119,34 +306,102 @@ namespace tools {
          */
         void endWaitInitiate() {
             _endWait = true;
+            MutexLockGuard lock(_workMutex);
             _workNotify.notify_all();
         }
 
         /**
-         * @return the size of the workQueue.
+         * @return the number of queued work functions that haven't started.
          */
         size_t size() const {
-            MutexLockGuard lock(_workMutex);
-            return _workQueue.size();
+            return _queued.load(std::memory_order_relaxed);
         }
 
     private:
         friend class ThreadPoolWorker;
-        void _workLoop();
+
+        struct Worker {
+            WorkStealingDeque deque;
+            //Tasks queued by threads outside of the pool, newest first, any worker may take them
+            std::atomic<Task*> inbox {};
+        };
+
+        void _workLoop(size_t index);
+
+        /**
+         * Puts a task on the current worker's deque or round robin into an inbox
+         */
+        void submit(Task* task);
+
+        /**
+         * @return a task for worker index to run, nullptr if there isn't one
+         */
+        Task* findWork(size_t index);
+
+        /**
+         * Moves an inbox onto the deque of worker index, oldest task on top
+         * @return true if there were tasks
+         */
+        bool drainInbox(Worker* inbox, size_t index);
+
+        /**
+         * Tasks are reused from a per thread cache.  A task run on another thread goes back on
+         * its producer's return list, so threads that only queue (i.e. input threads) reuse
+         * theirs too.
+         */
+        static Task* taskGet();
+        static void taskRelease(Task* task);
 
         //TODO:Change this to an int and use flags
         //Atomics are cheap, and if we leave x86...
         std::atomic<bool> _terminate;
         std::atomic<bool> _endWait;
 
+        const ThreadFunction _workerStart;
         std::deque<std::thread> _threads;
+        std::vector<std::unique_ptr<Worker>> _workers;
+        std::atomic<size_t> _queued {};
+        std::atomic<size_t> _sleepers {};
         mutable Mutex _workMutex;
         mutable ConditionVariable _workNotify;
-        std::deque<ThreadFunction> _workQueue;
     };
 
     inline void ThreadPoolWorker::operator()() {
-        _pool._workLoop();
+        _pool._workLoop(_index);
+    }
+
+    /**
+     * Test and set lock for critical sections that are only a few moves long
+     */
+    class SpinLock {
+    public:
+        void lock() {
+            while (_flag.test_and_set(std::memory_order_acquire))
+                std::this_thread::yield();
+        }
+
+        bool try_lock() {
+            return !_flag.test_and_set(std::memory_order_acquire);
+        }
+
+        void unlock() {
+            _flag.clear(std::memory_order_release);
+        }
+
+    private:
+        std::atomic_flag _flag = ATOMIC_FLAG_INIT;
+    };
+
+    /**
+     * Locks lock, timing the wait if the mutex is held by someone else
+     * @return nanoseconds waited, 0 if it wasn't contended
+     */
+    inline unsigned long long lockTimed(MutexUniqueLock* lock) {
+        if (lock->try_lock()) return 0;
+        auto start = std::chrono::steady_clock::now();
+        lock->lock();
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
     }
 
     /**
@@ -169,7 +424,7 @@ namespace tools {
             MutexUniqueLock lock(_mutex);
             if (!full()) {
                 auto queueSize = _queue.size();
-                _queue.emplace(value);
+                _queue.emplace(std::move(value));
                 //If there is only one element notify all waiters
                 if (queueSize == 0)
                     _queueNotify.notify_one();
@@ -178,7 +433,7 @@ namespace tools {
                 return;
             }
             _queueNotify.wait(lock, [this]() {return !this->full();});
-            _queue.emplace(value);
+            _queue.emplace(std::move(value));
         }
 
         /**
@@ -194,7 +449,28 @@ namespace tools {
             _queueNotify.wait(lock, [this]() {return !this->_queue.empty() || _endWait;});
             if (_queue.empty())
                 return false;
-            value = _queue.front();
+            value = std::move(_queue.front());
+            auto tolimit = _queueMaxSize - _queue.size();
+            if (tolimit == 0)
+                _queueNotify.notify_one();
+            else if (tolimit == 1)
+                _queueNotify.notify_all();
+            _queue.pop();
+            return true;
+        }
+
+        /**
+         * Pops a value as pop() does, only waiting for one until the deadline
+         * @return false if there was none by then or on exit
+         */
+        template<typename TimePoint>
+        bool popUntil(Value& value, const TimePoint& deadline) {
+            MutexUniqueLock lock(_mutex);
+            if (!_queueNotify.wait_until(lock, deadline,
+                                         [this]() {return !this->_queue.empty() || _endWait;})
+                || _queue.empty())
+                return false;
+            value = std::move(_queue.front());
             auto tolimit = _queueMaxSize - _queue.size();
             if (tolimit == 0)
                 _queueNotify.notify_one();
@@ -204,11 +480,62 @@ namespace tools {
             return true;
         }
 
+        /**
+         * Pushes every value in [first, last) under one lock, waiting for room as push() does.
+         * Consumers are woken before a wait so that they can make the room.
+         */
+        template<typename Iterator>
+        void pushMany(Iterator first, Iterator last) {
+            MutexUniqueLock lock(_mutex);
+            bool pushed = false;
+            for (; first != last; ++first) {
+                if (full()) {
+                    if (pushed) _queueNotify.notify_all();
+                    _queueNotify.wait(lock, [this]() {return !this->full();});
+                }
+                _queue.emplace(std::move(*first));
+                pushed = true;
+            }
+            if (pushed) _queueNotify.notify_all();
+        }
+
+        /**
+         * Pops up to max values onto the back of values under one lock.  Waits as pop() does
+         * for the first.
+         * @return the number of values popped, 0 only on exit
+         */
+        template<typename Container>
+        size_t popMany(Container* values, size_t max) {
+            MutexUniqueLock lock(_mutex);
+            _queueNotify.wait(lock, [this]() {return !this->_queue.empty() || _endWait;});
+            auto tolimit = _queueMaxSize - _queue.size();
+            size_t count = 0;
+            for (; count < max && !_queue.empty(); ++count) {
+                values->push_back(std::move(_queue.front()));
+                _queue.pop();
+            }
+            //Producers may be waiting on the room made
+            if (count && tolimit <= 1) _queueNotify.notify_all();
+            return count;
+        }
+
         /**
          * Stop waiting and start returning false on nothing to do
          */
         void endWait() { _endWait = true; _queueNotify.notify_all(); }
 
+        size_t size() const {
+            MutexLockGuard lock(_mutex);
+            return _queue.size();
+        }
+
+        /**
+         * @return how full the queue is, 1 when producers are blocked
+         */
+        double pressure() const {
+            return double(size()) / std::max<size_t>(_queueMaxSize, 1);
+        }
+
     private:
         mutable Mutex _mutex;
         mutable ConditionVariable _queueNotify;
@@ -19,7 +19,10 @@
 #include <chrono>
 #include <deque>
 #include <memory>
+#include <numeric>
 #include <string>
+#include <tuple>
+#include <vector>
 #ifdef __linux__
 #include <unistd.h>
 #endif
@@ -287,4 +290,17 @@ namespace tools {
     inline std::unique_ptr<Tp> make_unique(Args ...args) {
         return std::unique_ptr<Tp>(new Tp(std::forward<Args>(args)...));
     }
+
+    /**
+     * @return str with the regex special characters escaped, i.e. for a name in a fileRegex
+     */
+    inline std::string regexEscape(const std::string& str) {
+        std::string escaped;
+        for (char c : str) {
+            if (std::string("\\^$.|?*+()[]{}").find(c) != std::string::npos)
+                escaped.push_back('\\');
+            escaped.push_back(c);
+        }
+        return escaped;
+    }
 }  //namespace tools
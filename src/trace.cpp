@@ -0,0 +1,154 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "trace.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+namespace tools {
+
+    namespace {
+        void jsonEscape(std::ostream& out, const std::string& value) {
+            for (char c : value) {
+                if (c == '"' || c == '\\') out << '\\' << c;
+                else if (static_cast<unsigned char>(c) < 0x20) {
+                    char escaped[8];
+                    std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out << escaped;
+                }
+                else out << c;
+            }
+        }
+    }  //namespace
+
+    std::atomic<bool> Trace::_enabled {};
+
+    Mutex& Trace::mutex() {
+        static Mutex mutex;
+        return mutex;
+    }
+
+    std::vector<std::unique_ptr<Trace::Ring>>& Trace::rings() {
+        static std::vector<std::unique_ptr<Ring>> rings;
+        return rings;
+    }
+
+    std::deque<Trace::Tag>& Trace::tags() {
+        static std::deque<Tag> tags;
+        return tags;
+    }
+
+    const Trace::Tag* Trace::tag(std::string shard, std::string chunk) {
+        MutexLockGuard lock(mutex());
+        //A deque doesn't move its elements as it grows
+        tags().push_back(Tag {std::move(shard), std::move(chunk)});
+        return &tags().back();
+    }
+
+    std::string& Trace::path() {
+        static std::string path;
+        return path;
+    }
+
+    size_t& Trace::ringSpans() {
+        static size_t spans;
+        return spans;
+    }
+
+    void Trace::start(std::string path, size_t ringSpans) {
+        MutexLockGuard lock(mutex());
+        Trace::path() = std::move(path);
+        Trace::ringSpans() = std::max<size_t>(ringSpans, 1);
+        _enabled = true;
+    }
+
+    Trace::Ring* Trace::ring() {
+        static thread_local Ring* ring = nullptr;
+        if (ring) return ring;
+        MutexLockGuard lock(mutex());
+        rings().emplace_back(new Ring {std::vector<Event>(ringSpans()), 0, rings().size() + 1, {}});
+        ring = rings().back().get();
+        return ring;
+    }
+
+    void Trace::record(const char* name, const Tag* tag, unsigned long long start,
+                       unsigned long long end)
+    {
+        Ring* r = ring();
+        MutexLockGuard lock(r->mutex);
+        r->events[r->recorded++ % r->events.size()] = Event {name, tag, start, end};
+    }
+
+    void Trace::write() {
+        if (!_enabled.exchange(false)) return;
+        MutexLockGuard lock(mutex());
+        //Threads still finishing spans record into their rings while they are copied out
+        struct Snapshot {
+            size_t tid;
+            std::vector<Event> events;
+        };
+        std::vector<Snapshot> snapshots;
+        size_t dropped = 0;
+        unsigned long long epoch = ~0ULL;
+        for (auto&& r : rings()) {
+            MutexLockGuard ringLock(r->mutex);
+            size_t size = r->events.size();
+            size_t count = std::min(r->recorded, size);
+            dropped += r->recorded - count;
+            snapshots.push_back(Snapshot {r->tid, {}});
+            snapshots.back().events.reserve(count);
+            //Oldest first
+            for (size_t i = r->recorded - count; i < r->recorded; ++i) {
+                snapshots.back().events.push_back(r->events[i % size]);
+                epoch = std::min(epoch, r->events[i % size].start);
+            }
+        }
+        std::ofstream out(path(), std::ios_base::out | std::ios_base::trunc);
+        if (!out.is_open()) {
+            std::cerr << "Unable to open trace file: " << path() << std::endl;
+            return;
+        }
+        size_t spans = 0;
+        out << std::fixed << std::setprecision(3);
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        bool first = true;
+        for (auto&& r : snapshots) {
+            for (auto&& event : r.events) {
+                if (!first) out << ',';
+                first = false;
+                out << "\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+                    << r.tid << ",\"ts\":" << (event.start - epoch) / 1000.0 << ",\"dur\":"
+                    << (event.end - event.start) / 1000.0;
+                if (event.tag) {
+                    out << ",\"args\":{\"shard\":\"";
+                    jsonEscape(out, event.tag->shard);
+                    out << "\",\"chunk\":\"";
+                    jsonEscape(out, event.tag->chunk);
+                    out << "\"}";
+                }
+                out << '}';
+                ++spans;
+            }
+        }
+        out << "\n]}\n";
+        std::cout << "Trace: " << spans << " spans written to " << path();
+        if (dropped) std::cout << ", " << dropped << " older spans were overwritten";
+        std::cout << std::endl;
+    }
+
+}  //namespace tools
@@ -0,0 +1,132 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include "threading.h"
+
+namespace tools {
+
+    /**
+     * Timeline of what each thread spends its time on, written as Chrome trace event JSON to load
+     * into Perfetto or chrome://tracing.  Threads record finished spans into their own ring
+     * under its own lock, only write() ever contends for it.  Once a ring is full its oldest spans
+     * are overwritten.  The rings are copied out and written when tracing is stopped.
+     */
+    class Trace {
+    public:
+        /**
+         * Shard and chunk a span works on.  Spans point at their tag, use tag() for one that
+         * outlives write().
+         */
+        struct Tag {
+            std::string shard;
+            std::string chunk;
+        };
+
+        /**
+         * Records the time between construction and destruction, nothing if tracing is off
+         */
+        class Span {
+        public:
+            /**
+             * @param name must be a literal, only the pointer is kept
+             */
+            explicit Span(const char* name, const Tag* tag = nullptr) :
+                    _name(name), _tag(tag), _start(enabled() ? now() : 0)
+            {
+            }
+
+            ~Span() {
+                if (_start) record(_name, _tag, _start, now());
+            }
+
+            Span(const Span&) = delete;
+            Span& operator=(const Span&) = delete;
+
+        private:
+            const char* const _name;
+            const Tag* const _tag;
+            const unsigned long long _start;
+        };
+
+        /**
+         * Starts tracing, threads keep the last ringSpans spans they record
+         */
+        static void start(std::string path, size_t ringSpans);
+
+        static bool enabled() {
+            return _enabled.load(std::memory_order_relaxed);
+        }
+
+        /**
+         * @return a copy of the tag that the trace keeps for the rest of the process, so spans
+         * can outlive whatever they were tagged for
+         */
+        static const Tag* tag(std::string shard, std::string chunk);
+
+        /**
+         * Stops tracing and writes every thread's spans to the file given to start
+         */
+        static void write();
+
+    private:
+        struct Event {
+            const char* name;
+            const Tag* tag;
+            unsigned long long start;
+            unsigned long long end;
+        };
+
+        struct Ring {
+            std::vector<Event> events;
+            size_t recorded;
+            size_t tid;
+            //Uncontended but for write()
+            Mutex mutex;
+        };
+
+        static std::atomic<bool> _enabled;
+
+        /**
+         * @return nanoseconds since the epoch of the steady clock, never 0
+         */
+        static unsigned long long now() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count() | 1;
+        }
+
+        static void record(const char* name, const Tag* tag, unsigned long long start,
+                           unsigned long long end);
+
+        /**
+         * @return the calling thread's ring, created and registered on first use
+         */
+        static Ring* ring();
+
+        static Mutex& mutex();
+        static std::vector<std::unique_ptr<Ring>>& rings();
+        static std::deque<Tag>& tags();
+        static std::string& path();
+        static size_t& ringSpans();
+    };
+
+}  //namespace tools
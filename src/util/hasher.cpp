@@ -32,6 +32,8 @@
  */
 
 #include "hasher.h"
+#include <cstring>
+#include <vector>
 #include "mongo/db/jsobj.h"
 
 namespace mongo {
@@ -61,45 +63,88 @@ namespace mongo {
         return *reinterpret_cast<long long int *>(d);
     }
 
-    void BSONElementHasher::recursiveHash(Hasher* h, const BSONElement& e, bool includeFieldName) {
+    namespace {
+        /* Collects the MD5 input of an element so it can be hashed with others
+         */
+        struct HashInput {
+            std::string* data;
 
-        int canonicalType = e.canonicalType();
-        h->addData(&canonicalType, sizeof(canonicalType));
+            void addData(const void * keyData, size_t numBytes) {
+                data->append(static_cast<const char*>(keyData), numBytes);
+            }
+        };
 
-        if (includeFieldName) {
-            h->addData(e.fieldName(), e.fieldNameSize());
-        }
+        /* The body of recursiveHash, for Hasher and HashInput alike
+         */
+        template<typename HashTarget>
+        void hashElement(HashTarget* h, const BSONElement& e, bool includeFieldName) {
 
-        if (!e.mayEncapsulate()) {
-            //if there are no embedded objects (subobjects or arrays),
-            //compute the hash, squashing numeric types to 64-bit ints
-            if (e.isNumber()) {
-                long long int i = e.safeNumberLong(); //well-defined for troublesome doubles
-                h->addData(&i, sizeof(i));
-            }
-            else {
-                h->addData(e.value(), e.valuesize());
+            int canonicalType = e.canonicalType();
+            h->addData(&canonicalType, sizeof(canonicalType));
+
+            if (includeFieldName) {
+                h->addData(e.fieldName(), e.fieldNameSize());
             }
-        }
-        else {
-            //else identify the subobject.
-            //hash any preceding stuff (in the case of codeWscope)
-            //then each sub-element
-            //then finish with the EOO element.
-            BSONObj b;
-            if (e.type() == CodeWScope) {
-                h->addData(e.codeWScopeCode(), e.codeWScopeCodeLen());
-                b = e.codeWScopeObject();
+
+            if (!e.mayEncapsulate()) {
+                //if there are no embedded objects (subobjects or arrays),
+                //compute the hash, squashing numeric types to 64-bit ints
+                if (e.isNumber()) {
+                    long long int i = e.safeNumberLong(); //well-defined for troublesome doubles
+                    h->addData(&i, sizeof(i));
+                }
+                else {
+                    h->addData(e.value(), e.valuesize());
+                }
             }
             else {
-                b = e.embeddedObject();
-            }
-            BSONObjIterator i(b);
-            while (i.moreWithEOO()) {
-                BSONElement el = i.next();
-                recursiveHash(h, el, true);
+                //else identify the subobject.
+                //hash any preceding stuff (in the case of codeWscope)
+                //then each sub-element
+                //then finish with the EOO element.
+                BSONObj b;
+                if (e.type() == CodeWScope) {
+                    h->addData(e.codeWScopeCode(), e.codeWScopeCodeLen());
+                    b = e.codeWScopeObject();
+                }
+                else {
+                    b = e.embeddedObject();
+                }
+                BSONObjIterator i(b);
+                while (i.moreWithEOO()) {
+                    BSONElement el = i.next();
+                    hashElement(h, el, true);
+                }
             }
         }
+    }  //namespace
+
+    void BSONElementHasher::recursiveHash(Hasher* h, const BSONElement& e, bool includeFieldName) {
+        hashElement(h, e, includeFieldName);
+    }
+
+    BSONElementBatchHasher::BSONElementBatchHasher(HashSeed seed) :
+            _seed(seed)
+    {
+    }
+
+    void BSONElementBatchHasher::hash64(const BSONElement* elements, size_t count,
+                                        long long int* out) {
+        assert(count <= BATCH_MAX);
+        const unsigned char* messages[BATCH_MAX];
+        size_t sizes[BATCH_MAX];
+        for (size_t i = 0; i < count; ++i) {
+            _inputs[i].assign(reinterpret_cast<const char*>(&_seed), sizeof(_seed));
+            HashInput input {&_inputs[i]};
+            hashElement(&input, elements[i], false);
+            messages[i] = reinterpret_cast<const unsigned char*>(_inputs[i].data());
+            sizes[i] = _inputs[i].size();
+        }
+        HashDigest digests[BATCH_MAX];
+        md5Lanes(messages, sizes, count, digests);
+        // NOTE: assumes little-endian, truncated to 8 bytes as hash64
+        for (size_t i = 0; i < count; ++i)
+            std::memcpy(&out[i], digests[i], sizeof(out[i]));
     }
 
     struct HasherUnitTest {
@@ -109,4 +154,60 @@ namespace mongo {
             assert(BSONElementHasher::hash64(o.firstElement(), 0) == -944302157085130861LL);
         }
     } hasherUnitTest;
+
+    /* Runs at startup: md5Lanes against the RFC 1321 digests and the batch hasher against the
+     * server value above and hash64, at every lane count.
+     */
+    struct BatchHasherUnitTest {
+        BatchHasherUnitTest() {
+            const char* rfc[][2] = {
+                {"", "d41d8cd98f00b204e9800998ecf8427e"},
+                {"a", "0cc175b9c0f1b6a831c399e269772661"},
+                {"abc", "900150983cd24fb0d6963f7d28e17f72"},
+                {"message digest", "f96b697d7cb7938d525a2f31aaf161d0"},
+                {"abcdefghijklmnopqrstuvwxyz", "c3fcd3d76192e4007dfb496cca67e13b"},
+                {"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789",
+                 "d174ab98d277d9f5a5611c2c9f419d9f"},
+                {"1234567890123456789012345678901234567890"
+                 "1234567890123456789012345678901234567890",
+                 "57edf4a22be3c955ac49da2e2107b67a"}
+            };
+            const size_t rfcCount = sizeof(rfc) / sizeof(rfc[0]);
+            const unsigned char* messages[rfcCount];
+            size_t sizes[rfcCount];
+            for (size_t i = 0; i < rfcCount; ++i) {
+                messages[i] = reinterpret_cast<const unsigned char*>(rfc[i][0]);
+                sizes[i] = strlen(rfc[i][0]);
+            }
+            md5digest digests[rfcCount];
+            md5Lanes(messages, sizes, rfcCount, digests);
+            for (size_t i = 0; i < rfcCount; ++i)
+                assert(digestToString(digests[i]) == rfc[i][1]);
+
+            BSONObjBuilder elements;
+            elements.append("check", 42);
+            elements.append("long", 1LL << 40);
+            elements.append("double", 42.9);
+            elements.append("string", "a string long enough to need a second md5 block, "
+                            "which lanes with single block keys must not be thrown by");
+            elements.append("oid", OID("54d9476a1b2c3d4e5f607182"));
+            elements.append("object", BSON("a" << 1 << "b" << BSON_ARRAY("c" << 2)));
+            elements.appendNull("null");
+            BSONObj o = elements.obj();
+            std::vector<BSONElement> keys;
+            for (BSONObjIterator i(o); i.more();)
+                keys.push_back(i.next());
+            //Pad out to the widest batch so every lane count is exercised
+            while (keys.size() < BSONElementBatchHasher::BATCH_MAX)
+                keys.push_back(keys[keys.size() % 7]);
+            BSONElementBatchHasher batch(0);
+            long long int hashes[BSONElementBatchHasher::BATCH_MAX];
+            for (size_t count = 1; count <= keys.size(); ++count) {
+                batch.hash64(keys.data(), count, hashes);
+                assert(hashes[0] == -944302157085130861LL);
+                for (size_t i = 0; i < count; ++i)
+                    assert(hashes[i] == BSONElementHasher::hash64(keys[i], 0));
+            }
+        }
+    } batchHasherUnitTest;
 }
@@ -38,6 +38,7 @@
 #include <mongo/client/dbclient.h>
 //#include <mongo/bson/bsonelement.h>
 #include "md5.hpp"
+#include "md5_lanes.h"
 
 namespace mongo {
 
@@ -118,4 +119,23 @@ namespace mongo {
 
     };
 
+    /* Computes BSONElementHasher::hash64 for several elements at once.  The MD5 inputs
+     * are serialized and then hashed side by side by md5Lanes.  The input buffers are kept
+     * between calls, so keep one of these per thread.
+     */
+    class BSONElementBatchHasher : private boost::noncopyable {
+    public:
+        static const size_t BATCH_MAX = MD5_LANES_MAX;
+
+        explicit BSONElementBatchHasher(HashSeed seed = BSONElementHasher::DEFAULT_HASH_SEED);
+
+        /* out[i] = BSONElementHasher::hash64(elements[i], seed) for count <= BATCH_MAX
+         */
+        void hash64(const BSONElement* elements, size_t count, long long int* out);
+
+    private:
+        HashSeed _seed;
+        std::string _inputs[BATCH_MAX];
+    };
+
 }
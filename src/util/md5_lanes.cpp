@@ -0,0 +1,258 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "md5_lanes.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MD5_LANES_X86
+//AVX-512 intrinsics arrived in gcc 4.9
+#if !defined(__clang__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define MD5_LANES_AVX512
+#endif
+#endif
+
+namespace mongo {
+
+    namespace {
+        //NOTE: assumes little-endian, as the server's hash64 does
+        const uint32_t MD5_INIT[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+
+        //floor(abs(sin(i + 1)) * 2^32)
+        const uint32_t MD5_K[64] = {
+            0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613,
+            0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193,
+            0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d,
+            0x02441453, 0xd8a1e681, 0xe7d3fbc8, 0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+            0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122,
+            0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+            0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665, 0xf4292244,
+            0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+            0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb,
+            0xeb86d391
+        };
+
+        const int MD5_S[64] = {
+            7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+            5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+            4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+            6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+        };
+
+        /**
+         * A message split into the blocks read straight from it and the padded tail
+         */
+        struct LaneMessage {
+            const unsigned char* data;
+            size_t fullBlocks;
+            size_t blocks;
+            unsigned char tail[128];
+
+            void set(const unsigned char* message, size_t size) {
+                data = message;
+                fullBlocks = size / 64;
+                size_t tailSize = size % 64;
+                //0x80, zeros, then the bit length needs 9 bytes past the data
+                size_t tailBlocks = tailSize + 9 > 64 ? 2 : 1;
+                blocks = fullBlocks + tailBlocks;
+                std::memset(tail, 0, sizeof(tail));
+                std::memcpy(tail, message + fullBlocks * 64, tailSize);
+                tail[tailSize] = 0x80;
+                uint64_t bits = uint64_t(size) * 8;
+                std::memcpy(tail + tailBlocks * 64 - 8, &bits, 8);
+            }
+
+            /**
+             * @return the block, blocks past the end of the message give back the tail
+             */
+            const unsigned char* block(size_t index) const {
+                if (index < fullBlocks) return data + index * 64;
+                index -= fullBlocks;
+                return tail + (index < 2 ? index : 0) * 64;
+            }
+        };
+
+#ifdef MD5_LANES_X86
+#define MD5_LANES_NAME md5Sse2
+#define MD5_LANES_TARGET "sse2"
+#define MD5_LANES 4
+#define V __m128i
+#define V_LOAD(p) _mm_load_si128(reinterpret_cast<const __m128i*>(p))
+#define V_STORE(p, v) _mm_store_si128(reinterpret_cast<__m128i*>(p), v)
+#define V_SET1(x) _mm_set1_epi32(int(x))
+#define V_ADD _mm_add_epi32
+#define V_AND _mm_and_si128
+#define V_OR _mm_or_si128
+#define V_XOR _mm_xor_si128
+#define V_ANDNOT _mm_andnot_si128
+#define V_ROTL(x, s) _mm_or_si128(_mm_sll_epi32(x, _mm_cvtsi32_si128(s)), \
+        _mm_srl_epi32(x, _mm_cvtsi32_si128(32 - (s))))
+#include "md5_lanes_body.h"
+#undef MD5_LANES_NAME
+#undef MD5_LANES_TARGET
+#undef MD5_LANES
+#undef V
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_ADD
+#undef V_AND
+#undef V_OR
+#undef V_XOR
+#undef V_ANDNOT
+#undef V_ROTL
+
+#define MD5_LANES_NAME md5Avx2
+#define MD5_LANES_TARGET "avx2"
+#define MD5_LANES 8
+#define V __m256i
+#define V_LOAD(p) _mm256_load_si256(reinterpret_cast<const __m256i*>(p))
+#define V_STORE(p, v) _mm256_store_si256(reinterpret_cast<__m256i*>(p), v)
+#define V_SET1(x) _mm256_set1_epi32(int(x))
+#define V_ADD _mm256_add_epi32
+#define V_AND _mm256_and_si256
+#define V_OR _mm256_or_si256
+#define V_XOR _mm256_xor_si256
+#define V_ANDNOT _mm256_andnot_si256
+#define V_ROTL(x, s) _mm256_or_si256(_mm256_sll_epi32(x, _mm_cvtsi32_si128(s)), \
+        _mm256_srl_epi32(x, _mm_cvtsi32_si128(32 - (s))))
+#include "md5_lanes_body.h"
+#undef MD5_LANES_NAME
+#undef MD5_LANES_TARGET
+#undef MD5_LANES
+#undef V
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_ADD
+#undef V_AND
+#undef V_OR
+#undef V_XOR
+#undef V_ANDNOT
+#undef V_ROTL
+
+#ifdef MD5_LANES_AVX512
+#define MD5_LANES_NAME md5Avx512
+#define MD5_LANES_TARGET "avx512f"
+#define MD5_LANES 16
+#define V __m512i
+#define V_LOAD(p) _mm512_load_si512(p)
+#define V_STORE(p, v) _mm512_store_si512(p, v)
+#define V_SET1(x) _mm512_set1_epi32(int(x))
+#define V_ADD _mm512_add_epi32
+#define V_AND _mm512_and_si512
+#define V_OR _mm512_or_si512
+#define V_XOR _mm512_xor_si512
+#define V_ANDNOT _mm512_andnot_si512
+#define V_ROTL(x, s) _mm512_rolv_epi32(x, _mm512_set1_epi32(s))
+#include "md5_lanes_body.h"
+#undef MD5_LANES_NAME
+#undef MD5_LANES_TARGET
+#undef MD5_LANES
+#undef V
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_ADD
+#undef V_AND
+#undef V_OR
+#undef V_XOR
+#undef V_ANDNOT
+#undef V_ROTL
+#endif
+
+        using Md5LanesFunc = void (*)(const LaneMessage*, md5digest*);
+
+        struct Md5LanesImpl {
+            Md5LanesFunc func;
+            size_t width;
+        };
+
+        /**
+         * Function local so that static initializers in other files can hash
+         */
+        const Md5LanesImpl& md5LanesImpl() {
+            static const Md5LanesImpl impl = []() -> Md5LanesImpl {
+                __builtin_cpu_init();
+#ifdef MD5_LANES_AVX512
+                if (__builtin_cpu_supports("avx512f")) return Md5LanesImpl {&md5Avx512, 16};
+#endif
+                if (__builtin_cpu_supports("avx2")) return Md5LanesImpl {&md5Avx2, 8};
+                return Md5LanesImpl {&md5Sse2, 4};
+            }();
+            return impl;
+        }
+
+        /**
+         * Hashes up to width messages with func, unused lanes hash an empty message
+         */
+        void md5Group(Md5LanesFunc func, size_t width, const unsigned char* const* messages,
+                      const size_t* sizes, size_t count, md5digest* digests) {
+            LaneMessage lanes[MD5_LANES_MAX];
+            md5digest out[MD5_LANES_MAX];
+            for (size_t lane = 0; lane < width; ++lane) {
+                if (lane < count) lanes[lane].set(messages[lane], sizes[lane]);
+                else lanes[lane].set(nullptr, 0);
+            }
+            func(lanes, out);
+            for (size_t lane = 0; lane < count; ++lane)
+                std::memcpy(digests[lane], out[lane], sizeof(md5digest));
+        }
+#endif
+    }  //namespace
+
+    void md5Lanes(const unsigned char* const* messages, const size_t* sizes, size_t count,
+                  md5digest* digests) {
+        size_t done = 0;
+#ifdef MD5_LANES_X86
+        const Md5LanesImpl& impl = md5LanesImpl();
+        while (count - done > 1) {
+            //Narrower lanes for the remainder, rather than hashing mostly empty lanes
+            size_t remaining = count - done;
+            if (remaining > 4 && impl.width >= 8) {
+                Md5LanesFunc func = &md5Avx2;
+                size_t width = 8;
+#ifdef MD5_LANES_AVX512
+                if (remaining > 8 && impl.width == 16) {
+                    func = &md5Avx512;
+                    width = 16;
+                }
+#endif
+                size_t group = std::min(width, remaining);
+                md5Group(func, width, messages + done, sizes + done, group, digests + done);
+                done += group;
+            }
+            else {
+                size_t group = std::min(size_t(4), remaining);
+                md5Group(&md5Sse2, 4, messages + done, sizes + done, group, digests + done);
+                done += group;
+            }
+        }
+#endif
+        for (; done < count; ++done)
+            md5(messages[done], sizes[done], digests[done]);
+    }
+
+    size_t md5LanesWidth() {
+#ifdef MD5_LANES_X86
+        return md5LanesImpl().width;
+#else
+        return 1;
+#endif
+    }
+
+}  //namespace mongo
@@ -0,0 +1,40 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include "md5.hpp"
+
+namespace mongo {
+
+    //Most messages that are hashed side by side, AVX-512 width
+    constexpr size_t MD5_LANES_MAX = 16;
+
+    /**
+     * MD5 of count independent messages computed side by side in SIMD lanes, i.e. multi-buffer
+     * MD5.  digests[i] is bit identical to md5(messages[i], sizes[i]).
+     * Messages of differing lengths are fine, lanes that finish early are masked off.
+     * Any count is accepted, it is cut into groups of the widest lanes the cpu has.
+     */
+    void md5Lanes(const unsigned char* const* messages, const size_t* sizes, size_t count,
+                  md5digest* digests);
+
+    /**
+     * @return the messages the cpu hashes at once, 1 if there is no SIMD implementation
+     */
+    size_t md5LanesWidth();
+
+}  //namespace mongo
@@ -0,0 +1,84 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+/*
+ * The body of a multi-buffer MD5 transform, included by md5_lanes.cpp once per instruction set.
+ * There are no include guards on purpose.  The includer defines:
+ * MD5_LANES_NAME function name; MD5_LANES_TARGET target attribute; MD5_LANES lanes per vector
+ * V vector type; V_LOAD(p) V_STORE(p, v) V_SET1(x) V_ADD V_AND V_OR V_XOR; V_ANDNOT(a, b) being
+ * ~a & b; V_ROTL(x, s)
+ */
+
+__attribute__((target(MD5_LANES_TARGET)))
+void MD5_LANES_NAME(const LaneMessage* lanes, md5digest* digests) {
+    alignas(64) uint32_t words[16][MD5_LANES];
+    alignas(64) uint32_t mask[MD5_LANES];
+    alignas(64) uint32_t out[4][MD5_LANES];
+    size_t blocksMax = 0;
+    for (size_t lane = 0; lane < MD5_LANES; ++lane)
+        blocksMax = std::max(blocksMax, lanes[lane].blocks);
+
+    V a = V_SET1(MD5_INIT[0]), b = V_SET1(MD5_INIT[1]), c = V_SET1(MD5_INIT[2]),
+            d = V_SET1(MD5_INIT[3]);
+    const V ones = V_SET1(0xffffffff);
+    for (size_t block = 0; block < blocksMax; ++block) {
+        //Transpose the block so each vector holds the same message word of every lane
+        for (size_t lane = 0; lane < MD5_LANES; ++lane) {
+            const unsigned char* data = lanes[lane].block(block);
+            for (size_t word = 0; word < 16; ++word)
+                std::memcpy(&words[word][lane], data + word * 4, 4);
+            mask[lane] = block < lanes[lane].blocks ? 0xffffffff : 0;
+        }
+        V aa = a, bb = b, cc = c, dd = d;
+        for (int i = 0; i < 64; ++i) {
+            V f;
+            int g;
+            if (i < 16) {
+                f = V_OR(V_AND(bb, cc), V_ANDNOT(bb, dd));
+                g = i;
+            }
+            else if (i < 32) {
+                f = V_OR(V_AND(dd, bb), V_ANDNOT(dd, cc));
+                g = (5 * i + 1) & 15;
+            }
+            else if (i < 48) {
+                f = V_XOR(V_XOR(bb, cc), dd);
+                g = (3 * i + 5) & 15;
+            }
+            else {
+                f = V_XOR(cc, V_OR(bb, V_XOR(dd, ones)));
+                g = (7 * i) & 15;
+            }
+            V sum = V_ADD(V_ADD(aa, f), V_ADD(V_SET1(MD5_K[i]), V_LOAD(words[g])));
+            aa = dd;
+            dd = cc;
+            cc = bb;
+            bb = V_ADD(bb, V_ROTL(sum, MD5_S[i]));
+        }
+        //Lanes past their last block keep their state
+        V live = V_LOAD(mask);
+        a = V_OR(V_AND(live, V_ADD(a, aa)), V_ANDNOT(live, a));
+        b = V_OR(V_AND(live, V_ADD(b, bb)), V_ANDNOT(live, b));
+        c = V_OR(V_AND(live, V_ADD(c, cc)), V_ANDNOT(live, c));
+        d = V_OR(V_AND(live, V_ADD(d, dd)), V_ANDNOT(live, d));
+    }
+    V_STORE(out[0], a);
+    V_STORE(out[1], b);
+    V_STORE(out[2], c);
+    V_STORE(out[3], d);
+    for (size_t lane = 0; lane < MD5_LANES; ++lane)
+        for (size_t word = 0; word < 4; ++word)
+            std::memcpy(digests[lane] + word * 4, &out[word][lane], 4);
+}
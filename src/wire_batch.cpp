@@ -0,0 +1,69 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "wire_batch.h"
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+
+namespace tools {
+    namespace mtools {
+
+        constexpr size_t WireBatch::PREFIX_SIZE;
+
+        WireBatch::WireBatch(const std::string& ns, size_t reserve) {
+            _docsBegin = PREFIX_SIZE + ns.size() + 1;
+            grow(_docsBegin + reserve);
+            std::memset(_buffer, 0, PREFIX_SIZE);
+            std::memcpy(_buffer + PREFIX_SIZE, ns.c_str(), ns.size() + 1);
+            _size = _docsBegin;
+        }
+
+        WireBatch::~WireBatch() {
+            free(_buffer);
+        }
+
+        void WireBatch::grow(size_t size) {
+            size_t capacity = std::max(size, _capacity * 2);
+            char* buffer = static_cast<char*>(realloc(_buffer, capacity));
+            if (!buffer) {
+                std::cerr << "Unable to allocate a " << capacity << " byte insert message"
+                        << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            _buffer = buffer;
+            _capacity = capacity;
+        }
+
+        void WireBatch::send(mongo::DBClientBase* conn, int32_t flags) {
+            int32_t header[4] = {int32_t(_size), 0, 0, mongo::dbInsert};
+            std::memcpy(_buffer, header, sizeof(header));
+            std::memcpy(_buffer + sizeof(header), &flags, sizeof(flags));
+            mongo::Message message;
+            //The buffer is only lent to the message, the id is set by the driver's say()
+            message.setData(reinterpret_cast<mongo::MsgData*>(_buffer), false);
+            conn->say(message);
+        }
+
+        void WireBatch::clear() {
+            free(_buffer);
+            _buffer = nullptr;
+            _size = 0;
+            _capacity = 0;
+            _docs = 0;
+        }
+
+    }  //namespace mtools
+}  //namespace tools
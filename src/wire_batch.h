@@ -0,0 +1,106 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include "mongo_cxxdriver.h"
+
+namespace tools {
+    namespace mtools {
+
+        /**
+         * An OP_INSERT message built in place.  Documents are appended straight into one buffer
+         * behind the message header, flags and namespace, and the buffer is lent to the driver as
+         * the message so nothing is copied again on the way out.
+         */
+        class WireBatch {
+        public:
+            //Header, flags
+            static constexpr size_t PREFIX_SIZE = 4 * sizeof(int32_t) + sizeof(int32_t);
+
+            /**
+             * @param reserve document bytes to allocate room for up front
+             */
+            WireBatch(const std::string& ns, size_t reserve);
+
+            ~WireBatch();
+
+            WireBatch(const WireBatch&) = delete;
+            WireBatch& operator=(const WireBatch&) = delete;
+
+            void append(const mongo::BSONObj& doc) {
+                size_t size = doc.objsize();
+                if (_size + size > _capacity) grow(_size + size);
+                std::memcpy(_buffer + _size, doc.objdata(), size);
+                _size += size;
+                ++_docs;
+            }
+
+            size_t docs() const {
+                return _docs;
+            }
+
+            /**
+             * @return bytes of documents in the batch
+             */
+            size_t bytes() const {
+                return _size ? _size - _docsBegin : 0;
+            }
+
+            bool empty() const {
+                return !_docs;
+            }
+
+            const char* docsData() const {
+                return _buffer + _docsBegin;
+            }
+
+            /**
+             * @return the namespace written to, the batch must not be cleared
+             */
+            const char* ns() const {
+                return _buffer + PREFIX_SIZE;
+            }
+
+            /**
+             * Frames the message with flags and sends it.  The batch keeps the message, so one
+             * that failed can be sent again, until it is cleared.
+             */
+            void send(mongo::DBClientBase* conn, int32_t flags);
+
+            /**
+             * Frees the message, the batch is empty afterwards
+             */
+            void clear();
+
+        private:
+            char* _buffer {};
+            size_t _size {};
+            size_t _capacity {};
+            size_t _docsBegin {};
+            size_t _docs {};
+
+            void grow(size_t size);
+        };
+
+        using WireBatchPointer = std::unique_ptr<WireBatch>;
+
+    }  //namespace mtools
+}  //namespace tools
@@ -0,0 +1,160 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "wire_stats.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <zlib.h>
+#include "threading.h"
+
+namespace tools {
+    namespace mtools {
+
+        namespace {
+            /**
+             * Runs the sampler thread, a batch is taken only while it is idle.  It lives until the
+             * process exits, so end points still sending then never see it gone.
+             */
+            class Sampler {
+            public:
+                Sampler() {
+                    std::thread([this]() {this->run();}).detach();
+                }
+
+                /**
+                 * @return the buffer to copy a batch into, nullptr if the sampler is busy
+                 */
+                std::vector<char>* take() {
+                    MutexUniqueLock lock(_mutex, std::try_to_lock);
+                    if (!lock || _busy) return nullptr;
+                    _busy = true;
+                    return &_batch;
+                }
+
+                /**
+                 * Hands the batch take() returned to the sampler
+                 */
+                void give() {
+                    {
+                        MutexLockGuard lock(_mutex);
+                        _ready = true;
+                    }
+                    _notify.notify_one();
+                }
+
+            private:
+                Mutex _mutex;
+                ConditionVariable _notify;
+                std::vector<char> _batch;
+                //_batch belongs to the caller of take() until it is ready, then to the sampler
+                bool _busy {};
+                bool _ready {};
+
+                void run() {
+                    MutexUniqueLock lock(_mutex);
+                    for (;;) {
+                        _notify.wait(lock, [this]() {return _ready;});
+                        lock.unlock();
+                        WireStats::sample(_batch);
+                        _batch.clear();
+                        lock.lock();
+                        _busy = _ready = false;
+                    }
+                }
+            };
+
+            Sampler* sampler {};
+        }  //namespace
+
+        constexpr size_t WireStats::SAMPLE_EVERY;
+        std::atomic<bool> WireStats::_estimate {};
+        std::atomic<unsigned long long> WireStats::_logical {};
+        std::atomic<unsigned long long> WireStats::_batches {};
+        std::atomic<unsigned long long> WireStats::_sampledIn {};
+        std::atomic<unsigned long long> WireStats::_sampledOut {};
+        std::atomic<unsigned long long> WireStats::_sampleNanos {};
+
+        void WireStats::compressEstimateSet(bool estimate) {
+            static Mutex startMutex;
+            MutexLockGuard lock(startMutex);
+            if (!estimate || _estimate) return;
+            sampler = new Sampler;
+            _estimate = true;
+            std::cout << "The mongo driver sends uncompressed messages, bytes on the wire for "
+                    "zlib are estimated from samples" << std::endl;
+        }
+
+        bool WireStats::counted(size_t bytes) {
+            _logical += bytes;
+            return _estimate && !(_batches++ % SAMPLE_EVERY) && bytes;
+        }
+
+        template<typename Pieces>
+        void WireStats::offer(const Pieces& pieces, size_t bytes) {
+            std::vector<char>* batch = sampler->take();
+            if (!batch) return;
+            batch->reserve(bytes);
+            for (auto&& piece : pieces)
+                batch->insert(batch->end(), piece.first, piece.first + piece.second);
+            sampler->give();
+        }
+
+        void WireStats::sample(const std::vector<char>& batch) {
+            auto start = std::chrono::steady_clock::now();
+            z_stream stream {};
+            deflateInit(&stream, 1);
+            std::vector<Bytef> out(deflateBound(&stream, batch.size()));
+            stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(batch.data()));
+            stream.avail_in = batch.size();
+            stream.next_out = out.data();
+            stream.avail_out = out.size();
+            deflate(&stream, Z_FINISH);
+            _sampledIn += batch.size();
+            _sampledOut += stream.total_out;
+            deflateEnd(&stream);
+            _sampleNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+        }
+
+        void WireStats::record(const std::vector<mongo::BSONObj>& docs) {
+            size_t bytes = 0;
+            for (auto&& doc : docs)
+                bytes += doc.objsize();
+            if (!counted(bytes)) return;
+            std::vector<std::pair<const char*, size_t>> pieces;
+            for (auto&& doc : docs)
+                pieces.emplace_back(doc.objdata(), doc.objsize());
+            offer(pieces, bytes);
+        }
+
+        void WireStats::record(const char* docs, size_t bytes) {
+            if (!counted(bytes)) return;
+            offer(std::vector<std::pair<const char*, size_t>> {{docs, bytes}}, bytes);
+        }
+
+        unsigned long long WireStats::wireBytes() {
+            if (!_estimate || !_sampledIn) return _logical;
+            return _logical * double(_sampledOut) / _sampledIn;
+        }
+
+        double WireStats::compressMBps() {
+            if (!_sampleNanos) return 0;
+            return double(_sampledIn) / 1024 / 1024 / (_sampleNanos / 1e9);
+        }
+
+    }  //namespace mtools
+}  //namespace tools
@@ -0,0 +1,95 @@
+/*    Copyright Charlie Page 2014
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include "mongo_cxxdriver.h"
+
+namespace tools {
+    namespace mtools {
+
+        /**
+         * Accounts for the bytes end points send, logical (BSON) against what goes on the wire.
+         * The legacy driver has no OP_COMPRESSED support so nothing is compressed.  With the
+         * estimate on, every SAMPLE_EVERY batch is copied to a sampler thread that deflates it at
+         * level 1, the ratio applied to the rest gives the bytes a zlib compressed wire would
+         * take.  A sample is skipped while the sampler is busy, so sends never wait on it.
+         */
+        class WireStats {
+        public:
+            static constexpr size_t SAMPLE_EVERY = 16;
+
+            /**
+             * Starts the sampler the first time the estimate is turned on
+             */
+            static void compressEstimateSet(bool estimate);
+
+            static bool compressEstimate() {
+                return _estimate;
+            }
+
+            /**
+             * Records a batch about to be sent
+             */
+            static void record(const std::vector<mongo::BSONObj>& docs);
+
+            /**
+             * Records a batch of documents laid out back to back
+             */
+            static void record(const char* docs, size_t bytes);
+
+            static unsigned long long logicalBytes() {
+                return _logical;
+            }
+
+            /**
+             * @return bytes on the wire, the zlib estimate if it is on
+             */
+            static unsigned long long wireBytes();
+
+            /**
+             * @return MB/s the sampler deflates at, 0 if nothing was sampled
+             */
+            static double compressMBps();
+
+            /**
+             * Deflates a sampled batch, called on the sampler thread
+             */
+            static void sample(const std::vector<char>& batch);
+
+        private:
+            /**
+             * @return true if the batch should be sampled
+             */
+            static bool counted(size_t bytes);
+
+            /**
+             * Hands pieces of a batch to the sampler unless it is busy
+             */
+            template<typename Pieces>
+            static void offer(const Pieces& pieces, size_t bytes);
+
+            static std::atomic<bool> _estimate;
+            static std::atomic<unsigned long long> _logical;
+            static std::atomic<unsigned long long> _batches;
+            static std::atomic<unsigned long long> _sampledIn;
+            static std::atomic<unsigned long long> _sampledOut;
+            static std::atomic<unsigned long long> _sampleNanos;
+        };
+
+    }  //namespace mtools
+}  //namespace tools